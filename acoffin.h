@@ -18,40 +18,451 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdint.h>		/* For typed ints */
-#include <gtk/gtk.h>		/* For GTK types */
 #include <jack/jack.h>		/* For jack-related types */
+#include <jack/ringbuffer.h>	/* For jack_ringbuffer_t */
 #include <sndfile.h>		/* For output handling */
 #include <soxr-lsr.h>		/* For the resampler */
 #include <signal.h>		/* For sig_atomic_t */
+#include <limits.h>		/* For PATH_MAX */
+#include <time.h>		/* For time_t */
+#include <stdio.h>		/* For FILE */
+#include <pthread.h>		/* For pthread_mutex_t / pthread_cond_t */
+#include "tap.h"		/* For struct tap_header */
+#include "manifest.h"		/* For struct sha256 */
+#include "sidecar.h"		/* For the sidecar extensions */
+
+/* Peak file format, see peaks.c */
+#define PEAKS_MAGIC		"ACPEAKS1"
+#define PEAKS_LEVELS		3
+#define PEAKS_BASE_FRAMES	1024
+#define PEAKS_LEVEL_FACTOR	16
+
+struct peaks_header {
+	char magic[8];
+	uint32_t sample_rate;
+	uint16_t channels;
+	uint16_t num_levels;
+	struct {
+		uint32_t frames_per_point;
+		uint32_t reserved;
+		uint64_t offset;
+		uint64_t num_points;
+	} levels[PEAKS_LEVELS];
+} __attribute__ ((packed));
+
+struct loudness_meter;
+struct peaks_writer;
+
+/* Direct libFLAC encoder, see flac.c */
+#define FLAC_CHUNK_FRAMES	4096
+#define FLAC_MAX_THREADS	64
+
+struct flac_opts {
+	/* Encode FLAC through libFLAC instead of libsndfile */
+	int direct;
+	/* Sample size (16 - 24 bits), with optional TPDF dither */
+	uint32_t bits;
+	int dither;
+	/* 0 / NULL to leave them to the compression level */
+	uint32_t blocksize;
+	char *apodization;
+	/* Encode chunks of the stream on this many
+	 * threads, 0 to encode on the consumer */
+	uint32_t threads;
+};
+
+struct flac_encoder;
+
+/* Storage targets, see storage.c */
+#define STORAGE_MAX_TARGETS	4
+#define STORAGE_MAX_SINKS	2
+#define STORAGE_RETRY_SECS	60
+#define STORAGE_RECOVER_MSECS	500
+
+enum storage_policies {
+	STORAGE_FAILOVER = 0,
+	STORAGE_MIRROR = 1
+};
+
+/* A copy of an output file on one of the storage targets */
+struct storage_sink {
+	int fd;
+	/* A write to it failed, its copy is incomplete */
+	int failed;
+	int target;
+	char dir[PATH_MAX];
+	char path[PATH_MAX];
+};
+
+/* Live stream, see stream.c */
+#define STREAM_BUF_SIZE		(4 * 1024 * 1024)
+#define STREAM_HEAD_MAX		(64 * 1024)
+
+/* Start of a file's encoded stream, up to its first audio
+ * frame / page, that listeners need before anything else.
+ * end is set once done. */
+struct stream_head {
+	uint8_t *data;
+	size_t len;
+	size_t end;
+	int done;
+};
+
+struct manifest_file {
+	/* Body bytes hashed as they got written, see manifest.c */
+	struct sha256 body;
+	sf_count_t hashed;
+	/* Something rewrote them, hash them again on close */
+	int stale;
+};
+
+struct recorder_file {
+	/* Encoder, libsndfile or libFLAC (for FLAC, unless
+	 * asked otherwise) */
+	SNDFILE *sf;
+	struct flac_encoder *flac;
+	/* Path of the first sink, sidecars go next to it while
+	 * it's written, and to the other good copies on close */
+	char path[PATH_MAX];
+	/* Output settings it was opened with */
+	char dir[PATH_MAX];
+	int format;
+	uint32_t sample_rate;
+	int channels;
+	/* Encoded stream, written to every sink */
+	struct storage_sink sinks[STORAGE_MAX_SINKS];
+	int num_sinks;
+	/* Every sink failed, encoders that don't check
+	 * their writes (libsndfile's Vorbis) won't tell */
+	int lost;
+	sf_count_t offset;
+	sf_count_t length;
+	/* Only kept while streaming */
+	struct stream_head head;
+	struct manifest_file manifest;
+	struct loudness_meter *loudness;
+	struct peaks_writer *peaks;
+	/* Pre-opened under a temporary name, still needs
+	 * to be renamed after its start time */
+	int unnamed;
+	time_t started;
+	/* Frames written so far, consumer only */
+	uint64_t frames;
+	/* Length as of the last progress update,
+	 * timer thread only */
+	sf_count_t progress_bytes;
+	/* Markers, one line per marker with its position in
+	 * frames / seconds and its label, opened on the first
+	 * marker */
+	FILE *markers;
+	struct recorder_file *next;
+};
+
+#define RECORDER_MARKER_LABEL_MAX	128
+
+struct recorder_marker {
+	char label[RECORDER_MARKER_LABEL_MAX];
+	struct recorder_marker *next;
+};
+
+/* Signal monitor */
+#define MONITOR_BLOCK_MSECS	100
+#define MONITOR_BACKLOG_SECS	5
+
+struct monitor_block {
+	float peak[2];
+	float rms[2];
+};
+
+/* What the detectors found on the last update */
+struct monitor_status {
+	struct monitor_block last;
+	int silence;
+	int dead[2];
+	int clipping;
+};
+
+struct monitor {
+	/* Thresholds in dBFS and hold times */
+	float silence_db;
+	uint32_t silence_hold_secs;
+	float clip_db;
+	uint32_t clip_hold_secs;
+	char *status_path;
+	int num_channels;
+	/* Running levels, process callback only */
+	jack_ringbuffer_t *blocks;
+	float win_peak[2];
+	double win_sumsq[2];
+	uint32_t win_frames;
+	uint32_t block_frames;
+	/* Detector state, timer thread only */
+	uint32_t silent_msecs[2];
+	uint32_t clip_quiet_msecs;
+	int silence;
+	int dead[2];
+	int clipping;
+	/* Published for the metrics once per update */
+	struct monitor_status status;
+	pthread_mutex_t status_lock;
+};
+
+/* Page locked memory for the audio path, see arena.c */
+#define ARENA_ALIGN		64
+#define ARENA_HUGE_PAGE_SIZE	(2 * 1024 * 1024)
+
+struct arena {
+	char *base;
+	size_t size;
+	size_t used;
+	/* Back it with huge pages if possible */
+	int huge;
+	int locked;
+};
+
+/* Free space forecasting, see space.c */
+#define SPACE_RATE_WEIGHT	0.2
+
+struct space_target {
+	/* Timer thread only */
+	uint64_t prev_bytes;
+	int low;
+	/* Read by the metrics too */
+	uint64_t avail_bytes;
+	double bytes_per_sec;
+	double secs_to_full;
+};
+
+struct space_monitor {
+	/* statvfs() interval and forecast thresholds,
+	 * 0 disables them */
+	uint32_t check_secs;
+	uint32_t low_mins;
+	uint32_t critical_mins;
+	/* Vorbis quality to fall back to below
+	 * critical_mins */
+	double degraded_quality;
+	/* Remove the oldest logs below low_mins */
+	int purge;
+	/* Timer thread only, except degraded
+	 * that the metrics read too */
+	uint32_t secs;
+	int degraded;
+	int saved_format;
+	double saved_quality;
+	double saved_bytes_per_sec;
+	struct space_target targets[STORAGE_MAX_TARGETS];
+};
+
+/* Adaptive degradation, see load.c */
+#define LOAD_COMP_STEP		0.25
+#define LOAD_QUALITY_STEP	0.2
+#define LOAD_SETTLE_SECS	5
+#define LOAD_MAX_HOLD_SECS	3600
+
+struct load_monitor {
+	/* Ring fill (percent) to step down at and to
+	 * step back up below, 0 disables it */
+	uint32_t high_pct;
+	uint32_t low_pct;
+	/* How long the ring has to stay below low_pct
+	 * before stepping back up */
+	uint32_t hold_secs;
+	/* Timer thread only, except step that's read when
+	 * opening files / by the metrics and resampler_type
+	 * that the consumer picks up */
+	int step;
+	int resampler_type;
+	int stepped_up;
+	uint32_t cur_hold_secs;
+	uint32_t secs_clear;
+	uint32_t secs_since_change;
+	uint64_t prev_dropped;
+	/* Marker of the last change, to tell when
+	 * the consumer got to it */
+	uint32_t mark;
+};
+
+/* Process callback timing, see rtstats.c */
+#define RTSTATS_BUCKETS	24
+
+enum rtstats_hists {
+	RTSTATS_CALLBACK = 0,
+	RTSTATS_LOCK_WAIT = 1,
+	RTSTATS_JITTER = 2,
+	RTSTATS_NUM_HISTS = 3
+};
+
+struct rtstats_hist {
+	uint64_t count[RTSTATS_BUCKETS];
+	uint64_t total_usecs;
+	uint32_t max_usecs;
+};
+
+struct rtstats {
+	int enabled;
+	uint32_t dump_interval_secs;
+	/* Written by the process callback only */
+	struct rtstats_hist hists[RTSTATS_NUM_HISTS];
+	uint64_t periods;
+	uint64_t over_budget;
+	uint64_t last_begin;
+	/* Written by the xrun callback */
+	uint32_t xruns;
+	/* Set on init */
+	double usecs_per_tick;
+	uint64_t ticks_per_frame;
+	/* Timer thread only */
+	uint32_t secs_since_dump;
+};
+
+extern volatile sig_atomic_t rtstats_dump_requested;
+
+/* Capture ring, between the process callback and the consumer.
+ * Each period goes in as a struct recorder_block followed by
+ * its interleaved frames, by default it holds
+ * RECORDER_RING_SECS of audio. */
+#define RECORDER_RING_SECS		4
+#define RECORDER_CONSUMER_POLL_MSECS	10
+
+/* JACK server reconnection, connections of our ports get
+ * cached so that we can restore them */
+#define RECORDER_RECONNECT_MSECS	250
+#define RECORDER_MAX_CONNS		8
+#define RECORDER_PORT_NAME_MAX		320
+
+struct recorder_block {
+	uint32_t nframes;
+	uint32_t flags;
+	/* Markers requested up to this period */
+	uint32_t marks;
+};
+
+/* Commands that take effect on a block */
+enum recorder_block_flags {
+	RECORDER_BLOCK_ROTATE = 1 << 0
+};
+
+/* Counters for the metrics endpoint, each one has a single
+ * writer and gets accessed with relaxed atomics */
+struct recorder_stats {
+	/* Process callback */
+	uint64_t frames_captured;
+	uint64_t dropped_periods;
+	/* Consumer */
+	uint64_t frames_consumed;
+	uint64_t frames_written;
+	uint64_t busy_usecs;
+	uint32_t last_write_usecs;
+	/* Timer thread */
+	uint64_t bytes_closed;
+	double encoder_rtf;
+	uint64_t prev_frames_consumed;
+	uint64_t prev_busy_usecs;
+};
+
+/* Disk-backed spool, see spool.c */
+#define SPOOL_DEFAULT_PATH	"/var/tmp"
+#define SPOOL_MAX_MINS		(24 * 60)
+#define SPOOL_CHUNK_SIZE	(1024 * 1024)
+
+struct spool {
+	/* Directory to keep the spool file on and mins
+	 * of audio it holds, 0 disables it */
+	char *path;
+	uint32_t mins;
+	/* Between the ring and the consumer, over the
+	 * mapped file. The process callback signals
+	 * trigger when there is a block to move. */
+	jack_ringbuffer_t *ring;
+	int fd;
+	pthread_mutex_t lock;
+	pthread_cond_t trigger;
+	/* Spool thread only, bytes put on the ring and
+	 * how far we've written back / dropped it */
+	uint64_t written;
+	uint64_t synced;
+	uint64_t released;
+	int full;
+};
+
+/* Shared memory tap, see tap.c */
+#define TAP_DEFAULT_SECS	4
+#define TAP_MAX_SECS		60
+
+struct tap {
+	/* POSIX shared memory name and secs of audio the
+	 * segment holds, disabled if name is NULL */
+	char *name;
+	uint32_t secs;
+	/* Process callback only */
+	struct tap_header *hdr;
+	float *ring;
+	size_t map_size;
+};
 
 struct recorder {
 	uint8_t opmode;
-	/* GUI stuff */
+	/* GUI stuff, the widgets are kept in gui.c */
 	int headless;
-	GtkWidget *window;
-	GtkWidget *button;
-	GtkWidget *button_image;
-	GdkPixbuf *active_pbuf;
-	GdkPixbuf *inactive_pbuf;
-	GtkWidget *timer;
-	GtkWidget *level_left;
-	GtkWidget *level_right;
 	/* Jack-related */
 	jack_port_t *inL;
 	jack_port_t *inR;
 	jack_client_t *client;
+	/* Set when the server goes away, until we get
+	 * back to it. Timer thread only, except jack_lost
+	 * that gets set by JACK's shutdown callback. */
+	int jack_lost;
+	int jack_resume;
+	int jack_mismatch;
+	uint64_t jack_retry_usecs;
+	char jack_conns[2][RECORDER_MAX_CONNS][RECORDER_PORT_NAME_MAX];
+	int jack_num_conns[2];
+	/* Port name patterns (regexps) to connect AudioL / AudioR
+	 * to, and the ports they resolved to. Timer thread only,
+	 * except jack_ports_changed that gets set by JACK's port
+	 * registration callback. */
+	char *jack_sources[2];
+	char jack_source_ports[2][RECORDER_PORT_NAME_MAX];
+	int jack_ports_changed;
+	/* Fed through recorder_capture() by something other
+	 * than JACK (e.g. the benchmark), no client around */
+	int offline;
 	/* Input Info */
 	int stereo;
+	uint32_t in_sample_rate;
 	/* Input buffer */
 	float *inbuff;
 	size_t inbuff_size;
-	/* Amplitude values */
-	float left_amp;
-	float right_amp;
-	/* Output info */
+	/* Peak-hold values, raised by the process callback and
+	 * reset by the GUI each time it reads them. These are the
+	 * bits of a positive float, so they compare as integers. */
+	uint32_t peak_hold[2];
+	struct monitor monitor;
+	struct tap tap;
+	struct space_monitor space;
+	struct load_monitor load;
+	struct rtstats rtstats;
+	/* Output info, storage_path is the first storage
+	 * target and the alternate ones follow */
 	char *storage_path;
-	SNDFILE *out;
+	char *alt_storage_paths[STORAGE_MAX_TARGETS - 1];
+	int num_alt_storage_paths;
+	int storage_policy;
+	/* Consumer only, set when all sinks of the output file
+	 * failed, until we get a new one. pending_frames of
+	 * outbuff (from pending_offset) still need writing.
+	 * storage_reopened is set once a retry got a new file. */
+	int storage_failed;
+	int storage_reopened;
+	uint32_t pending_offset;
+	uint32_t pending_frames;
+	uint64_t storage_retry_usecs;
+	struct recorder_file *out;
+	struct recorder_file *spare;
+	struct recorder_file *retired;
 	SF_INFO info;
+	struct flac_opts flac;
 	int format;
 	double quality;
 	double comp_level;
@@ -59,15 +470,50 @@ struct recorder {
 	/* Output buffer */
 	float *outbuff;
 	size_t outbuff_size;
-	/* Resampler */
+	/* Resampler, resampler_state is of state_type
+	 * that load.c may lower (consumer only) */
+	int resampler_type;
+	int resampler_state_type;
 	SRC_STATE *resampler_state;
 	SRC_DATA resampler_data;
 	double resampler_ratio;
 	int max_out_frames;
-	/* Consumer */
+	/* Every buffer above and below lives on the arena,
+	 * lock_all locks the rest of our memory too */
+	struct arena arena;
+	int lock_all;
+	/* Consumer, the ring holds buffer_secs of audio */
+	uint32_t buffer_secs;
+	jack_ringbuffer_t *ring;
 	float *inbuff_copy;
-	int num_frames;
+	/* Overflows to disk when not running offline */
+	struct spool spool;
 	int rtprio;
+	struct recorder_stats stats;
+	/* Metrics endpoint, disabled if 0 */
+	uint16_t metrics_port;
+	/* Live stream of the output file, disabled if 0 */
+	uint16_t stream_port;
+	/* Control socket, disabled if NULL */
+	char *ctl_path;
+	/* Config file, reloaded on SIGHUP */
+	char *config_path;
+	/* Commands for the next period (recorder_block_flags),
+	 * picked up by the process callback */
+	uint32_t ctl_pending;
+	/* Start requested through the control socket, handled
+	 * on the timer thread, see recorder_request_start() */
+	uint32_t start_pending;
+	/* Marker labels waiting for the consumer, marks_queued
+	 * counts every marker requested and marks_done the ones
+	 * the consumer got to */
+	struct recorder_marker *markers;
+	uint32_t marks_queued;
+	uint32_t marks_done;
+	/* Start latency */
+	uint64_t start_request_usecs;
+	uint64_t start_latency_usecs;
+	volatile sig_atomic_t start_latency_pending;
 	/* Timer */
 	uint32_t logrotate_interval_secs;
 	uint32_t secs_recorded;
@@ -81,7 +527,8 @@ enum recorder_states {
 	RECORDER_RUNNING = 1,
 	RECORDER_STOPPED = 2,
 	RECORDER_TRANSITION = 3,
-	RECORDER_DELAYED_STOP = 4
+	RECORDER_DELAYED_STOP = 4,
+	RECORDER_ARMED = 5
 };
 
 #define RECORDER_STOP_DELAY_SECS 2
@@ -95,7 +542,8 @@ enum recorder_error_codes {
 	RECORDER_AGAIN = -6,
 	RECORDER_TIMER_ERR = -7,
 	RECORDER_CONSUMER_ERR = -8,
-	RECODER_ERR_MAX = -9
+	RECORDER_SPOOL_ERR = -9,
+	RECODER_ERR_MAX = -10
 };
 
 enum recorder_modes {
@@ -123,15 +571,205 @@ enum gui_button_states {
 	GUI_BUTTON_DISABLED = 3
 };
 
-/* GUI */
-gboolean gui_update_meters(gpointer data);
-gboolean gui_update_timer_label(gpointer data);
-gboolean gui_update_button_state(gpointer data);
+/* GUI, only there when built with --enable-gui (the default), so
+ * that the recorder itself never pulls in GTK */
+#ifdef ENABLE_GUI
+void gui_update_timer_label(struct recorder *rcd);
+void gui_update_button_state(struct recorder *rcd, int state);
 int gui_initialize(int argc, char *argv[], struct recorder *rcd);
-gboolean gui_cleanup(gpointer data);
+void gui_cleanup(struct recorder *rcd);
+#else
+static inline void
+gui_update_timer_label(struct recorder *rcd)
+{
+}
+
+static inline void
+gui_update_button_state(struct recorder *rcd, int state)
+{
+}
+
+static inline int
+gui_initialize(int argc, char *argv[], struct recorder *rcd)
+{
+	return RECORDER_INVALID;
+}
+
+static inline void
+gui_cleanup(struct recorder *rcd)
+{
+}
+#endif
+
+/* Signal monitor */
+void monitor_process(struct monitor *mon, jack_default_audio_sample_t **in,
+		     int num_channels, jack_nframes_t nframes, float *peaks);
+void monitor_update(struct monitor *mon, struct recorder *rcd);
+void monitor_get_status(struct monitor *mon, struct monitor_status *status);
+int monitor_init(struct monitor *mon, int num_channels, uint32_t sample_rate);
+void monitor_cleanup(struct monitor *mon);
+
+/* Process callback timing */
+uint64_t rtstats_ticks(void);
+uint64_t rtstats_begin(struct rtstats *st, jack_nframes_t nframes);
+void rtstats_end(struct rtstats *st, uint64_t start, jack_nframes_t nframes);
+void rtstats_lock_wait(struct rtstats *st, uint64_t start);
+void rtstats_xrun(struct rtstats *st);
+void rtstats_update(struct rtstats *st);
+void rtstats_init(struct rtstats *st, uint32_t sample_rate);
+
+/* Event loop */
+typedef void (*evloop_handler) (int fd, short revents, void *data);
+int evloop_add(int fd, short events, evloop_handler handler, void *data);
+void evloop_set_events(int fd, short events);
+void evloop_remove(int fd);
+int evloop_start(void);
+void evloop_stop(void);
+
+/* Metrics endpoint */
+int metrics_init(struct recorder *rcd);
+void metrics_cleanup(void);
+
+/* Live stream */
+void stream_file_init(struct recorder_file *file);
+void stream_file_cleanup(struct recorder_file *file);
+void stream_write(struct recorder_file *file, const void *ptr, size_t count);
+void stream_set_file(struct recorder_file *file);
+int stream_num_listeners(void);
+int stream_init(struct recorder *rcd);
+void stream_cleanup(void);
+
+/* Hash manifests */
+void manifest_file_init(struct recorder_file *file);
+void manifest_write(struct recorder_file *file, const void *ptr, size_t count);
+void manifest_file_close(struct recorder_file *file);
+void manifest_init(struct recorder *rcd);
+
+/* Control socket */
+int ctl_init(struct recorder *rcd);
+void ctl_cleanup(void);
+
+/* Storage targets */
+int storage_open(struct recorder *rcd, struct recorder_file *file,
+		 const char *name);
+int storage_sf_open(struct recorder_file *file, SF_INFO *info);
+sf_count_t storage_write(struct recorder_file *file, const void *ptr,
+			 sf_count_t count);
+sf_count_t storage_seek(struct recorder_file *file, sf_count_t offset,
+			int whence);
+int storage_rename(struct recorder_file *file, const char *name);
+void storage_close(struct recorder_file *file, int remove);
+int storage_file_usable(struct recorder_file *file);
+const char *storage_good_copy(struct recorder_file *file);
+int storage_available(struct recorder *rcd);
+int storage_target_up(int target);
+uint64_t storage_target_bytes(int target);
+
+/* Page locked memory */
+size_t arena_round(size_t size);
+size_t arena_ringbuffer_size(size_t size);
+int arena_init(struct arena *a, size_t size);
+void *arena_alloc(struct arena *a, size_t size);
+jack_ringbuffer_t *arena_ringbuffer(struct arena *a, size_t size);
+void arena_cleanup(struct arena *a);
+void arena_lock_all(void);
+#ifdef ALLOC_TRAP
+void arena_trap_arm(const char *thread);
+void arena_trap_disarm(void);
+#else
+#define arena_trap_arm(thread)	do { } while (0)
+#define arena_trap_disarm()	do { } while (0)
+#endif
+
+/* Direct libFLAC encoder */
+#ifdef ENABLE_LIBFLAC
+struct flac_encoder *flac_open(struct recorder_file *file,
+			       const struct flac_opts *opts,
+			       const SF_INFO *info, double comp_level);
+int flac_write(struct flac_encoder *fe, const float *buf, uint32_t nframes);
+void flac_close(struct flac_encoder *fe);
+#else
+static inline struct flac_encoder *
+flac_open(struct recorder_file *file, const struct flac_opts *opts,
+	  const SF_INFO *info, double comp_level)
+{
+	return NULL;
+}
+
+static inline int
+flac_write(struct flac_encoder *fe, const float *buf, uint32_t nframes)
+{
+	return 0;
+}
+
+static inline void
+flac_close(struct flac_encoder *fe)
+{
+}
+#endif
+
+/* Disk-backed spool */
+int spool_move(struct spool *sp, jack_ringbuffer_t *ring, size_t frame_size);
+void spool_wait(struct spool *sp);
+int spool_init(struct spool *sp, size_t size);
+int spool_enable(struct spool *sp);
+void spool_cleanup(struct spool *sp);
+
+/* Shared memory tap */
+void tap_write(struct tap *tap, const float *buf, uint32_t nframes);
+int tap_init(struct tap *tap, int channels, uint32_t sample_rate,
+	     uint32_t max_period);
+void tap_cleanup(struct tap *tap);
+
+/* Free space forecasting */
+void space_update(struct space_monitor *sm, struct recorder *rcd);
+void space_init(struct space_monitor *sm);
+
+/* Adaptive degradation */
+void load_update(struct load_monitor *lm, struct recorder *rcd);
+void load_adjust(struct load_monitor *lm, int format, double *quality,
+		 double *comp_level);
+void load_init(struct load_monitor *lm, struct recorder *rcd);
+
+/* Config file */
+extern volatile sig_atomic_t config_reload_requested;
+int config_load(const char *path, struct recorder *rcd);
+void config_reload(struct recorder *rcd);
+void config_cleanup(void);
+
+/* Loudness meter */
+void loudness_process(struct loudness_meter *lm, const float *buf,
+		      uint32_t nframes);
+struct loudness_meter *loudness_new(uint32_t sample_rate, int num_channels,
+				    const char *track_path);
+double loudness_finish(struct loudness_meter *lm);
+
+/* Peak files */
+void peaks_process(struct peaks_writer *pw, const float *buf,
+		   uint32_t nframes);
+struct peaks_writer *peaks_new(uint32_t sample_rate, int num_channels,
+			       const char *path, uint32_t expected_secs);
+void peaks_reserve(struct peaks_writer *pw);
+void peaks_finish(struct peaks_writer *pw);
 
 /* Recorder */
+int recorder_capture(struct recorder *rcd, jack_default_audio_sample_t **in,
+		     jack_nframes_t nframes);
+void recorder_drain(struct recorder *rcd);
+void recorder_get_file_info(struct recorder *rcd, char *path,
+			    uint64_t *bytes);
+int recorder_file_in_use(struct recorder *rcd, const char *name);
+int recorder_remove_file(const char *path);
 int recorder_start(struct recorder *rcd);
+int recorder_request_start(struct recorder *rcd);
 int recorder_stop(struct recorder *rcd);
+int recorder_set_output(struct recorder *rcd, char *storage_path, int format,
+			double quality, double comp_level,
+			uint32_t logrotate_interval_secs);
+int recorder_rotate(struct recorder *rcd);
+void recorder_renew_spare(struct recorder *rcd);
+int recorder_mark(struct recorder *rcd, const char *label);
 int recorder_initialize(struct recorder *rcd);
+int recorder_initialize_offline(struct recorder *rcd, uint32_t in_sample_rate,
+				uint32_t max_frames);
 void recorder_cleanup(struct recorder *rcd);
@@ -0,0 +1,529 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Transcodes aging logs for archival
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE		/* For syscall() */
+#include "sidecar.h"
+#include <stdio.h>		/* For printf/fprintf/perror */
+#include <stdlib.h>		/* For exit() / strtol() / realloc() */
+#include <string.h>		/* For strcmp / strncmp / strrchr */
+#include <stdint.h>		/* For typed ints */
+#include <limits.h>		/* For PATH_MAX */
+#include <errno.h>		/* For errno */
+#include <time.h>		/* For time() */
+#include <fcntl.h>		/* For open() */
+#include <unistd.h>		/* For getopt() / fsync() / link() */
+#include <pthread.h>		/* For pthread_* */
+#include <dirent.h>		/* For opendir / readdir */
+#include <sys/stat.h>		/* For stat() / futimens() */
+#include <sys/syscall.h>	/* For SYS_ioprio_set */
+#include <sys/resource.h>	/* For setpriority() */
+#include <sndfile.h>		/* For decoding / encoding */
+
+/*
+ * Logs older than a number of days get transcoded from FLAC to
+ * Ogg/Vorbis, through libsndfile with the same quality setting
+ * the recorder uses for Ogg/Vorbis, on a thread per core. It
+ * runs at the lowest CPU / idle I/O priority so that it only
+ * gets what the recorder (and everything else) leaves, and may
+ * run e.g. daily from cron.
+ *
+ * The new file is written under a hidden temporary name and
+ * only replaces the log once it's on disk and it decodes to
+ * the same number of frames. It gets the log's mode, owner,
+ * timestamps and tags, its sidecars (loudness, peaks, markers,
+ * hash manifest) get renamed along. Files that are still being
+ * written (with a progress sidecar) or that already have an
+ * Ogg counterpart are left alone.
+ */
+
+#define ARCHIVE_BLOCK_FRAMES	4096
+#define ARCHIVE_MAX_JOBS	64
+
+/* From linux/ioprio.h, glibc doesn't wrap it */
+#define ARCHIVE_IOPRIO_WHO_PROCESS	1
+#define ARCHIVE_IOPRIO_CLASS_IDLE	3
+#define ARCHIVE_IOPRIO_CLASS_SHIFT	13
+
+/* The manifest names the FLAC file, acoffin-verify
+ * checks where it was on the chain */
+static const char *archive_sidecar_exts[] = { SIDECAR_EXTS, NULL };
+
+struct archive_opts {
+	uint32_t days;
+	double quality;
+	int jobs;
+	int dry_run;
+};
+
+struct archive_queue {
+	char **paths;
+	size_t count;
+	/* Next one to pick up, under lock */
+	size_t next;
+	pthread_mutex_t lock;
+	const struct archive_opts *opts;
+	/* Totals, under lock */
+	uint32_t done;
+	uint32_t failed;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+static int
+archive_has_ext(const char *name, const char *ext)
+{
+	size_t len = strlen(name);
+	size_t ext_len = strlen(ext);
+
+	return len > ext_len && !strcmp(name + len - ext_len, ext);
+}
+
+/**
+ * Queues the logs on dir old enough to be archived
+ */
+static int
+archive_scan(struct archive_queue *queue, const char *dir, time_t before)
+{
+	char path[PATH_MAX] = { 0 };
+	char progress_path[PATH_MAX] = { 0 };
+	struct dirent *entry = NULL;
+	struct stat st = { 0 };
+	char **paths = NULL;
+	DIR *dp = NULL;
+
+	dp = opendir(dir);
+	if (!dp) {
+		fprintf(stderr, "Could not open %s: %s\n", dir,
+			strerror(errno));
+		return -1;
+	}
+
+	while ((entry = readdir(dp))) {
+		/* Only our own logs, spare files are hidden */
+		if (strncmp(entry->d_name, "Log-", 4) ||
+		    !archive_has_ext(entry->d_name, ".flac"))
+			continue;
+
+		snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) ||
+		    st.st_mtime >= before)
+			continue;
+
+		/* Still being written */
+		snprintf(progress_path, PATH_MAX, "%s%s", path, PROGRESS_EXT);
+		if (!access(progress_path, F_OK))
+			continue;
+
+		paths = realloc(queue->paths,
+				(queue->count + 1) * sizeof(char *));
+		if (!paths)
+			break;
+		queue->paths = paths;
+		queue->paths[queue->count] = strdup(path);
+		if (!queue->paths[queue->count])
+			break;
+		queue->count++;
+	}
+	closedir(dp);
+
+	return entry ? -1 : 0;
+}
+
+/**
+ * Copies over the tags libsndfile knows about
+ */
+static void
+archive_copy_strings(SNDFILE *in, SNDFILE *out)
+{
+	const char *str = NULL;
+	int i = 0;
+
+	for (i = SF_STR_FIRST; i <= SF_STR_LAST; i++) {
+		str = sf_get_string(in, i);
+		if (str)
+			sf_set_string(out, i, str);
+	}
+}
+
+/**
+ * Decodes in and encodes it to fd, then checks that
+ * what's on fd decodes to as many frames
+ */
+static int
+archive_encode(SNDFILE *in, const SF_INFO *in_info, int fd,
+	       const char *tmp_path, double quality)
+{
+	static __thread float buf[ARCHIVE_BLOCK_FRAMES * 8];
+	SF_INFO out_info = { 0 };
+	SF_INFO check_info = { 0 };
+	SNDFILE *out = NULL;
+	sf_count_t block = ARCHIVE_BLOCK_FRAMES;
+	sf_count_t frames = 0;
+	sf_count_t ret = 0;
+	int err = 0;
+
+	if (in_info->channels > 8) {
+		fprintf(stderr, "%i channels are more than we do\n",
+			in_info->channels);
+		return -1;
+	}
+
+	out_info.samplerate = in_info->samplerate;
+	out_info.channels = in_info->channels;
+	out_info.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+	out = sf_open_fd(fd, SFM_WRITE, &out_info, 0);
+	if (!out) {
+		fprintf(stderr, "Could not open encoder: %s\n",
+			sf_strerror(NULL));
+		return -1;
+	}
+
+	if (sf_command(out, SFC_SET_VBR_ENCODING_QUALITY, &quality,
+		       sizeof(double)) != SF_TRUE) {
+		err = -1;
+		goto cleanup;
+	}
+	archive_copy_strings(in, out);
+
+	while ((ret = sf_readf_float(in, buf, block)) > 0) {
+		if (sf_writef_float(out, buf, ret) != ret) {
+			fprintf(stderr, "Encoder error: %s\n", sf_strerror(out));
+			err = -1;
+			goto cleanup;
+		}
+		frames += ret;
+	}
+
+	if (frames != in_info->frames) {
+		fprintf(stderr, "Decoded %lli of %lli frames\n",
+			(long long)frames, (long long)in_info->frames);
+		err = -1;
+	}
+
+ cleanup:
+	if (sf_close(out) != 0)
+		err = -1;
+	if (err < 0 || fsync(fd) < 0)
+		return -1;
+
+	/* Re-read what ended up on disk */
+	out = sf_open(tmp_path, SFM_READ, &check_info);
+	if (!out)
+		return -1;
+	sf_close(out);
+	if (check_info.frames != in_info->frames ||
+	    check_info.samplerate != in_info->samplerate ||
+	    check_info.channels != in_info->channels) {
+		fprintf(stderr, "Transcoded file has %lli frames instead "
+			"of %lli\n", (long long)check_info.frames,
+			(long long)in_info->frames);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Makes sure a rename / unlink on dir is on disk
+ */
+static void
+archive_sync_dir(const char *path)
+{
+	char dir[PATH_MAX] = { 0 };
+	char *slash = NULL;
+	int fd = -1;
+
+	snprintf(dir, PATH_MAX, "%s", path);
+	slash = strrchr(dir, '/');
+	if (slash)
+		*slash = '\0';
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	fsync(fd);
+	close(fd);
+}
+
+/**
+ * Transcodes the log on path, and puts the new one
+ * in its place. Returns its size or -1.
+ */
+static int64_t
+archive_file(const char *path, double quality)
+{
+	char out_path[PATH_MAX] = { 0 };
+	char tmp_path[PATH_MAX] = { 0 };
+	char from_path[PATH_MAX] = { 0 };
+	char to_path[PATH_MAX] = { 0 };
+	const char *name = strrchr(path, '/') + 1;
+	size_t base_len = strlen(path) - strlen(".flac");
+	struct timespec times[2] = { {0} };
+	struct stat st = { 0 };
+	SF_INFO in_info = { 0 };
+	SNDFILE *in = NULL;
+	int fd = -1;
+	int ret = 0;
+	int i = 0;
+
+	snprintf(out_path, PATH_MAX, "%.*s.ogg", (int)base_len, path);
+	snprintf(tmp_path, PATH_MAX, "%.*s.%.*s.ogg.tmp",
+		 (int)(name - path), path,
+		 (int)(strlen(name) - strlen(".flac")), name);
+
+	if (!access(out_path, F_OK)) {
+		fprintf(stderr, "%s is already there, skipping\n", out_path);
+		return -1;
+	}
+
+	in = sf_open(path, SFM_READ, &in_info);
+	if (!in || stat(path, &st) < 0) {
+		fprintf(stderr, "Could not open %s: %s\n", path,
+			sf_strerror(in));
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* A leftover from an interrupted run gets overwritten */
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+		  S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("Could not create temporary file");
+		ret = -1;
+		goto cleanup;
+	}
+
+	ret = archive_encode(in, &in_info, fd, tmp_path, quality);
+	if (ret < 0)
+		goto cleanup;
+
+	/* Same mode / owner / times as the log, chown
+	 * only works for root, keep ours otherwise */
+	times[0] = st.st_atim;
+	times[1] = st.st_mtim;
+	if (fchown(fd, st.st_uid, st.st_gid) < 0 && errno != EPERM)
+		perror("Could not change owner");
+	if (fchmod(fd, st.st_mode & 07777) < 0 ||
+	    futimens(fd, times) < 0) {
+		perror("Could not copy mode / timestamps");
+		ret = -1;
+		goto cleanup;
+	}
+
+	/* Doesn't replace anything that showed up meanwhile */
+	if (link(tmp_path, out_path) < 0) {
+		perror("Could not put transcoded file in place");
+		ret = -1;
+		goto cleanup;
+	}
+	unlink(tmp_path);
+	archive_sync_dir(out_path);
+
+	unlink(path);
+	for (i = 0; archive_sidecar_exts[i]; i++) {
+		snprintf(from_path, PATH_MAX, "%s%s", path,
+			 archive_sidecar_exts[i]);
+		snprintf(to_path, PATH_MAX, "%s%s", out_path,
+			 archive_sidecar_exts[i]);
+		rename(from_path, to_path);
+	}
+	archive_sync_dir(out_path);
+	fstat(fd, &st);
+
+ cleanup:
+	if (in)
+		sf_close(in);
+	if (fd >= 0)
+		close(fd);
+	if (ret < 0) {
+		unlink(tmp_path);
+		return -1;
+	}
+	return st.st_size;
+}
+
+/**
+ * Worker thread, takes logs off the queue until it's empty
+ */
+static void *
+archive_worker(void *data)
+{
+	struct archive_queue *queue = (struct archive_queue *)data;
+	struct stat st = { 0 };
+	const char *path = NULL;
+	int64_t out_size = 0;
+
+	while (1) {
+		pthread_mutex_lock(&queue->lock);
+		path = queue->next < queue->count ?
+		       queue->paths[queue->next++] : NULL;
+		pthread_mutex_unlock(&queue->lock);
+		if (!path)
+			break;
+
+		if (stat(path, &st) < 0)
+			continue;
+		out_size = archive_file(path, queue->opts->quality);
+
+		pthread_mutex_lock(&queue->lock);
+		if (out_size < 0) {
+			queue->failed++;
+			fprintf(stderr, "Could not archive %s\n", path);
+		} else {
+			queue->done++;
+			queue->bytes_in += st.st_size;
+			queue->bytes_out += out_size;
+			printf("%s: %lli -> %lli bytes\n", path,
+			       (long long)st.st_size, (long long)out_size);
+			fflush(stdout);
+		}
+		pthread_mutex_unlock(&queue->lock);
+	}
+
+	return NULL;
+}
+
+/**
+ * Lowest CPU priority and idle I/O class, threads
+ * created afterwards inherit both
+ */
+static void
+archive_lower_priority(void)
+{
+	if (setpriority(PRIO_PROCESS, 0, 19) < 0)
+		perror("Could not lower CPU priority");
+#ifdef SYS_ioprio_set
+	if (syscall(SYS_ioprio_set, ARCHIVE_IOPRIO_WHO_PROCESS, 0,
+		    ARCHIVE_IOPRIO_CLASS_IDLE <<
+		    ARCHIVE_IOPRIO_CLASS_SHIFT) < 0)
+		perror("Could not lower I/O priority");
+#endif
+}
+
+
+/*************\
+* ENTRY POINT *
+\*************/
+
+static void
+usage(char *name)
+{
+	printf("Audio Coffin, transcodes aging logs for archival\n");
+	printf("\nUsage: %s [<parameter> <value>] <directory> [<directory>...]\n",
+	       name);
+	printf("\nLogs on the given directories older than -d days get "
+	       "transcoded from FLAC to Ogg/Vorbis.\n");
+	printf("\nParameters:\n"
+	       "\t-h\t\tShow this list\n"
+	       "\t-d   <int>\tOnly logs last modified more than this many days ago (default: 30)\n"
+	       "\t-q   <float>\tOgg/Vorbis quality, from 0.0 to 1.0 (default: 0.4)\n"
+	       "\t-j   <int>\tTranscode this many logs in parallel (default: one per online CPU)\n"
+	       "\t-n\t\tOnly list the logs that would get transcoded\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct archive_opts opts = { 0 };
+	struct archive_queue queue = { 0 };
+	pthread_t threads[ARCHIVE_MAX_JOBS];
+	time_t before = 0;
+	size_t i = 0;
+	int started = 0;
+	int opt = 0;
+	int ret = 0;
+
+	/* Set default values */
+	opts.days = 30;
+	opts.quality = 0.4;
+	opts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "hd:q:j:n")) != -1) {
+		switch (opt) {
+		case 'd':
+			opts.days = strtol(optarg, NULL, 10);
+			break;
+		case 'q':
+			opts.quality = strtod(optarg, NULL);
+			break;
+		case 'j':
+			opts.jobs = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			opts.dry_run = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : -1);
+		}
+	}
+
+	if (optind >= argc || opts.quality < 0.0 || opts.quality > 1.0) {
+		usage(argv[0]);
+		exit(-1);
+	}
+	if (opts.jobs < 1)
+		opts.jobs = 1;
+	if (opts.jobs > ARCHIVE_MAX_JOBS)
+		opts.jobs = ARCHIVE_MAX_JOBS;
+
+	before = time(NULL) - (time_t) opts.days * 24 * 60 * 60;
+	for (; optind < argc; optind++)
+		if (archive_scan(&queue, argv[optind], before) < 0)
+			ret = -1;
+
+	if (opts.dry_run) {
+		for (i = 0; i < queue.count; i++)
+			printf("%s\n", queue.paths[i]);
+		goto cleanup;
+	}
+
+	archive_lower_priority();
+
+	queue.opts = &opts;
+	pthread_mutex_init(&queue.lock, NULL);
+	for (started = 0; started < opts.jobs &&
+	     (size_t)started < queue.count; started++)
+		if (pthread_create(&threads[started], NULL, archive_worker,
+				   &queue) != 0)
+			break;
+	/* Do it ourselves if we couldn't start any */
+	if (!started && queue.count)
+		archive_worker(&queue);
+	while (started--)
+		pthread_join(threads[started], NULL);
+	pthread_mutex_destroy(&queue.lock);
+
+	printf("Archived %u logs (%u failed), %llu -> %llu bytes\n",
+	       queue.done, queue.failed, (unsigned long long)queue.bytes_in,
+	       (unsigned long long)queue.bytes_out);
+	if (queue.failed)
+		ret = -1;
+
+ cleanup:
+	for (i = 0; i < queue.count; i++)
+		free(queue.paths[i]);
+	free(queue.paths);
+	return ret;
+}
@@ -0,0 +1,316 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Page locked memory for the audio path
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE		/* For MAP_HUGETLB / MADV_HUGEPAGE */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf / perror */
+#include <string.h>		/* For memset */
+#include <unistd.h>		/* For sysconf() / write() */
+#include <malloc.h>		/* For mallopt() */
+#include <sys/mman.h>		/* For mmap() / mlock() / mlockall() */
+#ifdef ALLOC_TRAP
+#include <execinfo.h>		/* For backtrace() */
+#endif
+
+/*
+ * Every buffer the capture, resample and encode stages work on
+ * (the ring between the process callback and the consumer, and
+ * the input / output buffers around the resampler) is carved
+ * out of a single mapping at init time, that's locked in memory
+ * and pre-faulted, so that the audio path never waits for a page
+ * to be faulted in or swapped back. It may also be backed by
+ * huge pages, falling back to transparent huge pages if none
+ * are reserved. Nothing gets freed until the recorder is torn
+ * down, allocations just move a pointer forward.
+ *
+ * What libsndfile / the encoders / the resampler allocate on
+ * their own is out of our hands, with lock_all everything gets
+ * locked (including what's allocated later on) and the C library
+ * is told to keep freed memory around, so that once allocations
+ * reach a steady state they get served from memory that's
+ * already there.
+ */
+
+/*********\
+* HELPERS *
+\*********/
+
+static size_t
+arena_page_size(void)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+
+	return page_size > 0 ? (size_t)page_size : 4096;
+}
+
+static void
+arena_prefault(struct arena *a)
+{
+	size_t page_size = arena_page_size();
+	size_t off = 0;
+
+	/* mlock() already did it, unless it failed */
+	for (off = 0; off < a->size; off += page_size)
+		((volatile char *)a->base)[off] = 0;
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Space an allocation of size takes on the arena,
+ * for sizing it up front
+ */
+size_t
+arena_round(size_t size)
+{
+	return (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+}
+
+/**
+ * Same for a ring buffer of size bytes, rounded up to
+ * a power of two as jack_ringbuffer_create() does
+ */
+size_t
+arena_ringbuffer_size(size_t size)
+{
+	size_t buf_size = 1;
+
+	while (buf_size < size)
+		buf_size <<= 1;
+
+	return arena_round(sizeof(jack_ringbuffer_t)) + arena_round(buf_size);
+}
+
+/**
+ * Maps size bytes, locks them in memory and faults them in.
+ * Not being able to lock them (e.g. due to RLIMIT_MEMLOCK)
+ * is not fatal, we just say so.
+ */
+int
+arena_init(struct arena *a, size_t size)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+
+	a->base = MAP_FAILED;
+	a->used = 0;
+	a->locked = 0;
+
+	if (a->huge) {
+		a->size = (size + ARENA_HUGE_PAGE_SIZE - 1) &
+			  ~((size_t)ARENA_HUGE_PAGE_SIZE - 1);
+		a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+			       flags | MAP_HUGETLB, -1, 0);
+		if (a->base == MAP_FAILED)
+			fprintf(stderr, "arena: no huge pages reserved, "
+				"trying transparent ones\n");
+	}
+
+	if (a->base == MAP_FAILED) {
+		a->size = (size + arena_page_size() - 1) &
+			  ~(arena_page_size() - 1);
+		a->base = mmap(NULL, a->size, PROT_READ | PROT_WRITE, flags,
+			       -1, 0);
+		if (a->base == MAP_FAILED) {
+			perror("arena mmap()");
+			a->base = NULL;
+			return RECORDER_NOMEM;
+		}
+		if (a->huge)
+			madvise(a->base, a->size, MADV_HUGEPAGE);
+	}
+
+	if (mlock(a->base, a->size) < 0)
+		fprintf(stderr, "arena: cannot lock %zu bytes in memory, "
+			"check ulimit -l\n", a->size);
+	else
+		a->locked = 1;
+
+	arena_prefault(a);
+
+	return 0;
+}
+
+/**
+ * Returns size bytes off the arena, aligned to ARENA_ALIGN,
+ * or NULL if it doesn't have room for them
+ */
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	void *ptr = NULL;
+
+	size = arena_round(size);
+	if (!a->base || size > a->size - a->used)
+		return NULL;
+
+	ptr = a->base + a->used;
+	a->used += size;
+
+	return ptr;
+}
+
+/**
+ * A JACK ring buffer on the arena, it shouldn't be passed
+ * to jack_ringbuffer_free(), it goes away with the arena
+ */
+jack_ringbuffer_t *
+arena_ringbuffer(struct arena *a, size_t size)
+{
+	jack_ringbuffer_t *rb = NULL;
+	size_t buf_size = 1;
+
+	while (buf_size < size)
+		buf_size <<= 1;
+
+	rb = arena_alloc(a, sizeof(jack_ringbuffer_t));
+	if (!rb)
+		return NULL;
+	memset(rb, 0, sizeof(jack_ringbuffer_t));
+
+	rb->buf = arena_alloc(a, buf_size);
+	if (!rb->buf)
+		return NULL;
+	rb->size = buf_size;
+	rb->size_mask = buf_size - 1;
+	rb->mlocked = a->locked;
+
+	return rb;
+}
+
+void
+arena_cleanup(struct arena *a)
+{
+	if (!a->base)
+		return;
+
+	if (a->locked)
+		munlock(a->base, a->size);
+	munmap(a->base, a->size);
+	a->base = NULL;
+	a->size = 0;
+	a->used = 0;
+	a->locked = 0;
+}
+
+/**
+ * Locks everything we have and will ever have in memory,
+ * and keeps freed memory around instead of giving it back
+ * to the kernel (and faulting it in again later on)
+ */
+void
+arena_lock_all(void)
+{
+	mallopt(M_MMAP_MAX, 0);
+	mallopt(M_TRIM_THRESHOLD, -1);
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		perror("cannot lock memory, mlockall()");
+}
+
+
+/*****************\
+* ALLOCATION TRAP *
+\*****************/
+
+#ifdef ALLOC_TRAP
+/*
+ * Debug builds (--enable-alloc-trap) wrap malloc / calloc /
+ * realloc and report every call made on a thread that armed
+ * the trap (the process callback, and the consumer while
+ * recording), with a backtrace. Put a breakpoint on
+ * arena_trap_hit() to stop there instead.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread const char *arena_trap_thread = NULL;
+
+void __attribute__ ((noinline))
+arena_trap_hit(const char *func)
+{
+	const char *thread = arena_trap_thread;
+	void *frames[32] = { NULL };
+	char msg[128] = { 0 };
+	int num_frames = 0;
+	int len = 0;
+
+	/* Don't trap ourselves */
+	arena_trap_thread = NULL;
+
+	len = snprintf(msg, sizeof(msg), "alloc trap: %s() on the %s "
+		       "thread\n", func, thread);
+	if (write(STDERR_FILENO, msg, len) < 0)
+		goto done;
+	num_frames = backtrace(frames, 32);
+	backtrace_symbols_fd(frames + 1, num_frames - 1, STDERR_FILENO);
+
+ done:
+	arena_trap_thread = thread;
+}
+
+/**
+ * Traps allocations on the calling thread from now on
+ */
+void
+arena_trap_arm(const char *thread)
+{
+	void *frame = NULL;
+
+	if (arena_trap_thread)
+		return;
+
+	/* The first call may load libgcc, which allocates */
+	backtrace(&frame, 1);
+	arena_trap_thread = thread;
+}
+
+void
+arena_trap_disarm(void)
+{
+	arena_trap_thread = NULL;
+}
+
+void *
+malloc(size_t size)
+{
+	if (arena_trap_thread)
+		arena_trap_hit("malloc");
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	if (arena_trap_thread)
+		arena_trap_hit("calloc");
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	if (arena_trap_thread)
+		arena_trap_hit("realloc");
+	return __libc_realloc(ptr, size);
+}
+#endif
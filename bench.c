@@ -0,0 +1,676 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Offline benchmark
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For printf/fprintf/perror */
+#include <stdlib.h>		/* For malloc/free/strtol */
+#include <string.h>		/* For memset/strcmp */
+#include <limits.h>		/* For PATH_MAX */
+#include <math.h>		/* For sinf / fabsf / M_PI */
+#include <unistd.h>		/* For getopt / unlink / rmdir */
+#include <dirent.h>		/* For opendir / readdir */
+#include <sys/stat.h>		/* For stat() */
+#include <sys/resource.h>	/* For getrusage() */
+
+/*
+ * Pushes audio from a synthetic or file-based source through
+ * the recorder as fast as it'll take it, for each of the
+ * format / quality / resampler combinations below, and
+ * reports how it went. The source runs on the calling thread
+ * in place of the process callback, everything past that
+ * (monitor, resampler, encoder, sidecars, file handling) is
+ * the same code the recorder runs on top of JACK. FLAC runs
+ * through libsndfile ("flac") and, if built with it, through
+ * libFLAC directly ("libflac"), on the consumer thread or on
+ * -T threads in parallel. CPU time is for the whole process,
+ * so it includes the encoder threads. With -c each run's output
+ * gets decoded back and checked against what the recorder
+ * wrote, that's what make check runs.
+ */
+
+#define BENCH_PERIOD_FRAMES	1024
+
+struct bench_setting {
+	const char *name;
+	int format;
+	/* FLAC through libFLAC instead of libsndfile */
+	int flac_direct;
+	double quality;
+	double comp_level;
+};
+
+static const struct bench_setting bench_settings[] = {
+	{"c0.00", RECORDER_FORMAT_FLAC, 0, 0.5, 0.0},
+	{"c0.50", RECORDER_FORMAT_FLAC, 0, 0.5, 0.5},
+	{"c1.00", RECORDER_FORMAT_FLAC, 0, 0.5, 1.0},
+#ifdef ENABLE_LIBFLAC
+	{"c0.00", RECORDER_FORMAT_FLAC, 1, 0.5, 0.0},
+	{"c0.50", RECORDER_FORMAT_FLAC, 1, 0.5, 0.5},
+	{"c1.00", RECORDER_FORMAT_FLAC, 1, 0.5, 1.0},
+#endif
+	{"q0.10", RECORDER_FORMAT_OGG_VORBIS, 0, 0.1, 0.75},
+	{"q0.50", RECORDER_FORMAT_OGG_VORBIS, 0, 0.5, 0.75},
+	{"q0.90", RECORDER_FORMAT_OGG_VORBIS, 0, 0.9, 0.75},
+	{NULL, 0, 0, 0.0, 0.0}
+};
+
+static const struct {
+	const char *name;
+	int type;
+} bench_resamplers[] = {
+	{"fastest", SRC_SINC_FASTEST},
+	{"medium", SRC_SINC_MEDIUM_QUALITY},
+	{"best", SRC_SINC_BEST_QUALITY},
+	{NULL, 0}
+};
+
+struct bench_source {
+	/* File source, looped */
+	SNDFILE *sf;
+	SF_INFO info;
+	float *file_buf;
+	/* Synthetic source */
+	double phase[2];
+	uint32_t noise;
+	/* What we feed the recorder */
+	uint32_t sample_rate;
+	int num_channels;
+	float *out[2];
+};
+
+struct bench_opts {
+	char *storage_path;
+	char *input_path;
+	uint32_t secs;
+	uint32_t in_sample_rate;
+	uint32_t out_sample_rate;
+	int stereo;
+	int format;
+	int resampler;
+	uint32_t flac_threads;
+	int check;
+};
+
+static const char *bench_sidecar_exts[] = { SIDECAR_EXTS, NULL };
+
+
+/*********************\
+* ALLOCATION COUNTING *
+\*********************/
+
+/* Everyone (including libsndfile and the encoders) ends up
+ * here instead of libc's allocator, we just count the calls */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static uint64_t bench_allocs = 0;
+
+void *
+malloc(size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+
+/*********\
+* HELPERS *
+\*********/
+
+static double
+bench_get_secs(void)
+{
+	struct timespec ts = { 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static double
+bench_get_cpu_secs(void)
+{
+	struct rusage ru = { 0 };
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (double)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) +
+	       (double)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+/**
+ * Resets the peak RSS of the process, so that each
+ * run gets its own
+ */
+static void
+bench_reset_peak_rss(void)
+{
+	FILE *clear_refs = fopen("/proc/self/clear_refs", "w");
+
+	if (!clear_refs)
+		return;
+	fprintf(clear_refs, "5\n");
+	fclose(clear_refs);
+}
+
+/**
+ * Peak RSS in KiB, from /proc/self/status
+ */
+static long
+bench_get_peak_rss(void)
+{
+	FILE *status = fopen("/proc/self/status", "r");
+	char line[128] = { 0 };
+	long hwm = 0;
+
+	if (!status)
+		return 0;
+	while (fgets(line, sizeof(line), status))
+		if (sscanf(line, "VmHWM: %ld kB", &hwm) == 1)
+			break;
+	fclose(status);
+	return hwm;
+}
+
+static int
+bench_is_sidecar(const char *name)
+{
+	size_t name_len = strlen(name);
+	size_t ext_len = 0;
+	int i = 0;
+
+	for (i = 0; bench_sidecar_exts[i]; i++) {
+		ext_len = strlen(bench_sidecar_exts[i]);
+		if (name_len > ext_len &&
+		    !strcmp(name + name_len - ext_len, bench_sidecar_exts[i]))
+			return 1;
+	}
+
+	return 0;
+}
+
+/**
+ * Removes the output directory of a run, returns the size
+ * of the audio files that were in there
+ */
+static uint64_t
+bench_remove_outputs(const char *dir_path)
+{
+	DIR *dir = NULL;
+	struct dirent *entry = NULL;
+	struct stat st = { 0 };
+	char path[PATH_MAX] = { 0 };
+	uint64_t bytes = 0;
+
+	dir = opendir(dir_path);
+	if (!dir)
+		return 0;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' &&
+		    (!entry->d_name[1] || !strcmp(entry->d_name, "..")))
+			continue;
+		snprintf(path, PATH_MAX, "%s/%s", dir_path, entry->d_name);
+		if (stat(path, &st) == 0 && !bench_is_sidecar(entry->d_name))
+			bytes += st.st_size;
+		unlink(path);
+	}
+	closedir(dir);
+	rmdir(dir_path);
+
+	return bytes;
+}
+
+/**
+ * Decodes the audio files of a run, they should hold all
+ * the frames the recorder wrote and not just silence
+ */
+static int
+bench_check_outputs(const char *dir_path, uint64_t frames_written)
+{
+	DIR *dir = NULL;
+	struct dirent *entry = NULL;
+	SNDFILE *sf = NULL;
+	SF_INFO info = { 0 };
+	char path[PATH_MAX] = { 0 };
+	float buf[BENCH_PERIOD_FRAMES * 2] = { 0 };
+	uint64_t frames = 0;
+	sf_count_t got = 0;
+	float peak = 0.0f;
+	int ret = 0;
+	int i = 0;
+
+	dir = opendir(dir_path);
+	if (!dir)
+		return RECORDER_INVALID;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.' || bench_is_sidecar(entry->d_name))
+			continue;
+		snprintf(path, PATH_MAX, "%s/%s", dir_path, entry->d_name);
+
+		memset(&info, 0, sizeof(SF_INFO));
+		sf = sf_open(path, SFM_READ, &info);
+		if (!sf) {
+			fprintf(stderr, "cannot decode %s: %s\n", path,
+				sf_strerror(NULL));
+			ret = RECORDER_SNDFILE_ERR;
+			goto cleanup;
+		}
+		if (info.channels > 2) {
+			sf_close(sf);
+			ret = RECORDER_INVALID;
+			goto cleanup;
+		}
+
+		while ((got = sf_readf_float(sf, buf,
+					     BENCH_PERIOD_FRAMES)) > 0) {
+			for (i = 0; i < got * info.channels; i++)
+				if (fabsf(buf[i]) > peak)
+					peak = fabsf(buf[i]);
+			frames += got;
+		}
+		sf_close(sf);
+	}
+
+	if (frames != frames_written) {
+		fprintf(stderr, "decoded %llu frames, %llu were written\n",
+			(unsigned long long)frames,
+			(unsigned long long)frames_written);
+		ret = RECORDER_INVALID;
+	} else if (frames && peak < 0.01f) {
+		fprintf(stderr, "decoded nothing but silence\n");
+		ret = RECORDER_INVALID;
+	}
+
+ cleanup:
+	closedir(dir);
+	return ret;
+}
+
+
+/*********\
+* SOURCES *
+\*********/
+
+static int
+bench_source_init(struct bench_source *src, struct bench_opts *opts)
+{
+	int i = 0;
+
+	memset(src, 0, sizeof(struct bench_source));
+	src->num_channels = opts->stereo ? 2 : 1;
+	src->sample_rate = opts->in_sample_rate;
+	src->noise = 0x12345678;
+
+	if (opts->input_path) {
+		src->sf = sf_open(opts->input_path, SFM_READ, &src->info);
+		if (!src->sf) {
+			fprintf(stderr, "cannot open %s: %s\n",
+				opts->input_path, sf_strerror(NULL));
+			return RECORDER_SNDFILE_ERR;
+		}
+		if (!src->info.frames) {
+			fprintf(stderr, "%s is empty\n", opts->input_path);
+			return RECORDER_INVALID;
+		}
+		src->sample_rate = src->info.samplerate;
+		src->num_channels = (src->info.channels > 1) ? 2 : 1;
+		opts->stereo = (src->num_channels == 2);
+		src->file_buf = malloc(BENCH_PERIOD_FRAMES *
+				       src->info.channels * sizeof(float));
+		if (!src->file_buf)
+			return RECORDER_NOMEM;
+	}
+
+	for (i = 0; i < src->num_channels; i++) {
+		src->out[i] = malloc(BENCH_PERIOD_FRAMES * sizeof(float));
+		if (!src->out[i])
+			return RECORDER_NOMEM;
+	}
+
+	return 0;
+}
+
+static void
+bench_source_cleanup(struct bench_source *src)
+{
+	int i = 0;
+
+	if (src->sf)
+		sf_close(src->sf);
+	free(src->file_buf);
+	for (i = 0; i < 2; i++)
+		free(src->out[i]);
+}
+
+/**
+ * Fills in the next nframes of the file, looping over
+ * it as needed. Anything past the first two channels
+ * is ignored.
+ */
+static int
+bench_source_read_file(struct bench_source *src, uint32_t nframes)
+{
+	sf_count_t got = 0;
+	uint32_t done = 0;
+	int file_chans = src->info.channels;
+	int i = 0;
+	int c = 0;
+
+	while (done < nframes) {
+		got = sf_readf_float(src->sf, src->file_buf, nframes - done);
+		if (got <= 0) {
+			if (sf_seek(src->sf, 0, SEEK_SET) < 0)
+				return RECORDER_SNDFILE_ERR;
+			continue;
+		}
+		for (i = 0; i < got; i++)
+			for (c = 0; c < src->num_channels; c++)
+				src->out[c][done + i] =
+				    src->file_buf[i * file_chans + c];
+		done += got;
+	}
+
+	return 0;
+}
+
+/**
+ * A tone per channel with a slow tremolo and some noise on
+ * top, so that the encoders have something to work on
+ */
+static void
+bench_source_synth(struct bench_source *src, uint32_t nframes)
+{
+	static const double freqs[2] = { 440.0, 554.37 };
+	double step = 0.0;
+	float noise = 0.0f;
+	uint32_t i = 0;
+	int c = 0;
+
+	for (c = 0; c < src->num_channels; c++) {
+		step = 2.0 * M_PI * freqs[c] / (double)src->sample_rate;
+		for (i = 0; i < nframes; i++) {
+			src->noise = src->noise * 1664525 + 1013904223;
+			noise = (float)(int32_t) src->noise / 2147483648.0f;
+			src->out[c][i] = 0.3f * sinf(src->phase[c]) *
+					 (0.75f + 0.25f *
+					  sinf(src->phase[c] / 1000.0)) +
+					 0.01f * noise;
+			src->phase[c] += step;
+			if (src->phase[c] > 2000.0 * M_PI)
+				src->phase[c] -= 2000.0 * M_PI;
+		}
+	}
+}
+
+static int
+bench_source_read(struct bench_source *src, uint32_t nframes)
+{
+	if (src->sf)
+		return bench_source_read_file(src, nframes);
+
+	bench_source_synth(src, nframes);
+	return 0;
+}
+
+
+/******\
+* RUNS *
+\******/
+
+static int
+bench_run(struct bench_opts *opts, struct bench_source *src,
+	  const struct bench_setting *set, const char *resampler_name,
+	  int resampler_type)
+{
+	struct recorder rcd = { 0 };
+	char dir_path[PATH_MAX] = { 0 };
+	uint64_t total_frames = (uint64_t) opts->secs * src->sample_rate;
+	uint64_t done = 0;
+	uint64_t allocs = 0;
+	uint64_t bytes = 0;
+	uint32_t nframes = 0;
+	double wall_secs = 0.0;
+	double cpu_secs = 0.0;
+	double hours = (double)opts->secs / 3600.0;
+	int ret = 0;
+
+	snprintf(dir_path, PATH_MAX, "%s/acoffin-bench-XXXXXX",
+		 opts->storage_path);
+	if (!mkdtemp(dir_path)) {
+		perror("cannot create output directory");
+		return RECORDER_INVALID;
+	}
+
+	rcd.storage_path = dir_path;
+	rcd.opmode = RECORDER_LIVE;
+	rcd.headless = 1;
+	rcd.stereo = opts->stereo;
+	rcd.sample_rate = opts->out_sample_rate;
+	rcd.format = set->format;
+	rcd.quality = set->quality;
+	rcd.comp_level = set->comp_level;
+	rcd.flac.direct = set->flac_direct;
+	rcd.flac.bits = 24;
+	rcd.flac.threads = opts->flac_threads;
+	rcd.resampler_type = resampler_type;
+	rcd.monitor.silence_db = -60.0;
+	rcd.monitor.silence_hold_secs = 30;
+	rcd.monitor.clip_db = -0.1;
+	rcd.monitor.clip_hold_secs = 5;
+
+	bench_reset_peak_rss();
+	allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+	cpu_secs = bench_get_cpu_secs();
+	wall_secs = bench_get_secs();
+
+	ret = recorder_initialize_offline(&rcd, src->sample_rate,
+					  BENCH_PERIOD_FRAMES);
+	if (ret < 0)
+		goto cleanup;
+
+	ret = recorder_start(&rcd);
+	if (ret < 0)
+		goto cleanup;
+
+	for (done = 0; done < total_frames && recorder_state; done += nframes) {
+		nframes = BENCH_PERIOD_FRAMES;
+		if (total_frames - done < nframes)
+			nframes = total_frames - done;
+
+		ret = bench_source_read(src, nframes);
+		if (ret < 0)
+			goto cleanup;
+
+		recorder_capture(&rcd, src->out, nframes);
+	}
+	recorder_drain(&rcd);
+
+	/* Closing the file is part of the job */
+	if (recorder_state)
+		recorder_cleanup(&rcd);
+	else
+		ret = RECORDER_CONSUMER_ERR;
+
+	wall_secs = bench_get_secs() - wall_secs;
+	cpu_secs = bench_get_cpu_secs() - cpu_secs;
+	allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - allocs;
+
+	if (ret == 0 && opts->check)
+		ret = bench_check_outputs(dir_path,
+					  rcd.stats.frames_written);
+
+ cleanup:
+	if (recorder_state)
+		recorder_cleanup(&rcd);
+	bytes = bench_remove_outputs(dir_path);
+
+	printf("%-7s %-6s %-8s ",
+	       set->format == RECORDER_FORMAT_OGG_VORBIS ? "vorbis" :
+	       set->flac_direct ? "libflac" : "flac",
+	       set->name, resampler_name);
+	if (ret < 0) {
+		printf("failed (%i)\n", ret);
+		return ret;
+	}
+
+	printf("%9.1fx %10.1f %9.1f %10llu %8.1f\n",
+	       (double)opts->secs / wall_secs,
+	       cpu_secs / (hours * src->num_channels),
+	       (double)bench_get_peak_rss() / 1024.0,
+	       (unsigned long long)allocs,
+	       (double)bytes / (1024.0 * 1024.0) / hours);
+	fflush(stdout);
+
+	return 0;
+}
+
+
+/*************\
+* ENTRY POINT *
+\*************/
+
+static void
+usage(char *name)
+{
+	printf("Audio Coffin offline benchmark\n");
+	printf("\nUsage: %s -h or [<parameter> <value>] pairs\n", name);
+	printf("\nParameters:\n"
+	       "\t-h\t\tShow this list\n"
+	       "\t-p   <string>\tDirectory for temporary output files (default: .)\n"
+	       "\t-i   <string>\tRead input from this audio file, looped as needed (default: synthetic input)\n"
+	       "\t-t   <int>\tMinutes of audio to push through on each run (default: 60)\n"
+	       "\t-s   <boolean>\tStereo input, valid values are 0 and 1 (default), ignored with -i\n"
+	       "\t-r   <int>\tInput sample rate for synthetic input (default: 44100)\n"
+	       "\t-o   <int>\tOutput sample rate (default: 48000)\n"
+	       "\t-f   <int>\tOnly run this format, 1 for FLAC and 2 for Ogg/Vorbis (default: both)\n"
+	       "\t-R   <int>\tOnly run this resampler, 1 for fastest, 2 for medium and 3 for best quality (default: all)\n"
+	       "\t-T   <int>\tEncode libflac runs on this many threads in parallel (default: 0, on the consumer thread)\n"
+	       "\t-c\t\tDecode each run's output back and check it, fail if it doesn't match\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct bench_opts opts = { 0 };
+	struct bench_source src = { 0 };
+	int opt = 0;
+	int ret = 0;
+	int i = 0;
+	int j = 0;
+
+	/* Set default values */
+	opts.storage_path = ".";
+	opts.secs = 60 * 60;
+	opts.in_sample_rate = 44100;
+	opts.out_sample_rate = 48000;
+	opts.stereo = 1;
+
+	while ((opt = getopt(argc, argv, "hcp:i:t:s:r:o:f:R:T:")) != -1) {
+		switch (opt) {
+		case 'p':
+			opts.storage_path = optarg;
+			break;
+		case 'i':
+			opts.input_path = optarg;
+			break;
+		case 't':
+			opts.secs = strtol(optarg, NULL, 10) * 60;
+			break;
+		case 's':
+			opts.stereo = strtol(optarg, NULL, 10) ? 1 : 0;
+			break;
+		case 'r':
+			opts.in_sample_rate = strtol(optarg, NULL, 10);
+			break;
+		case 'o':
+			opts.out_sample_rate = strtol(optarg, NULL, 10);
+			break;
+		case 'f':
+			opts.format = strtol(optarg, NULL, 10);
+			break;
+		case 'R':
+			opts.resampler = strtol(optarg, NULL, 10);
+			break;
+		case 'T':
+			opts.flac_threads = strtol(optarg, NULL, 10);
+			if (opts.flac_threads > FLAC_MAX_THREADS)
+				opts.flac_threads = FLAC_MAX_THREADS;
+			break;
+		case 'c':
+			opts.check = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : -1);
+		}
+	}
+
+	if (!opts.secs || !opts.in_sample_rate || !opts.out_sample_rate) {
+		usage(argv[0]);
+		exit(-1);
+	}
+
+	ret = bench_source_init(&src, &opts);
+	if (ret < 0)
+		goto cleanup;
+
+	printf("%u secs of %s %s input at %uHz, resampled to %uHz, "
+	       "%u frames per period\n\n", opts.secs,
+	       opts.stereo ? "stereo" : "mono",
+	       opts.input_path ? opts.input_path : "synthetic",
+	       src.sample_rate, opts.out_sample_rate, BENCH_PERIOD_FRAMES);
+	printf("%-7s %-6s %-8s %10s %10s %9s %10s %8s\n", "format",
+	       "level", "resamp", "realtime", "cpu s/chh", "peak MiB",
+	       "allocs", "MiB/h");
+
+	for (i = 0; bench_settings[i].name; i++) {
+		if (opts.format &&
+		    bench_settings[i].format != opts.format - 1)
+			continue;
+		for (j = 0; bench_resamplers[j].name; j++) {
+			if (opts.resampler && j != opts.resampler - 1)
+				continue;
+			if (bench_run(&opts, &src, &bench_settings[i],
+				      bench_resamplers[j].name,
+				      bench_resamplers[j].type) < 0)
+				ret = -1;
+		}
+	}
+
+ cleanup:
+	bench_source_cleanup(&src);
+	return ret < 0 ? -1 : 0;
+}
@@ -0,0 +1,494 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Config file handling
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For fopen / fprintf / perror */
+#include <stdlib.h>		/* For malloc / free / strtod */
+#include <string.h>		/* For strcmp / strchr */
+#include <strings.h>		/* For strcasecmp */
+#include <stddef.h>		/* For offsetof */
+#include <ctype.h>		/* For isspace */
+#include <unistd.h>		/* For access() */
+
+/*
+ * An INI style config file, with the same settings as the
+ * command line, e.g.
+ *
+ * [recorder]
+ * mode = logger
+ * stereo = yes
+ *
+ * [output]
+ * path = /srv/audiologs
+ * format = flac
+ * compression = 0.75
+ * rotate_mins = 60
+ *
+ * Lists (e.g. alt_path) take the key once per entry. See
+ * config_keys below for the rest. On SIGHUP the file gets
+ * parsed again on the timer thread, and if the output settings
+ * in it are valid they get swapped in all together, taking
+ * effect on the next file. Everything else needs a restart.
+ *
+ * String values point into the file's contents, which are kept
+ * around for as long as we run (as with getopt's optarg).
+ */
+
+#define CONFIG_MAX_SIZE	(64 * 1024)
+
+enum config_types {
+	CONFIG_BOOL = 0,	/* int */
+	CONFIG_NOT_BOOL,	/* int, inverted */
+	CONFIG_UINT,		/* uint32_t */
+	CONFIG_PORT,		/* uint16_t */
+	CONFIG_MINS,		/* uint32_t, in secs */
+	CONFIG_FLOAT,		/* float */
+	CONFIG_DOUBLE,		/* double */
+	CONFIG_STRING,		/* char * */
+	CONFIG_MODE,		/* uint8_t, one of recorder_modes */
+	CONFIG_FORMAT,		/* int, one of recorder_formats */
+	CONFIG_POLICY,		/* int, one of storage_policies */
+	CONFIG_ALT_PATH		/* char *, added to alt_storage_paths */
+};
+
+struct config_key {
+	const char *section;
+	const char *name;
+	int type;
+	size_t offset;
+	double min;
+	double max;
+	/* Picked up on SIGHUP */
+	int reloadable;
+};
+
+#define CONFIG_FIELD(f)	offsetof(struct recorder, f)
+
+static const struct config_key config_keys[] = {
+	{"recorder", "mode", CONFIG_MODE, CONFIG_FIELD(opmode), 0, 0, 0},
+	{"recorder", "stereo", CONFIG_BOOL, CONFIG_FIELD(stereo), 0, 0, 0},
+	{"recorder", "gui", CONFIG_NOT_BOOL, CONFIG_FIELD(headless), 0, 0, 0},
+	{"output", "path", CONFIG_STRING, CONFIG_FIELD(storage_path), 0, 0, 1},
+	{"output", "alt_path", CONFIG_ALT_PATH,
+	 CONFIG_FIELD(alt_storage_paths), 0, 0, 0},
+	{"output", "policy", CONFIG_POLICY, CONFIG_FIELD(storage_policy),
+	 0, 0, 0},
+	{"output", "buffer_secs", CONFIG_UINT, CONFIG_FIELD(buffer_secs),
+	 1, 600, 0},
+	{"output", "format", CONFIG_FORMAT, CONFIG_FIELD(format), 0, 0, 1},
+	{"output", "sample_rate", CONFIG_UINT, CONFIG_FIELD(sample_rate),
+	 1, 768000, 0},
+	{"output", "quality", CONFIG_DOUBLE, CONFIG_FIELD(quality),
+	 0.0, 1.0, 1},
+	{"output", "compression", CONFIG_DOUBLE, CONFIG_FIELD(comp_level),
+	 0.0, 1.0, 1},
+	{"output", "rotate_mins", CONFIG_MINS,
+	 CONFIG_FIELD(logrotate_interval_secs), 0, 24 * 60, 1},
+	{"flac", "direct", CONFIG_BOOL, CONFIG_FIELD(flac.direct), 0, 0, 0},
+	{"flac", "bits", CONFIG_UINT, CONFIG_FIELD(flac.bits), 16, 24, 0},
+	{"flac", "dither", CONFIG_BOOL, CONFIG_FIELD(flac.dither), 0, 0, 0},
+	{"flac", "blocksize", CONFIG_UINT, CONFIG_FIELD(flac.blocksize),
+	 16, 65535, 0},
+	{"flac", "apodization", CONFIG_STRING,
+	 CONFIG_FIELD(flac.apodization), 0, 0, 0},
+	{"flac", "threads", CONFIG_UINT, CONFIG_FIELD(flac.threads), 0,
+	 FLAC_MAX_THREADS, 0},
+	{"monitor", "silence", CONFIG_FLOAT, CONFIG_FIELD(monitor.silence_db),
+	 -120.0, 0.0, 0},
+	{"monitor", "silence_hold", CONFIG_UINT,
+	 CONFIG_FIELD(monitor.silence_hold_secs), 1, 24 * 60 * 60, 0},
+	{"monitor", "clip", CONFIG_FLOAT, CONFIG_FIELD(monitor.clip_db),
+	 -120.0, 0.0, 0},
+	{"monitor", "clip_hold", CONFIG_UINT,
+	 CONFIG_FIELD(monitor.clip_hold_secs), 1, 24 * 60 * 60, 0},
+	{"monitor", "status", CONFIG_STRING, CONFIG_FIELD(monitor.status_path),
+	 0, 0, 0},
+	{"space", "check_secs", CONFIG_UINT, CONFIG_FIELD(space.check_secs),
+	 0, 60 * 60, 0},
+	{"space", "low_mins", CONFIG_UINT, CONFIG_FIELD(space.low_mins),
+	 0, 7 * 24 * 60, 0},
+	{"space", "critical_mins", CONFIG_UINT,
+	 CONFIG_FIELD(space.critical_mins), 0, 7 * 24 * 60, 0},
+	{"space", "degraded_quality", CONFIG_DOUBLE,
+	 CONFIG_FIELD(space.degraded_quality), 0.0, 1.0, 0},
+	{"space", "purge", CONFIG_BOOL, CONFIG_FIELD(space.purge), 0, 0, 0},
+	{"load", "high_pct", CONFIG_UINT, CONFIG_FIELD(load.high_pct), 0, 100, 0},
+	{"load", "low_pct", CONFIG_UINT, CONFIG_FIELD(load.low_pct), 0, 100, 0},
+	{"load", "hold_secs", CONFIG_UINT, CONFIG_FIELD(load.hold_secs), 1,
+	 LOAD_MAX_HOLD_SECS, 0},
+	{"tap", "name", CONFIG_STRING, CONFIG_FIELD(tap.name), 0, 0, 0},
+	{"tap", "secs", CONFIG_UINT, CONFIG_FIELD(tap.secs), 1, TAP_MAX_SECS, 0},
+	{"spool", "mins", CONFIG_UINT, CONFIG_FIELD(spool.mins), 0,
+	 SPOOL_MAX_MINS, 0},
+	{"spool", "path", CONFIG_STRING, CONFIG_FIELD(spool.path), 0, 0, 0},
+	{"memory", "huge_pages", CONFIG_BOOL, CONFIG_FIELD(arena.huge), 0, 0, 0},
+	{"memory", "lock_all", CONFIG_BOOL, CONFIG_FIELD(lock_all), 0, 0, 0},
+	{"jack", "source_left", CONFIG_STRING, CONFIG_FIELD(jack_sources[0]),
+	 0, 0, 0},
+	{"jack", "source_right", CONFIG_STRING, CONFIG_FIELD(jack_sources[1]),
+	 0, 0, 0},
+	{"server", "metrics_port", CONFIG_PORT, CONFIG_FIELD(metrics_port),
+	 1, 65535, 0},
+	{"server", "stream_port", CONFIG_PORT, CONFIG_FIELD(stream_port),
+	 1, 65535, 0},
+	{"server", "control_socket", CONFIG_STRING, CONFIG_FIELD(ctl_path),
+	 0, 0, 0},
+	{NULL, NULL, 0, 0, 0, 0, 0}
+};
+
+volatile sig_atomic_t config_reload_requested = 0;
+
+/* Contents of the file loaded on startup */
+static char *config_buf = NULL;
+/* Storage path we got on the last reload */
+static char *config_reloaded_path = NULL;
+
+/*********\
+* HELPERS *
+\*********/
+
+static char *
+config_read(const char *path)
+{
+	FILE *file = NULL;
+	char *buf = NULL;
+	size_t len = 0;
+
+	file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "config: cannot open %s\n", path);
+		perror("fopen()");
+		return NULL;
+	}
+
+	buf = malloc(CONFIG_MAX_SIZE);
+	if (!buf)
+		goto cleanup;
+
+	len = fread(buf, 1, CONFIG_MAX_SIZE - 1, file);
+	if (ferror(file) || !feof(file)) {
+		fprintf(stderr, "config: cannot read %s (max %i bytes)\n",
+			path, CONFIG_MAX_SIZE - 1);
+		free(buf);
+		buf = NULL;
+		goto cleanup;
+	}
+	buf[len] = '\0';
+
+ cleanup:
+	fclose(file);
+	return buf;
+}
+
+static char *
+config_trim(char *str)
+{
+	char *end = NULL;
+
+	while (isspace((unsigned char)*str))
+		str++;
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		end--;
+	*end = '\0';
+
+	return str;
+}
+
+static int
+config_parse_bool(const char *value)
+{
+	if (!strcasecmp(value, "yes") || !strcasecmp(value, "true") ||
+	    !strcasecmp(value, "on") || !strcmp(value, "1"))
+		return 1;
+	if (!strcasecmp(value, "no") || !strcasecmp(value, "false") ||
+	    !strcasecmp(value, "off") || !strcmp(value, "0"))
+		return 0;
+	return -1;
+}
+
+/**
+ * Sets a single setting on rcd, checking its value
+ */
+static int
+config_set(const struct config_key *key, char *value, struct recorder *rcd)
+{
+	char *field = (char *)rcd + key->offset;
+	char *end = NULL;
+	double num = 0.0;
+	int tmp = 0;
+
+	switch (key->type) {
+	case CONFIG_BOOL:
+	case CONFIG_NOT_BOOL:
+		tmp = config_parse_bool(value);
+		if (tmp < 0)
+			return RECORDER_INVALID;
+		*(int *)field = (key->type == CONFIG_BOOL) ? tmp : !tmp;
+		return 0;
+	case CONFIG_STRING:
+		if (value[0] == '\0')
+			return RECORDER_INVALID;
+		*(char **)field = value;
+		return 0;
+	case CONFIG_MODE:
+		if (!strcasecmp(value, "recorder"))
+			*(uint8_t *) field = RECORDER_LIVE;
+		else if (!strcasecmp(value, "logger"))
+			*(uint8_t *) field = RECORDER_LOGGER;
+		else
+			return RECORDER_INVALID;
+		return 0;
+	case CONFIG_FORMAT:
+		if (!strcasecmp(value, "flac"))
+			*(int *)field = RECORDER_FORMAT_FLAC;
+		else if (!strcasecmp(value, "vorbis"))
+			*(int *)field = RECORDER_FORMAT_OGG_VORBIS;
+		else
+			return RECORDER_INVALID;
+		return 0;
+	case CONFIG_POLICY:
+		if (!strcasecmp(value, "failover"))
+			*(int *)field = STORAGE_FAILOVER;
+		else if (!strcasecmp(value, "mirror"))
+			*(int *)field = STORAGE_MIRROR;
+		else
+			return RECORDER_INVALID;
+		return 0;
+	case CONFIG_ALT_PATH:
+		if (value[0] == '\0' ||
+		    rcd->num_alt_storage_paths >= STORAGE_MAX_TARGETS - 1)
+			return RECORDER_INVALID;
+		rcd->alt_storage_paths[rcd->num_alt_storage_paths++] = value;
+		return 0;
+	default:
+		break;
+	}
+
+	/* Numbers */
+	num = strtod(value, &end);
+	if (end == value || *end != '\0' || num < key->min || num > key->max)
+		return RECORDER_INVALID;
+
+	switch (key->type) {
+	case CONFIG_UINT:
+		*(uint32_t *) field = (uint32_t) num;
+		break;
+	case CONFIG_PORT:
+		*(uint16_t *) field = (uint16_t) num;
+		break;
+	case CONFIG_MINS:
+		*(uint32_t *) field = (uint32_t) num * 60;
+		break;
+	case CONFIG_FLOAT:
+		*(float *)field = (float)num;
+		break;
+	case CONFIG_DOUBLE:
+		*(double *)field = num;
+		break;
+	default:
+		return RECORDER_INVALID;
+	}
+
+	return 0;
+}
+
+/**
+ * Goes through the file's contents (modifying them in place)
+ * and applies its settings to rcd, only the reloadable ones
+ * if reload is set
+ */
+static int
+config_parse(char *buf, const char *path, struct recorder *rcd, int reload)
+{
+	const struct config_key *key = NULL;
+	char *section = "";
+	char *line = NULL;
+	char *next = NULL;
+	char *value = NULL;
+	char *end = NULL;
+	int lineno = 0;
+
+	for (line = buf; line; line = next) {
+		lineno++;
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		/* Comments */
+		end = strpbrk(line, "#;");
+		if (end)
+			*end = '\0';
+		line = config_trim(line);
+		if (line[0] == '\0')
+			continue;
+
+		if (line[0] == '[') {
+			end = strchr(line, ']');
+			if (!end || end[1] != '\0')
+				goto invalid;
+			*end = '\0';
+			section = config_trim(line + 1);
+			continue;
+		}
+
+		value = strchr(line, '=');
+		if (!value)
+			goto invalid;
+		*value++ = '\0';
+		line = config_trim(line);
+		value = config_trim(value);
+
+		for (key = config_keys; key->name; key++)
+			if (!strcmp(key->section, section) &&
+			    !strcmp(key->name, line))
+				break;
+		if (!key->name) {
+			fprintf(stderr, "config: %s:%i: unknown setting "
+				"[%s] %s\n", path, lineno, section, line);
+			return RECORDER_INVALID;
+		}
+
+		if (reload && !key->reloadable)
+			continue;
+
+		if (config_set(key, value, rcd) < 0) {
+			fprintf(stderr, "config: %s:%i: invalid value for "
+				"[%s] %s: %s\n", path, lineno, section, line,
+				value);
+			return RECORDER_INVALID;
+		}
+	}
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "config: %s:%i: cannot parse line\n", path, lineno);
+	return RECORDER_INVALID;
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Loads the config file on startup, settings given on the
+ * command line after it override it
+ */
+int
+config_load(const char *path, struct recorder *rcd)
+{
+	int ret = 0;
+
+	/* Settings point into the previous one */
+	if (config_buf) {
+		fprintf(stderr, "config: only one config file is supported\n");
+		return RECORDER_INVALID;
+	}
+
+	config_buf = config_read(path);
+	if (!config_buf)
+		return RECORDER_INVALID;
+
+	ret = config_parse(config_buf, path, rcd, 0);
+	if (ret < 0) {
+		config_cleanup();
+		return ret;
+	}
+
+	rcd->config_path = (char *)path;
+	return 0;
+}
+
+/**
+ * Called from the timer thread when we get a SIGHUP, parses the
+ * file again on a scratch copy of the output settings, checks
+ * them and swaps them in. On any error the current ones stay.
+ */
+void
+config_reload(struct recorder *rcd)
+{
+	struct recorder *new = NULL;
+	char *buf = NULL;
+	char *resolved_path = NULL;
+	int ret = 0;
+
+	if (!rcd->config_path)
+		return;
+
+	new = malloc(sizeof(struct recorder));
+	buf = config_read(rcd->config_path);
+	if (!new || !buf) {
+		ret = RECORDER_NOMEM;
+		goto cleanup;
+	}
+
+	/* The timer thread is the only one changing these */
+	new->storage_path = rcd->storage_path;
+	new->format = rcd->format;
+	new->quality = rcd->quality;
+	new->comp_level = rcd->comp_level;
+	new->logrotate_interval_secs = rcd->logrotate_interval_secs;
+
+	ret = config_parse(buf, rcd->config_path, new, 1);
+	if (ret < 0)
+		goto cleanup;
+
+	/* The path points to buf, resolve it to something
+	 * that outlives it */
+	resolved_path = realpath(new->storage_path, NULL);
+	if (!resolved_path || access(resolved_path, W_OK) < 0) {
+		fprintf(stderr, "config: invalid or inaccessible path: %s\n",
+			new->storage_path);
+		ret = RECORDER_INVALID;
+		goto cleanup;
+	}
+
+	ret = recorder_set_output(rcd, resolved_path, new->format,
+				  new->quality, new->comp_level,
+				  new->logrotate_interval_secs);
+	if (ret < 0) {
+		fprintf(stderr, "config: output format not supported\n");
+		goto cleanup;
+	}
+
+	/* Nobody uses the previous one any more */
+	free(config_reloaded_path);
+	config_reloaded_path = resolved_path;
+	resolved_path = NULL;
+	fprintf(stderr, "config: reloaded %s, changes apply to the next "
+		"file\n", rcd->config_path);
+
+ cleanup:
+	if (ret < 0)
+		fprintf(stderr, "config: keeping the current settings\n");
+	free(resolved_path);
+	free(buf);
+	free(new);
+}
+
+void
+config_cleanup(void)
+{
+	free(config_buf);
+	config_buf = NULL;
+	free(config_reloaded_path);
+	config_reloaded_path = NULL;
+}
@@ -0,0 +1,344 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Control socket
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE		/* For accept4() */
+#include "acoffin.h"
+#include <stdio.h>		/* For snprintf / perror */
+#include <string.h>		/* For memset / strncmp */
+#include <unistd.h>		/* For close() / read() / unlink() */
+#include <sys/socket.h>		/* For socket() / accept4() / send() */
+#include <sys/un.h>		/* For struct sockaddr_un */
+#include <sys/stat.h>		/* For umask() */
+#include <poll.h>		/* For POLLIN */
+#include <errno.h>		/* For EAGAIN */
+
+/*
+ * A line based command interface on a UNIX socket, so that
+ * a headless recorder can be driven by scripts (e.g. through
+ * socat). Each command gets a single line response, starting
+ * with OK or ERR. Commands:
+ *
+ * start		Start recording on the next period, once the
+ *			previous recording is written out
+ * stop			Stop recording on the next period
+ * rotate		Switch to a new file on the next period
+ * mark [label]		Put a marker on the next period
+ * status		Report the recorder's state
+ *
+ * Requests get handled on the event loop thread, the process
+ * callback only sees a flag / counter on the recorder and
+ * applies it on the period that follows. Starting may have to
+ * wait for the consumer, it's left to the timer thread so that
+ * the event loop doesn't block, the reply only means that the
+ * request was taken.
+ */
+
+#define CTL_MAX_CLIENTS	4
+#define CTL_LINE_MAX	256
+
+struct ctl_client {
+	int fd;
+	char line[CTL_LINE_MAX];
+	size_t line_len;
+};
+
+static struct ctl_client ctl_clients[CTL_MAX_CLIENTS];
+static struct recorder *ctl_rcd = NULL;
+static int ctl_fd = -1;
+
+/*********\
+* HELPERS *
+\*********/
+
+/**
+ * Responses are short, if the client isn't reading
+ * them it's its problem
+ */
+static void
+ctl_reply(struct ctl_client *client, const char *resp)
+{
+	if (send(client->fd, resp, strlen(resp), MSG_NOSIGNAL) < 0)
+		return;
+}
+
+static const char *
+ctl_state_name(void)
+{
+	switch (recorder_state) {
+	case RECORDER_RUNNING:
+		return "running";
+	case RECORDER_STOPPED:
+		return "stopped";
+	case RECORDER_ARMED:
+		return "starting";
+	case RECORDER_DELAYED_STOP:
+	case RECORDER_TRANSITION:
+		return "stopping";
+	default:
+		return "down";
+	}
+}
+
+static const char *
+ctl_error_name(int ret)
+{
+	switch (ret) {
+	case RECORDER_AGAIN:
+		return "busy";
+	case RECORDER_NOMEM:
+		return "out of memory";
+	case RECORDER_SNDFILE_ERR:
+		return "cannot open output file";
+	default:
+		return "failed";
+	}
+}
+
+static void
+ctl_status(struct ctl_client *client, struct recorder *rcd)
+{
+	char resp[PATH_MAX + 256] = { 0 };
+	char path[PATH_MAX] = { 0 };
+	uint64_t bytes = 0;
+
+	recorder_get_file_info(rcd, path, &bytes);
+	snprintf(resp, sizeof(resp), "OK state=%s secs=%u rotations=%u "
+		 "dropped=%llu bytes=%llu file=%s\n", ctl_state_name(),
+		 rcd->secs_recorded,
+		 __atomic_load_n(&rcd->rotations, __ATOMIC_RELAXED),
+		 (unsigned long long)
+		 __atomic_load_n(&rcd->stats.dropped_periods,
+				 __ATOMIC_RELAXED),
+		 (unsigned long long)bytes, path[0] ? path : "-");
+	ctl_reply(client, resp);
+}
+
+static void
+ctl_handle_line(struct ctl_client *client, char *line)
+{
+	struct recorder *rcd = ctl_rcd;
+	char resp[64] = { 0 };
+	char *arg = NULL;
+	int ret = 0;
+
+	/* Split the command from its argument */
+	arg = strchr(line, ' ');
+	if (arg) {
+		*arg = '\0';
+		arg++;
+	} else
+		arg = "";
+
+	if (!strcmp(line, "start"))
+		ret = recorder_request_start(rcd);
+	else if (!strcmp(line, "stop")) {
+		ret = recorder_stop(rcd);
+		/* The timer thread will get to it */
+		if (ret == RECORDER_AGAIN &&
+		    recorder_state == RECORDER_DELAYED_STOP)
+			ret = 0;
+	} else if (!strcmp(line, "rotate"))
+		ret = recorder_rotate(rcd);
+	else if (!strcmp(line, "mark"))
+		ret = recorder_mark(rcd, arg);
+	else if (!strcmp(line, "status")) {
+		ctl_status(client, rcd);
+		return;
+	} else if (line[0] == '\0')
+		return;
+	else {
+		ctl_reply(client, "ERR unknown command\n");
+		return;
+	}
+
+	if (ret < 0)
+		snprintf(resp, sizeof(resp), "ERR %s\n", ctl_error_name(ret));
+	else
+		snprintf(resp, sizeof(resp), "OK\n");
+	ctl_reply(client, resp);
+}
+
+static void
+ctl_close_client(struct ctl_client *client)
+{
+	evloop_remove(client->fd);
+	close(client->fd);
+	memset(client, 0, sizeof(struct ctl_client));
+	client->fd = -1;
+}
+
+
+/****************\
+* EVENT HANDLERS *
+\****************/
+
+static void
+ctl_client_handler(int fd, short revents, void *data)
+{
+	struct ctl_client *client = (struct ctl_client *)data;
+	char *start = NULL;
+	char *end = NULL;
+	ssize_t ret = 0;
+
+	if (!(revents & POLLIN))
+		goto close;
+
+	ret = read(fd, client->line + client->line_len,
+		   CTL_LINE_MAX - 1 - client->line_len);
+	if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (ret <= 0)
+		goto close;
+
+	client->line_len += ret;
+	client->line[client->line_len] = '\0';
+
+	/* Handle every complete line we got */
+	start = client->line;
+	while ((end = strchr(start, '\n'))) {
+		*end = '\0';
+		if (end > start && end[-1] == '\r')
+			end[-1] = '\0';
+		ctl_handle_line(client, start);
+		start = end + 1;
+	}
+
+	client->line_len -= start - client->line;
+	memmove(client->line, start, client->line_len + 1);
+
+	/* Too long for us */
+	if (client->line_len >= CTL_LINE_MAX - 1)
+		goto close;
+
+	return;
+
+ close:
+	ctl_close_client(client);
+}
+
+static void
+ctl_accept_handler(int fd, short revents, void *data)
+{
+	struct ctl_client *client = NULL;
+	int client_fd = 0;
+	int i = 0;
+
+	client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd < 0)
+		return;
+
+	for (i = 0; i < CTL_MAX_CLIENTS; i++)
+		if (ctl_clients[i].fd < 0) {
+			client = &ctl_clients[i];
+			break;
+		}
+
+	if (!client || evloop_add(client_fd, POLLIN, ctl_client_handler,
+				  client) < 0) {
+		close(client_fd);
+		return;
+	}
+	client->fd = client_fd;
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Starts listening on ctl_path, only the owner gets to
+ * connect. Commands get handled once the event loop is
+ * started.
+ */
+int
+ctl_init(struct recorder *rcd)
+{
+	struct sockaddr_un addr = { 0 };
+	mode_t mask = 0;
+	int ret = 0;
+	int i = 0;
+
+	if (strlen(rcd->ctl_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Control socket path too long: %s\n",
+			rcd->ctl_path);
+		return RECORDER_INVALID;
+	}
+
+	ctl_rcd = rcd;
+	for (i = 0; i < CTL_MAX_CLIENTS; i++)
+		ctl_clients[i].fd = -1;
+
+	ctl_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (ctl_fd < 0) {
+		perror("control socket()");
+		return RECORDER_INVALID;
+	}
+
+	/* Left behind by a previous instance */
+	unlink(rcd->ctl_path);
+
+	/* The socket gets created with the umask applied, a
+	 * chmod() after bind() would leave a window for others
+	 * to connect. The umask is per process, we get called
+	 * before our other threads get to create any files. */
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", rcd->ctl_path);
+	mask = umask(0177);
+	ret = bind(ctl_fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || listen(ctl_fd, CTL_MAX_CLIENTS) < 0) {
+		perror("cannot listen for control requests");
+		ctl_cleanup();
+		return RECORDER_INVALID;
+	}
+
+	if (evloop_add(ctl_fd, POLLIN, ctl_accept_handler, NULL) < 0) {
+		ctl_cleanup();
+		return RECORDER_INVALID;
+	}
+
+	return 0;
+}
+
+/**
+ * Closes the listening socket and any clients, the event
+ * loop should be stopped by now
+ */
+void
+ctl_cleanup(void)
+{
+	int i = 0;
+
+	/* Never initialized */
+	if (!ctl_rcd)
+		return;
+
+	for (i = 0; i < CTL_MAX_CLIENTS; i++)
+		if (ctl_clients[i].fd >= 0)
+			ctl_close_client(&ctl_clients[i]);
+
+	if (ctl_fd >= 0) {
+		evloop_remove(ctl_fd);
+		close(ctl_fd);
+		unlink(ctl_rcd->ctl_path);
+	}
+	ctl_fd = -1;
+	ctl_rcd = NULL;
+}
@@ -0,0 +1,251 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Event loop for sockets
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE		/* For pipe2() */
+#include "acoffin.h"
+#include <stdio.h>		/* For perror */
+#include <pthread.h>		/* For pthread_* */
+#include <poll.h>		/* For poll() */
+#include <fcntl.h>		/* For O_NONBLOCK */
+#include <unistd.h>		/* For pipe2() / read() / write() */
+#include <errno.h>		/* For EINTR */
+
+/*
+ * A single thread that poll()s on every socket we serve and
+ * calls their handlers, so that nothing network related ever
+ * runs on the audio path. Handlers run on the event loop
+ * thread and should never block. File descriptors may be
+ * added / removed / updated from any thread, the loop gets
+ * woken up through a pipe to pick up the changes.
+ */
+
+#define EVLOOP_MAX_FDS	64
+
+struct evloop_entry {
+	evloop_handler handler;
+	void *data;
+};
+
+static pthread_mutex_t evloop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct pollfd evloop_fds[EVLOOP_MAX_FDS];
+static struct evloop_entry evloop_entries[EVLOOP_MAX_FDS];
+static int evloop_num_fds = 0;
+static int evloop_wake_pipe[2] = { -1, -1 };
+static volatile sig_atomic_t evloop_active = 0;
+static pthread_t evloop_tid;
+
+/*********\
+* HELPERS *
+\*********/
+
+static void
+evloop_wake(void)
+{
+	char c = 0;
+
+	if (evloop_wake_pipe[1] < 0)
+		return;
+	if (write(evloop_wake_pipe[1], &c, 1) < 0)
+		return;
+}
+
+/**
+ * Called with evloop_mutex held
+ */
+static int
+evloop_find(int fd)
+{
+	int i = 0;
+
+	for (i = 0; i < evloop_num_fds; i++)
+		if (evloop_fds[i].fd == fd)
+			return i;
+	return -1;
+}
+
+static void *
+evloop_main_loop(void *arg)
+{
+	struct pollfd fds[EVLOOP_MAX_FDS + 1];
+	struct evloop_entry entry = { 0 };
+	char drain[64] = { 0 };
+	int num_fds = 0;
+	int ret = 0;
+	int idx = 0;
+	int i = 0;
+
+	while (evloop_active) {
+		pthread_mutex_lock(&evloop_mutex);
+		num_fds = evloop_num_fds;
+		for (i = 0; i < num_fds; i++)
+			fds[i] = evloop_fds[i];
+		pthread_mutex_unlock(&evloop_mutex);
+
+		fds[num_fds].fd = evloop_wake_pipe[0];
+		fds[num_fds].events = POLLIN;
+		fds[num_fds].revents = 0;
+
+		ret = poll(fds, num_fds + 1, -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll()");
+			break;
+		}
+
+		if (fds[num_fds].revents)
+			while (read(evloop_wake_pipe[0], drain,
+				    sizeof(drain)) > 0) ;
+
+		for (i = 0; i < num_fds && evloop_active; i++) {
+			if (!fds[i].revents)
+				continue;
+
+			/* A previous handler may have removed it */
+			pthread_mutex_lock(&evloop_mutex);
+			idx = evloop_find(fds[i].fd);
+			if (idx >= 0)
+				entry = evloop_entries[idx];
+			pthread_mutex_unlock(&evloop_mutex);
+
+			if (idx >= 0)
+				entry.handler(fds[i].fd, fds[i].revents,
+					      entry.data);
+		}
+	}
+
+	evloop_active = 0;
+
+	return NULL;
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+int
+evloop_add(int fd, short events, evloop_handler handler, void *data)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&evloop_mutex);
+	if (evloop_num_fds >= EVLOOP_MAX_FDS)
+		ret = RECORDER_AGAIN;
+	else {
+		evloop_fds[evloop_num_fds].fd = fd;
+		evloop_fds[evloop_num_fds].events = events;
+		evloop_fds[evloop_num_fds].revents = 0;
+		evloop_entries[evloop_num_fds].handler = handler;
+		evloop_entries[evloop_num_fds].data = data;
+		evloop_num_fds++;
+	}
+	pthread_mutex_unlock(&evloop_mutex);
+
+	evloop_wake();
+	return ret;
+}
+
+void
+evloop_set_events(int fd, short events)
+{
+	int idx = 0;
+
+	pthread_mutex_lock(&evloop_mutex);
+	idx = evloop_find(fd);
+	if (idx >= 0)
+		evloop_fds[idx].events = events;
+	pthread_mutex_unlock(&evloop_mutex);
+
+	evloop_wake();
+}
+
+void
+evloop_remove(int fd)
+{
+	int idx = 0;
+
+	pthread_mutex_lock(&evloop_mutex);
+	idx = evloop_find(fd);
+	if (idx >= 0) {
+		evloop_num_fds--;
+		evloop_fds[idx] = evloop_fds[evloop_num_fds];
+		evloop_entries[idx] = evloop_entries[evloop_num_fds];
+	}
+	pthread_mutex_unlock(&evloop_mutex);
+
+	evloop_wake();
+}
+
+int
+evloop_start(void)
+{
+	int ret = 0;
+
+	/* Already running */
+	if (evloop_active)
+		return 0;
+
+	ret = pipe2(evloop_wake_pipe, O_NONBLOCK | O_CLOEXEC);
+	if (ret < 0) {
+		perror("pipe2()");
+		return RECORDER_INVALID;
+	}
+
+	evloop_active = 1;
+	ret = pthread_create(&evloop_tid, NULL, evloop_main_loop, NULL);
+	if (ret != 0) {
+		evloop_active = 0;
+		close(evloop_wake_pipe[0]);
+		close(evloop_wake_pipe[1]);
+		evloop_wake_pipe[0] = evloop_wake_pipe[1] = -1;
+		return RECORDER_INVALID;
+	}
+
+	return 0;
+}
+
+/**
+ * Stops the event loop thread, file descriptors still
+ * registered are left to their owners
+ */
+void
+evloop_stop(void)
+{
+	if (evloop_wake_pipe[0] < 0)
+		return;
+
+	evloop_active = 0;
+	evloop_wake();
+
+	/* A handler may end up here (e.g. through a shutdown
+	 * request), in which case the loop exits on its own */
+	if (!pthread_equal(pthread_self(), evloop_tid))
+		pthread_join(evloop_tid, NULL);
+	else
+		pthread_detach(evloop_tid);
+
+	close(evloop_wake_pipe[0]);
+	close(evloop_wake_pipe[1]);
+	evloop_wake_pipe[0] = evloop_wake_pipe[1] = -1;
+
+	pthread_mutex_lock(&evloop_mutex);
+	evloop_num_fds = 0;
+	pthread_mutex_unlock(&evloop_mutex);
+}
@@ -0,0 +1,1092 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Direct libFLAC encoder
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf */
+#include <stdlib.h>		/* For malloc / free */
+#include <string.h>		/* For memset / memcpy */
+#include <math.h>		/* For lrint() / copysignf() */
+#include <time.h>		/* For time() */
+#include <pthread.h>		/* For pthread_* */
+#include <FLAC/stream_encoder.h>
+
+/*
+ * Feeds FLAC files to libFLAC's stream encoder directly, instead
+ * of going through libsndfile that converts samples with its own
+ * buffering on the way. The encoded stream goes to the file's
+ * sinks through storage_write(), as with libsndfile, and libFLAC
+ * seeks back to update the STREAMINFO block when we are done.
+ *
+ * Samples get converted from float four at a time, scaled to
+ * bits, optionally with TPDF dither (the sum of two uniform
+ * random values, of up to 1 LSB), clamped and rounded to the
+ * nearest integer. The dither's random numbers come from four
+ * xorshift32 generators, one per lane.
+ *
+ * comp_level (0.0 - 1.0) maps to libFLAC's compression levels
+ * (0 - 8) as it does with libsndfile, the block size and the
+ * apodization functions that the level picks may be overridden.
+ *
+ * With threads set, the stream gets split in chunks of whole
+ * blocks instead, that a pool of workers encodes in parallel,
+ * each with its own libFLAC encoder. FLAC frames don't depend
+ * on each other, the only thing that ties them to their place
+ * in the stream is the frame number in their header, so the
+ * workers renumber the frames they get from libFLAC (fixing
+ * up the header's CRC-8 and the frame's CRC-16 on the way)
+ * and the consumer writes the chunks out in order. We write
+ * STREAMINFO ourselves, including the MD5 of the samples that
+ * we compute as we go, since libFLAC only sees a chunk at a
+ * time. Up to two chunks per worker are in flight, so what
+ * reaches the disk lags a few seconds behind.
+ */
+
+typedef float v4sf __attribute__ ((vector_size(16)));
+typedef int32_t v4si __attribute__ ((vector_size(16)));
+typedef uint32_t v4su __attribute__ ((vector_size(16)));
+
+/* Largest block size of the streamable subset,
+ * for up to 48KHz */
+#define FLAC_SUBSET_MAX_BLOCKSIZE	4608
+
+/* Parallel mode, blocks per chunk and chunks
+ * in flight per worker */
+#define FLAC_PARALLEL_BLOCKS	32
+#define FLAC_JOBS_PER_THREAD	2
+
+/* "fLaC" and the STREAMINFO block, with its header */
+#define FLAC_STREAMINFO_LEN	34
+#define FLAC_HEADER_LEN		(4 + 4 + FLAC_STREAMINFO_LEN)
+
+struct flac_md5 {
+	uint32_t state[4];
+	uint64_t len;
+	uint8_t block[64];
+};
+
+enum flac_job_state {
+	FLAC_JOB_FREE = 0,
+	FLAC_JOB_QUEUED,
+	FLAC_JOB_BUSY,
+	FLAC_JOB_DONE
+};
+
+struct flac_job {
+	/* Protected by the encoder's lock */
+	enum flac_job_state state;
+	int failed;
+	FLAC__int32 *samples;
+	uint32_t nframes;
+	/* Number of the chunk's first frame in the stream */
+	uint64_t first_frame;
+	/* Renumbered frames */
+	uint8_t *out;
+	size_t out_len;
+	size_t out_size;
+	uint32_t min_framesize;
+	uint32_t max_framesize;
+};
+
+struct flac_encoder {
+	FLAC__StreamEncoder *enc;
+	struct recorder_file *file;
+	int num_channels;
+	int sample_rate;
+	uint32_t bits;
+	uint32_t level;
+	uint32_t blocksize;
+	char *apodization;
+	int dither;
+	float scale;
+	float max;
+	float min;
+	v4su rng;
+	/* Converted samples, FLAC_CHUNK_FRAMES at a time */
+	FLAC__int32 *buf;
+	/* Parallel mode */
+	int num_threads;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t work_trigger;
+	pthread_cond_t done_trigger;
+	int stop;
+	int failed;
+	struct flac_job *jobs;
+	int num_jobs;
+	/* Job we fill, the next one for the workers
+	 * and the next one to write out */
+	int fill_job;
+	int next_job;
+	int write_job;
+	int jobs_in_flight;
+	int num_started;
+	uint32_t chunk_frames;
+	uint32_t fill_frames;
+	uint64_t total_frames;
+	uint32_t min_framesize;
+	uint32_t max_framesize;
+	struct flac_md5 md5;
+	uint8_t *md5_buf;
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+/**
+ * Next four uniform random values in [-0.5, 0.5)
+ */
+static inline v4sf
+flac_uniform(struct flac_encoder *fe)
+{
+	const v4sf scale = { 0x1p-24f, 0x1p-24f, 0x1p-24f, 0x1p-24f };
+	const v4sf half = { 0.5f, 0.5f, 0.5f, 0.5f };
+	v4su x = fe->rng;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	fe->rng = x;
+
+	return __builtin_convertvector((v4si) (x >> 8), v4sf) * scale - half;
+}
+
+/**
+ * Converts nsamples of interleaved float samples to
+ * fe's sample size
+ */
+static void
+flac_convert(struct flac_encoder *fe, const float *in, FLAC__int32 *out,
+	     uint32_t nsamples)
+{
+	const v4sf scale = { fe->scale, fe->scale, fe->scale, fe->scale };
+	const v4sf vmax = { fe->max, fe->max, fe->max, fe->max };
+	const v4sf vmin = { fe->min, fe->min, fe->min, fe->min };
+	const v4sf half = { 0.5f, 0.5f, 0.5f, 0.5f };
+	const v4si signmask = { INT32_MIN, INT32_MIN, INT32_MIN, INT32_MIN };
+	v4sf dither = { 0 };
+	v4sf v;
+	v4si mask;
+	v4si vi;
+	uint32_t i = 0;
+	float x = 0.0f;
+
+	for (i = 0; i + 4 <= nsamples; i += 4) {
+		memcpy(&v, in + i, sizeof(v4sf));
+		v *= scale;
+		if (fe->dither)
+			v += flac_uniform(fe) + flac_uniform(fe);
+
+		mask = v > vmax;
+		v = (v4sf) (((v4si) vmax & mask) | ((v4si) v & ~mask));
+		mask = v < vmin;
+		v = (v4sf) (((v4si) vmin & mask) | ((v4si) v & ~mask));
+
+		/* Round half away from zero, conversion truncates */
+		v += (v4sf) ((v4si) half | ((v4si) v & signmask));
+		vi = __builtin_convertvector(v, v4si);
+		memcpy(out + i, &vi, sizeof(v4si));
+	}
+
+	/* Leftovers */
+	if (fe->dither && i < nsamples)
+		dither = flac_uniform(fe) + flac_uniform(fe);
+	for (; i < nsamples; i++) {
+		x = in[i] * fe->scale + dither[i & 3];
+		if (x > fe->max)
+			x = fe->max;
+		if (x < fe->min)
+			x = fe->min;
+		out[i] = (FLAC__int32) (x + copysignf(0.5f, x));
+	}
+}
+
+/**
+ * Applies our settings to a libFLAC encoder, before
+ * it gets initialized
+ */
+static int
+flac_setup(struct flac_encoder *fe, FLAC__StreamEncoder *enc)
+{
+	int ok = 1;
+
+	ok &= FLAC__stream_encoder_set_channels(enc, fe->num_channels);
+	ok &= FLAC__stream_encoder_set_bits_per_sample(enc, fe->bits);
+	ok &= FLAC__stream_encoder_set_sample_rate(enc, fe->sample_rate);
+	ok &= FLAC__stream_encoder_set_compression_level(enc, fe->level);
+	if (fe->blocksize) {
+		ok &= FLAC__stream_encoder_set_blocksize(enc, fe->blocksize);
+		ok &= FLAC__stream_encoder_set_streamable_subset(enc,
+					fe->blocksize <=
+					FLAC_SUBSET_MAX_BLOCKSIZE);
+	}
+	if (fe->apodization)
+		ok &= FLAC__stream_encoder_set_apodization(enc,
+							   fe->apodization);
+	/* We do it ourselves in parallel mode */
+	if (fe->num_threads)
+		ok &= FLAC__stream_encoder_set_do_md5(enc, 0);
+
+	return ok ? 0 : -1;
+}
+
+/*
+ * MD5 (RFC 1321) of the samples, as libFLAC computes it for
+ * STREAMINFO, on the consumer thread
+ */
+
+static const uint32_t flac_md5_k[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee,
+	0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+	0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa,
+	0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed,
+	0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+	0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05,
+	0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039,
+	0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+	0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+};
+
+static const uint8_t flac_md5_shift[16] = {
+	7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+static void
+flac_md5_init(struct flac_md5 *md5)
+{
+	md5->state[0] = 0x67452301;
+	md5->state[1] = 0xefcdab89;
+	md5->state[2] = 0x98badcfe;
+	md5->state[3] = 0x10325476;
+	md5->len = 0;
+}
+
+static void
+flac_md5_block(struct flac_md5 *md5, const uint8_t *block)
+{
+	uint32_t w[16] = { 0 };
+	uint32_t a = md5->state[0];
+	uint32_t b = md5->state[1];
+	uint32_t c = md5->state[2];
+	uint32_t d = md5->state[3];
+	uint32_t f = 0;
+	uint32_t tmp = 0;
+	int g = 0;
+	int i = 0;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) block[i * 4] |
+		       (uint32_t) block[i * 4 + 1] << 8 |
+		       (uint32_t) block[i * 4 + 2] << 16 |
+		       (uint32_t) block[i * 4 + 3] << 24;
+
+	for (i = 0; i < 64; i++) {
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		} else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5 * i + 1) & 15;
+		} else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3 * i + 5) & 15;
+		} else {
+			f = c ^ (b | ~d);
+			g = (7 * i) & 15;
+		}
+		tmp = a + f + flac_md5_k[i] + w[g];
+		a = d;
+		d = c;
+		c = b;
+		b += (tmp << flac_md5_shift[(i >> 4) * 4 + (i & 3)]) |
+		     (tmp >> (32 - flac_md5_shift[(i >> 4) * 4 + (i & 3)]));
+	}
+
+	md5->state[0] += a;
+	md5->state[1] += b;
+	md5->state[2] += c;
+	md5->state[3] += d;
+}
+
+static void
+flac_md5_update(struct flac_md5 *md5, const uint8_t *data, size_t len)
+{
+	size_t used = md5->len & 63;
+	size_t n = 0;
+
+	md5->len += len;
+
+	if (used) {
+		n = 64 - used < len ? 64 - used : len;
+		memcpy(md5->block + used, data, n);
+		data += n;
+		len -= n;
+		if (used + n < 64)
+			return;
+		flac_md5_block(md5, md5->block);
+	}
+
+	for (; len >= 64; data += 64, len -= 64)
+		flac_md5_block(md5, data);
+
+	memcpy(md5->block, data, len);
+}
+
+static void
+flac_md5_final(struct flac_md5 *md5, uint8_t digest[16])
+{
+	uint64_t bits = md5->len * 8;
+	size_t used = md5->len & 63;
+	int i = 0;
+
+	md5->block[used++] = 0x80;
+	if (used > 56) {
+		memset(md5->block + used, 0, 64 - used);
+		flac_md5_block(md5, md5->block);
+		used = 0;
+	}
+	memset(md5->block + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		md5->block[56 + i] = (uint8_t) (bits >> (i * 8));
+	flac_md5_block(md5, md5->block);
+
+	for (i = 0; i < 16; i++)
+		digest[i] = (uint8_t) (md5->state[i / 4] >> ((i % 4) * 8));
+}
+
+/**
+ * Feeds nsamples of converted samples to the MD5, as little
+ * endian integers of the sample size rounded up to bytes
+ */
+static void
+flac_md5_samples(struct flac_encoder *fe, const FLAC__int32 *samples,
+		 uint32_t nsamples)
+{
+	uint32_t bytes = (fe->bits + 7) / 8;
+	uint8_t *out = fe->md5_buf;
+	uint32_t i = 0;
+	uint32_t j = 0;
+
+	for (i = 0; i < nsamples; i++)
+		for (j = 0; j < bytes; j++)
+			*out++ = (uint8_t) ((uint32_t) samples[i] >> (j * 8));
+
+	flac_md5_update(&fe->md5, fe->md5_buf, out - fe->md5_buf);
+}
+
+/*
+ * CRCs of the frame header (CRC-8, poly 0x07) and of
+ * the whole frame (CRC-16, poly 0x8005)
+ */
+
+static uint8_t flac_crc8_table[256];
+static uint16_t flac_crc16_table[256];
+static pthread_once_t flac_crc_once = PTHREAD_ONCE_INIT;
+
+static void
+flac_crc_init(void)
+{
+	uint16_t crc16 = 0;
+	uint8_t crc8 = 0;
+	int i = 0;
+	int j = 0;
+
+	for (i = 0; i < 256; i++) {
+		crc8 = (uint8_t) i;
+		crc16 = (uint16_t) (i << 8);
+		for (j = 0; j < 8; j++) {
+			crc8 = (crc8 & 0x80) ? (crc8 << 1) ^ 0x07 : crc8 << 1;
+			crc16 = (crc16 & 0x8000) ? (crc16 << 1) ^ 0x8005 :
+				crc16 << 1;
+		}
+		flac_crc8_table[i] = crc8;
+		flac_crc16_table[i] = crc16;
+	}
+}
+
+static uint8_t
+flac_crc8(const uint8_t *data, size_t len)
+{
+	uint8_t crc = 0;
+
+	while (len--)
+		crc = flac_crc8_table[crc ^ *data++];
+	return crc;
+}
+
+static uint16_t
+flac_crc16(const uint8_t *data, size_t len)
+{
+	uint16_t crc = 0;
+
+	while (len--)
+		crc = (crc << 8) ^ flac_crc16_table[(crc >> 8) ^ *data++];
+	return crc;
+}
+
+/**
+ * Copies a frame from in to out with its frame number
+ * replaced, the number is UTF-8 coded so the header may
+ * grow. Returns the new frame's length, or 0 if it's not
+ * a frame we can handle or out can't hold it.
+ */
+static size_t
+flac_renumber_frame(const uint8_t *in, size_t in_len, uint64_t number,
+		    uint8_t *out, size_t out_size)
+{
+	size_t num_len = 0;
+	size_t new_num_len = 1;
+	size_t extra_len = 0;
+	size_t hdr_len = 0;
+	size_t out_len = 0;
+	uint16_t crc = 0;
+	uint8_t code = 0;
+	size_t i = 0;
+
+	/* Sync code, with the fixed block size strategy */
+	if (in_len < 6 || in[0] != 0xFF || in[1] != 0xF8)
+		return 0;
+
+	/* The coded number's length is in its first
+	 * byte's leading ones */
+	for (code = in[4]; code & 0x80; code <<= 1)
+		num_len++;
+	if (num_len == 1 || num_len > 6)
+		return 0;
+	if (!num_len)
+		num_len = 1;
+
+	/* Block size / sample rate that didn't fit
+	 * in their codes */
+	code = in[2] >> 4;
+	if (code == 6 || code == 7)
+		extra_len += code - 5;
+	code = in[2] & 0x0F;
+	if (code == 12)
+		extra_len += 1;
+	else if (code == 13 || code == 14)
+		extra_len += 2;
+
+	/* Header up to the CRC-8, and the CRC-16 */
+	hdr_len = 4 + num_len + extra_len;
+	if (hdr_len + 1 + 2 > in_len)
+		return 0;
+
+	if (number >= 0x80)
+		for (new_num_len = 2; new_num_len < 6 &&
+		     number >= (1ULL << (5 * new_num_len + 1)); new_num_len++) ;
+
+	out_len = in_len - num_len + new_num_len;
+	if (out_len > out_size)
+		return 0;
+
+	memcpy(out, in, 4);
+	if (new_num_len == 1)
+		out[4] = (uint8_t) number;
+	else
+		out[4] = (uint8_t) ((0xFF00 >> new_num_len) |
+				    (number >> (6 * (new_num_len - 1))));
+	for (i = 1; i < new_num_len; i++)
+		out[4 + i] = 0x80 | ((number >> (6 * (new_num_len - 1 - i))) &
+				     0x3F);
+	memcpy(out + 4 + new_num_len, in + 4 + num_len, extra_len);
+	out[4 + new_num_len + extra_len] = flac_crc8(out, 4 + new_num_len +
+						      extra_len);
+
+	/* The rest of the frame as it was, up to the CRC-16 */
+	memcpy(out + 4 + new_num_len + extra_len + 1, in + hdr_len + 1,
+	       in_len - hdr_len - 1 - 2);
+	crc = flac_crc16(out, out_len - 2);
+	out[out_len - 2] = (uint8_t) (crc >> 8);
+	out[out_len - 1] = (uint8_t) crc;
+
+	return out_len;
+}
+
+
+/*******************\
+* LIBFLAC CALLBACKS *
+\*******************/
+
+static FLAC__StreamEncoderWriteStatus
+flac_write_cb(const FLAC__StreamEncoder *enc, const FLAC__byte buffer[],
+	      size_t bytes, uint32_t samples, uint32_t current_frame,
+	      void *client_data)
+{
+	struct flac_encoder *fe = (struct flac_encoder *)client_data;
+
+	if (storage_write(fe->file, buffer, bytes) != (sf_count_t) bytes)
+		return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+	return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static FLAC__StreamEncoderSeekStatus
+flac_seek_cb(const FLAC__StreamEncoder *enc, FLAC__uint64 offset,
+	     void *client_data)
+{
+	struct flac_encoder *fe = (struct flac_encoder *)client_data;
+
+	storage_seek(fe->file, offset, SEEK_SET);
+	return FLAC__STREAM_ENCODER_SEEK_STATUS_OK;
+}
+
+static FLAC__StreamEncoderTellStatus
+flac_tell_cb(const FLAC__StreamEncoder *enc, FLAC__uint64 *offset,
+	     void *client_data)
+{
+	struct flac_encoder *fe = (struct flac_encoder *)client_data;
+
+	*offset = fe->file->offset;
+	return FLAC__STREAM_ENCODER_TELL_STATUS_OK;
+}
+
+
+/*******************\
+* PARALLEL ENCODING *
+\*******************/
+
+/**
+ * Receives a chunk's frames from a worker's encoder and
+ * stores them renumbered, after the frames before it
+ */
+static FLAC__StreamEncoderWriteStatus
+flac_job_write_cb(const FLAC__StreamEncoder *enc, const FLAC__byte buffer[],
+		  size_t bytes, uint32_t samples, uint32_t current_frame,
+		  void *client_data)
+{
+	struct flac_job *job = (struct flac_job *)client_data;
+	size_t len = 0;
+
+	/* The chunk's own "fLaC" / STREAMINFO */
+	if (!samples)
+		return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+
+	len = flac_renumber_frame(buffer, bytes,
+				  job->first_frame + current_frame,
+				  job->out + job->out_len,
+				  job->out_size - job->out_len);
+	if (!len)
+		return FLAC__STREAM_ENCODER_WRITE_STATUS_FATAL_ERROR;
+
+	job->out_len += len;
+	if (len < job->min_framesize)
+		job->min_framesize = len;
+	if (len > job->max_framesize)
+		job->max_framesize = len;
+
+	return FLAC__STREAM_ENCODER_WRITE_STATUS_OK;
+}
+
+static int
+flac_encode_job(struct flac_encoder *fe, FLAC__StreamEncoder *enc,
+		struct flac_job *job)
+{
+	FLAC__StreamEncoderInitStatus status = 0;
+	int ok = 0;
+
+	job->out_len = 0;
+	job->min_framesize = UINT32_MAX;
+	job->max_framesize = 0;
+
+	if (!enc || flac_setup(fe, enc) < 0)
+		return -1;
+
+	status = FLAC__stream_encoder_init_stream(enc, flac_job_write_cb,
+						  NULL, NULL, NULL, job);
+	if (status != FLAC__STREAM_ENCODER_INIT_STATUS_OK)
+		return -1;
+
+	ok = FLAC__stream_encoder_process_interleaved(enc, job->samples,
+						      job->nframes);
+	/* Resets the encoder for the next chunk, with the
+	 * last (partial) block flushed */
+	if (!FLAC__stream_encoder_finish(enc))
+		ok = 0;
+
+	return ok ? 0 : -1;
+}
+
+/**
+ * A worker, encodes chunks as they get queued, in order
+ */
+static void *
+flac_worker(void *arg)
+{
+	struct flac_encoder *fe = (struct flac_encoder *)arg;
+	FLAC__StreamEncoder *enc = FLAC__stream_encoder_new();
+	struct flac_job *job = NULL;
+	int ret = 0;
+
+	pthread_mutex_lock(&fe->lock);
+	while (!fe->stop) {
+		job = &fe->jobs[fe->next_job];
+		if (job->state != FLAC_JOB_QUEUED) {
+			pthread_cond_wait(&fe->work_trigger, &fe->lock);
+			continue;
+		}
+		job->state = FLAC_JOB_BUSY;
+		fe->next_job = (fe->next_job + 1) % fe->num_jobs;
+		pthread_mutex_unlock(&fe->lock);
+
+		ret = flac_encode_job(fe, enc, job);
+
+		pthread_mutex_lock(&fe->lock);
+		job->failed = (ret < 0);
+		job->state = FLAC_JOB_DONE;
+		pthread_cond_broadcast(&fe->done_trigger);
+	}
+	pthread_mutex_unlock(&fe->lock);
+
+	if (enc)
+		FLAC__stream_encoder_delete(enc);
+	return NULL;
+}
+
+/**
+ * Hands the chunk we filled to the workers
+ */
+static void
+flac_submit_job(struct flac_encoder *fe)
+{
+	struct flac_job *job = &fe->jobs[fe->fill_job];
+
+	pthread_mutex_lock(&fe->lock);
+	job->nframes = fe->fill_frames;
+	job->first_frame = fe->total_frames / fe->blocksize;
+	job->state = FLAC_JOB_QUEUED;
+	pthread_cond_signal(&fe->work_trigger);
+	pthread_mutex_unlock(&fe->lock);
+
+	fe->total_frames += fe->fill_frames;
+	fe->fill_frames = 0;
+	fe->fill_job = (fe->fill_job + 1) % fe->num_jobs;
+	fe->jobs_in_flight++;
+}
+
+/**
+ * Writes out the oldest chunk in flight if it's encoded,
+ * or once it is with wait set. Returns 1 if it got one out
+ * of the way, 0 if not and -1 on failure, after which the
+ * rest just get dropped.
+ */
+static int
+flac_write_job(struct flac_encoder *fe, int wait)
+{
+	struct flac_job *job = &fe->jobs[fe->write_job];
+	int ret = 1;
+
+	if (!fe->jobs_in_flight)
+		return 0;
+
+	pthread_mutex_lock(&fe->lock);
+	if (job->state != FLAC_JOB_DONE && !wait) {
+		pthread_mutex_unlock(&fe->lock);
+		return 0;
+	}
+	while (job->state != FLAC_JOB_DONE)
+		pthread_cond_wait(&fe->done_trigger, &fe->lock);
+	pthread_mutex_unlock(&fe->lock);
+
+	if (fe->failed)
+		ret = -1;
+	else if (job->failed) {
+		fprintf(stderr, "flac: failed to encode a chunk of %s\n",
+			fe->file->path);
+		ret = -1;
+	} else if (storage_write(fe->file, job->out, job->out_len) !=
+		   (sf_count_t) job->out_len)
+		ret = -1;
+	else {
+		if (job->min_framesize < fe->min_framesize)
+			fe->min_framesize = job->min_framesize;
+		if (job->max_framesize > fe->max_framesize)
+			fe->max_framesize = job->max_framesize;
+	}
+
+	pthread_mutex_lock(&fe->lock);
+	job->state = FLAC_JOB_FREE;
+	pthread_mutex_unlock(&fe->lock);
+
+	fe->write_job = (fe->write_job + 1) % fe->num_jobs;
+	fe->jobs_in_flight--;
+	if (ret < 0)
+		fe->failed = 1;
+
+	return ret;
+}
+
+/**
+ * "fLaC" and STREAMINFO, for what we wrote so far
+ */
+static void
+flac_streaminfo(struct flac_encoder *fe, uint8_t *hdr, const uint8_t *md5)
+{
+	uint32_t min_framesize = fe->min_framesize;
+	uint64_t packed = 0;
+	uint8_t *si = hdr + 8;
+	int i = 0;
+
+	if (min_framesize == UINT32_MAX)
+		min_framesize = 0;
+
+	memcpy(hdr, "fLaC", 4);
+	/* Last metadata block, of type STREAMINFO */
+	hdr[4] = 0x80;
+	hdr[5] = 0;
+	hdr[6] = 0;
+	hdr[7] = FLAC_STREAMINFO_LEN;
+
+	si[0] = si[2] = (uint8_t) (fe->blocksize >> 8);
+	si[1] = si[3] = (uint8_t) fe->blocksize;
+	for (i = 0; i < 3; i++) {
+		si[4 + i] = (uint8_t) (min_framesize >> (16 - i * 8));
+		si[7 + i] = (uint8_t) (fe->max_framesize >> (16 - i * 8));
+	}
+	packed = (uint64_t) fe->sample_rate << 44 |
+		 (uint64_t) (fe->num_channels - 1) << 41 |
+		 (uint64_t) (fe->bits - 1) << 36 |
+		 (fe->total_frames & 0xFFFFFFFFFULL);
+	for (i = 0; i < 8; i++)
+		si[10 + i] = (uint8_t) (packed >> (56 - i * 8));
+	memcpy(si + 18, md5, 16);
+}
+
+static void
+flac_stop_workers(struct flac_encoder *fe)
+{
+	int i = 0;
+
+	if (!fe->num_started)
+		return;
+
+	pthread_mutex_lock(&fe->lock);
+	fe->stop = 1;
+	pthread_cond_broadcast(&fe->work_trigger);
+	pthread_mutex_unlock(&fe->lock);
+
+	for (i = 0; i < fe->num_started; i++)
+		pthread_join(fe->threads[i], NULL);
+	fe->num_started = 0;
+}
+
+/**
+ * Sets up the job ring and the workers, and writes the
+ * stream's header, to be updated once we are done
+ */
+static int
+flac_start_workers(struct flac_encoder *fe)
+{
+	FLAC__StreamEncoder *enc = NULL;
+	uint8_t hdr[FLAC_HEADER_LEN] = { 0 };
+	uint8_t md5[16] = { 0 };
+	size_t samples_size = 0;
+	int i = 0;
+
+	/* Chunks are made of whole blocks, for the
+	 * frame numbers to add up */
+	enc = FLAC__stream_encoder_new();
+	if (!enc || flac_setup(fe, enc) < 0) {
+		if (enc)
+			FLAC__stream_encoder_delete(enc);
+		return -1;
+	}
+	fe->blocksize = FLAC__stream_encoder_get_blocksize(enc);
+	FLAC__stream_encoder_delete(enc);
+
+	fe->chunk_frames = FLAC_PARALLEL_BLOCKS * fe->blocksize;
+	fe->min_framesize = UINT32_MAX;
+	flac_md5_init(&fe->md5);
+	fe->md5_buf = malloc(FLAC_CHUNK_FRAMES * fe->num_channels *
+			     sizeof(FLAC__int32));
+	if (!fe->md5_buf)
+		return -1;
+
+	fe->num_jobs = fe->num_threads * FLAC_JOBS_PER_THREAD;
+	fe->jobs = malloc(fe->num_jobs * sizeof(struct flac_job));
+	if (!fe->jobs)
+		return -1;
+	memset(fe->jobs, 0, fe->num_jobs * sizeof(struct flac_job));
+
+	/* Enough for verbatim frames, even with
+	 * the side channel's extra bit */
+	samples_size = fe->chunk_frames * fe->num_channels *
+		       sizeof(FLAC__int32);
+	for (i = 0; i < fe->num_jobs; i++) {
+		fe->jobs[i].samples = malloc(samples_size);
+		fe->jobs[i].out_size = samples_size +
+				       (FLAC_PARALLEL_BLOCKS + 1) *
+				       (64 + fe->num_channels * 8);
+		fe->jobs[i].out = malloc(fe->jobs[i].out_size);
+		if (!fe->jobs[i].samples || !fe->jobs[i].out)
+			return -1;
+	}
+
+	flac_streaminfo(fe, hdr, md5);
+	if (storage_write(fe->file, hdr, FLAC_HEADER_LEN) != FLAC_HEADER_LEN)
+		return -1;
+
+	pthread_mutex_init(&fe->lock, NULL);
+	pthread_cond_init(&fe->work_trigger, NULL);
+	pthread_cond_init(&fe->done_trigger, NULL);
+
+	fe->threads = malloc(fe->num_threads * sizeof(pthread_t));
+	if (!fe->threads)
+		return -1;
+	for (i = 0; i < fe->num_threads; i++) {
+		if (pthread_create(&fe->threads[i], NULL, flac_worker, fe))
+			return -1;
+		fe->num_started++;
+	}
+
+	return 0;
+}
+
+/**
+ * Writes out the rest and updates the stream's header
+ */
+static void
+flac_finish_workers(struct flac_encoder *fe)
+{
+	uint8_t hdr[FLAC_HEADER_LEN] = { 0 };
+	uint8_t md5[16] = { 0 };
+
+	if (fe->fill_frames && !fe->failed)
+		flac_submit_job(fe);
+	while (fe->jobs_in_flight)
+		flac_write_job(fe, 1);
+
+	flac_stop_workers(fe);
+
+	if (fe->failed)
+		return;
+
+	flac_md5_final(&fe->md5, md5);
+	flac_streaminfo(fe, hdr, md5);
+	if (storage_seek(fe->file, 0, SEEK_SET) < 0 ||
+	    storage_write(fe->file, hdr, FLAC_HEADER_LEN) != FLAC_HEADER_LEN)
+		fprintf(stderr, "flac: could not update the header of %s\n",
+			fe->file->path);
+}
+
+static void
+flac_free(struct flac_encoder *fe)
+{
+	int i = 0;
+
+	flac_stop_workers(fe);
+	if (fe->threads) {
+		pthread_mutex_destroy(&fe->lock);
+		pthread_cond_destroy(&fe->work_trigger);
+		pthread_cond_destroy(&fe->done_trigger);
+	}
+	free(fe->threads);
+	for (i = 0; fe->jobs && i < fe->num_jobs; i++) {
+		free(fe->jobs[i].samples);
+		free(fe->jobs[i].out);
+	}
+	free(fe->jobs);
+	free(fe->md5_buf);
+
+	if (fe->enc)
+		FLAC__stream_encoder_delete(fe->enc);
+	free(fe->buf);
+	free(fe);
+}
+
+static int
+flac_write_parallel(struct flac_encoder *fe, const float *buf,
+		    uint32_t nframes)
+{
+	struct flac_job *job = NULL;
+	FLAC__int32 *samples = NULL;
+	uint32_t done = 0;
+	uint32_t chunk = 0;
+	int ret = 0;
+
+	if (fe->failed)
+		return 0;
+
+	/* Get what's ready out of the way */
+	while ((ret = flac_write_job(fe, 0)) > 0) ;
+	if (ret < 0)
+		return 0;
+
+	while (done < nframes) {
+		/* Every job is in flight, wait for the oldest */
+		if (!fe->fill_frames && fe->jobs_in_flight == fe->num_jobs &&
+		    flac_write_job(fe, 1) < 0)
+			break;
+
+		chunk = nframes - done;
+		if (chunk > FLAC_CHUNK_FRAMES)
+			chunk = FLAC_CHUNK_FRAMES;
+		if (chunk > fe->chunk_frames - fe->fill_frames)
+			chunk = fe->chunk_frames - fe->fill_frames;
+
+		job = &fe->jobs[fe->fill_job];
+		samples = job->samples + fe->fill_frames * fe->num_channels;
+		flac_convert(fe, buf + done * fe->num_channels, samples,
+			     chunk * fe->num_channels);
+		flac_md5_samples(fe, samples, chunk * fe->num_channels);
+		fe->fill_frames += chunk;
+		done += chunk;
+
+		if (fe->fill_frames == fe->chunk_frames)
+			flac_submit_job(fe);
+	}
+
+	return done;
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Sets up an encoder for file, that's already on its
+ * sinks (see storage_open()), and writes the stream's
+ * header. Returns NULL on failure.
+ */
+struct flac_encoder *
+flac_open(struct recorder_file *file, const struct flac_opts *opts,
+	  const SF_INFO *info, double comp_level)
+{
+	struct flac_encoder *fe = NULL;
+	FLAC__StreamEncoderInitStatus status = 0;
+	uint32_t seed = (uint32_t) time(NULL) | 1;
+	int i = 0;
+
+	pthread_once(&flac_crc_once, flac_crc_init);
+
+	fe = malloc(sizeof(struct flac_encoder));
+	if (!fe)
+		return NULL;
+	memset(fe, 0, sizeof(struct flac_encoder));
+
+	fe->file = file;
+	fe->num_channels = info->channels;
+	fe->sample_rate = info->samplerate;
+	fe->bits = opts->bits ? opts->bits : 24;
+	fe->level = lrint(comp_level * 8.0);
+	fe->blocksize = opts->blocksize;
+	fe->apodization = opts->apodization;
+	fe->num_threads = opts->threads;
+	fe->dither = opts->dither;
+	fe->scale = (float)(1 << (fe->bits - 1));
+	fe->max = fe->scale - 1.0f;
+	fe->min = -fe->scale;
+	for (i = 0; i < 4; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		fe->rng[i] = seed;
+	}
+
+	if (fe->num_threads) {
+		if (flac_start_workers(fe) < 0) {
+			fprintf(stderr, "Could not start FLAC encoders for %s\n",
+				file->path);
+			goto cleanup;
+		}
+		return fe;
+	}
+
+	fe->buf = malloc(FLAC_CHUNK_FRAMES * info->channels *
+			 sizeof(FLAC__int32));
+	if (!fe->buf)
+		goto cleanup;
+
+	fe->enc = FLAC__stream_encoder_new();
+	if (!fe->enc)
+		goto cleanup;
+
+	if (flac_setup(fe, fe->enc) < 0)
+		goto cleanup;
+
+	status = FLAC__stream_encoder_init_stream(fe->enc, flac_write_cb,
+						  flac_seek_cb, flac_tell_cb,
+						  NULL, fe);
+	if (status != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+		fprintf(stderr, "Could not open %s\n\t%s\n", file->path,
+			FLAC__StreamEncoderInitStatusString[status]);
+		goto cleanup;
+	}
+
+	return fe;
+
+ cleanup:
+	flac_free(fe);
+	return NULL;
+}
+
+/**
+ * Encodes nframes of interleaved float frames, returns how
+ * many made it as sf_writef_float() does. In parallel mode
+ * that's how many got queued, if writing out an earlier
+ * chunk fails the ones still in flight get lost.
+ */
+int
+flac_write(struct flac_encoder *fe, const float *buf, uint32_t nframes)
+{
+	uint32_t done = 0;
+	uint32_t chunk = 0;
+
+	if (fe->num_threads)
+		return flac_write_parallel(fe, buf, nframes);
+
+	while (done < nframes) {
+		chunk = nframes - done;
+		if (chunk > FLAC_CHUNK_FRAMES)
+			chunk = FLAC_CHUNK_FRAMES;
+
+		flac_convert(fe, buf + done * fe->num_channels, fe->buf,
+			     chunk * fe->num_channels);
+		if (!FLAC__stream_encoder_process_interleaved(fe->enc, fe->buf,
+							      chunk))
+			break;
+		done += chunk;
+	}
+
+	return done;
+}
+
+/**
+ * Flushes what's left, updates the stream's header and
+ * frees the encoder
+ */
+void
+flac_close(struct flac_encoder *fe)
+{
+	if (!fe)
+		return;
+
+	if (fe->num_threads)
+		flac_finish_workers(fe);
+	else
+		FLAC__stream_encoder_finish(fe->enc);
+	flac_free(fe);
+}
@@ -18,10 +18,35 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "acoffin.h"
+#include <gtk/gtk.h>		/* For GTK types */
 #include <math.h>		/* For log10 and fabs */
+#include <string.h>		/* For memcpy */
+
+/*
+ * Everything GTK / GLib related lives here, the recorder
+ * only calls the gui_update_* / gui_cleanup entry points
+ * below, which hand the work over to the main thread.
+ * Built only with --enable-gui (the default).
+ */
+
+/* Refresh rate of the level meters */
+#define GUI_METER_FPS	30
+
+struct gui_widgets {
+	GtkWidget *window;
+	GtkWidget *button;
+	GtkWidget *button_image;
+	GdkPixbuf *active_pbuf;
+	GdkPixbuf *inactive_pbuf;
+	GtkWidget *timer;
+	GtkWidget *level_left;
+	GtkWidget *level_right;
+};
 
 volatile sig_atomic_t button_state = GUI_BUTTON_RAISED;
 volatile sig_atomic_t gui_state = GUI_NOT_INITIALIZED;
+static guint meters_source = 0;
+static struct gui_widgets gui = { 0 };
 
 /**********************\
 * TIMER LABEL HANDLING *
@@ -30,11 +55,11 @@ volatile sig_atomic_t gui_state = GUI_NOT_INITIALIZED;
 /**
  * Updates the timer label to the given value
  */
-gboolean
-gui_update_timer_label(gpointer data)
+static gboolean
+gui_timer_label_cb(gpointer data)
 {
 	struct recorder *rcd = (struct recorder *)data;
-	GtkWidget *timer = rcd->timer;
+	GtkWidget *timer = gui.timer;
 	char str_buff[16] = { 0 };
 	uint32_t mins = 0;
 	uint32_t hours = 0;
@@ -69,7 +94,7 @@ gui_button_action(GtkWidget * widget, gpointer data)
 {
 	struct recorder *rcd = (struct recorder *)data;
 	GtkWidget *record_button = widget;
-	GtkWidget *timer = rcd->timer;
+	GtkWidget *timer = gui.timer;
 
 	/* Ignore any signals when disabled */
 	if (button_state == GUI_BUTTON_DISABLED)
@@ -80,12 +105,13 @@ gui_button_action(GtkWidget * widget, gpointer data)
 	else
 		recorder_stop(rcd);
 
-	if (recorder_state == RECORDER_RUNNING)
-		gtk_image_set_from_pixbuf(GTK_IMAGE(rcd->button_image),
-					  rcd->active_pbuf);
+	if (recorder_state == RECORDER_RUNNING ||
+	    recorder_state == RECORDER_ARMED)
+		gtk_image_set_from_pixbuf(GTK_IMAGE(gui.button_image),
+					  gui.active_pbuf);
 	else
-		gtk_image_set_from_pixbuf(GTK_IMAGE(rcd->button_image),
-					  rcd->inactive_pbuf);
+		gtk_image_set_from_pixbuf(GTK_IMAGE(gui.button_image),
+					  gui.inactive_pbuf);
 
 	return;
 }
@@ -93,26 +119,25 @@ gui_button_action(GtkWidget * widget, gpointer data)
 /**
  * Button state update callback from recorder
  */
-gboolean
-gui_update_button_state(gpointer data)
+static gboolean
+gui_button_state_cb(gpointer data)
 {
-	struct recorder *rcd = (struct recorder *)data;
-	GtkToggleButton *button = GTK_TOGGLE_BUTTON(rcd->button);
+	GtkToggleButton *button = GTK_TOGGLE_BUTTON(gui.button);
 
 	switch (button_state) {
 	case GUI_BUTTON_PRESSED:
 		gtk_toggle_button_set_inconsistent(button, FALSE);
 		gtk_toggle_button_set_active(button, TRUE);
-		gtk_widget_set_sensitive(rcd->button, TRUE);
+		gtk_widget_set_sensitive(gui.button, TRUE);
 		break;
 	case GUI_BUTTON_RAISED:
 		gtk_toggle_button_set_inconsistent(button, FALSE);
 		gtk_toggle_button_set_active(button, FALSE);
-		gtk_widget_set_sensitive(rcd->button, TRUE);
+		gtk_widget_set_sensitive(gui.button, TRUE);
 		break;
 	case GUI_BUTTON_DISABLED:
 		gtk_toggle_button_set_inconsistent(button, TRUE);
-		gtk_widget_set_sensitive(rcd->button, FALSE);
+		gtk_widget_set_sensitive(gui.button, FALSE);
 		break;
 	default:
 		return FALSE;
@@ -154,9 +179,25 @@ iec_scale(float db)
 }
 
 /**
- * Level state callback from recorder
+ * Grabs and resets the peak-hold value of a channel
  */
-gboolean
+static float
+gui_take_peak(struct recorder *rcd, int channel)
+{
+	uint32_t bits = 0;
+	float peak = 0.0f;
+
+	bits = __atomic_exchange_n(&rcd->peak_hold[channel], 0,
+				   __ATOMIC_RELAXED);
+	memcpy(&peak, &bits, sizeof(float));
+	return peak;
+}
+
+/**
+ * Polls the peak levels published by the recorder, runs
+ * GUI_METER_FPS times per second no matter the period size
+ */
+static gboolean
 gui_update_meters(gpointer data)
 {
 	struct recorder *rcd = (struct recorder *)data;
@@ -164,20 +205,20 @@ gui_update_meters(gpointer data)
 	float db_right = 0.0f;
 
 	/* Amplitude to db + iec scaling */
-	db_left = 20.0f * log10(rcd->left_amp);
+	db_left = 20.0f * log10(gui_take_peak(rcd, 0));
 	db_left = iec_scale(db_left) / 100;
 
 	if (rcd->stereo) {
-		db_right = 20.0f * log10(rcd->right_amp);
+		db_right = 20.0f * log10(gui_take_peak(rcd, 1));
 		db_right = iec_scale(db_right) / 100;
-		gtk_level_bar_set_value(GTK_LEVEL_BAR(rcd->level_right),
+		gtk_level_bar_set_value(GTK_LEVEL_BAR(gui.level_right),
 					db_right);
 	}
 
-	gtk_level_bar_set_value(GTK_LEVEL_BAR(rcd->level_left), db_left);
+	gtk_level_bar_set_value(GTK_LEVEL_BAR(gui.level_left), db_left);
 
-	/* Always return false or it'll loop */
-	return FALSE;
+	/* Keep polling */
+	return TRUE;
 }
 
 /****************\
@@ -232,7 +273,7 @@ gui_initialize(int argc, char *argv[], struct recorder *rcd)
 	/* Add event handler for closing the window */
 	g_signal_connect(window, "delete-event", G_CALLBACK(gtk_main_quit),
 			 NULL);
-	rcd->window = window;
+	gui.window = window;
 
 	/* Create a vertical box */
 	vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 0);
@@ -259,7 +300,7 @@ gui_initialize(int argc, char *argv[], struct recorder *rcd)
 		ret = -4;
 		goto cleanup;
 	}
-	rcd->active_pbuf = pixbuf_img_active;
+	gui.active_pbuf = pixbuf_img_active;
 	pixbuf_img_inactive =
 	    gdk_pixbuf_new_from_file_at_scale(DATA_PATH"record_inactive.png", 160,
 					      160, TRUE, NULL);
@@ -267,14 +308,14 @@ gui_initialize(int argc, char *argv[], struct recorder *rcd)
 		ret = -5;
 		goto cleanup;
 	}
-	rcd->inactive_pbuf = pixbuf_img_inactive;
+	gui.inactive_pbuf = pixbuf_img_inactive;
 
 	button_image = gtk_image_new_from_pixbuf(pixbuf_img_inactive);
 	if (!button_image) {
 		ret = -6;
 		goto cleanup;
 	}
-	rcd->button_image = button_image;
+	gui.button_image = button_image;
 
 	/* Create the record button */
 	record_button = gtk_toggle_button_new();
@@ -282,7 +323,7 @@ gui_initialize(int argc, char *argv[], struct recorder *rcd)
 		ret = -7;
 		goto cleanup;
 	}
-	rcd->button = record_button;
+	gui.button = record_button;
 	gtk_button_set_image(GTK_BUTTON(record_button), button_image);
 	g_signal_connect(record_button, "toggled",
 			 G_CALLBACK(gui_button_action), (gpointer) rcd);
@@ -299,7 +340,7 @@ gui_initialize(int argc, char *argv[], struct recorder *rcd)
 				       GTK_LEVEL_BAR_OFFSET_HIGH, 0.25);
 	gtk_level_bar_add_offset_value(GTK_LEVEL_BAR(level_left),
 				       GTK_LEVEL_BAR_OFFSET_LOW, 0.85);
-	rcd->level_left = level_left;
+	gui.level_left = level_left;
 
 	if (rcd->stereo) {
 		level_right = gtk_level_bar_new();
@@ -311,7 +352,7 @@ gui_initialize(int argc, char *argv[], struct recorder *rcd)
 					       GTK_LEVEL_BAR_OFFSET_HIGH, 0.25);
 		gtk_level_bar_add_offset_value(GTK_LEVEL_BAR(level_right),
 					       GTK_LEVEL_BAR_OFFSET_LOW, 0.85);
-		rcd->level_right = level_right;
+		gui.level_right = level_right;
 
 		separator = gtk_separator_new(GTK_ORIENTATION_HORIZONTAL);
 		if (!separator) {
@@ -337,7 +378,7 @@ gui_initialize(int argc, char *argv[], struct recorder *rcd)
 					}\n", -1,
 					NULL);
 	g_object_unref(provider);
-	rcd->timer = timer;
+	gui.timer = timer;
 
 
 	/* Put them all in and draw the window */
@@ -353,6 +394,10 @@ gui_initialize(int argc, char *argv[], struct recorder *rcd)
 	gtk_widget_show_all(window);
 
 
+	/* Start polling the meters */
+	meters_source = g_timeout_add(1000 / GUI_METER_FPS, gui_update_meters,
+				      (gpointer) rcd);
+
 	/* Mark GUI as ready */
 	gui_state = GUI_READY;
 
@@ -367,10 +412,52 @@ gui_initialize(int argc, char *argv[], struct recorder *rcd)
 /**
  * Cleanup callback from recorder
  */
-gboolean gui_cleanup(gpointer data)
+static gboolean
+gui_cleanup_cb(gpointer data)
 {
-	struct recorder *rcd = (struct recorder *)data;
-	gtk_widget_destroy(rcd->window);
+	if (meters_source)
+		g_source_remove(meters_source);
+	meters_source = 0;
+	gtk_widget_destroy(gui.window);
 	gui_state = GUI_NOT_INITIALIZED;
 	gtk_main_quit();
+
+	/* Always return false or it'll loop */
+	return FALSE;
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/* GUI changes should be done on the main thread, so run these
+ * through g_main_context_invoke */
+
+void
+gui_update_timer_label(struct recorder *rcd)
+{
+	if (gui_state != GUI_READY)
+		return;
+	g_main_context_invoke(NULL, gui_timer_label_cb, (gpointer) rcd);
+	return;
+}
+
+void
+gui_update_button_state(struct recorder *rcd, int state)
+{
+	if (gui_state != GUI_READY)
+		return;
+	button_state = state;
+	g_main_context_invoke(NULL, gui_button_state_cb, (gpointer) rcd);
+	return;
+}
+
+void
+gui_cleanup(struct recorder *rcd)
+{
+	if (gui_state != GUI_READY)
+		return;
+	g_main_context_invoke(NULL, gui_cleanup_cb, (gpointer) rcd);
+	return;
 }
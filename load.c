@@ -0,0 +1,251 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Adaptive degradation under CPU pressure
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf / snprintf */
+
+/*
+ * Runs on the timer thread, once per second it checks how
+ * far behind the consumer is (how full the ring it reads from
+ * is, the spool if there is one, and if the process callback
+ * had to drop periods). Once it gets past high_pct we go one
+ * step down a ladder of cheaper settings, and once the consumer
+ * gets to the point where it takes effect we wait
+ * LOAD_SETTLE_SECS before going further. The steps first lower
+ * FLAC's compression level by LOAD_COMP_STEP (or Vorbis'
+ * quality by LOAD_QUALITY_STEP) down to 0, and then move the
+ * resampler to the next cheaper recipe, down to
+ * SRC_SINC_FASTEST. Once the ring stays below low_pct for
+ * hold_secs we go back up a step, if that gets us in trouble
+ * again we wait twice as long the next time.
+ *
+ * Encoder settings take effect on a new file, opened by the
+ * timer thread as a spare, that we rotate to. The resampler
+ * gets swapped by the consumer, after flushing the old one
+ * to the file. Either way no audio gets lost and each change
+ * is put on the markers file (see recorder_mark()) at the
+ * point it takes effect.
+ */
+
+/*********\
+* HELPERS *
+\*********/
+
+/**
+ * Steps of the ladder that lower the encoder settings
+ */
+static int
+load_encoder_steps(int format, double quality, double comp_level)
+{
+	double value = (format == RECORDER_FORMAT_OGG_VORBIS) ?
+		       quality / LOAD_QUALITY_STEP : comp_level / LOAD_COMP_STEP;
+	int steps = (int)value;
+
+	/* Round up, a partial step takes us to 0 */
+	if (value - steps > 1e-6)
+		steps++;
+	return steps;
+}
+
+/**
+ * Steps of the ladder that lower the resampler, there
+ * are none if we don't resample
+ */
+static int
+load_resampler_steps(struct recorder *rcd)
+{
+	if (rcd->resampler_ratio == 1.0 ||
+	    rcd->resampler_type >= SRC_SINC_FASTEST)
+		return 0;
+	return SRC_SINC_FASTEST - rcd->resampler_type;
+}
+
+static const char *
+load_resampler_name(int type)
+{
+	switch (type) {
+	case SRC_SINC_BEST_QUALITY:
+		return "best";
+	case SRC_SINC_MEDIUM_QUALITY:
+		return "medium";
+	case SRC_SINC_FASTEST:
+		return "fastest";
+	default:
+		return "other";
+	}
+}
+
+/**
+ * Moves to the given step and records it
+ */
+static void
+load_set_step(struct load_monitor *lm, struct recorder *rcd, int step,
+	      uint32_t fill_pct)
+{
+	char label[128] = { 0 };
+	int enc_steps = load_encoder_steps(rcd->format, rcd->quality,
+					   rcd->comp_level);
+	int old_enc = lm->step < enc_steps ? lm->step : enc_steps;
+	int new_enc = step < enc_steps ? step : enc_steps;
+	int resampler_type = rcd->resampler_type;
+	double quality = rcd->quality;
+	double comp_level = rcd->comp_level;
+
+	if (step - enc_steps > load_resampler_steps(rcd))
+		resampler_type += load_resampler_steps(rcd);
+	else if (step > enc_steps)
+		resampler_type += step - enc_steps;
+
+	lm->stepped_up = step < lm->step;
+	lm->secs_since_change = 0;
+	lm->secs_clear = 0;
+	__atomic_store_n(&lm->step, step, __ATOMIC_RELAXED);
+	__atomic_store_n(&lm->resampler_type, resampler_type,
+			 __ATOMIC_RELEASE);
+
+	load_adjust(lm, rcd->format, &quality, &comp_level);
+	if (rcd->format == RECORDER_FORMAT_OGG_VORBIS)
+		snprintf(label, sizeof(label), "load: step %i, quality %.2f, "
+			 "resampler %s, ring %u%% full", step, quality,
+			 load_resampler_name(resampler_type), fill_pct);
+	else
+		snprintf(label, sizeof(label), "load: step %i, compression "
+			 "%.2f, resampler %s, ring %u%% full", step,
+			 comp_level, load_resampler_name(resampler_type),
+			 fill_pct);
+	fprintf(stderr, "%s\n", label);
+
+	/* New encoder settings need a new file, get a
+	 * spare with them ready before switching */
+	if (new_enc != old_enc) {
+		recorder_renew_spare(rcd);
+		recorder_rotate(rcd);
+	}
+	if (!recorder_mark(rcd, label))
+		lm->mark = __atomic_load_n(&rcd->marks_queued,
+					   __ATOMIC_RELAXED);
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Lowers the encoder settings of a new file,
+ * depending on the step we are at
+ */
+void
+load_adjust(struct load_monitor *lm, int format, double *quality,
+	    double *comp_level)
+{
+	int step = __atomic_load_n(&lm->step, __ATOMIC_RELAXED);
+
+	if (!step)
+		return;
+
+	if (format == RECORDER_FORMAT_OGG_VORBIS) {
+		*quality -= step * LOAD_QUALITY_STEP;
+		if (*quality < 0.0)
+			*quality = 0.0;
+	} else {
+		*comp_level -= step * LOAD_COMP_STEP;
+		if (*comp_level < 0.0)
+			*comp_level = 0.0;
+	}
+}
+
+/**
+ * Called from the timer thread once per second
+ */
+void
+load_update(struct load_monitor *lm, struct recorder *rcd)
+{
+	jack_ringbuffer_t *ring = rcd->spool.ring ? rcd->spool.ring : rcd->ring;
+	uint64_t dropped = 0;
+	uint32_t fill_pct = 0;
+	int max_step = 0;
+
+	if (!lm->high_pct || !ring)
+		return;
+
+	fill_pct = (uint32_t) ((uint64_t) jack_ringbuffer_read_space(ring) *
+			       100 / ring->size);
+	dropped = __atomic_load_n(&rcd->stats.dropped_periods,
+				  __ATOMIC_RELAXED);
+	if (lm->secs_since_change < UINT32_MAX)
+		lm->secs_since_change++;
+
+	/* Count from when the consumer got to the last
+	 * change, it may be way behind */
+	if ((int32_t) (__atomic_load_n(&rcd->marks_done, __ATOMIC_RELAXED) -
+		       lm->mark) < 0)
+		lm->secs_since_change = 0;
+
+	if (fill_pct >= lm->high_pct || dropped != lm->prev_dropped) {
+		lm->prev_dropped = dropped;
+		lm->secs_clear = 0;
+
+		/* Give the last step time to kick in */
+		if (lm->secs_since_change < LOAD_SETTLE_SECS ||
+		    recorder_state != RECORDER_RUNNING)
+			return;
+
+		max_step = load_encoder_steps(rcd->format, rcd->quality,
+					      rcd->comp_level) +
+			   load_resampler_steps(rcd);
+		if (lm->step >= max_step)
+			return;
+
+		/* Stepped back up too soon */
+		if (lm->stepped_up && lm->secs_since_change < lm->cur_hold_secs) {
+			lm->cur_hold_secs *= 2;
+			if (lm->cur_hold_secs > LOAD_MAX_HOLD_SECS)
+				lm->cur_hold_secs = LOAD_MAX_HOLD_SECS;
+		}
+
+		load_set_step(lm, rcd, lm->step + 1, fill_pct);
+		return;
+	}
+
+	if (fill_pct > lm->low_pct || !lm->step) {
+		lm->secs_clear = 0;
+		return;
+	}
+
+	lm->secs_clear++;
+	if (lm->secs_clear < lm->cur_hold_secs ||
+	    recorder_state != RECORDER_RUNNING)
+		return;
+
+	load_set_step(lm, rcd, lm->step - 1, fill_pct);
+}
+
+void
+load_init(struct load_monitor *lm, struct recorder *rcd)
+{
+	lm->step = 0;
+	lm->resampler_type = rcd->resampler_type;
+	lm->stepped_up = 0;
+	lm->cur_hold_secs = lm->hold_secs;
+	lm->secs_clear = 0;
+	lm->secs_since_change = UINT32_MAX;
+	lm->prev_dropped = 0;
+	lm->mark = rcd->marks_done;
+}
@@ -0,0 +1,356 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. EBU R128 loudness meter
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf */
+#include <stdlib.h>		/* For malloc / free */
+#include <string.h>		/* For memset */
+#include <math.h>		/* For tan / pow / log10 */
+
+/*
+ * Loudness is measured as per ITU-R BS.1770 / EBU R128, on the
+ * resampled output (so what ends up on the file). The signal
+ * goes through the K-weighting filter (a high shelf followed
+ * by a high pass), we then keep the mean square of each 100ms
+ * sub-block, from which we get the momentary (400ms), short-term
+ * (3s) and gated integrated loudness. Both channels are filtered
+ * at once, one on each lane of a vector.
+ */
+
+typedef double v2df __attribute__ ((vector_size(16)));
+
+#define LOUDNESS_SUBBLOCK_MSECS	100
+#define LOUDNESS_MOMENTARY_SUBBLOCKS	4
+#define LOUDNESS_SHORT_TERM_SUBBLOCKS	30
+#define LOUDNESS_ABS_GATE	-70.0
+#define LOUDNESS_REL_GATE	-10.0
+/* Histogram of gating block loudness, from the absolute
+ * gate up to +5 LUFS in 0.1 LU steps */
+#define LOUDNESS_HIST_STEP	0.1
+#define LOUDNESS_HIST_BINS	750
+
+struct loudness_meter {
+	int num_channels;
+	/* K-weighting filter, two biquads in transposed
+	 * direct form II, one channel per lane */
+	v2df shelf_b[3];
+	v2df shelf_a[2];
+	v2df shelf_z[2];
+	v2df hpf_b[3];
+	v2df hpf_a[2];
+	v2df hpf_z[2];
+	/* Current sub-block */
+	v2df sumsq;
+	uint32_t subblock_frames;
+	uint32_t frames;
+	/* Energy of the last sub-blocks */
+	double energy[LOUDNESS_SHORT_TERM_SUBBLOCKS];
+	uint32_t energy_idx;
+	uint64_t subblocks;
+	/* Gated integration */
+	uint32_t hist_count[LOUDNESS_HIST_BINS];
+	double hist_energy[LOUDNESS_HIST_BINS];
+	/* Per-second loudness track */
+	FILE *track;
+	uint32_t secs;
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+static double
+loudness_from_energy(double energy)
+{
+	if (energy <= 0.0)
+		return -INFINITY;
+	return -0.691 + 10.0 * log10(energy);
+}
+
+/**
+ * Same as above but anything below the absolute gate
+ * counts as silence, used for the track
+ */
+static double
+loudness_track_value(double energy)
+{
+	double lufs = loudness_from_energy(energy);
+	return (lufs < LOUDNESS_ABS_GATE) ? -INFINITY : lufs;
+}
+
+static v2df
+loudness_v2df(double val)
+{
+	v2df ret = { val, val };
+	return ret;
+}
+
+/**
+ * Calculates the K-weighting filter coefficients for the
+ * given sample rate (BS.1770 gives them for 48KHz only)
+ */
+static void
+loudness_init_filter(struct loudness_meter *lm, uint32_t sample_rate)
+{
+	double f0 = 1681.974450955533;
+	double gain = 3.999843853973347;
+	double q = 0.7071752369554196;
+	double k = tan(M_PI * f0 / (double)sample_rate);
+	double vh = pow(10.0, gain / 20.0);
+	double vb = pow(vh, 0.4996667741545416);
+	double a0 = 1.0 + k / q + k * k;
+
+	/* Stage 1, high shelf */
+	lm->shelf_b[0] = loudness_v2df((vh + vb * k / q + k * k) / a0);
+	lm->shelf_b[1] = loudness_v2df(2.0 * (k * k - vh) / a0);
+	lm->shelf_b[2] = loudness_v2df((vh - vb * k / q + k * k) / a0);
+	lm->shelf_a[0] = loudness_v2df(2.0 * (k * k - 1.0) / a0);
+	lm->shelf_a[1] = loudness_v2df((1.0 - k / q + k * k) / a0);
+
+	/* Stage 2, high pass */
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan(M_PI * f0 / (double)sample_rate);
+	a0 = 1.0 + k / q + k * k;
+	lm->hpf_b[0] = loudness_v2df(1.0);
+	lm->hpf_b[1] = loudness_v2df(-2.0);
+	lm->hpf_b[2] = loudness_v2df(1.0);
+	lm->hpf_a[0] = loudness_v2df(2.0 * (k * k - 1.0) / a0);
+	lm->hpf_a[1] = loudness_v2df((1.0 - k / q + k * k) / a0);
+}
+
+/**
+ * Mean energy of the last num_subblocks sub-blocks
+ */
+static double
+loudness_window_energy(struct loudness_meter *lm, uint32_t num_subblocks)
+{
+	double energy = 0.0;
+	uint32_t idx = lm->energy_idx;
+	uint32_t i = 0;
+
+	if (num_subblocks > lm->subblocks)
+		num_subblocks = lm->subblocks;
+	if (!num_subblocks)
+		return 0.0;
+
+	for (i = 0; i < num_subblocks; i++) {
+		idx = (idx + LOUDNESS_SHORT_TERM_SUBBLOCKS - 1) %
+		      LOUDNESS_SHORT_TERM_SUBBLOCKS;
+		energy += lm->energy[idx];
+	}
+
+	return energy / num_subblocks;
+}
+
+/**
+ * Called at the end of each sub-block, updates the gating
+ * histogram and the per-second track
+ */
+static void
+loudness_end_subblock(struct loudness_meter *lm)
+{
+	double energy = 0.0;
+	double block_lufs = 0.0;
+	int bin = 0;
+	int i = 0;
+
+	/* Both channels have a weight of 1.0 */
+	for (i = 0; i < lm->num_channels; i++)
+		energy += lm->sumsq[i] / lm->frames;
+
+	/* Don't let the filter state decay into denormals
+	 * on digital silence */
+	for (i = 0; i < 2; i++) {
+		if (fabs(lm->shelf_z[i][0]) + fabs(lm->shelf_z[i][1]) < 1e-20)
+			lm->shelf_z[i] = loudness_v2df(0.0);
+		if (fabs(lm->hpf_z[i][0]) + fabs(lm->hpf_z[i][1]) < 1e-20)
+			lm->hpf_z[i] = loudness_v2df(0.0);
+	}
+
+	lm->energy[lm->energy_idx] = energy;
+	lm->energy_idx = (lm->energy_idx + 1) % LOUDNESS_SHORT_TERM_SUBBLOCKS;
+	lm->subblocks++;
+	lm->sumsq = loudness_v2df(0.0);
+	lm->frames = 0;
+
+	/* Gating blocks are 400ms long and overlap by 75%,
+	 * so we get a new one on each sub-block */
+	if (lm->subblocks >= LOUDNESS_MOMENTARY_SUBBLOCKS) {
+		energy = loudness_window_energy(lm,
+						LOUDNESS_MOMENTARY_SUBBLOCKS);
+		block_lufs = loudness_from_energy(energy);
+		if (block_lufs >= LOUDNESS_ABS_GATE) {
+			bin = (int)((block_lufs - LOUDNESS_ABS_GATE) /
+				    LOUDNESS_HIST_STEP);
+			if (bin >= LOUDNESS_HIST_BINS)
+				bin = LOUDNESS_HIST_BINS - 1;
+			lm->hist_count[bin]++;
+			lm->hist_energy[bin] += energy;
+		}
+	}
+
+	if (lm->subblocks % (1000 / LOUDNESS_SUBBLOCK_MSECS))
+		return;
+
+	lm->secs++;
+	if (!lm->track)
+		return;
+
+	fprintf(lm->track, "%u\t%.1f\t%.1f\n", lm->secs,
+		loudness_track_value(loudness_window_energy(lm,
+				LOUDNESS_MOMENTARY_SUBBLOCKS)),
+		loudness_track_value(loudness_window_energy(lm,
+				LOUDNESS_SHORT_TERM_SUBBLOCKS)));
+}
+
+/**
+ * Gated integrated loudness, from the histogram
+ */
+static double
+loudness_integrated(struct loudness_meter *lm)
+{
+	double energy = 0.0;
+	uint64_t count = 0;
+	double rel_gate = 0.0;
+	int start_bin = 0;
+	int i = 0;
+
+	/* Absolute gate is already applied */
+	for (i = 0; i < LOUDNESS_HIST_BINS; i++) {
+		energy += lm->hist_energy[i];
+		count += lm->hist_count[i];
+	}
+	if (!count)
+		return -INFINITY;
+
+	rel_gate = loudness_from_energy(energy / count) + LOUDNESS_REL_GATE;
+	if (rel_gate > LOUDNESS_ABS_GATE)
+		start_bin = (int)((rel_gate - LOUDNESS_ABS_GATE) /
+				  LOUDNESS_HIST_STEP);
+
+	energy = 0.0;
+	count = 0;
+	for (i = start_bin; i < LOUDNESS_HIST_BINS; i++) {
+		energy += lm->hist_energy[i];
+		count += lm->hist_count[i];
+	}
+	if (!count)
+		return -INFINITY;
+
+	return loudness_from_energy(energy / count);
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Runs the meter over a buffer of interleaved frames, called
+ * from the consumer thread
+ */
+void
+loudness_process(struct loudness_meter *lm, const float *buf,
+		 uint32_t nframes)
+{
+	v2df x = { 0 };
+	v2df y = { 0 };
+	uint32_t i = 0;
+
+	if (!lm)
+		return;
+
+	for (i = 0; i < nframes; i++) {
+		if (lm->num_channels == 2) {
+			x[0] = buf[2 * i];
+			x[1] = buf[2 * i + 1];
+		} else
+			x[0] = buf[i];
+
+		/* High shelf */
+		y = lm->shelf_b[0] * x + lm->shelf_z[0];
+		lm->shelf_z[0] = lm->shelf_b[1] * x - lm->shelf_a[0] * y +
+				 lm->shelf_z[1];
+		lm->shelf_z[1] = lm->shelf_b[2] * x - lm->shelf_a[1] * y;
+
+		/* High pass */
+		x = y;
+		y = lm->hpf_b[0] * x + lm->hpf_z[0];
+		lm->hpf_z[0] = lm->hpf_b[1] * x - lm->hpf_a[0] * y +
+			       lm->hpf_z[1];
+		lm->hpf_z[1] = lm->hpf_b[2] * x - lm->hpf_a[1] * y;
+
+		lm->sumsq += y * y;
+		if (++lm->frames == lm->subblock_frames)
+			loudness_end_subblock(lm);
+	}
+}
+
+/**
+ * Creates a new meter for a file, the per-second loudness
+ * track goes to track_path
+ */
+struct loudness_meter *
+loudness_new(uint32_t sample_rate, int num_channels, const char *track_path)
+{
+	struct loudness_meter *lm = NULL;
+
+	lm = malloc(sizeof(struct loudness_meter));
+	if (!lm)
+		return NULL;
+	memset(lm, 0, sizeof(struct loudness_meter));
+
+	lm->num_channels = num_channels;
+	lm->subblock_frames = sample_rate * LOUDNESS_SUBBLOCK_MSECS / 1000;
+	loudness_init_filter(lm, sample_rate);
+
+	lm->track = fopen(track_path, "w");
+	if (!lm->track) {
+		perror("cannot open loudness track");
+		free(lm);
+		return NULL;
+	}
+	fprintf(lm->track, "# EBU R128 loudness track\n"
+		"# secs\tmomentary_lufs\tshort_term_lufs\n");
+
+	return lm;
+}
+
+/**
+ * Appends the integrated loudness to the track, closes it
+ * and frees the meter. Returns the integrated loudness.
+ */
+double
+loudness_finish(struct loudness_meter *lm)
+{
+	double integrated = -INFINITY;
+
+	if (!lm)
+		return integrated;
+
+	integrated = loudness_integrated(lm);
+	if (lm->track) {
+		fprintf(lm->track, "# integrated_lufs\n%.1f\n", integrated);
+		fclose(lm->track);
+	}
+
+	free(lm);
+	return integrated;
+}
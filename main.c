@@ -18,13 +18,15 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "acoffin.h"
-#include <string.h>		/* For memset() */
+#include <string.h>		/* For memset() / strchr() */
 #include <limits.h>		/* For PATH_MAX */
 #include <stdio.h>		/* For printf/fprintf/perror */
 #include <stdlib.h>		/* For exit() */
 #include <errno.h>		/* For EINVAL */
 #include <sys/stat.h>		/* For stat() etc */
 #include <pwd.h>		/* For getpuid() etc */
+#include <signal.h>		/* For sigaction() */
+#include <unistd.h>		/* For getopt() / getuid() / sleep() */
 
 void
 usage(char *name)
@@ -33,15 +35,541 @@ usage(char *name)
 	printf("\nUsage: %s -h or [<parameter> <value>] pairs\n", name);
 	printf("\nParameters:\n"
 	       "\t-h\t\tShow this list\n"
+	       "\t-C   <string>\tLoad settings from this config file, the parameters that follow override it. On SIGHUP it gets reloaded and the [output] settings (except sample_rate) apply to the next file\n"
 	       "\t-p   <string>\tSet output directory for storing files (default: ~/Recordings and ~/AudioLogs)\n"
+	       "\t-a   <string>\tAdd an alternate output directory, used in the order given when writing to the ones before it fails, may be given up to 3 times\n"
+	       "\t-y   <int>\tSet storage policy for alternate directories, valid values are 1 for failover (default) and 2 for mirroring to the first two usable ones\n"
+	       "\t-b   <int>\tSet secs of audio to buffer in memory while the disk is slow or being switched, max is 600 (default: 4)\n"
 	       "\t-m   <int>\tSet operation mode, valid values are 1 for recorder (default) and 2 for logger'\n"
 	       "\t-t   <int>\tSet time interval in mins for log rotation (default is 1 hour, max is 24h), only valid for logger'\n"
+	       "\t-L   <regex>\tConnect AudioL to the first JACK output port matching <regex> (e.g. 'playout:out_1'), also when that port comes back later on (default: leave it unconnected)\n"
+	       "\t-R   <regex>\tSame as -L for AudioR, ignored when mono\n"
 	       "\t-s   <boolean>\tEnable / disable stereo operation, valid values are 0 and 1 (default)\n"
-	       "\t-g   <boolean>\tEnable / disable GUI, valid values are 0 and 1 (default)\n"
+	       "\t-g   <boolean>\tEnable / disable GUI, valid values are 0 and 1 (default, unless built with --disable-gui)\n"
 	       "\t-r   <int>\tSet output sample rate, default value is 48000\n"
 	       "\t-f   <int>\tSet output format, valid values are 1 for FLAC (default) and 2 for Ogg/Vorbis\n"
 	       "\t-q   <double>\tSet encoding quality for the vorbis/FLAC encoder, valid values are 0.0 - 1.0 (default: 0.5)\n"
-	       "\t-c   <double>\tSet compression level for the vorbis/FLAC encoder, valid values are 0.0 - 1.0 (default: 0.75)\n");
+	       "\t-c   <double>\tSet compression level for the vorbis/FLAC encoder, valid values are 0.0 - 1.0 (default: 0.75)\n"
+	       "\t-F   <opts>\tSet FLAC encoder options as comma separated <key>=<value> pairs:\n"
+	       "\t\t\t direct=<boolean>\tEncode through libFLAC instead of libsndfile, if built with it (default: 0)\n"
+	       "\t\t\t bits=<int>\tSample size, 16 - 24, only with direct (default: 24)\n"
+	       "\t\t\t dither=<boolean>\tApply TPDF dither when reducing samples to bits, recommended below 24, only with direct (default: 0)\n"
+	       "\t\t\t blocksize=<frames>\tOverride the block size picked by the compression level, only with direct (default: 0)\n"
+	       "\t\t\t apodization=<string>\tOverride the apodization functions picked by the compression level, as in flac -A, only with direct (default: none)\n"
+	       "\t\t\t threads=<int>\tEncode on this many threads in parallel, up to 64, only with direct (default: 0, encode on the consumer thread)\n"
+	       "\t-d   <opts>\tSet signal monitor options as comma separated <key>=<value> pairs:\n"
+	       "\t\t\t silence=<dBFS>\tRMS level below which input is considered silent (default: -60.0)\n"
+	       "\t\t\t silence_hold=<secs>\tSilence duration before reporting silence / dead channels (default: 30)\n"
+	       "\t\t\t clip=<dBFS>\tPeak level above which input is considered clipped (default: -0.1)\n"
+	       "\t\t\t clip_hold=<secs>\tTime without clipping before clearing a clipping event (default: 5)\n"
+	       "\t\t\t status=<path>\tFile to keep updated with the current recorder / signal status (default: none)\n"
+	       "\t-k   <opts>\tSet free space forecasting options as comma separated <key>=<value> pairs:\n"
+	       "\t\t\t check=<secs>\tHow often to check free space on the output directories, 0 to disable (default: 10)\n"
+	       "\t\t\t low=<mins>\tWarn when an output directory is forecast to fill up in less than this, 0 to disable (default: 120)\n"
+	       "\t\t\t critical=<mins>\tSwitch to Ogg/Vorbis at a lower quality below this, until there is room again, 0 to disable (default: 30)\n"
+	       "\t\t\t quality=<double>\tVorbis quality to use below critical (default: 0.1)\n"
+	       "\t\t\t purge=<boolean>\tRemove the oldest log on a directory below low, on every check (default: 0)\n"
+	       "\t-A   <opts>\tSet adaptive degradation options as comma separated <key>=<value> pairs, for when encoding can't keep up:\n"
+	       "\t\t\t high=<percent>\tStep down to a lower compression level / quality, then to a cheaper resampler, when the capture ring (or the spool, with -S) gets this full, 0 to disable (default: 50)\n"
+	       "\t\t\t low=<percent>\tStep back up once the ring stays below this (default: 10)\n"
+	       "\t\t\t hold=<secs>\tHow long the ring has to stay below low before stepping back up (default: 60)\n"
+	       "\t-S   <opts>\tSet disk-backed spool options as comma separated <key>=<value> pairs, for output storage stalls longer than -b covers:\n"
+	       "\t\t\t mins=<mins>\tSpool up to this many mins of captured audio to disk while the output can't keep up, 0 to disable (default: 0)\n"
+	       "\t\t\t path=<string>\tDirectory to keep the spool file on, it gets allocated in full on startup and should be on a local disk (default: /var/tmp)\n"
+	       "\t-T   <opts>\tPublish the captured audio on a POSIX shared memory segment for local readers (see tap.h), as comma separated <key>=<value> pairs:\n"
+	       "\t\t\t name=<string>\tName of the segment, e.g. /acoffin (default: none, disabled)\n"
+	       "\t\t\t secs=<int>\tSecs of audio it holds, up to 60 (default: 4)\n"
+	       "\t-l   <opts>\tSet memory locking options as comma separated <key>=<value> pairs, the audio buffers are always locked in memory:\n"
+	       "\t\t\t huge=<boolean>\tPut the audio buffers on huge pages if there are any reserved, else on transparent ones (default: 0)\n"
+	       "\t\t\t all=<boolean>\tLock all our memory, including what libsndfile / the encoders allocate, needs enough ulimit -l (default: 0)\n"
+	       "\t-j   <int>\tKeep timing stats of the JACK process callback and print them every <int> secs, 0 to only print them on SIGUSR1 (default: disabled)\n"
+	       "\t-e   <int>\tServe metrics in Prometheus' text format on http://localhost:<int>/metrics (default: disabled)\n"
+	       "\t-w   <int>\tStream the file being recorded, as it gets encoded, on http://localhost:<int>/stream (default: disabled)\n"
+	       "\t-u   <string>\tAccept start / stop / rotate / mark / status commands on a UNIX socket at <string>, stopping no longer exits (default: disabled)\n");
+}
+
+enum monitor_subopts {
+	MONITOR_OPT_SILENCE = 0,
+	MONITOR_OPT_SILENCE_HOLD,
+	MONITOR_OPT_CLIP,
+	MONITOR_OPT_CLIP_HOLD,
+	MONITOR_OPT_STATUS
+};
+
+static char *const monitor_tokens[] = {
+	[MONITOR_OPT_SILENCE] = "silence",
+	[MONITOR_OPT_SILENCE_HOLD] = "silence_hold",
+	[MONITOR_OPT_CLIP] = "clip",
+	[MONITOR_OPT_CLIP_HOLD] = "clip_hold",
+	[MONITOR_OPT_STATUS] = "status",
+	NULL
+};
+
+/**
+ * Parses the comma separated options of the signal monitor
+ */
+static int
+parse_monitor_opts(char *subopts, struct monitor *mon)
+{
+	char *token = NULL;
+	char *value = NULL;
+	double tmp = 0;
+	int secs = 0;
+	int opt = 0;
+
+	while (*subopts != '\0') {
+		token = subopts;
+		opt = getsubopt(&subopts, monitor_tokens, &value);
+		if (!value)
+			goto invalid;
+
+		switch (opt) {
+		case MONITOR_OPT_SILENCE:
+		case MONITOR_OPT_CLIP:
+			tmp = atof(value);
+			if (tmp > 0.0 || tmp < -120.0)
+				goto invalid;
+			if (opt == MONITOR_OPT_SILENCE)
+				mon->silence_db = tmp;
+			else
+				mon->clip_db = tmp;
+			break;
+		case MONITOR_OPT_SILENCE_HOLD:
+		case MONITOR_OPT_CLIP_HOLD:
+			secs = atoi(value);
+			if (secs <= 0 || secs > (24 * 60 * 60))
+				goto invalid;
+			if (opt == MONITOR_OPT_SILENCE_HOLD)
+				mon->silence_hold_secs = secs;
+			else
+				mon->clip_hold_secs = secs;
+			break;
+		case MONITOR_OPT_STATUS:
+			mon->status_path = value;
+			break;
+		default:
+			goto invalid;
+		}
+	}
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "Invalid signal monitor option: %s\n", token);
+	return -EINVAL;
+}
+
+enum space_subopts {
+	SPACE_OPT_CHECK = 0,
+	SPACE_OPT_LOW,
+	SPACE_OPT_CRITICAL,
+	SPACE_OPT_QUALITY,
+	SPACE_OPT_PURGE
+};
+
+static char *const space_tokens[] = {
+	[SPACE_OPT_CHECK] = "check",
+	[SPACE_OPT_LOW] = "low",
+	[SPACE_OPT_CRITICAL] = "critical",
+	[SPACE_OPT_QUALITY] = "quality",
+	[SPACE_OPT_PURGE] = "purge",
+	NULL
+};
+
+/**
+ * Parses the comma separated options of free space forecasting
+ */
+static int
+parse_space_opts(char *subopts, struct space_monitor *sm)
+{
+	char *token = NULL;
+	char *value = NULL;
+	double tmp = 0;
+	int num = 0;
+	int opt = 0;
+
+	while (*subopts != '\0') {
+		token = subopts;
+		opt = getsubopt(&subopts, space_tokens, &value);
+		if (!value)
+			goto invalid;
+
+		switch (opt) {
+		case SPACE_OPT_CHECK:
+			num = atoi(value);
+			if (num < 0 || num > (60 * 60))
+				goto invalid;
+			sm->check_secs = num;
+			break;
+		case SPACE_OPT_LOW:
+		case SPACE_OPT_CRITICAL:
+			num = atoi(value);
+			if (num < 0 || num > (7 * 24 * 60))
+				goto invalid;
+			if (opt == SPACE_OPT_LOW)
+				sm->low_mins = num;
+			else
+				sm->critical_mins = num;
+			break;
+		case SPACE_OPT_QUALITY:
+			tmp = atof(value);
+			if (tmp > 1.0 || tmp < 0.0)
+				goto invalid;
+			sm->degraded_quality = tmp;
+			break;
+		case SPACE_OPT_PURGE:
+			num = atoi(value);
+			if (num > 1 || num < 0)
+				goto invalid;
+			sm->purge = num;
+			break;
+		default:
+			goto invalid;
+		}
+	}
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "Invalid free space option: %s\n", token);
+	return -EINVAL;
+}
+
+enum memory_subopts {
+	MEMORY_OPT_HUGE = 0,
+	MEMORY_OPT_ALL
+};
+
+static char *const memory_tokens[] = {
+	[MEMORY_OPT_HUGE] = "huge",
+	[MEMORY_OPT_ALL] = "all",
+	NULL
+};
+
+/**
+ * Parses the comma separated memory locking options
+ */
+static int
+parse_memory_opts(char *subopts, struct recorder *rcd)
+{
+	char *token = NULL;
+	char *value = NULL;
+	int num = 0;
+	int opt = 0;
+
+	while (*subopts != '\0') {
+		token = subopts;
+		opt = getsubopt(&subopts, memory_tokens, &value);
+		if (!value)
+			goto invalid;
+
+		num = atoi(value);
+		if (num > 1 || num < 0)
+			goto invalid;
+
+		switch (opt) {
+		case MEMORY_OPT_HUGE:
+			rcd->arena.huge = num;
+			break;
+		case MEMORY_OPT_ALL:
+			rcd->lock_all = num;
+			break;
+		default:
+			goto invalid;
+		}
+	}
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "Invalid memory option: %s\n", token);
+	return -EINVAL;
+}
+
+enum load_subopts {
+	LOAD_OPT_HIGH = 0,
+	LOAD_OPT_LOW,
+	LOAD_OPT_HOLD
+};
+
+static char *const load_tokens[] = {
+	[LOAD_OPT_HIGH] = "high",
+	[LOAD_OPT_LOW] = "low",
+	[LOAD_OPT_HOLD] = "hold",
+	NULL
+};
+
+/**
+ * Parses the comma separated options of adaptive degradation
+ */
+static int
+parse_load_opts(char *subopts, struct load_monitor *lm)
+{
+	char *token = NULL;
+	char *value = NULL;
+	int num = 0;
+	int opt = 0;
+
+	while (*subopts != '\0') {
+		token = subopts;
+		opt = getsubopt(&subopts, load_tokens, &value);
+		if (!value)
+			goto invalid;
+
+		switch (opt) {
+		case LOAD_OPT_HIGH:
+		case LOAD_OPT_LOW:
+			num = atoi(value);
+			if (num < 0 || num > 100)
+				goto invalid;
+			if (opt == LOAD_OPT_HIGH)
+				lm->high_pct = num;
+			else
+				lm->low_pct = num;
+			break;
+		case LOAD_OPT_HOLD:
+			num = atoi(value);
+			if (num < 1 || num > LOAD_MAX_HOLD_SECS)
+				goto invalid;
+			lm->hold_secs = num;
+			break;
+		default:
+			goto invalid;
+		}
+	}
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "Invalid adaptive degradation option: %s\n", token);
+	return -EINVAL;
+}
+
+enum tap_subopts {
+	TAP_OPT_NAME = 0,
+	TAP_OPT_SECS
+};
+
+static char *const tap_tokens[] = {
+	[TAP_OPT_NAME] = "name",
+	[TAP_OPT_SECS] = "secs",
+	NULL
+};
+
+/**
+ * Parses the comma separated options of the shared memory tap
+ */
+static int
+parse_tap_opts(char *subopts, struct tap *tap)
+{
+	char *token = NULL;
+	char *value = NULL;
+	int num = 0;
+	int opt = 0;
+
+	while (*subopts != '\0') {
+		token = subopts;
+		opt = getsubopt(&subopts, tap_tokens, &value);
+		if (!value)
+			goto invalid;
+
+		switch (opt) {
+		case TAP_OPT_NAME:
+			tap->name = value;
+			break;
+		case TAP_OPT_SECS:
+			num = atoi(value);
+			if (num < 1 || num > TAP_MAX_SECS)
+				goto invalid;
+			tap->secs = num;
+			break;
+		default:
+			goto invalid;
+		}
+	}
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "Invalid tap option: %s\n", token);
+	return -EINVAL;
+}
+
+enum spool_subopts {
+	SPOOL_OPT_MINS = 0,
+	SPOOL_OPT_PATH
+};
+
+static char *const spool_tokens[] = {
+	[SPOOL_OPT_MINS] = "mins",
+	[SPOOL_OPT_PATH] = "path",
+	NULL
+};
+
+/**
+ * Parses the comma separated options of the disk-backed spool
+ */
+static int
+parse_spool_opts(char *subopts, struct spool *sp)
+{
+	char *token = NULL;
+	char *value = NULL;
+	int num = 0;
+	int opt = 0;
+
+	while (*subopts != '\0') {
+		token = subopts;
+		opt = getsubopt(&subopts, spool_tokens, &value);
+		if (!value)
+			goto invalid;
+
+		switch (opt) {
+		case SPOOL_OPT_MINS:
+			num = atoi(value);
+			if (num < 0 || num > SPOOL_MAX_MINS)
+				goto invalid;
+			sp->mins = num;
+			break;
+		case SPOOL_OPT_PATH:
+			if (!value[0])
+				goto invalid;
+			sp->path = value;
+			break;
+		default:
+			goto invalid;
+		}
+	}
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "Invalid spool option: %s\n", token);
+	return -EINVAL;
+}
+
+enum flac_subopts {
+	FLAC_OPT_DIRECT = 0,
+	FLAC_OPT_BITS,
+	FLAC_OPT_DITHER,
+	FLAC_OPT_BLOCKSIZE,
+	FLAC_OPT_APODIZATION,
+	FLAC_OPT_THREADS
+};
+
+static char *const flac_tokens[] = {
+	[FLAC_OPT_DIRECT] = "direct",
+	[FLAC_OPT_BITS] = "bits",
+	[FLAC_OPT_DITHER] = "dither",
+	[FLAC_OPT_BLOCKSIZE] = "blocksize",
+	[FLAC_OPT_APODIZATION] = "apodization",
+	[FLAC_OPT_THREADS] = "threads",
+	NULL
+};
+
+/**
+ * Parses the comma separated options of the FLAC encoder
+ */
+static int
+parse_flac_opts(char *subopts, struct flac_opts *flac)
+{
+	char *token = NULL;
+	char *value = NULL;
+	int num = 0;
+	int opt = 0;
+
+	while (*subopts != '\0') {
+		token = subopts;
+		opt = getsubopt(&subopts, flac_tokens, &value);
+		if (!value)
+			goto invalid;
+
+		switch (opt) {
+		case FLAC_OPT_DIRECT:
+		case FLAC_OPT_DITHER:
+			num = atoi(value);
+			if (num > 1 || num < 0)
+				goto invalid;
+			if (opt == FLAC_OPT_DIRECT)
+				flac->direct = num;
+			else
+				flac->dither = num;
+			break;
+		case FLAC_OPT_BITS:
+			num = atoi(value);
+			if (num > 24 || num < 16)
+				goto invalid;
+			flac->bits = num;
+			break;
+		case FLAC_OPT_BLOCKSIZE:
+			num = atoi(value);
+			if (num > 65535 || (num < 16 && num != 0))
+				goto invalid;
+			flac->blocksize = num;
+			break;
+		case FLAC_OPT_APODIZATION:
+			if (value[0] == '\0')
+				goto invalid;
+			flac->apodization = value;
+			break;
+		case FLAC_OPT_THREADS:
+			num = atoi(value);
+			if (num > FLAC_MAX_THREADS || num < 0)
+				goto invalid;
+			flac->threads = num;
+			break;
+		default:
+			goto invalid;
+		}
+	}
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "Invalid FLAC option: %s\n", token);
+	return -EINVAL;
+}
+
+/**
+ * Checks the settings that depend on each other, once both the
+ * config file and the command line got applied
+ */
+static int
+check_opts(struct recorder *rcd)
+{
+	if (rcd->load.high_pct && rcd->load.low_pct >= rcd->load.high_pct) {
+		fprintf(stderr, "Invalid adaptive degradation options: "
+			"low (%u%%) must be below high (%u%%)\n",
+			rcd->load.low_pct, rcd->load.high_pct);
+		return -EINVAL;
+	}
+
+	/* One component, as shm_open() wants it */
+	if (rcd->tap.name && (rcd->tap.name[0] != '/' || !rcd->tap.name[1] ||
+			      strchr(rcd->tap.name + 1, '/'))) {
+		fprintf(stderr, "Invalid tap name: %s\n", rcd->tap.name);
+		return -EINVAL;
+	}
+
+#ifndef ENABLE_GUI
+	if (!rcd->headless) {
+		fprintf(stderr, "Built without GUI support\n");
+		return -EINVAL;
+	}
+#endif
+
+	return 0;
+}
+
+static void
+sigusr1_handler(int sig)
+{
+	rtstats_dump_requested = 1;
+}
+
+static void
+sighup_handler(int sig)
+{
+	config_reload_requested = 1;
 }
 
 int
@@ -53,40 +581,91 @@ main(int argc, char *argv[])
 	struct recorder rcd = { 0 };
 	char filepath[PATH_MAX] = { 0 };
 	char *resolved_path = NULL;
+	int num_alt_resolved = 0;
+	int i = 0;
 	struct stat st = {0};
 	struct passwd *pw = NULL;
 	const char *homedir = NULL;
+	struct sigaction sa = { 0 };
 
 	/* Set default values */
-	rcd.storage_path = ".";
+	rcd.storage_path = NULL;
 	rcd.opmode = RECORDER_LIVE;
 	rcd.logrotate_interval_secs = 60 * 60;
 	rcd.stereo = 1;
+#ifdef ENABLE_GUI
 	rcd.headless = 0;
+#else
+	rcd.headless = 1;
+#endif
 	rcd.sample_rate = 48000;
 	rcd.format = RECORDER_FORMAT_FLAC;
 	rcd.quality = 0.5;
 	rcd.comp_level = 0.75;
+	rcd.flac.bits = 24;
+	rcd.resampler_type = SRC_SINC_FASTEST;
+	rcd.monitor.silence_db = -60.0;
+	rcd.monitor.silence_hold_secs = 30;
+	rcd.monitor.clip_db = -0.1;
+	rcd.monitor.clip_hold_secs = 5;
+	rcd.space.check_secs = 10;
+	rcd.space.low_mins = 120;
+	rcd.space.critical_mins = 30;
+	rcd.space.degraded_quality = 0.1;
+	rcd.load.high_pct = 50;
+	rcd.load.low_pct = 10;
+	rcd.load.hold_secs = 60;
 
 	/* Grab user arguments */
-	while ((opt = getopt(argc, argv, "p:m:t:s:g:r:f:q:c:")) != -1)
+	while ((opt = getopt(argc, argv, "C:p:a:y:b:m:t:L:R:s:g:r:f:q:c:F:d:k:A:S:T:l:j:e:w:u:")) != -1)
 		switch (opt) {
 		case 'h':
 			usage(argv[0]);
 			exit(0);
 			break;
+		case 'C':
+			ret = config_load(optarg, &rcd);
+			if (ret < 0) {
+				ret = -EINVAL;
+				goto cleanup;
+			}
+			break;
 		case 'p':
-			snprintf(filepath, PATH_MAX, "%s", optarg);
-			resolved_path = realpath(filepath, resolved_path);
-			if (!resolved_path) {
+			rcd.storage_path = optarg;
+			break;
+		case 'a':
+			if (rcd.num_alt_storage_paths >=
+			    STORAGE_MAX_TARGETS - 1) {
 				fprintf(stderr,
-					"Invalid or inaccessible path: %s\n",
+					"Too many alternate paths: %s\n",
 					optarg);
-				perror("realpath()");
-				ret = -errno;
+				ret = -EINVAL;
+				goto cleanup;
+			} else
+				rcd.alt_storage_paths
+				    [rcd.num_alt_storage_paths++] = optarg;
+			break;
+		case 'y':
+			ret = atoi(optarg);
+			if (ret > 2 || ret < 1) {
+				fprintf(stderr, "Invalid storage policy: %s\n",
+					optarg);
+				ret = -EINVAL;
+				goto cleanup;
+			} else
+				rcd.storage_policy =
+				    (ret ==
+				     1) ? STORAGE_FAILOVER : STORAGE_MIRROR;
+			break;
+		case 'b':
+			ret = atoi(optarg);
+			if (ret > 600 || ret < 1) {
+				fprintf(stderr, "Invalid buffer size: %s\n",
+					optarg);
+				ret = -EINVAL;
 				goto cleanup;
 			} else
-				rcd.storage_path = resolved_path;
+				rcd.buffer_secs = ret;
 			break;
 		case 'm':
 			ret = atoi(optarg);
@@ -110,6 +689,12 @@ main(int argc, char *argv[])
 			} else
 				rcd.logrotate_interval_secs = ret * 60;
 			break;
+		case 'L':
+			rcd.jack_sources[0] = optarg;
+			break;
+		case 'R':
+			rcd.jack_sources[1] = optarg;
+			break;
 		case 's':
 			ret = atoi(optarg);
 			if (ret > 1 || ret < 0) {
@@ -177,6 +762,76 @@ main(int argc, char *argv[])
 			} else
 				rcd.comp_level = tmp;
 			break;
+		case 'd':
+			ret = parse_monitor_opts(optarg, &rcd.monitor);
+			if (ret < 0)
+				goto cleanup;
+			break;
+		case 'k':
+			ret = parse_space_opts(optarg, &rcd.space);
+			if (ret < 0)
+				goto cleanup;
+			break;
+		case 'A':
+			ret = parse_load_opts(optarg, &rcd.load);
+			if (ret < 0)
+				goto cleanup;
+			break;
+		case 'T':
+			ret = parse_tap_opts(optarg, &rcd.tap);
+			if (ret < 0)
+				goto cleanup;
+			break;
+		case 'S':
+			ret = parse_spool_opts(optarg, &rcd.spool);
+			if (ret < 0)
+				goto cleanup;
+			break;
+		case 'F':
+			ret = parse_flac_opts(optarg, &rcd.flac);
+			if (ret < 0)
+				goto cleanup;
+			break;
+		case 'l':
+			ret = parse_memory_opts(optarg, &rcd);
+			if (ret < 0)
+				goto cleanup;
+			break;
+		case 'j':
+			ret = atoi(optarg);
+			if (ret < 0) {
+				fprintf(stderr, "Invalid stats interval: %s\n",
+					optarg);
+				ret = -EINVAL;
+				goto cleanup;
+			} else {
+				rcd.rtstats.enabled = 1;
+				rcd.rtstats.dump_interval_secs = ret;
+			}
+			break;
+		case 'e':
+			ret = atoi(optarg);
+			if (ret <= 0 || ret > 65535) {
+				fprintf(stderr, "Invalid metrics port: %s\n",
+					optarg);
+				ret = -EINVAL;
+				goto cleanup;
+			} else
+				rcd.metrics_port = ret;
+			break;
+		case 'w':
+			ret = atoi(optarg);
+			if (ret <= 0 || ret > 65535) {
+				fprintf(stderr, "Invalid stream port: %s\n",
+					optarg);
+				ret = -EINVAL;
+				goto cleanup;
+			} else
+				rcd.stream_port = ret;
+			break;
+		case 'u':
+			rcd.ctl_path = optarg;
+			break;
 		default:	/* '?' */
 			usage(argv[0]);
 			ret = -EINVAL;
@@ -189,6 +844,25 @@ main(int argc, char *argv[])
 		exit(-EINVAL);
 	}
 
+	ret = check_opts(&rcd);
+	if (ret < 0)
+		goto cleanup;
+
+	/* Output directory given through -p or the config file */
+	if (rcd.storage_path) {
+		snprintf(filepath, PATH_MAX, "%s", rcd.storage_path);
+		resolved_path = realpath(filepath, resolved_path);
+		if (!resolved_path) {
+			fprintf(stderr,
+				"Invalid or inaccessible path: %s\n",
+				filepath);
+			perror("realpath()");
+			ret = -errno;
+			goto cleanup;
+		} else
+			rcd.storage_path = resolved_path;
+	}
+
 	/* Create default output directory if it doesn't exist
 	 * and if output directory is not set.
 	 * Use ~/Recordings for recordings and ~/AudioLogs
@@ -233,6 +907,36 @@ main(int argc, char *argv[])
 			rcd.storage_path = resolved_path;
 	}
 
+	/* Alternate output directories, given through -a
+	 * or the config file */
+	for (i = 0; i < rcd.num_alt_storage_paths; i++) {
+		snprintf(filepath, PATH_MAX, "%s", rcd.alt_storage_paths[i]);
+		rcd.alt_storage_paths[i] = realpath(filepath, NULL);
+		if (!rcd.alt_storage_paths[i]) {
+			fprintf(stderr,
+				"Invalid or inaccessible path: %s\n",
+				filepath);
+			perror("realpath()");
+			ret = -errno;
+			goto cleanup;
+		}
+		num_alt_resolved++;
+	}
+
+	/* Dump timing stats on demand */
+	if (rcd.rtstats.enabled) {
+		sa.sa_handler = sigusr1_handler;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+
+	/* Reload the config file on demand */
+	if (rcd.config_path) {
+		sa.sa_handler = sighup_handler;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGHUP, &sa, NULL);
+	}
+
 	/* Initialize the recorder */
 	ret = recorder_initialize(&rcd);
 	if (ret < 0)
@@ -258,5 +962,8 @@ main(int argc, char *argv[])
 		recorder_cleanup(&rcd);
 	if(resolved_path)
 		free(resolved_path);
+	for (i = 0; i < num_alt_resolved; i++)
+		free(rcd.alt_storage_paths[i]);
+	config_cleanup();
 	return ret;
 }
@@ -0,0 +1,292 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Hash manifests
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf / snprintf / rename() */
+#include <string.h>		/* For strcmp / strrchr */
+#include <fcntl.h>		/* For open() */
+#include <unistd.h>		/* For close() / fsync() / unlink() */
+#include <dirent.h>		/* For opendir() / readdir() */
+#include <sys/stat.h>		/* For stat() */
+
+/*
+ * Writes a manifest (see manifest.h) next to each good copy of
+ * a file once it's closed, so that the archive (and its mirror)
+ * can be checked for changes
+ * (acoffin-verify) without hashing it all over again. The
+ * body of the file gets hashed on the thread that writes to
+ * it, as it's written (see storage_write()), the head gets
+ * read back on close, once the encoder is done rewriting it.
+ * Hashing is a couple of hundred MB/s against a few hundred
+ * KB/s of FLAC at most, it doesn't hold the consumer back.
+ *
+ * The chain hash of the last file closed is kept to link the
+ * next one to it, files are only closed by the timer thread
+ * (and on cleanup, once it's gone), so no need to lock. It
+ * gets picked up from the newest manifest on the storage
+ * targets on startup, so the chain also goes across restarts.
+ */
+
+static uint8_t manifest_chain[SHA256_LEN];
+static char manifest_prev[NAME_MAX + 1];
+
+/*********\
+* HELPERS *
+\*********/
+
+/**
+ * Reads the chain hash and the name of the
+ * file of the manifest on path
+ */
+static int
+manifest_load(const char *path, uint8_t chain[SHA256_LEN], char *name)
+{
+	char line[PATH_MAX + 16] = { 0 };
+	FILE *manifest = NULL;
+	size_t len = 0;
+	int got_chain = 0;
+
+	manifest = fopen(path, "r");
+	if (!manifest)
+		return -1;
+
+	name[0] = '\0';
+	while (fgets(line, sizeof(line), manifest)) {
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!strncmp(line, "chain=", 6))
+			got_chain = !sha256_from_hex(line + 6, chain);
+		else if (!strncmp(line, "file=", 5))
+			snprintf(name, NAME_MAX + 1, "%s", line + 5);
+	}
+	fclose(manifest);
+
+	return got_chain && name[0] ? 0 : -1;
+}
+
+/**
+ * Picks up the chain from the newest manifest on dir,
+ * if it's newer than *newest
+ */
+static void
+manifest_find_last(const char *dir, struct timespec *newest)
+{
+	char path[PATH_MAX] = { 0 };
+	char name[NAME_MAX + 1] = { 0 };
+	uint8_t chain[SHA256_LEN] = { 0 };
+	struct dirent *entry = NULL;
+	struct stat st = { 0 };
+	size_t ext_len = strlen(MANIFEST_EXT);
+	size_t len = 0;
+	DIR *dp = NULL;
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+
+	while ((entry = readdir(dp))) {
+		len = strlen(entry->d_name);
+		if (entry->d_name[0] == '.' || len <= ext_len ||
+		    strcmp(entry->d_name + len - ext_len, MANIFEST_EXT))
+			continue;
+
+		snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name);
+		if (stat(path, &st) < 0 ||
+		    (manifest_prev[0] &&
+		     (st.st_mtim.tv_sec < newest->tv_sec ||
+		      (st.st_mtim.tv_sec == newest->tv_sec &&
+		       st.st_mtim.tv_nsec < newest->tv_nsec))))
+			continue;
+
+		if (manifest_load(path, chain, name) < 0)
+			continue;
+		memcpy(manifest_chain, chain, SHA256_LEN);
+		memcpy(manifest_prev, name, sizeof(manifest_prev));
+		*newest = st.st_mtim;
+	}
+	closedir(dp);
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+void
+manifest_file_init(struct recorder_file *file)
+{
+	sha256_init(&file->manifest.body);
+	file->manifest.hashed = MANIFEST_HEAD_BYTES;
+	file->manifest.stale = 0;
+}
+
+/**
+ * Called with everything the encoder writes to file at
+ * file->offset, from the thread that writes to it
+ */
+void
+manifest_write(struct recorder_file *file, const void *ptr, size_t count)
+{
+	struct manifest_file *mf = &file->manifest;
+	const uint8_t *buf = (const uint8_t *)ptr;
+	sf_count_t start = file->offset;
+	sf_count_t end = file->offset + count;
+
+	/* The head gets read back on close */
+	if (mf->stale || end <= MANIFEST_HEAD_BYTES)
+		return;
+	if (start < MANIFEST_HEAD_BYTES) {
+		buf += MANIFEST_HEAD_BYTES - start;
+		start = MANIFEST_HEAD_BYTES;
+	}
+
+	/* Not where we are, the encoder went back to
+	 * rewrite part of the body */
+	if (start != mf->hashed) {
+		mf->stale = 1;
+		return;
+	}
+
+	sha256_update(&mf->body, buf, end - start);
+	mf->hashed = end;
+}
+
+/**
+ * Writes a manifest to path, through a temporary
+ * file so that it's either there or not
+ */
+static int
+manifest_store(const char *path, const char *name, sf_count_t length,
+	       const uint8_t segment[SHA256_LEN],
+	       const uint8_t chain[SHA256_LEN])
+{
+	char tmp_path[PATH_MAX] = { 0 };
+	char hex[SHA256_HEX_LEN + 1] = { 0 };
+	FILE *manifest = NULL;
+	int ret = 0;
+
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+	manifest = fopen(tmp_path, "w");
+	if (!manifest) {
+		perror("manifest: cannot create manifest");
+		return -1;
+	}
+
+	fprintf(manifest, "file=%s\n", name);
+	fprintf(manifest, "bytes=%llu\n", (unsigned long long)length);
+	sha256_to_hex(segment, hex);
+	fprintf(manifest, "sha256=%s\n", hex);
+	fprintf(manifest, "prev_file=%s\n", manifest_prev);
+	sha256_to_hex(manifest_chain, hex);
+	fprintf(manifest, "prev_chain=%s\n", hex);
+	sha256_to_hex(chain, hex);
+	fprintf(manifest, "chain=%s\n", hex);
+
+	/* It's evidence, make sure it's there */
+	ret = fflush(manifest);
+	if (ret == 0)
+		ret = fsync(fileno(manifest));
+	if (fclose(manifest) != 0 || ret != 0 ||
+	    rename(tmp_path, path) < 0) {
+		fprintf(stderr, "manifest: cannot write %s\n", path);
+		unlink(tmp_path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Writes the manifest of a file the encoder is done with next
+ * to each of its good copies (read back from the first one),
+ * and links the next one to it. Timer thread only.
+ */
+void
+manifest_file_close(struct recorder_file *file)
+{
+	struct manifest_file *mf = &file->manifest;
+	char path[PATH_MAX] = { 0 };
+	uint8_t segment[SHA256_LEN] = { 0 };
+	uint8_t chain[SHA256_LEN] = { 0 };
+	const char *copy = storage_good_copy(file);
+	const char *name = NULL;
+	int stored = 0;
+	int fd = -1;
+	int ret = 0;
+	int i = 0;
+
+	/* Nothing to vouch for */
+	if (!copy)
+		return;
+	name = strrchr(copy, '/') + 1;
+
+	if (file->length > MANIFEST_HEAD_BYTES &&
+	    mf->hashed != file->length)
+		mf->stale = 1;
+	if (mf->stale)
+		fprintf(stderr, "manifest: %s got rewritten, reading it "
+			"back\n", copy);
+
+	fd = open(copy, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror("manifest: cannot read back file");
+		return;
+	}
+	ret = sha256_segment(fd, file->length, mf->stale ? NULL : &mf->body,
+			     segment);
+	close(fd);
+	if (ret < 0) {
+		fprintf(stderr, "manifest: cannot read back %s\n", copy);
+		return;
+	}
+	sha256_chain(manifest_chain, segment, chain);
+
+	for (i = 0; i < file->num_sinks; i++) {
+		if (file->sinks[i].failed)
+			continue;
+		snprintf(path, PATH_MAX, "%s%s", file->sinks[i].path,
+			 MANIFEST_EXT);
+		if (manifest_store(path, name, file->length, segment,
+				   chain) == 0)
+			stored = 1;
+	}
+	if (!stored)
+		return;
+
+	memcpy(manifest_chain, chain, SHA256_LEN);
+	snprintf(manifest_prev, sizeof(manifest_prev), "%s", name);
+}
+
+/**
+ * Picks up the chain where the last run left it
+ */
+void
+manifest_init(struct recorder *rcd)
+{
+	struct timespec newest = { 0 };
+	int i = 0;
+
+	memset(manifest_chain, 0, SHA256_LEN);
+	manifest_prev[0] = '\0';
+
+	manifest_find_last(rcd->storage_path, &newest);
+	for (i = 0; i < rcd->num_alt_storage_paths; i++)
+		manifest_find_last(rcd->alt_storage_paths[i], &newest);
+}
@@ -0,0 +1,75 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Hash manifest format and SHA-256
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ACOFFIN_MANIFEST_H__
+#define __ACOFFIN_MANIFEST_H__
+
+#include <stdint.h>		/* For typed ints */
+#include <stddef.h>		/* For size_t */
+
+/*
+ * Each file the recorder closes gets a manifest sidecar
+ * (<file>.sha256), with key=value lines:
+ *
+ *	file=<name of the file>
+ *	bytes=<its length>
+ *	sha256=<segment hash>
+ *	prev_file=<name of the file closed before it, may be empty>
+ *	prev_chain=<chain hash of that one, zeroes for the first one>
+ *	chain=<SHA-256(prev_chain | sha256)>
+ *
+ * Hashes are in hex, | is concatenation of the binary hashes.
+ * Encoders rewrite the file's header once they are done with
+ * it, so the segment hash is not a plain SHA-256 of the file,
+ * it's SHA-256(SHA-256(head) | SHA-256(body)), the head being
+ * the first MANIFEST_HEAD_BYTES of the file (or all of it if
+ * it's shorter) and the body the rest. The body gets hashed as
+ * it's written and the head gets read back once it's final.
+ *
+ * Since every manifest carries the chain hash of the one before
+ * it, removing, reordering or replacing a file (and its
+ * manifest) breaks the chain at the file that follows.
+ */
+
+#define MANIFEST_EXT		".sha256"
+#define MANIFEST_HEAD_BYTES	(64 * 1024)
+
+#define SHA256_LEN		32
+#define SHA256_HEX_LEN		(2 * SHA256_LEN)
+
+struct sha256 {
+	uint32_t state[8];
+	uint64_t bytes;
+	uint8_t block[64];
+};
+
+/* Functions on sha256.c */
+void sha256_init(struct sha256 *ctx);
+void sha256_update(struct sha256 *ctx, const void *data, size_t len);
+void sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_LEN]);
+void sha256_to_hex(const uint8_t digest[SHA256_LEN],
+		   char hex[SHA256_HEX_LEN + 1]);
+int sha256_from_hex(const char *hex, uint8_t digest[SHA256_LEN]);
+int sha256_segment(int fd, uint64_t len, struct sha256 *body,
+		   uint8_t digest[SHA256_LEN]);
+void sha256_chain(const uint8_t prev_chain[SHA256_LEN],
+		  const uint8_t segment[SHA256_LEN],
+		  uint8_t chain[SHA256_LEN]);
+
+#endif /* __ACOFFIN_MANIFEST_H__ */
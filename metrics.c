@@ -0,0 +1,538 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Metrics endpoint
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE		/* For accept4() */
+#include "acoffin.h"
+#include <stdio.h>		/* For snprintf / perror */
+#include <stdarg.h>		/* For va_list */
+#include <stdlib.h>		/* For malloc / free */
+#include <string.h>		/* For memset / strstr */
+#include <math.h>		/* For log10f / isinf */
+#include <unistd.h>		/* For close() / read() */
+#include <sys/socket.h>		/* For socket() / accept4() / send() */
+#include <netinet/in.h>		/* For struct sockaddr_in */
+#include <arpa/inet.h>		/* For htons() / htonl() */
+#include <poll.h>		/* For POLLIN / POLLOUT */
+#include <errno.h>		/* For EAGAIN */
+
+/*
+ * A minimal HTTP server on localhost, serving the recorder's
+ * counters on /metrics in Prometheus' text format. It runs on
+ * the event loop thread and only reads the counters (relaxed
+ * atomics), so a slow or stuck scraper can't affect the
+ * recording. One request per connection.
+ */
+
+#define METRICS_MAX_CLIENTS	8
+#define METRICS_REQ_MAX		1024
+#define METRICS_RESP_MAX	(16 * 1024)
+
+struct metrics_client {
+	int fd;
+	char req[METRICS_REQ_MAX];
+	size_t req_len;
+	char *resp;
+	size_t resp_len;
+	size_t sent;
+};
+
+struct metrics_buf {
+	char *data;
+	size_t len;
+};
+
+static struct metrics_client metrics_clients[METRICS_MAX_CLIENTS];
+static struct recorder *metrics_rcd = NULL;
+static int metrics_fd = -1;
+
+static const char *channel_names[2][2] = {
+	{"mono", NULL},
+	{"left", "right"}
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+static void
+metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list args;
+	int ret = 0;
+
+	if (mb->len >= METRICS_RESP_MAX)
+		return;
+
+	va_start(args, fmt);
+	ret = vsnprintf(mb->data + mb->len, METRICS_RESP_MAX - mb->len, fmt,
+			args);
+	va_end(args);
+
+	if (ret > 0)
+		mb->len += ret;
+	if (mb->len > METRICS_RESP_MAX)
+		mb->len = METRICS_RESP_MAX;
+}
+
+static void
+metrics_header(struct metrics_buf *mb, const char *name, const char *type,
+	       const char *help)
+{
+	metrics_printf(mb, "# HELP acoffin_%s %s\n# TYPE acoffin_%s %s\n",
+		       name, help, name, type);
+}
+
+/**
+ * Prints a sample, labels are given as a complete
+ * {key="value"} string or NULL
+ */
+static void
+metrics_sample(struct metrics_buf *mb, const char *name, const char *labels,
+	       double value)
+{
+	metrics_printf(mb, "acoffin_%s%s ", name, labels ? labels : "");
+	if (isinf(value))
+		metrics_printf(mb, "%sInf\n", value < 0 ? "-" : "+");
+	else
+		metrics_printf(mb, "%.15g\n", value);
+}
+
+static double
+metrics_to_db(float amp)
+{
+	if (amp <= 0.0f)
+		return -INFINITY;
+	return 20.0 * log10f(amp);
+}
+
+/**
+ * Escapes a label value as per the text format
+ */
+static void
+metrics_escape(const char *in, char *out, size_t out_len)
+{
+	size_t len = 0;
+
+	for (; *in && len + 2 < out_len; in++) {
+		if (*in == '\\' || *in == '"' || *in == '\n') {
+			out[len++] = '\\';
+			out[len++] = (*in == '\n') ? 'n' : *in;
+		} else
+			out[len++] = *in;
+	}
+	out[len] = '\0';
+}
+
+static void
+metrics_fill(struct metrics_buf *mb, struct recorder *rcd)
+{
+	struct recorder_stats *stats = &rcd->stats;
+	struct monitor_status ms = { 0 };
+	const char **names = channel_names[rcd->stereo ? 1 : 0];
+	char path[PATH_MAX] = { 0 };
+	char escaped[2 * PATH_MAX] = { 0 };
+	char labels[2 * PATH_MAX + 16] = { 0 };
+	uint64_t bytes = 0;
+	double rtf = 0.0;
+	double fill = 0.0;
+	double rate = 0.0;
+	double secs = 0.0;
+	struct space_target *tgt = NULL;
+	int num_channels = rcd->stereo ? 2 : 1;
+	int i = 0;
+
+	recorder_get_file_info(rcd, path, &bytes);
+	monitor_get_status(&rcd->monitor, &ms);
+	__atomic_load(&stats->encoder_rtf, &rtf, __ATOMIC_RELAXED);
+	if (rcd->ring)
+		fill = (double)jack_ringbuffer_read_space(rcd->ring) /
+		       (double)rcd->ring->size;
+
+	metrics_header(mb, "recording", "gauge",
+		       "Whether a recording is in progress");
+	metrics_sample(mb, "recording", NULL,
+		       recorder_state == RECORDER_RUNNING ? 1 : 0);
+
+	metrics_header(mb, "jack_connected", "gauge",
+		       "Whether we are connected to the JACK server");
+	metrics_sample(mb, "jack_connected", NULL, rcd->offline ? 0 :
+		       !__atomic_load_n(&rcd->jack_lost, __ATOMIC_ACQUIRE));
+
+	metrics_header(mb, "frames_captured_total", "counter",
+		       "Frames captured from JACK");
+	metrics_sample(mb, "frames_captured_total", NULL,
+		       __atomic_load_n(&stats->frames_captured,
+				       __ATOMIC_RELAXED));
+
+	metrics_header(mb, "frames_written_total", "counter",
+		       "Frames written to output files, at the output sample rate");
+	metrics_sample(mb, "frames_written_total", NULL,
+		       __atomic_load_n(&stats->frames_written,
+				       __ATOMIC_RELAXED));
+
+	metrics_header(mb, "dropped_periods_total", "counter",
+		       "Periods dropped because the capture ring was full");
+	metrics_sample(mb, "dropped_periods_total", NULL,
+		       __atomic_load_n(&stats->dropped_periods,
+				       __ATOMIC_RELAXED));
+
+	metrics_header(mb, "ring_fill_ratio", "gauge",
+		       "How full the capture ring is");
+	metrics_sample(mb, "ring_fill_ratio", NULL, fill);
+
+	if (rcd->spool.ring) {
+		metrics_header(mb, "spool_fill_ratio", "gauge",
+			       "How full the disk-backed spool is");
+		metrics_sample(mb, "spool_fill_ratio", NULL,
+			       (double)jack_ringbuffer_read_space(rcd->spool.ring) /
+			       (double)rcd->spool.ring->size);
+	}
+
+	metrics_header(mb, "encoder_realtime_factor", "gauge",
+		       "Seconds of audio resampled / encoded / written per second of work, over the last second");
+	metrics_sample(mb, "encoder_realtime_factor", NULL, rtf);
+
+	metrics_header(mb, "bytes_written_total", "counter",
+		       "Bytes written to output files");
+	metrics_sample(mb, "bytes_written_total", NULL, bytes);
+
+	metrics_header(mb, "last_write_seconds", "gauge",
+		       "How long the last write to the output file took");
+	metrics_sample(mb, "last_write_seconds", NULL,
+		       __atomic_load_n(&stats->last_write_usecs,
+				       __ATOMIC_RELAXED) / 1e6);
+
+	metrics_header(mb, "rotations_total", "counter",
+		       "Log file rotations");
+	metrics_sample(mb, "rotations_total", NULL, rcd->rotations);
+
+	metrics_header(mb, "storage_target_up", "gauge",
+		       "Whether new files may go to a storage target, 0 is the output directory and the rest the alternate ones in order");
+	for (i = 0; i <= rcd->num_alt_storage_paths; i++) {
+		snprintf(labels, sizeof(labels), "{target=\"%i\"}", i);
+		metrics_sample(mb, "storage_target_up", labels,
+			       storage_target_up(i));
+	}
+
+	/* Forecasting may be disabled */
+	if (rcd->space.check_secs) {
+		metrics_header(mb, "storage_free_bytes", "gauge",
+			       "Free space on a storage target, as of the last check");
+		for (i = 0; i <= rcd->num_alt_storage_paths; i++) {
+			tgt = &rcd->space.targets[i];
+			snprintf(labels, sizeof(labels), "{target=\"%i\"}", i);
+			metrics_sample(mb, "storage_free_bytes", labels,
+				       __atomic_load_n(&tgt->avail_bytes,
+						       __ATOMIC_RELAXED));
+		}
+
+		metrics_header(mb, "storage_write_bytes_per_second", "gauge",
+			       "How fast we write to a storage target, averaged over the last few checks");
+		for (i = 0; i <= rcd->num_alt_storage_paths; i++) {
+			tgt = &rcd->space.targets[i];
+			snprintf(labels, sizeof(labels), "{target=\"%i\"}", i);
+			__atomic_load(&tgt->bytes_per_sec, &rate,
+				      __ATOMIC_RELAXED);
+			metrics_sample(mb, "storage_write_bytes_per_second",
+				       labels, rate);
+		}
+
+		metrics_header(mb, "storage_seconds_to_full", "gauge",
+			       "Forecast of when a storage target fills up at the current rate");
+		for (i = 0; i <= rcd->num_alt_storage_paths; i++) {
+			tgt = &rcd->space.targets[i];
+			snprintf(labels, sizeof(labels), "{target=\"%i\"}", i);
+			__atomic_load(&tgt->secs_to_full, &secs,
+				      __ATOMIC_RELAXED);
+			metrics_sample(mb, "storage_seconds_to_full", labels,
+				       secs);
+		}
+
+		metrics_header(mb, "storage_degraded", "gauge",
+			       "Whether we switched to a lower bitrate because storage is running out");
+		metrics_sample(mb, "storage_degraded", NULL,
+			       __atomic_load_n(&rcd->space.degraded,
+					       __ATOMIC_RELAXED));
+	}
+
+	if (rcd->load.high_pct) {
+		metrics_header(mb, "load_step", "gauge",
+			       "How many steps we went down to cheaper encoder / resampler settings because encoding couldn't keep up");
+		metrics_sample(mb, "load_step", NULL,
+			       __atomic_load_n(&rcd->load.step,
+					       __ATOMIC_RELAXED));
+	}
+
+	if (rcd->stream_port) {
+		metrics_header(mb, "stream_listeners", "gauge",
+			       "Listeners of the live stream");
+		metrics_sample(mb, "stream_listeners", NULL,
+			       stream_num_listeners());
+	}
+
+	metrics_header(mb, "seconds_recorded", "gauge",
+		       "Seconds recorded on the current file");
+	metrics_sample(mb, "seconds_recorded", NULL, rcd->secs_recorded);
+
+	if (path[0]) {
+		metrics_escape(path, escaped, sizeof(escaped));
+		snprintf(labels, sizeof(labels), "{path=\"%s\"}", escaped);
+		metrics_header(mb, "current_file_info", "gauge",
+			       "The file currently being written");
+		metrics_sample(mb, "current_file_info", labels, 1);
+	}
+
+	metrics_header(mb, "peak_dbfs", "gauge",
+		       "Peak level over the last second");
+	for (i = 0; i < num_channels; i++) {
+		snprintf(labels, sizeof(labels), "{channel=\"%s\"}",
+			 names[i]);
+		metrics_sample(mb, "peak_dbfs", labels,
+			       metrics_to_db(ms.last.peak[i]));
+	}
+
+	metrics_header(mb, "rms_dbfs", "gauge",
+		       "Highest RMS level of a monitor block over the last second");
+	for (i = 0; i < num_channels; i++) {
+		snprintf(labels, sizeof(labels), "{channel=\"%s\"}",
+			 names[i]);
+		metrics_sample(mb, "rms_dbfs", labels,
+			       metrics_to_db(ms.last.rms[i]));
+	}
+
+	metrics_header(mb, "dead_channel", "gauge",
+		       "Whether a channel is silent while the other one isn't");
+	for (i = 0; i < num_channels; i++) {
+		snprintf(labels, sizeof(labels), "{channel=\"%s\"}",
+			 names[i]);
+		metrics_sample(mb, "dead_channel", labels, ms.dead[i]);
+	}
+
+	metrics_header(mb, "silence", "gauge", "Whether input is silent");
+	metrics_sample(mb, "silence", NULL, ms.silence);
+
+	metrics_header(mb, "clipping", "gauge", "Whether input is clipping");
+	metrics_sample(mb, "clipping", NULL, ms.clipping);
+}
+
+/**
+ * Prepares the response to a complete request
+ */
+static int
+metrics_respond(struct metrics_client *client)
+{
+	struct metrics_buf body = { 0 };
+	char header[256] = { 0 };
+	const char *status = "200 OK";
+	int header_len = 0;
+
+	body.data = malloc(METRICS_RESP_MAX);
+	if (!body.data)
+		return RECORDER_NOMEM;
+
+	if (!strncmp(client->req, "GET /metrics ", 13))
+		metrics_fill(&body, metrics_rcd);
+	else {
+		status = "404 Not Found";
+		metrics_printf(&body, "Not found, try /metrics\n");
+	}
+
+	header_len = snprintf(header, sizeof(header),
+			      "HTTP/1.0 %s\r\n"
+			      "Content-Type: text/plain; version=0.0.4\r\n"
+			      "Content-Length: %zu\r\n"
+			      "Connection: close\r\n\r\n", status, body.len);
+
+	client->resp = malloc(header_len + body.len);
+	if (!client->resp) {
+		free(body.data);
+		return RECORDER_NOMEM;
+	}
+	memcpy(client->resp, header, header_len);
+	memcpy(client->resp + header_len, body.data, body.len);
+	client->resp_len = header_len + body.len;
+	client->sent = 0;
+	free(body.data);
+
+	return 0;
+}
+
+static void
+metrics_close_client(struct metrics_client *client)
+{
+	evloop_remove(client->fd);
+	close(client->fd);
+	free(client->resp);
+	memset(client, 0, sizeof(struct metrics_client));
+	client->fd = -1;
+}
+
+
+/****************\
+* EVENT HANDLERS *
+\****************/
+
+static void
+metrics_client_handler(int fd, short revents, void *data)
+{
+	struct metrics_client *client = (struct metrics_client *)data;
+	ssize_t ret = 0;
+
+	/* Still reading the request */
+	if (!client->resp && (revents & POLLIN)) {
+		ret = read(fd, client->req + client->req_len,
+			   METRICS_REQ_MAX - 1 - client->req_len);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (ret <= 0)
+			goto close;
+
+		client->req_len += ret;
+		client->req[client->req_len] = '\0';
+		if (!strstr(client->req, "\r\n\r\n")) {
+			/* Too large for us */
+			if (client->req_len >= METRICS_REQ_MAX - 1)
+				goto close;
+			return;
+		}
+
+		if (metrics_respond(client) < 0)
+			goto close;
+		evloop_set_events(fd, POLLOUT);
+		return;
+	}
+
+	if (client->resp && (revents & POLLOUT)) {
+		ret = send(fd, client->resp + client->sent,
+			   client->resp_len - client->sent, MSG_NOSIGNAL);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (ret < 0)
+			goto close;
+
+		client->sent += ret;
+		if (client->sent < client->resp_len)
+			return;
+		goto close;
+	}
+
+	if (!(revents & (POLLERR | POLLHUP | POLLNVAL)))
+		return;
+
+ close:
+	metrics_close_client(client);
+}
+
+static void
+metrics_accept_handler(int fd, short revents, void *data)
+{
+	struct metrics_client *client = NULL;
+	int client_fd = 0;
+	int i = 0;
+
+	client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd < 0)
+		return;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+		if (metrics_clients[i].fd < 0) {
+			client = &metrics_clients[i];
+			break;
+		}
+
+	/* Too many scrapers at once */
+	if (!client || evloop_add(client_fd, POLLIN, metrics_client_handler,
+				  client) < 0) {
+		close(client_fd);
+		return;
+	}
+	client->fd = client_fd;
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Starts listening on localhost:metrics_port, requests get
+ * served once the event loop is started
+ */
+int
+metrics_init(struct recorder *rcd)
+{
+	struct sockaddr_in addr = { 0 };
+	int one = 1;
+	int i = 0;
+
+	metrics_rcd = rcd;
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+		metrics_clients[i].fd = -1;
+
+	metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+			    SOCK_CLOEXEC, 0);
+	if (metrics_fd < 0) {
+		perror("metrics socket()");
+		return RECORDER_INVALID;
+	}
+	setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(rcd->metrics_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(metrics_fd, METRICS_MAX_CLIENTS) < 0) {
+		perror("cannot listen for metrics requests");
+		metrics_cleanup();
+		return RECORDER_INVALID;
+	}
+
+	if (evloop_add(metrics_fd, POLLIN, metrics_accept_handler,
+		       NULL) < 0) {
+		metrics_cleanup();
+		return RECORDER_INVALID;
+	}
+
+	return 0;
+}
+
+/**
+ * Closes the listening socket and any clients, the event
+ * loop should be stopped by now
+ */
+void
+metrics_cleanup(void)
+{
+	int i = 0;
+
+	/* Never initialized */
+	if (!metrics_rcd)
+		return;
+
+	for (i = 0; i < METRICS_MAX_CLIENTS; i++)
+		if (metrics_clients[i].fd >= 0)
+			metrics_close_client(&metrics_clients[i]);
+
+	if (metrics_fd >= 0) {
+		evloop_remove(metrics_fd);
+		close(metrics_fd);
+	}
+	metrics_fd = -1;
+	metrics_rcd = NULL;
+}
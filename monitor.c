@@ -0,0 +1,345 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Signal monitor
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf / rename */
+#include <stdarg.h>		/* For va_list */
+#include <string.h>		/* For memcpy / memset */
+#include <math.h>		/* For log10f / sqrt / powf */
+#include <limits.h>		/* For PATH_MAX */
+#include <unistd.h>		/* For unlink() */
+
+typedef float v4sf __attribute__ ((vector_size(16)));
+typedef int32_t v4si __attribute__ ((vector_size(16)));
+
+static const char *channel_names[2][2] = {
+	{"mono", NULL},
+	{"left", "right"}
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+static float
+monitor_to_db(float amp)
+{
+	if (amp <= 0.0f)
+		return -INFINITY;
+	return 20.0f * log10f(amp);
+}
+
+/**
+ * Prints a timestamped event on stderr
+ */
+static void
+monitor_event(const char *fmt, ...)
+{
+	va_list args;
+	time_t curr_time = 0;
+	char date_time[26] = { 0 };
+
+	time(&curr_time);
+	strftime(date_time, 26, "%F %T", localtime(&curr_time));
+
+	fprintf(stderr, "[%s] monitor: ", date_time);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fprintf(stderr, "\n");
+}
+
+
+/*****************\
+* PROCESS HELPERS *
+\*****************/
+
+/**
+ * Scans a buffer of samples four at a time, returning its
+ * absolute peak and the sum of its squares
+ */
+static void
+monitor_scan(const float *in, uint32_t nframes, float *peak, float *sumsq)
+{
+	const v4si absmask = { 0x7fffffff, 0x7fffffff,
+			       0x7fffffff, 0x7fffffff };
+	v4sf vpeak = { 0 };
+	v4sf vsum = { 0 };
+	v4sf v;
+	v4si mask;
+	float p = 0.0f;
+	float s = 0.0f;
+	float a = 0.0f;
+	uint32_t i = 0;
+
+	for (i = 0; i + 4 <= nframes; i += 4) {
+		memcpy(&v, in + i, sizeof(v4sf));
+		vsum += v * v;
+		v = (v4sf) ((v4si) v & absmask);
+		mask = v > vpeak;
+		vpeak = (v4sf) (((v4si) v & mask) | ((v4si) vpeak & ~mask));
+	}
+
+	s = vsum[0] + vsum[1] + vsum[2] + vsum[3];
+	for (p = vpeak[0], i = 1; i < 4; i++)
+		p = (vpeak[i] > p) ? vpeak[i] : p;
+
+	/* Leftovers */
+	for (i = nframes & ~3U; i < nframes; i++) {
+		a = fabsf(in[i]);
+		s += in[i] * in[i];
+		p = (a > p) ? a : p;
+	}
+
+	*peak = p;
+	*sumsq = s;
+}
+
+/**
+ * Called from the process callback, updates the running
+ * per-channel levels and passes a summary of each
+ * MONITOR_BLOCK_MSECS block to the timer thread. The
+ * peaks of this period are returned on peaks.
+ */
+void
+monitor_process(struct monitor *mon, jack_default_audio_sample_t **in,
+		int num_channels, jack_nframes_t nframes, float *peaks)
+{
+	struct monitor_block block = { 0 };
+	float sumsq = 0.0f;
+	int i = 0;
+
+	for (i = 0; i < num_channels; i++) {
+		monitor_scan(in[i], nframes, &peaks[i], &sumsq);
+		mon->win_sumsq[i] += sumsq;
+		if (peaks[i] > mon->win_peak[i])
+			mon->win_peak[i] = peaks[i];
+	}
+
+	mon->win_frames += nframes;
+	if (mon->win_frames < mon->block_frames)
+		return;
+
+	for (i = 0; i < num_channels; i++) {
+		block.peak[i] = mon->win_peak[i];
+		block.rms[i] = sqrt(mon->win_sumsq[i] / mon->win_frames);
+		mon->win_peak[i] = 0.0f;
+		mon->win_sumsq[i] = 0.0;
+	}
+	mon->win_frames = 0;
+
+	/* If the timer thread fell behind, just drop
+	 * the block */
+	if (jack_ringbuffer_write_space(mon->blocks) >= sizeof(block))
+		jack_ringbuffer_write(mon->blocks, (const char *)&block,
+				      sizeof(block));
+}
+
+
+/***************\
+* TIMER HELPERS *
+\***************/
+
+/**
+ * Runs the detectors over one block
+ */
+static void
+monitor_check_block(struct monitor *mon, struct monitor_block *block)
+{
+	const char **names = channel_names[mon->num_channels - 1];
+	uint32_t hold_msecs = mon->silence_hold_secs * 1000;
+	float silence_lvl = powf(10.0f, mon->silence_db / 20.0f);
+	float clip_lvl = powf(10.0f, mon->clip_db / 20.0f);
+	int all_silent = 1;
+	int clipped = 0;
+	int other = 0;
+	int i = 0;
+
+	for (i = 0; i < mon->num_channels; i++) {
+		if (block->rms[i] < silence_lvl)
+			mon->silent_msecs[i] += MONITOR_BLOCK_MSECS;
+		else
+			mon->silent_msecs[i] = 0;
+
+		if (mon->silent_msecs[i] < hold_msecs)
+			all_silent = 0;
+
+		if (block->peak[i] >= clip_lvl)
+			clipped = 1;
+	}
+
+	/* Silence on all channels */
+	if (all_silent && !mon->silence) {
+		mon->silence = 1;
+		monitor_event("silence detected, no signal above %.1f dBFS "
+			      "for %u secs", mon->silence_db,
+			      mon->silence_hold_secs);
+	} else if (mon->silence && !all_silent) {
+		mon->silence = 0;
+		monitor_event("signal restored");
+	}
+
+	/* One channel dead while the other one carries signal */
+	for (i = 0; mon->num_channels == 2 && i < 2; i++) {
+		other = !i;
+		if (!mon->dead[i] && mon->silent_msecs[i] >= hold_msecs &&
+		    !mon->silent_msecs[other]) {
+			mon->dead[i] = 1;
+			monitor_event("%s channel dead for %u secs", names[i],
+				      mon->silence_hold_secs);
+		} else if (mon->dead[i] && !mon->silent_msecs[i]) {
+			mon->dead[i] = 0;
+			monitor_event("%s channel restored", names[i]);
+		}
+	}
+
+	/* Clipping, stays active until there is no clipping for
+	 * clip_hold_secs */
+	if (clipped) {
+		mon->clip_quiet_msecs = 0;
+		if (!mon->clipping) {
+			mon->clipping = 1;
+			monitor_event("clipping detected, peak above %.1f dBFS",
+				      mon->clip_db);
+		}
+	} else if (mon->clipping) {
+		mon->clip_quiet_msecs += MONITOR_BLOCK_MSECS;
+		if (mon->clip_quiet_msecs >= mon->clip_hold_secs * 1000) {
+			mon->clipping = 0;
+			monitor_event("clipping cleared");
+		}
+	}
+}
+
+/**
+ * Atomically replaces the status file with the current
+ * monitor / recorder status
+ */
+static void
+monitor_write_status(struct monitor *mon, struct recorder *rcd,
+		     struct monitor_status *ms)
+{
+	const char **names = channel_names[mon->num_channels - 1];
+	char tmp_path[PATH_MAX] = { 0 };
+	FILE *status = NULL;
+	int i = 0;
+
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", mon->status_path);
+	status = fopen(tmp_path, "w");
+	if (!status)
+		return;
+
+	fprintf(status, "recording=%i\n",
+		recorder_state == RECORDER_RUNNING ? 1 : 0);
+	fprintf(status, "secs_recorded=%u\n", rcd->secs_recorded);
+	fprintf(status, "rotations=%u\n", rcd->rotations);
+	for (i = 0; i < mon->num_channels; i++) {
+		fprintf(status, "peak_db_%s=%.1f\n", names[i],
+			monitor_to_db(ms->last.peak[i]));
+		fprintf(status, "rms_db_%s=%.1f\n", names[i],
+			monitor_to_db(ms->last.rms[i]));
+		fprintf(status, "dead_%s=%i\n", names[i], ms->dead[i]);
+	}
+	fprintf(status, "silence=%i\n", ms->silence);
+	fprintf(status, "clipping=%i\n", ms->clipping);
+
+	if (fclose(status) != 0 || rename(tmp_path, mon->status_path) < 0)
+		unlink(tmp_path);
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Called from the timer thread once per second, runs the
+ * detectors over the blocks received since last time and
+ * updates the status file. The metrics get a copy of what
+ * was found, they never see it half way through.
+ */
+void
+monitor_update(struct monitor *mon, struct recorder *rcd)
+{
+	struct monitor_block block = { 0 };
+	struct monitor_status ms = { 0 };
+	int i = 0;
+
+	if (!mon->blocks)
+		return;
+
+	while (jack_ringbuffer_read_space(mon->blocks) >= sizeof(block)) {
+		jack_ringbuffer_read(mon->blocks, (char *)&block,
+				     sizeof(block));
+		monitor_check_block(mon, &block);
+		for (i = 0; i < mon->num_channels; i++) {
+			if (block.peak[i] > ms.last.peak[i])
+				ms.last.peak[i] = block.peak[i];
+			if (block.rms[i] > ms.last.rms[i])
+				ms.last.rms[i] = block.rms[i];
+		}
+	}
+	ms.silence = mon->silence;
+	memcpy(ms.dead, mon->dead, sizeof(ms.dead));
+	ms.clipping = mon->clipping;
+
+	pthread_mutex_lock(&mon->status_lock);
+	mon->status = ms;
+	pthread_mutex_unlock(&mon->status_lock);
+
+	if (mon->status_path)
+		monitor_write_status(mon, rcd, &ms);
+}
+
+void
+monitor_get_status(struct monitor *mon, struct monitor_status *status)
+{
+	pthread_mutex_lock(&mon->status_lock);
+	*status = mon->status;
+	pthread_mutex_unlock(&mon->status_lock);
+}
+
+int
+monitor_init(struct monitor *mon, int num_channels, uint32_t sample_rate)
+{
+	mon->num_channels = num_channels;
+	mon->block_frames = sample_rate * MONITOR_BLOCK_MSECS / 1000;
+	pthread_mutex_init(&mon->status_lock, NULL);
+
+	/* Room for a few seconds worth of blocks */
+	mon->blocks = jack_ringbuffer_create(sizeof(struct monitor_block) *
+					     (MONITOR_BACKLOG_SECS * 1000 /
+					      MONITOR_BLOCK_MSECS));
+	if (!mon->blocks)
+		return RECORDER_NOMEM;
+	jack_ringbuffer_mlock(mon->blocks);
+
+	return 0;
+}
+
+void
+monitor_cleanup(struct monitor *mon)
+{
+	if (!mon->blocks)
+		return;
+
+	jack_ringbuffer_free(mon->blocks);
+	mon->blocks = NULL;
+	pthread_mutex_destroy(&mon->status_lock);
+}
@@ -0,0 +1,408 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Waveform overview (peak file) generator
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For FILE / fwrite */
+#include <stdlib.h>		/* For malloc / free */
+#include <string.h>		/* For memset / memcpy */
+
+/*
+ * The peak file starts with a struct peaks_header, followed by
+ * the points of the finest level, which get appended as audio
+ * gets written. Coarser levels are kept in memory (each one is
+ * PEAKS_LEVEL_FACTOR times smaller than the previous one) and get
+ * appended when the file is closed, at which point the header is
+ * updated with their offsets / number of points. While recording,
+ * num_points of the first level is zero and readers should
+ * use the file's size instead.
+ *
+ * Coarser levels are kept in chunks, the consumer moves on to
+ * the level's spare chunk once one fills up and the timer thread
+ * puts a new spare there (peaks_reserve()), so that the consumer
+ * never allocates. A chunk holds minutes of audio on the second
+ * level, hours on the rest.
+ *
+ * Each point is a min/max pair of int16_t per channel, with
+ * the channels interleaved. Everything is in host byte order.
+ */
+
+typedef float v4sf __attribute__ ((vector_size(16)));
+typedef int32_t v4si __attribute__ ((vector_size(16)));
+
+#define PEAKS_CHUNK_POINTS	4096
+
+struct peaks_chunk {
+	struct peaks_chunk *next;
+	size_t max_points;
+	size_t num_points;
+	int16_t points[];
+};
+
+struct peaks_level {
+	float min[2];
+	float max[2];
+	uint32_t frames;
+	/* Points of coarser levels, kept until the end */
+	struct peaks_chunk *first;
+	struct peaks_chunk *last;
+	struct peaks_chunk *spare;
+	uint64_t dropped;
+};
+
+struct peaks_writer {
+	FILE *out;
+	struct peaks_header hdr;
+	int num_channels;
+	struct peaks_level levels[PEAKS_LEVELS];
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+static int16_t
+peaks_to_int16(float val)
+{
+	if (val >= 1.0f)
+		return 32767;
+	if (val <= -1.0f)
+		return -32767;
+	return (int16_t) (val * 32767.0f);
+}
+
+static void
+peaks_reset_level(struct peaks_writer *pw, int lvl)
+{
+	struct peaks_level *level = &pw->levels[lvl];
+	int i = 0;
+
+	for (i = 0; i < 2; i++) {
+		level->min[i] = 1.0f;
+		level->max[i] = -1.0f;
+	}
+	level->frames = 0;
+}
+
+static struct peaks_chunk *
+peaks_new_chunk(int num_channels, size_t max_points)
+{
+	struct peaks_chunk *chunk = NULL;
+
+	chunk = malloc(sizeof(struct peaks_chunk) +
+		       max_points * 2 * num_channels * sizeof(int16_t));
+	if (!chunk)
+		return NULL;
+	chunk->next = NULL;
+	chunk->max_points = max_points;
+	chunk->num_points = 0;
+
+	return chunk;
+}
+
+/**
+ * Appends a point to a coarser level, moving on to its
+ * spare chunk if needed
+ */
+static int
+peaks_store_point(struct peaks_level *level, const int16_t *point,
+		  size_t point_len)
+{
+	struct peaks_chunk *chunk = level->last;
+
+	if (!chunk || chunk->num_points == chunk->max_points) {
+		chunk = __atomic_exchange_n(&level->spare, NULL,
+					    __ATOMIC_ACQUIRE);
+		if (!chunk) {
+			level->dropped++;
+			return -1;
+		}
+		if (level->last)
+			level->last->next = chunk;
+		else
+			level->first = chunk;
+		level->last = chunk;
+	}
+
+	memcpy(chunk->points + chunk->num_points * point_len, point,
+	       point_len * sizeof(int16_t));
+	chunk->num_points++;
+
+	return 0;
+}
+
+/**
+ * Scans interleaved frames, two stereo (or four mono)
+ * frames at a time, merging their min/max values to
+ * the given ones
+ */
+static void
+peaks_scan(const float *buf, uint32_t nframes, int num_channels,
+	   float *min, float *max)
+{
+	uint32_t nsamples = nframes * num_channels;
+	v4sf vmin = { min[0], min[num_channels - 1],
+		      min[0], min[num_channels - 1] };
+	v4sf vmax = { max[0], max[num_channels - 1],
+		      max[0], max[num_channels - 1] };
+	v4sf v;
+	v4si mask;
+	uint32_t i = 0;
+	int c = 0;
+
+	for (i = 0; i + 4 <= nsamples; i += 4) {
+		memcpy(&v, buf + i, sizeof(v4sf));
+		mask = v < vmin;
+		vmin = (v4sf) (((v4si) v & mask) | ((v4si) vmin & ~mask));
+		mask = v > vmax;
+		vmax = (v4sf) (((v4si) v & mask) | ((v4si) vmax & ~mask));
+	}
+
+	/* Lane i holds samples of channel i % num_channels */
+	for (c = 0; c < 4; c++) {
+		if (vmin[c] < min[c % num_channels])
+			min[c % num_channels] = vmin[c];
+		if (vmax[c] > max[c % num_channels])
+			max[c % num_channels] = vmax[c];
+	}
+
+	/* Leftovers */
+	for (; i < nsamples; i++) {
+		c = i % num_channels;
+		if (buf[i] < min[c])
+			min[c] = buf[i];
+		if (buf[i] > max[c])
+			max[c] = buf[i];
+	}
+}
+
+static void
+peaks_free_levels(struct peaks_writer *pw)
+{
+	struct peaks_chunk *chunk = NULL;
+	struct peaks_chunk *next = NULL;
+	int i = 0;
+
+	for (i = 1; i < PEAKS_LEVELS; i++) {
+		for (chunk = pw->levels[i].first; chunk; chunk = next) {
+			next = chunk->next;
+			free(chunk);
+		}
+		free(pw->levels[i].spare);
+		pw->levels[i].first = NULL;
+		pw->levels[i].last = NULL;
+		pw->levels[i].spare = NULL;
+	}
+}
+
+/**
+ * Emits a point on the given level, merging it to the
+ * next one
+ */
+static void
+peaks_emit_point(struct peaks_writer *pw, int lvl)
+{
+	struct peaks_level *level = &pw->levels[lvl];
+	struct peaks_level *next = NULL;
+	int16_t point[4] = { 0 };
+	size_t point_len = 2 * pw->num_channels;
+	int i = 0;
+
+	for (i = 0; i < pw->num_channels; i++) {
+		point[2 * i] = peaks_to_int16(level->min[i]);
+		point[2 * i + 1] = peaks_to_int16(level->max[i]);
+	}
+
+	if (lvl == 0) {
+		fwrite(point, sizeof(int16_t), point_len, pw->out);
+		pw->hdr.levels[lvl].num_points++;
+	} else if (peaks_store_point(level, point, point_len) == 0)
+		pw->hdr.levels[lvl].num_points++;
+
+	if (lvl + 1 < PEAKS_LEVELS) {
+		next = &pw->levels[lvl + 1];
+		for (i = 0; i < pw->num_channels; i++) {
+			if (level->min[i] < next->min[i])
+				next->min[i] = level->min[i];
+			if (level->max[i] > next->max[i])
+				next->max[i] = level->max[i];
+		}
+		next->frames += level->frames;
+		if (next->frames >= pw->hdr.levels[lvl + 1].frames_per_point)
+			peaks_emit_point(pw, lvl + 1);
+	}
+
+	peaks_reset_level(pw, lvl);
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Runs over a buffer of interleaved frames, called from
+ * the consumer thread
+ */
+void
+peaks_process(struct peaks_writer *pw, const float *buf, uint32_t nframes)
+{
+	struct peaks_level *base = NULL;
+	uint32_t frames_per_point = 0;
+	uint32_t todo = 0;
+
+	if (!pw)
+		return;
+
+	base = &pw->levels[0];
+	frames_per_point = pw->hdr.levels[0].frames_per_point;
+	while (nframes) {
+		todo = frames_per_point - base->frames;
+		if (todo > nframes)
+			todo = nframes;
+
+		peaks_scan(buf, todo, pw->num_channels, base->min, base->max);
+		base->frames += todo;
+		buf += todo * pw->num_channels;
+		nframes -= todo;
+
+		if (base->frames == frames_per_point)
+			peaks_emit_point(pw, 0);
+	}
+}
+
+/**
+ * Makes sure every coarser level has a spare chunk to move
+ * on to, called from the timer thread while recording
+ */
+void
+peaks_reserve(struct peaks_writer *pw)
+{
+	struct peaks_chunk *chunk = NULL;
+	int i = 0;
+
+	if (!pw)
+		return;
+
+	/* Only the consumer takes it away */
+	for (i = 1; i < PEAKS_LEVELS; i++) {
+		if (__atomic_load_n(&pw->levels[i].spare, __ATOMIC_ACQUIRE))
+			continue;
+		chunk = peaks_new_chunk(pw->num_channels, PEAKS_CHUNK_POINTS);
+		if (chunk)
+			__atomic_store_n(&pw->levels[i].spare, chunk,
+					 __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Creates a new peak file at the given path, with room for
+ * expected_secs of audio on the coarser levels so that they
+ * don't need more chunks while recording (0 if unknown)
+ */
+struct peaks_writer *
+peaks_new(uint32_t sample_rate, int num_channels, const char *path,
+	  uint32_t expected_secs)
+{
+	struct peaks_writer *pw = NULL;
+	uint32_t frames_per_point = PEAKS_BASE_FRAMES;
+	size_t num_points = 0;
+	int i = 0;
+
+	pw = malloc(sizeof(struct peaks_writer));
+	if (!pw)
+		return NULL;
+	memset(pw, 0, sizeof(struct peaks_writer));
+
+	pw->num_channels = num_channels;
+	memcpy(pw->hdr.magic, PEAKS_MAGIC, sizeof(pw->hdr.magic));
+	pw->hdr.sample_rate = sample_rate;
+	pw->hdr.channels = num_channels;
+	pw->hdr.num_levels = PEAKS_LEVELS;
+	for (i = 0; i < PEAKS_LEVELS; i++) {
+		pw->hdr.levels[i].frames_per_point = frames_per_point;
+		frames_per_point *= PEAKS_LEVEL_FACTOR;
+		peaks_reset_level(pw, i);
+	}
+	pw->hdr.levels[0].offset = sizeof(struct peaks_header);
+
+	for (i = 1; i < PEAKS_LEVELS; i++) {
+		num_points = (uint64_t)expected_secs * sample_rate /
+			     pw->hdr.levels[i].frames_per_point + 2;
+		if (num_points < PEAKS_CHUNK_POINTS)
+			num_points = PEAKS_CHUNK_POINTS;
+		pw->levels[i].spare = peaks_new_chunk(num_channels,
+						      num_points);
+	}
+	peaks_reserve(pw);
+
+	pw->out = fopen(path, "w");
+	if (!pw->out) {
+		perror("cannot open peak file");
+		peaks_free_levels(pw);
+		free(pw);
+		return NULL;
+	}
+	fwrite(&pw->hdr, sizeof(struct peaks_header), 1, pw->out);
+
+	return pw;
+}
+
+/**
+ * Flushes any partial points, appends the coarser levels,
+ * updates the header and frees the writer
+ */
+void
+peaks_finish(struct peaks_writer *pw)
+{
+	struct peaks_chunk *chunk = NULL;
+	size_t point_len = 0;
+	uint64_t offset = 0;
+	int i = 0;
+
+	if (!pw)
+		return;
+
+	point_len = 2 * pw->num_channels * sizeof(int16_t);
+
+	/* Partial points at the end, flushing the first
+	 * level propagates to the rest */
+	for (i = 0; i < PEAKS_LEVELS; i++)
+		if (pw->levels[i].frames)
+			peaks_emit_point(pw, i);
+
+	offset = sizeof(struct peaks_header) +
+		 pw->hdr.levels[0].num_points * point_len;
+	for (i = 1; i < PEAKS_LEVELS; i++) {
+		pw->hdr.levels[i].offset = offset;
+		for (chunk = pw->levels[i].first; chunk; chunk = chunk->next)
+			fwrite(chunk->points, point_len, chunk->num_points,
+			       pw->out);
+		offset += pw->hdr.levels[i].num_points * point_len;
+		if (pw->levels[i].dropped)
+			fprintf(stderr, "peaks: dropped %llu points of level "
+				"%i\n", (unsigned long long)
+				pw->levels[i].dropped, i);
+	}
+	peaks_free_levels(pw);
+
+	fseek(pw->out, 0, SEEK_SET);
+	fwrite(&pw->hdr, sizeof(struct peaks_header), 1, pw->out);
+	fclose(pw->out);
+	free(pw);
+}
@@ -25,189 +25,664 @@
 #include <limits.h>		/* For PATH_MAX */
 #include <time.h>		/* For clock_* functions */
 #include <signal.h>		/* For pthread_kill and signals */
-#include <errno.h>		/* For EINTR */
+#include <errno.h>		/* For ETIMEDOUT */
+#include <unistd.h>		/* For getpid() / unlink() / read() */
+#include <fcntl.h>		/* For open() */
+#include <sys/stat.h>		/* For stat() */
 
 pthread_mutex_t consumer_process_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t consumer_process_trigger = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t consumer_done_trigger = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t files_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t markers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t timer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_trigger;
 volatile sig_atomic_t recorder_state = RECORDER_NOT_INITIALIZED;
 static volatile sig_atomic_t consumer_active = 0;
 static volatile sig_atomic_t timer_active = 0;
+static volatile sig_atomic_t spool_active = 0;
+static int timer_kicked = 0;
+static jack_native_thread_t consumer_tid = 0;
+static jack_native_thread_t spool_tid = 0;
+static jack_native_thread_t timer_tid = 0;
+static pthread_mutex_t jack_conns_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t jack_quiet = 0;
+
+/* Files that follow each output file around */
+static const char *sidecar_exts[] = { SIDECAR_EXTS, NULL };
+
+/* Run on the timer thread, see JACK CALLBACKS */
+static void recorder_jack_reconnect(struct recorder *rcd);
+static void recorder_jack_autoconnect(struct recorder *rcd);
 
 /*********\
 * HELPERS *
 \*********/
 
+static uint64_t
+recorder_get_usecs(void)
+{
+	struct timespec ts = { 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /**
- * Initializes and opens a new file for writing
+ * The ring the consumer reads from, the spool sits between
+ * it and the process callback when enabled
  */
-static SNDFILE *
-recorder_open_new_file(struct recorder *rcd)
+static jack_ringbuffer_t *
+recorder_consumer_ring(struct recorder *rcd)
+{
+	return rcd->spool.ring ? rcd->spool.ring : rcd->ring;
+}
+
+/**
+ * Checks if the consumer got through everything we captured,
+ * a block being moved to the spool only leaves the ring once
+ * it's there, so check the ring first
+ */
+static int
+recorder_backlog_empty(struct recorder *rcd)
+{
+	if (jack_ringbuffer_read_space(rcd->ring))
+		return 0;
+
+	return !rcd->spool.ring || !jack_ringbuffer_read_space(rcd->spool.ring);
+}
+
+/**
+ * Creates one of our threads, through JACK when we have a
+ * client (so that it gets the same RT priority as JACK's
+ * threads) or as a plain thread when running offline
+ */
+static int
+recorder_create_thread(struct recorder *rcd, jack_native_thread_t *tid,
+		       void *(*thread_fn) (void *))
+{
+	if (rcd->offline)
+		return pthread_create(tid, NULL, thread_fn, (void *)rcd);
+
+	return jack_client_create_thread(rcd->client, tid, rcd->rtprio, 1,
+					 thread_fn, (void *)rcd);
+}
+
+/**
+ * Fills in the final name of a file, based on its start time
+ * and the format it was opened with
+ */
+static void
+recorder_get_file_name(struct recorder *rcd, struct recorder_file *file,
+		       char *filename)
 {
-	int ret = 0;
-	time_t curr_time = 0;
 	struct tm *curr_time_info = { 0 };
 	char date_time[26] = { 0 };
-	char filepath[PATH_MAX] = { 0 };
-	SNDFILE *out = NULL;
 	char *opmode = (rcd->opmode == RECORDER_LOGGER) ? "Log" : "Live";
 	char *chan_mode = (rcd->stereo) ? "stereo" : "mono";
-	char *ext = (rcd->format == RECORDER_FORMAT_FLAC) ? "flac" : "ogg";
+	char *ext = (file->format == RECORDER_FORMAT_FLAC) ? "flac" : "ogg";
 
-	/* Create file name based on current date and time */
-	memset(filepath, 0, PATH_MAX * sizeof(char));
-	time(&curr_time);
-	curr_time_info = localtime(&curr_time);
+	/* Create file name based on the given date and time */
+	memset(filename, 0, PATH_MAX * sizeof(char));
+	curr_time_info = localtime(&file->started);
 	strftime(date_time, 26, "[%F]-[%T]", curr_time_info);
-	snprintf(filepath, PATH_MAX, "%s/%s-%s-(%s).%s", rcd->storage_path,
+	snprintf(filename, PATH_MAX, "%s-%s-(%s).%s",
 		 opmode, date_time, chan_mode, ext);
+}
 
-	/* Open file with libsndfile for writing */
-	out = sf_open(filepath, SFM_WRITE, &rcd->info);
-	if (!out) {
-		perror("cannot open file for writing");
-		ret = RECORDER_SNDFILE_ERR;
-		goto cleanup;
+/**
+ * Maps one of recorder_formats to libsndfile's format
+ */
+static int
+recorder_get_sf_format(int format)
+{
+	switch (format) {
+	case RECORDER_FORMAT_FLAC:
+		return SF_FORMAT_FLAC | SF_FORMAT_PCM_24;
+	case RECORDER_FORMAT_OGG_VORBIS:
+		return SF_FORMAT_OGG | SF_FORMAT_VORBIS;
+	default:
+		return 0;
 	}
+}
 
-	ret = sf_command(out, SFC_SET_VBR_ENCODING_QUALITY,
-			 &rcd->quality, sizeof(double));
-	if (ret != SF_TRUE) {
-		ret = RECORDER_SNDFILE_ERR;
-		goto cleanup;
+/**
+ * Renames (or removes if to is NULL) the sidecar files
+ * of an output file
+ */
+static void
+recorder_move_sidecars(const char *from, const char *to)
+{
+	char from_path[PATH_MAX] = { 0 };
+	char to_path[PATH_MAX] = { 0 };
+	int i = 0;
+
+	for (i = 0; sidecar_exts[i]; i++) {
+		snprintf(from_path, PATH_MAX, "%s%s", from, sidecar_exts[i]);
+		if (!to) {
+			unlink(from_path);
+			continue;
+		}
+		snprintf(to_path, PATH_MAX, "%s%s", to, sidecar_exts[i]);
+		rename(from_path, to_path);
 	}
+}
 
-	ret = sf_command(out, SFC_SET_COMPRESSION_LEVEL,
-			 &rcd->comp_level, sizeof(double));
-	if (ret != SF_TRUE) {
-		ret = RECORDER_SNDFILE_ERR;
+/**
+ * Copies the sidecar files of an output file next to
+ * another copy of it, leaving alone the ones that are
+ * there already
+ */
+static void
+recorder_copy_sidecars(const char *from, const char *to)
+{
+	char from_path[PATH_MAX] = { 0 };
+	char to_path[PATH_MAX] = { 0 };
+	char buf[16384] = { 0 };
+	ssize_t len = 0;
+	int in = -1;
+	int out = -1;
+	int i = 0;
+
+	for (i = 0; sidecar_exts[i]; i++) {
+		snprintf(from_path, PATH_MAX, "%s%s", from, sidecar_exts[i]);
+		snprintf(to_path, PATH_MAX, "%s%s", to, sidecar_exts[i]);
+		in = open(from_path, O_RDONLY | O_CLOEXEC);
+		if (in < 0)
+			continue;
+		out = open(to_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+			   0666);
+		if (out < 0) {
+			close(in);
+			continue;
+		}
+
+		while ((len = read(in, buf, sizeof(buf))) > 0)
+			if (write(out, buf, len) != len)
+				break;
+		if (len != 0) {
+			fprintf(stderr, "cannot copy %s\n", from_path);
+			unlink(to_path);
+		}
+		close(out);
+		close(in);
+	}
+}
+
+/**
+ * Opens file with libsndfile, for the formats
+ * (or the cases) libFLAC doesn't handle
+ */
+static int
+recorder_open_sndfile(struct recorder_file *file, SF_INFO *info,
+		      double quality, double comp_level)
+{
+	int ret = 0;
+
+	ret = storage_sf_open(file, info);
+	if (ret < 0)
+		return ret;
+
+	ret = sf_command(file->sf, SFC_SET_VBR_ENCODING_QUALITY,
+			 &quality, sizeof(double));
+	if (ret != SF_TRUE)
+		return RECORDER_SNDFILE_ERR;
+
+	ret = sf_command(file->sf, SFC_SET_COMPRESSION_LEVEL,
+			 &comp_level, sizeof(double));
+	if (ret != SF_TRUE)
+		return RECORDER_SNDFILE_ERR;
+
+	return 0;
+}
+
+/**
+ * Writes nframes of interleaved frames to the file's
+ * encoder, returns how many made it. Nothing makes it
+ * to a file that lost all its copies, whatever the
+ * encoder says.
+ */
+static int
+recorder_write_file(struct recorder_file *file, const float *buf,
+		    uint32_t nframes)
+{
+	int ret = 0;
+
+	if (file->flac)
+		ret = flac_write(file->flac, buf, nframes);
+	else
+		ret = sf_writef_float(file->sf, buf, nframes);
+
+	return file->lost ? 0 : ret;
+}
+
+/**
+ * Initializes and opens a new file for writing. Spare files
+ * get opened in advance under a hidden temporary name, and
+ * get their final name through recorder_name_file() once
+ * they are put to use.
+ */
+static struct recorder_file *
+recorder_open_new_file(struct recorder *rcd, int spare)
+{
+	int ret = 0;
+	static unsigned int spare_idx = 0;
+	struct recorder_file *file = NULL;
+	char sidecar_path[PATH_MAX] = { 0 };
+	char filename[PATH_MAX] = { 0 };
+	char *opmode = (rcd->opmode == RECORDER_LOGGER) ? "Log" : "Live";
+	char *ext = NULL;
+	SF_INFO info = { 0 };
+	double quality = 0.0;
+	double comp_level = 0.0;
+
+	file = malloc(sizeof(struct recorder_file));
+	if (!file)
+		return NULL;
+	memset(file, 0, sizeof(struct recorder_file));
+
+	/* Output settings may get swapped by a reload, work
+	 * on a consistent copy */
+	pthread_mutex_lock(&files_mutex);
+	snprintf(file->dir, PATH_MAX, "%s", rcd->storage_path);
+	file->format = rcd->format;
+	info = rcd->info;
+	quality = rcd->quality;
+	comp_level = rcd->comp_level;
+	pthread_mutex_unlock(&files_mutex);
+	file->sample_rate = info.samplerate;
+	file->channels = info.channels;
+	load_adjust(&rcd->load, file->format, &quality, &comp_level);
+	ext = (file->format == RECORDER_FORMAT_FLAC) ? "flac" : "ogg";
+
+	time(&file->started);
+	if (spare) {
+		snprintf(filename, PATH_MAX, ".%s-spare-%i-%u.%s",
+			 opmode, getpid(), spare_idx++, ext);
+		file->unnamed = 1;
+	} else
+		recorder_get_file_name(rcd, file, filename);
+
+	/* Create it on the storage target(s) and open an
+	 * encoder on top of it */
+	ret = storage_open(rcd, file, filename);
+	if (ret < 0)
 		goto cleanup;
+	stream_file_init(file);
+	manifest_file_init(file);
+
+	if (file->format == RECORDER_FORMAT_FLAC && rcd->flac.direct) {
+		file->flac = flac_open(file, &rcd->flac, &info, comp_level);
+		if (!file->flac) {
+			ret = RECORDER_SNDFILE_ERR;
+			goto cleanup;
+		}
+	} else {
+		ret = recorder_open_sndfile(file, &info, quality, comp_level);
+		if (ret < 0)
+			goto cleanup;
 	}
 
+	/* Loudness track and peak file, not having them is not
+	 * a reason to lose audio so keep going without them */
+	snprintf(sidecar_path, PATH_MAX, "%s%s", file->path, LOUDNESS_EXT);
+	file->loudness = loudness_new(rcd->sample_rate, rcd->info.channels,
+				      sidecar_path);
+	snprintf(sidecar_path, PATH_MAX, "%s%s", file->path, PEAKS_EXT);
+	file->peaks = peaks_new(rcd->sample_rate, rcd->info.channels,
+				sidecar_path,
+				rcd->opmode == RECORDER_LOGGER ?
+				rcd->logrotate_interval_secs : 0);
+
  cleanup:
 	if (ret < 0) {
-		sf_close(out);
-		out = NULL;
+		flac_close(file->flac);
+		storage_close(file, 1);
+		stream_file_cleanup(file);
+		free(file);
+		file = NULL;
 	}
-	return out;
+	return file;
 }
 
 /**
- * Closes the current active file pointed by rcd->out
+ * Renames a pre-opened file after its start time
  */
 static void
-recorder_close_file(struct recorder *rcd)
+recorder_name_file(struct recorder *rcd, struct recorder_file *file)
 {
-	if (rcd->out) {
-		sf_close(rcd->out);
-		rcd->out = NULL;
-	}
-	return;
+	char filename[PATH_MAX] = { 0 };
+	char oldpath[PATH_MAX] = { 0 };
+
+	if (!file->unnamed)
+		return;
+
+	recorder_get_file_name(rcd, file, filename);
+	memcpy(oldpath, file->path, PATH_MAX);
+	if (storage_rename(file, filename) < 0)
+		return;
+	recorder_move_sidecars(oldpath, file->path);
+
+	file->unnamed = 0;
 }
 
 /**
- * Creates a new file for output and switches rcd->out to it
+ * Closes the given file and frees it, files that were never
+ * put to use (or lost their copies before anything made it
+ * to them) get removed
  */
-static int
-recorder_switch_file(struct recorder *rcd)
+static void
+recorder_close_file(struct recorder *rcd, struct recorder_file *file)
 {
-	int ret = 0;
-	SNDFILE *new = NULL;
-	SNDFILE *old = rcd->out;
-
-	/* This function should not be called on
-	 * state transitions. It's meant to be used
-	 * for switching to a new file without messing
-	 * with the recorder's state. */
-	if (recorder_state == RECORDER_TRANSITION)
-		return RECORDER_AGAIN;
+	char path[PATH_MAX] = { 0 };
+	const char *copy = NULL;
+	double integrated = 0.0;
+	struct stat st = { 0 };
+	int discard = 0;
+	int i = 0;
 
-	/* This doesn't make sense, in order to switch
-	 * to a new file a file should be already open
-	 * and active */
-	if (recorder_state != RECORDER_RUNNING)
-		return RECORDER_AGAIN;
+	if (!file)
+		return;
 
-	new = recorder_open_new_file(rcd);
-	if (!new)
-		return RECORDER_SNDFILE_ERR;
+	flac_close(file->flac);
+	discard = file->unnamed || (file->lost && !file->length);
+	storage_close(file, discard);
+	stream_file_cleanup(file);
+	if (file->markers)
+		fclose(file->markers);
+
+	/* Its header is final now, readers that follow it
+	 * may read it through to the end */
+	snprintf(path, PATH_MAX, "%s%s", file->path, PROGRESS_EXT);
+	unlink(path);
+	if (!discard)
+		manifest_file_close(file);
+
+	copy = storage_good_copy(file);
+	if (!discard && copy && stat(copy, &st) == 0)
+		__atomic_store_n(&rcd->stats.bytes_closed,
+				 rcd->stats.bytes_closed + st.st_size,
+				 __ATOMIC_RELAXED);
+
+	integrated = loudness_finish(file->loudness);
+	peaks_finish(file->peaks);
+
+	/* They got written next to the first copy, each
+	 * good copy (mirror / failover) gets its own */
+	for (i = 0; i < file->num_sinks && !discard; i++)
+		if (!file->sinks[i].failed &&
+		    strcmp(file->sinks[i].path, file->path))
+			recorder_copy_sidecars(file->path,
+					       file->sinks[i].path);
+
+	if (discard) {
+		recorder_move_sidecars(file->path, NULL);
+	} else if (file->loudness)
+		fprintf(stderr, "Closed %s, integrated loudness %.1f LUFS\n",
+			file->path, integrated);
+	free(file);
+	return;
+}
 
-	old = rcd->out;
+/**
+ * Detaches the active file from the consumer and queues it
+ * for closing by the timer thread
+ */
+static void
+recorder_retire_file(struct recorder *rcd)
+{
+	struct recorder_file *old = NULL;
 
-	/* New file opened, update the pointer on
-	 * rcd->out */
+	pthread_mutex_lock(&files_mutex);
 	pthread_mutex_lock(&consumer_process_mutex);
-	rcd->out = new;
+	old = rcd->out;
+	rcd->out = NULL;
+	stream_set_file(NULL);
+	/* Don't let the next recording start with
+	 * the tail of this one */
+	if (old && rcd->resampler_state)
+		src_reset(rcd->resampler_state);
 	pthread_mutex_unlock(&consumer_process_mutex);
 
-	/* Close the previous one */
-	sf_close(old);
+	if (old) {
+		old->next = rcd->retired;
+		rcd->retired = old;
+	}
+	pthread_mutex_unlock(&files_mutex);
+}
 
-	/* Reset the timer */
-	rcd->secs_recorded = 0;
+/**
+ * Takes the pre-opened spare file if there is one,
+ * else opens a new file
+ */
+static struct recorder_file *
+recorder_get_next_file(struct recorder *rcd)
+{
+	struct recorder_file *file = NULL;
 
-	rcd->rotations++;
+	pthread_mutex_lock(&files_mutex);
+	file = rcd->spare;
+	rcd->spare = NULL;
+	pthread_mutex_unlock(&files_mutex);
 
-	return 0;
+	/* Its storage target failed in the meantime */
+	if (file && !storage_file_usable(file)) {
+		recorder_close_file(rcd, file);
+		file = NULL;
+	}
+
+	if (!file)
+		return recorder_open_new_file(rcd, 0);
+
+	time(&file->started);
+	return file;
 }
 
+/**************\
+* GUI METERING *
+\**************/
+
+/**
+ * Called from the process callback, this one doesn't go through
+ * the GUI at all. It just raises the peak-hold values, the GUI
+ * polls them at its own pace.
+ */
+static void
+recorder_update_gui_meters(struct recorder *rcd, float *peaks)
+{
+	uint32_t bits = 0;
+	uint32_t old = 0;
+	int i = 0;
+
+	for (i = 0; i < 2; i++) {
+		memcpy(&bits, &peaks[i], sizeof(uint32_t));
+		old = __atomic_load_n(&rcd->peak_hold[i], __ATOMIC_RELAXED);
+		while (bits > old &&
+		       !__atomic_compare_exchange_n(&rcd->peak_hold[i], &old,
+						    bits, 1, __ATOMIC_RELAXED,
+						    __ATOMIC_RELAXED)) ;
+	}
+}
 
-/***********************\
-* GUI CALLBACK WRAPPERS *
-\***********************/
 
-/* GUI changes should be done on the main thread, so run these
- * through g_main_context_invoke */
+/**************\
+* TIMER THREAD *
+\**************/
 
+/**
+ * Wakes up the timer thread to do its housekeeping
+ * without waiting for the next tick
+ */
 static void
-recorder_update_gui_timer_label(struct recorder *rcd)
+recorder_timer_kick(void)
 {
-	if (gui_state != GUI_READY)
-		return;
-	g_main_context_invoke(NULL, gui_update_timer_label, (gpointer) rcd);
-	return;
+	pthread_mutex_lock(&timer_mutex);
+	timer_kicked = 1;
+	pthread_cond_signal(&timer_trigger);
+	pthread_mutex_unlock(&timer_mutex);
 }
 
+/**
+ * How many seconds of audio the consumer went through
+ * during the last second, per second it spent on them
+ */
 static void
-recorder_update_gui_button_state(struct recorder *rcd, int state)
+recorder_update_encoder_rtf(struct recorder *rcd)
 {
-	if (gui_state != GUI_READY)
-		return;
-	button_state = state;
-	g_main_context_invoke(NULL, gui_update_button_state, (gpointer) rcd);
-	return;
+	struct recorder_stats *stats = &rcd->stats;
+	uint64_t frames = 0;
+	uint64_t busy_usecs = 0;
+	double rtf = 0.0;
+
+	frames = __atomic_load_n(&stats->frames_consumed, __ATOMIC_RELAXED);
+	busy_usecs = __atomic_load_n(&stats->busy_usecs, __ATOMIC_RELAXED);
+
+	if (busy_usecs > stats->prev_busy_usecs)
+		rtf = ((double)(frames - stats->prev_frames_consumed) /
+		       (double)rcd->in_sample_rate) /
+		      ((double)(busy_usecs - stats->prev_busy_usecs) / 1e6);
+
+	__atomic_store(&stats->encoder_rtf, &rtf, __ATOMIC_RELAXED);
+	stats->prev_frames_consumed = frames;
+	stats->prev_busy_usecs = busy_usecs;
 }
 
+/**
+ * Opens a spare file, unless someone else
+ * got one in the meantime
+ */
 static void
-recorder_update_gui_meters(struct recorder *rcd, float left_amp,
-				       float right_amp)
+recorder_open_spare(struct recorder *rcd)
 {
-	if (gui_state != GUI_READY)
+	struct recorder_file *spare = NULL;
+
+	spare = recorder_open_new_file(rcd, 1);
+	if (!spare)
 		return;
-	rcd->left_amp = left_amp;
-	rcd->right_amp = right_amp;
-	g_main_context_invoke(NULL, gui_update_meters, (gpointer) rcd);
-	return;
+
+	pthread_mutex_lock(&files_mutex);
+	if (!rcd->spare) {
+		rcd->spare = spare;
+		spare = NULL;
+	}
+	pthread_mutex_unlock(&files_mutex);
+	recorder_close_file(rcd, spare);
 }
 
+/**
+ * Atomically replaces the progress sidecar of the active file,
+ * for readers that follow it while it's being written (see
+ * tail.c). The consumer holds consumer_process_mutex while it
+ * writes to the file, and encoders write out whole frames /
+ * pages, so with it held the file ends with a complete one.
+ */
 static void
-recorder_cleanup_gui(struct recorder *rcd)
+recorder_write_progress(struct recorder *rcd)
 {
-	if (gui_state != GUI_READY)
+	struct recorder_file *file = NULL;
+	char path[PATH_MAX] = { 0 };
+	char tmp_path[PATH_MAX] = { 0 };
+	uint64_t frames = 0;
+	sf_count_t bytes = 0;
+	FILE *progress = NULL;
+
+	pthread_mutex_lock(&files_mutex);
+	pthread_mutex_lock(&consumer_process_mutex);
+	file = rcd->out;
+	if (file) {
+		frames = file->frames;
+		bytes = file->length;
+	}
+	pthread_mutex_unlock(&consumer_process_mutex);
+	pthread_mutex_unlock(&files_mutex);
+
+	/* Only we close / rename files, so it stays around.
+	 * Skip it if it's not named yet / nothing's new. */
+	if (!file || file->unnamed || bytes == file->progress_bytes)
 		return;
-	g_main_context_invoke(NULL, gui_cleanup, (gpointer) rcd);
-	return;
+	file->progress_bytes = bytes;
+	snprintf(path, PATH_MAX, "%s%s", file->path, PROGRESS_EXT);
+	snprintf(tmp_path, PATH_MAX, "%s.tmp", path);
+
+	progress = fopen(tmp_path, "w");
+	if (!progress)
+		return;
+
+	fprintf(progress, "format=%s\n",
+		file->format == RECORDER_FORMAT_FLAC ? "flac" : "ogg");
+	fprintf(progress, "sample_rate=%u\n", file->sample_rate);
+	fprintf(progress, "channels=%i\n", file->channels);
+	fprintf(progress, "frames=%llu\n", (unsigned long long)frames);
+	fprintf(progress, "bytes=%llu\n", (unsigned long long)bytes);
+
+	if (fclose(progress) != 0 || rename(tmp_path, path) < 0)
+		unlink(tmp_path);
 }
 
+/**
+ * Keeps file handling off the start / stop paths. Closes
+ * retired files, renames the active file if it was pre-opened
+ * and makes sure there is a spare file ready for the next
+ * start or rotation. Also updates the active file's progress.
+ */
+static void
+recorder_housekeeping(struct recorder *rcd)
+{
+	struct recorder_file *retired = NULL;
+	struct recorder_file *next = NULL;
+	struct recorder_file *spare = NULL;
+	int ret = 0;
+
+	/* Started through the control socket, the drain
+	 * may take a while so it's done here */
+	if (__atomic_exchange_n(&rcd->start_pending, 0, __ATOMIC_RELAXED)) {
+		ret = recorder_start(rcd);
+		if (ret < 0 && ret != RECORDER_AGAIN)
+			fprintf(stderr, "Unable to start recording\n");
+	}
 
-/**************\
-* TIMER THREAD *
-\**************/
+	/* A stop request only flips the state, detach the
+	 * file here, once the consumer is done with what's
+	 * left on the ring */
+	if (recorder_state == RECORDER_STOPPED && rcd->out &&
+	    recorder_backlog_empty(rcd))
+		recorder_retire_file(rcd);
+
+	pthread_mutex_lock(&files_mutex);
+	retired = rcd->retired;
+	rcd->retired = NULL;
+	if (rcd->out) {
+		recorder_name_file(rcd, rcd->out);
+		peaks_reserve(rcd->out->peaks);
+	}
+	spare = rcd->spare;
+	pthread_mutex_unlock(&files_mutex);
+
+	while (retired) {
+		next = retired->next;
+		recorder_close_file(rcd, retired);
+		retired = next;
+	}
+
+	if (rcd->start_latency_pending) {
+		rcd->start_latency_pending = 0;
+		fprintf(stderr, "Recording started, first period after %llu usecs\n",
+			(unsigned long long) rcd->start_latency_usecs);
+	}
+
+	if (!spare && recorder_state != RECORDER_NOT_INITIALIZED)
+		recorder_open_spare(rcd);
+
+	recorder_write_progress(rcd);
+}
 
 /*
  * Increases the timer by one second periodicaly, updates
  * the GUI and switches output file in case we run on
  * logger mode and the rotate interval has passed. Also
- * handles the delayed stop time counting / triggering.
+ * handles the delayed stop time counting / triggering and
+ * the housekeeping of output files. It stays around for
+ * the lifetime of the recorder.
  */
 
 static void *
@@ -215,41 +690,92 @@ recorder_timer_loop(void *arg)
 {
 	struct recorder *rcd = (struct recorder *)arg;
 	int ret = 0;
+	int tick = 0;
 	struct timespec tv = { 0 };
+	struct timespec wait = { 0 };
+	struct timespec now = { 0 };
 
-	/* Reset timer value */
-	rcd->secs_recorded = 0;
 	clock_gettime(CLOCK_MONOTONIC, &tv);
-	timer_active = 1;
+	tv.tv_sec++;
 	while (timer_active) {
+		ret = 0;
+
+		/* Poll for the JACK server more often
+		 * while it's gone */
+		wait = tv;
+		if (__atomic_load_n(&rcd->jack_lost, __ATOMIC_ACQUIRE)) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			now.tv_nsec += RECORDER_RECONNECT_MSECS * 1000000L;
+			if (now.tv_nsec >= 1000000000L) {
+				now.tv_sec++;
+				now.tv_nsec -= 1000000000L;
+			}
+			if (now.tv_sec < tv.tv_sec ||
+			    (now.tv_sec == tv.tv_sec &&
+			     now.tv_nsec < tv.tv_nsec))
+				wait = now;
+		}
+
+		pthread_mutex_lock(&timer_mutex);
+		while (timer_active && !timer_kicked && ret != ETIMEDOUT)
+			ret = pthread_cond_timedwait(&timer_trigger,
+						     &timer_mutex, &wait);
+		timer_kicked = 0;
+		pthread_mutex_unlock(&timer_mutex);
+		ret = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		tick = (now.tv_sec > tv.tv_sec ||
+			(now.tv_sec == tv.tv_sec && now.tv_nsec >= tv.tv_nsec));
+
+		if (!timer_active)
+			break;
+
+		recorder_housekeeping(rcd);
+
+		if (__atomic_load_n(&rcd->jack_lost, __ATOMIC_ACQUIRE))
+			recorder_jack_reconnect(rcd);
+		else if (__atomic_exchange_n(&rcd->jack_ports_changed, 0,
+					     __ATOMIC_ACQUIRE))
+			recorder_jack_autoconnect(rcd);
+
+		if (!tick)
+			continue;
 		tv.tv_sec++;
+
+		/* Parse / validate it here, off the audio path */
+		if (config_reload_requested) {
+			config_reload_requested = 0;
+			config_reload(rcd);
+		}
+
+		monitor_update(&rcd->monitor, rcd);
+		space_update(&rcd->space, rcd);
+		load_update(&rcd->load, rcd);
+		rtstats_update(&rcd->rtstats);
+		recorder_update_encoder_rtf(rcd);
+
+		if (recorder_state != RECORDER_RUNNING &&
+		    recorder_state != RECORDER_DELAYED_STOP)
+			continue;
+		rcd->secs_recorded++;
+
 		if (!rcd->headless) {
 			if (recorder_state == RECORDER_RUNNING)
-				recorder_update_gui_timer_label(rcd);
+				gui_update_timer_label(rcd);
 			if (recorder_state == RECORDER_DELAYED_STOP &&
 			    rcd->secs_recorded >= RECORDER_STOP_DELAY_SECS)
-				break;
+				recorder_stop(rcd);
 		}
+		/* The consumer switches files once it gets to the
+		 * next period, and stops the recorder if that fails */
 		if ((rcd->opmode == RECORDER_LOGGER) &&
-		    (rcd->secs_recorded >= rcd->logrotate_interval_secs)) {
-			ret = recorder_switch_file(rcd);
-			if (ret < 0)
-				break;
-		}
-		ret = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
-				      &tv, NULL);
-		if (ret == EINTR) {
-			ret = 0;
-			break;
-		}
-		rcd->secs_recorded++;
+		    (rcd->secs_recorded >= rcd->logrotate_interval_secs))
+			recorder_rotate(rcd);
 	}
 
 	timer_active = 0;
 
-	if (recorder_state == RECORDER_DELAYED_STOP || ret < 0)
-		recorder_stop(rcd);
-
 	return NULL;
 }
 
@@ -260,29 +786,39 @@ static int
 recorder_set_timer_state(struct recorder *rcd, int state)
 {
 	int ret = 0;
-	static jack_native_thread_t timer_tid = 0;
+	pthread_condattr_t attr;
 
 	if (state) {
 		/* Already running  */
 		if (timer_active)
 			return 0;
 
-		ret = jack_client_create_thread(rcd->client, &timer_tid,
-						rcd->rtprio, 1,
-						recorder_timer_loop,
-						(void *)rcd);
-		if (ret < 0)
+		/* We sleep on CLOCK_MONOTONIC deadlines */
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&timer_trigger, &attr);
+		pthread_condattr_destroy(&attr);
+
+		timer_active = 1;
+		ret = recorder_create_thread(rcd, &timer_tid,
+					     recorder_timer_loop);
+		if (ret != 0) {
+			timer_active = 0;
 			return RECORDER_TIMER_ERR;
+		}
 	} else {
 		/* Already stopped */
 		if (!timer_active)
 			return 0;
 
-		ret = pthread_cancel(timer_tid);
-		if (ret != 0)
-			return RECORDER_TIMER_ERR;
-
 		timer_active = 0;
+		recorder_timer_kick();
+
+		/* We may get here from the timer thread itself
+		 * (e.g. when rotation fails), in which case it'll
+		 * exit on its own */
+		if (!pthread_equal(pthread_self(), timer_tid))
+			pthread_join(timer_tid, NULL);
 	}
 
 	return ret;
@@ -294,56 +830,451 @@ recorder_set_timer_state(struct recorder *rcd, int state)
 \*****************/
 
 /**
- * Writes data to an open file, gets triggered by the process
- * callback and runs as a different thread.
+ * Switches rcd->out to the next file, the block that
+ * requested it is the first one to go to the new file.
+ * The old file gets closed and the new one gets renamed
+ * by the timer thread.
  */
 static int
-recorder_consume(struct recorder *rcd)
+recorder_rotate_file(struct recorder *rcd)
 {
-	int ret = 0;
-	uint32_t frames_generated = 0;
+	struct recorder_file *new = NULL;
 
+	new = recorder_get_next_file(rcd);
+	if (!new)
+		return RECORDER_SNDFILE_ERR;
+
+	pthread_mutex_lock(&files_mutex);
 	pthread_mutex_lock(&consumer_process_mutex);
-	while (pthread_cond_wait
-	       (&consumer_process_trigger, &consumer_process_mutex) != 0) ;
+	if (rcd->out) {
+		rcd->out->next = rcd->retired;
+		rcd->retired = rcd->out;
+	}
+	rcd->out = new;
+	stream_set_file(new);
+	pthread_mutex_unlock(&consumer_process_mutex);
+	pthread_mutex_unlock(&files_mutex);
 
-	/* Don't attempt to write to the file because it might
-	 * be closed or not exist yet. This also handles propper
-	 * exit of the consumer thread (without calling recorder_stop()
-	 * again), when switching states. */
-	if (recorder_state != RECORDER_RUNNING)
-		goto cleanup;
+	recorder_timer_kick();
 
-	/* Resample audio to the requested output sampling rate */
-	rcd->resampler_data.data_in = rcd->inbuff_copy;
-	rcd->resampler_data.data_out = rcd->outbuff;
-	rcd->resampler_data.input_frames = rcd->num_frames;
-	rcd->resampler_data.output_frames = rcd->max_out_frames;
-	rcd->resampler_data.end_of_input = 0;
-	rcd->resampler_data.src_ratio = rcd->resampler_ratio;
+	return 0;
+}
 
-	ret = src_process(rcd->resampler_state, &rcd->resampler_data);
-	if (ret != 0) {
-		fprintf(stderr, "resampler: %s (%i)\n", src_strerror(ret), ret);
-		ret = RECORDER_RESAMPLER_ERR;
-		goto cleanup;
-	}
-	frames_generated = rcd->resampler_data.output_frames_gen;
+/**
+ * Puts a marker on the active file, after the last frame
+ * written to it
+ */
+static void
+recorder_append_marker(struct recorder *rcd, const char *label)
+{
+	struct recorder_file *out = NULL;
+	char path[PATH_MAX] = { 0 };
+	double secs = 0.0;
+
+	/* The timer thread renames files (and their sidecars)
+	 * with files_mutex held */
+	pthread_mutex_lock(&files_mutex);
+	out = rcd->out;
+	if (out && !out->markers) {
+		snprintf(path, PATH_MAX, "%s%s", out->path, MARKERS_EXT);
+		out->markers = fopen(path, "a");
+		if (!out->markers)
+			perror("cannot open markers file");
+	}
+	if (out && out->markers) {
+		secs = (double)out->frames / (double)rcd->sample_rate;
+		fprintf(out->markers, "%llu\t%.3f\t%s\n",
+			(unsigned long long)out->frames, secs, label);
+		fflush(out->markers);
+	}
+	pthread_mutex_unlock(&files_mutex);
+}
+
+/**
+ * Writes out the markers requested up to the given block,
+ * at the position of its first frame
+ */
+static void
+recorder_write_markers(struct recorder *rcd, uint32_t marks)
+{
+	struct recorder_marker *marker = NULL;
+
+	while (rcd->marks_done != marks) {
+		pthread_mutex_lock(&markers_mutex);
+		marker = rcd->markers;
+		if (marker)
+			rcd->markers = marker->next;
+		pthread_mutex_unlock(&markers_mutex);
+		rcd->marks_done++;
+
+		if (!marker)
+			continue;
+
+		recorder_append_marker(rcd, marker->label);
+		free(marker);
+	}
+}
+
+/**
+ * Drops any markers the consumer didn't get to
+ */
+static void
+recorder_flush_markers(struct recorder *rcd)
+{
+	struct recorder_marker *marker = NULL;
+
+	pthread_mutex_lock(&markers_mutex);
+	while (rcd->markers) {
+		marker = rcd->markers;
+		rcd->markers = marker->next;
+		free(marker);
+	}
+	rcd->marks_done = rcd->marks_queued;
+	pthread_mutex_unlock(&markers_mutex);
+}
+
+/**
+ * Checks if there is a complete block on the ring, the
+ * process callback writes the header first so we may
+ * see it before the frames that follow it
+ */
+static int
+recorder_block_ready(struct recorder *rcd, struct recorder_block *block)
+{
+	jack_ringbuffer_t *ring = NULL;
+	size_t avail = 0;
+
+	if (!rcd->ring)
+		return 0;
+
+	ring = recorder_consumer_ring(rcd);
+	avail = jack_ringbuffer_read_space(ring);
+	if (avail < sizeof(struct recorder_block))
+		return 0;
+
+	jack_ringbuffer_peek(ring, (char *)block,
+			     sizeof(struct recorder_block));
+	return avail >= sizeof(struct recorder_block) +
+			block->nframes * rcd->info.channels * sizeof(float);
+}
+
+/**
+ * Waits on the process callback for a bit, or until
+ * we get asked to exit
+ */
+static void
+recorder_consumer_wait(void)
+{
+	struct timespec tv = { 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	tv.tv_nsec += RECORDER_CONSUMER_POLL_MSECS * 1000000L;
+	if (tv.tv_nsec >= 1000000000L) {
+		tv.tv_sec++;
+		tv.tv_nsec -= 1000000000L;
+	}
+	pthread_cond_timedwait(&consumer_process_trigger,
+			       &consumer_process_mutex, &tv);
+}
+
+/**
+ * Called by the consumer after every copy of the output file
+ * failed. Audio keeps piling up on the ring (or the spool)
+ * meanwhile, so we retry switching to a new file (on whatever
+ * storage is still up) and writing out what was left of the
+ * failed block, until it fills up. Returns 1 once recovered,
+ * 0 if we should be called again, or an error if we gave up.
+ */
+static int
+recorder_storage_recover(struct recorder *rcd)
+{
+	struct recorder_block block = { 0 };
+	jack_ringbuffer_t *ring = recorder_consumer_ring(rcd);
+	float *pending = NULL;
+	uint64_t now = recorder_get_usecs();
+	int lost = 0;
+	int ret = 0;
+
+	/* Recording got stopped in the meantime */
+	pthread_mutex_lock(&consumer_process_mutex);
+	if (!rcd->out) {
+		pthread_mutex_unlock(&consumer_process_mutex);
+		goto done;
+	}
+	lost = rcd->out->lost;
+	pthread_mutex_unlock(&consumer_process_mutex);
+
+	/* Don't hammer a failing disk, unless we are
+	 * exiting */
+	if (now >= rcd->storage_retry_usecs || !consumer_active) {
+		rcd->storage_retry_usecs = now +
+					   STORAGE_RECOVER_MSECS * 1000;
+
+		/* Keep the file an earlier retry got unless it
+		 * lost its copies too, and only open a new one
+		 * once there is a target that didn't fail since,
+		 * so that we don't leave a trail of empty files */
+		if (lost && !storage_available(rcd))
+			goto full;
+		if (lost || !rcd->storage_reopened) {
+			if (recorder_rotate_file(rcd) < 0)
+				goto full;
+			rcd->storage_reopened = 1;
+		}
+
+		pending = rcd->outbuff + rcd->pending_offset *
+			  rcd->info.channels;
+		pthread_mutex_lock(&consumer_process_mutex);
+		ret = recorder_write_file(rcd->out, pending,
+					  rcd->pending_frames);
+		if (ret > 0)
+			rcd->out->frames += ret;
+		pthread_mutex_unlock(&consumer_process_mutex);
+		if (ret > 0) {
+			__atomic_store_n(&rcd->stats.frames_written,
+					 rcd->stats.frames_written + ret,
+					 __ATOMIC_RELAXED);
+			rcd->pending_offset += ret;
+			rcd->pending_frames -= ret;
+		}
+		if (!rcd->pending_frames) {
+			fprintf(stderr, "storage: switched to %s\n",
+				rcd->out->path);
+			goto done;
+		}
+	}
+
+ full:
+	pthread_mutex_lock(&consumer_process_mutex);
+	if (jack_ringbuffer_write_space(ring) >=
+	    sizeof(struct recorder_block) + rcd->inbuff_size) {
+		if (consumer_active)
+			recorder_consumer_wait();
+		pthread_mutex_unlock(&consumer_process_mutex);
+		return 0;
+	}
+
+	/* Out of room, drop what we have and let the process
+	 * callback go on */
+	fprintf(stderr, "storage: no usable storage and the buffer is "
+		"full, giving up\n");
+	while (recorder_block_ready(rcd, &block))
+		jack_ringbuffer_read_advance(ring,
+					     sizeof(struct recorder_block) +
+					     block.nframes *
+					     rcd->info.channels *
+					     sizeof(float));
+	if (rcd->offline)
+		pthread_cond_broadcast(&consumer_done_trigger);
+	pthread_mutex_unlock(&consumer_process_mutex);
+	rcd->storage_failed = 0;
+	rcd->pending_frames = 0;
+	return RECORDER_SNDFILE_ERR;
+
+ done:
+	rcd->storage_failed = 0;
+	rcd->pending_frames = 0;
+	return 1;
+}
+
+/**
+ * Swaps the resampler for one of the type load.c asked for,
+ * what the old one still holds goes to the file first so that
+ * we don't lose it
+ */
+static void
+recorder_swap_resampler(struct recorder *rcd)
+{
+	int type = __atomic_load_n(&rcd->load.resampler_type,
+				   __ATOMIC_ACQUIRE);
+	SRC_STATE *state = NULL;
+	uint32_t frames_generated = 0;
+	int err = 0;
+	int ret = 0;
+
+	/* A rare event, the consumer loop re-arms
+	 * the trap on its next pass */
+	arena_trap_disarm();
+
+	state = src_new(type, rcd->info.channels, &err);
+	if (!state) {
+		fprintf(stderr, "resampler: %s\n", src_strerror(err));
+		/* Don't try again until it changes */
+		rcd->resampler_state_type = type;
+		return;
+	}
+
+	rcd->resampler_data.data_in = rcd->inbuff_copy;
+	rcd->resampler_data.data_out = rcd->outbuff;
+	rcd->resampler_data.input_frames = 0;
+	rcd->resampler_data.end_of_input = 1;
+	rcd->resampler_data.src_ratio = rcd->resampler_ratio;
+	do {
+		rcd->resampler_data.output_frames = rcd->max_out_frames;
+		if (src_process(rcd->resampler_state, &rcd->resampler_data))
+			break;
+		frames_generated = rcd->resampler_data.output_frames_gen;
+		if (!frames_generated)
+			break;
+
+		loudness_process(rcd->out->loudness, rcd->outbuff,
+				 frames_generated);
+		peaks_process(rcd->out->peaks, rcd->outbuff, frames_generated);
+		ret = recorder_write_file(rcd->out, rcd->outbuff,
+					  frames_generated);
+		if (ret > 0) {
+			rcd->out->frames += ret;
+			__atomic_store_n(&rcd->stats.frames_written,
+					 rcd->stats.frames_written + ret,
+					 __ATOMIC_RELAXED);
+		}
+	} while (ret == (int)frames_generated);
+
+	src_delete(rcd->resampler_state);
+	rcd->resampler_state = state;
+	rcd->resampler_state_type = type;
+}
+
+/**
+ * Writes data to an open file, gets triggered by the process
+ * callback and runs as a different thread. Returns 1 if it
+ * handled a block, 0 if there was none.
+ */
+static int
+recorder_consume(struct recorder *rcd)
+{
+	int ret = 0;
+	int cmd_ret = 0;
+	uint32_t frames_generated = 0;
+	struct recorder_block block = { 0 };
+	jack_ringbuffer_t *ring = recorder_consumer_ring(rcd);
+	uint64_t start = 0;
+	uint64_t write_start = 0;
+	struct recorder_stats *stats = &rcd->stats;
+
+	/* Lost the output file, the ring holds on to
+	 * the audio until we get a new one */
+	if (rcd->storage_failed) {
+		ret = recorder_storage_recover(rcd);
+		if (ret <= 0)
+			return ret;
+		ret = 0;
+	}
+
+	/* The process callback doesn't wait for us to signal
+	 * it, so don't sleep for long */
+	pthread_mutex_lock(&consumer_process_mutex);
+	while (!recorder_block_ready(rcd, &block) && consumer_active)
+		recorder_consumer_wait();
+
+	/* Exiting and there is nothing left on the ring */
+	if (!recorder_block_ready(rcd, &block))
+		goto cleanup;
+
+	/* Commands that take effect on this block need files_mutex,
+	 * which goes before ours. The block stays on the ring in the
+	 * meantime, so the file can't get retired under us. */
+	if ((block.flags & RECORDER_BLOCK_ROTATE) ||
+	    block.marks != rcd->marks_done) {
+		pthread_mutex_unlock(&consumer_process_mutex);
+		if (block.flags & RECORDER_BLOCK_ROTATE) {
+			cmd_ret = recorder_rotate_file(rcd);
+			if (!cmd_ret)
+				__atomic_store_n(&rcd->rotations,
+						 rcd->rotations + 1,
+						 __ATOMIC_RELAXED);
+		}
+		recorder_write_markers(rcd, block.marks);
+		pthread_mutex_lock(&consumer_process_mutex);
+	}
+
+	start = recorder_get_usecs();
+	jack_ringbuffer_read_advance(ring, sizeof(struct recorder_block));
+	jack_ringbuffer_read(ring, (char *)rcd->inbuff_copy,
+			     block.nframes * rcd->info.channels *
+			     sizeof(float));
+	ret = 1;
+
+	if (cmd_ret < 0) {
+		ret = cmd_ret;
+		goto cleanup;
+	}
+
+	/* Don't attempt to write to the file if it has been
+	 * detached */
+	if (!rcd->out)
+		goto cleanup;
+
+	/* Moved to a cheaper / back to the original recipe */
+	if (__atomic_load_n(&rcd->load.resampler_type, __ATOMIC_ACQUIRE) !=
+	    rcd->resampler_state_type)
+		recorder_swap_resampler(rcd);
+
+	/* Resample audio to the requested output sampling rate */
+	rcd->resampler_data.data_in = rcd->inbuff_copy;
+	rcd->resampler_data.data_out = rcd->outbuff;
+	rcd->resampler_data.input_frames = block.nframes;
+	rcd->resampler_data.output_frames = rcd->max_out_frames;
+	rcd->resampler_data.end_of_input = 0;
+	rcd->resampler_data.src_ratio = rcd->resampler_ratio;
+
+	ret = src_process(rcd->resampler_state, &rcd->resampler_data);
+	if (ret != 0) {
+		fprintf(stderr, "resampler: %s (%i)\n", src_strerror(ret), ret);
+		ret = RECORDER_RESAMPLER_ERR;
+		goto cleanup;
+	}
+	frames_generated = rcd->resampler_data.output_frames_gen;
+
+	loudness_process(rcd->out->loudness, rcd->outbuff, frames_generated);
+	peaks_process(rcd->out->peaks, rcd->outbuff, frames_generated);
 
 	/* Write data to file */
-	ret = sf_writef_float(rcd->out, rcd->outbuff, frames_generated);
+	write_start = recorder_get_usecs();
+	ret = recorder_write_file(rcd->out, rcd->outbuff, frames_generated);
 	if (ret != frames_generated) {
-		fprintf(stderr, "libsndfile failed writing to file %d !\n", ret);
-		ret = RECORDER_SNDFILE_ERR;
+		fprintf(stderr, "encoder failed writing to file %d !\n", ret);
+		/* Keep what didn't make it for the next
+		 * file, see recorder_storage_recover() */
+		rcd->pending_offset = ret > 0 ? ret : 0;
+		rcd->pending_frames = frames_generated - rcd->pending_offset;
+		rcd->storage_failed = 1;
+		rcd->storage_reopened = 0;
+		rcd->storage_retry_usecs = 0;
+		ret = 1;
+		goto cleanup;
 	}
+	ret = 1;
+	rcd->out->frames += frames_generated;
+
+	__atomic_store_n(&stats->last_write_usecs,
+			 (uint32_t) (recorder_get_usecs() - write_start),
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->frames_written,
+			 stats->frames_written + frames_generated,
+			 __ATOMIC_RELAXED);
 
  cleanup:
+	if (start) {
+		__atomic_store_n(&stats->frames_consumed,
+				 stats->frames_consumed + block.nframes,
+				 __ATOMIC_RELAXED);
+		__atomic_store_n(&stats->busy_usecs, stats->busy_usecs +
+				 recorder_get_usecs() - start,
+				 __ATOMIC_RELAXED);
+	}
+
+	/* Let recorder_capture() (when running offline) /
+	 * recorder_drain() know */
+	if (ret)
+		pthread_cond_broadcast(&consumer_done_trigger);
 	pthread_mutex_unlock(&consumer_process_mutex);
 	return ret;
 }
 
 /**
- * The consumer thread
+ * The consumer thread, once asked to exit it keeps going
+ * until the ring is empty
  */
 static void *
 recorder_consumer_main_loop(void *arg)
@@ -351,41 +1282,128 @@ recorder_consumer_main_loop(void *arg)
 	struct recorder *rcd = (struct recorder *)arg;
 	int ret = 0;
 
-	consumer_active = 1;
-	while (consumer_active) {
+	while (consumer_active || ret > 0) {
+		/* Files get opened / closed elsewhere, unless
+		 * we failed to write to one */
+		if (recorder_state == RECORDER_RUNNING &&
+		    !rcd->storage_failed)
+			arena_trap_arm("consumer");
+		else
+			arena_trap_disarm();
+
 		ret = recorder_consume(rcd);
-		if (ret < 0)
-			break;
+
+		/* Stays around for the next recording, unless this
+		 * leads to a shutdown, in which case consumer_active
+		 * gets cleared */
+		if (ret < 0) {
+			recorder_stop(rcd);
+			ret = 0;
+		}
 	}
 
-	if (ret < 0) {
-		consumer_active = 0;
-		recorder_stop(rcd);
+	return NULL;
+}
+
+/**
+ * The spool thread, moves blocks from the ring to the spool
+ * and lets the consumer know. Once asked to exit it moves
+ * what's left, if the spool is full by then it's lost, as
+ * it would be without it.
+ */
+static void *
+recorder_spool_main_loop(void *arg)
+{
+	struct recorder *rcd = (struct recorder *)arg;
+	size_t frame_size = rcd->info.channels * sizeof(float);
+	int moved = 0;
+
+	while (spool_active || moved > 0) {
+		moved = spool_move(&rcd->spool, rcd->ring, frame_size);
+		if (!moved) {
+			if (spool_active)
+				spool_wait(&rcd->spool);
+			continue;
+		}
+
+		/* The consumer holds its lock while writing, if
+		 * it's busy it'll get to it anyway */
+		if (!pthread_mutex_trylock(&consumer_process_mutex)) {
+			pthread_cond_signal(&consumer_process_trigger);
+			pthread_mutex_unlock(&consumer_process_mutex);
+		}
 	}
 
 	return NULL;
 }
 
 /**
- * Starts and stops the timer thread
+ * Starts and stops the spool thread, it comes and goes
+ * with the consumer
+ */
+static int
+recorder_set_spool_state(struct recorder *rcd, int state)
+{
+	int ret = 0;
+
+	if (!rcd->spool.ring)
+		return 0;
+
+	if (state) {
+		if (spool_active)
+			return 0;
+
+		spool_active = 1;
+		ret = recorder_create_thread(rcd, &spool_tid,
+					     recorder_spool_main_loop);
+		if (ret != 0) {
+			spool_active = 0;
+			return RECORDER_CONSUMER_ERR;
+		}
+	} else {
+		if (!spool_active)
+			return 0;
+
+		/* Never called from the spool thread */
+		spool_active = 0;
+		pthread_mutex_lock(&rcd->spool.lock);
+		pthread_cond_signal(&rcd->spool.trigger);
+		pthread_mutex_unlock(&rcd->spool.lock);
+		pthread_join(spool_tid, NULL);
+	}
+
+	return 0;
+}
+
+/**
+ * Starts and stops the consumer thread
  */
 static int
 recorder_set_consumer_state(struct recorder *rcd, int state)
 {
 	int ret = 0;
-	static jack_native_thread_t consumer_tid = 0;
+	pthread_condattr_t attr;
 
 	if (state) {
 		/* Already started */
 		if (consumer_active)
 			return 0;
 
-		ret = jack_client_create_thread(rcd->client, &consumer_tid,
-						rcd->rtprio, 1,
-						recorder_consumer_main_loop,
-						(void *)rcd);
-		if (ret < 0)
+		/* We sleep on CLOCK_MONOTONIC deadlines */
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&consumer_process_trigger, &attr);
+		pthread_condattr_destroy(&attr);
+
+		consumer_active = 1;
+		ret = recorder_create_thread(rcd, &consumer_tid,
+					     recorder_consumer_main_loop);
+		if (ret != 0) {
+			consumer_active = 0;
 			return RECORDER_CONSUMER_ERR;
+		}
+
+		ret = recorder_set_spool_state(rcd, 1);
 	} else {
 		/* Already stopped */
 		if (!consumer_active)
@@ -396,21 +1414,175 @@ recorder_set_consumer_state(struct recorder *rcd, int state)
 		if (recorder_state == RECORDER_RUNNING)
 			return RECORDER_AGAIN;
 
+		/* Let the consumer see the last of what was
+		 * on the ring before it goes */
+		recorder_set_spool_state(rcd, 0);
 		consumer_active = 0;
 
-		/* Unblock the consumer thread so that it exits */
+		/* Unblock the consumer thread so that it exits, and
+		 * anyone waiting for it */
 		pthread_mutex_lock(&consumer_process_mutex);
 		pthread_cond_signal(&consumer_process_trigger);
+		pthread_cond_broadcast(&consumer_done_trigger);
 		pthread_mutex_unlock(&consumer_process_mutex);
 
-		/* Wait for the consumer thread to exit */
-		pthread_join(consumer_tid, NULL);
+		/* Wait for the consumer thread to exit, unless
+		 * we got here from the consumer thread itself */
+		if (!pthread_equal(pthread_self(), consumer_tid))
+			pthread_join(consumer_tid, NULL);
 	}
 
 	return ret;
 }
 
 
+/*********\
+* CAPTURE *
+\*********/
+
+/**
+ * Offline only, waits until the consumer makes room for
+ * a block of nbytes
+ */
+static void
+recorder_wait_consumer(struct recorder *rcd, size_t nbytes)
+{
+	pthread_mutex_lock(&consumer_process_mutex);
+	while (consumer_active &&
+	       jack_ringbuffer_write_space(rcd->ring) < nbytes)
+		pthread_cond_wait(&consumer_done_trigger,
+				  &consumer_process_mutex);
+	pthread_mutex_unlock(&consumer_process_mutex);
+}
+
+/**
+ * Feeds a period of audio to the recorder, in[] holds one
+ * buffer of nframes samples per channel. This is the process
+ * callback's job when running on top of JACK, when running
+ * offline it's up to the caller, in which case we wait for
+ * the consumer to make room on the ring instead of dropping
+ * the period.
+ */
+int
+recorder_capture(struct recorder *rcd, jack_default_audio_sample_t **in,
+		 jack_nframes_t nframes)
+{
+	int i = 0;
+	int c = 0;
+	float peaks[2] = { 0 };
+	uint64_t lock_start = 0;
+	struct recorder_block block = { 0 };
+	size_t len = 0;
+	int locked = 0;
+	pthread_mutex_t *lock = &consumer_process_mutex;
+	pthread_cond_t *trigger = &consumer_process_trigger;
+	struct recorder_stats *stats = &rcd->stats;
+
+	/* Recorder not ready */
+	if (!recorder_state)
+		return 0;
+
+	/* Put frames on the buffer */
+	if (rcd->stereo) {
+		for (i = 0, c = 0; i < nframes; i++) {
+			rcd->inbuff[c] = in[0][i];
+			rcd->inbuff[c + 1] = in[1][i];
+			c += 2;
+		}
+	} else
+		memcpy(rcd->inbuff, in[0], nframes * sizeof(float));
+
+	/* Update the peak / rms levels, we need them
+	 * with or without GUI */
+	monitor_process(&rcd->monitor, in, rcd->stereo ? 2 : 1, nframes,
+			peaks);
+
+	/* Local readers follow it whether we record or not */
+	tap_write(&rcd->tap, rcd->inbuff, nframes);
+
+	if (!rcd->headless)
+		recorder_update_gui_meters(rcd, peaks);
+
+	/* A start request takes effect on the first period
+	 * after it, keep track of how long it took */
+	if (recorder_state == RECORDER_ARMED &&
+	    __sync_bool_compare_and_swap(&recorder_state, RECORDER_ARMED,
+					 RECORDER_RUNNING)) {
+		rcd->start_latency_usecs = recorder_get_usecs() -
+					   rcd->start_request_usecs;
+		rcd->start_latency_pending = 1;
+	}
+
+	if (recorder_state != RECORDER_RUNNING)
+		return 0;
+
+	/* Commands posted since the last period take
+	 * effect on this one */
+	block.nframes = nframes;
+	block.flags = __atomic_exchange_n(&rcd->ctl_pending, 0,
+					  __ATOMIC_ACQUIRE);
+	block.marks = __atomic_load_n(&rcd->marks_queued, __ATOMIC_ACQUIRE);
+	len = nframes * (rcd->stereo ? 2 : 1) * sizeof(float);
+
+	if (rcd->offline)
+		recorder_wait_consumer(rcd, sizeof(block) + len);
+
+	/* Never wait for the consumer, if it fell that
+	 * much behind drop the period */
+	if (jack_ringbuffer_write_space(rcd->ring) < sizeof(block) + len) {
+		__atomic_store_n(&stats->dropped_periods,
+				 stats->dropped_periods + 1,
+				 __ATOMIC_RELAXED);
+		/* Retry the commands on the next one */
+		if (block.flags)
+			__atomic_or_fetch(&rcd->ctl_pending, block.flags,
+					  __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	jack_ringbuffer_write(rcd->ring, (const char *)&block, sizeof(block));
+	jack_ringbuffer_write(rcd->ring, (const char *)rcd->inbuff, len);
+	__atomic_store_n(&stats->frames_captured,
+			 stats->frames_captured + nframes, __ATOMIC_RELAXED);
+
+	/* Wake up the consumer (or the spool thread that
+	 * feeds it) if it's sleeping, if it's not it'll get
+	 * to it anyway */
+	if (rcd->spool.ring) {
+		lock = &rcd->spool.lock;
+		trigger = &rcd->spool.trigger;
+	}
+
+	if (rcd->rtstats.enabled) {
+		lock_start = rtstats_ticks();
+		locked = !pthread_mutex_trylock(lock);
+		rtstats_lock_wait(&rcd->rtstats, lock_start);
+	} else
+		locked = !pthread_mutex_trylock(lock);
+
+	if (locked) {
+		pthread_cond_signal(trigger);
+		pthread_mutex_unlock(lock);
+	}
+
+	return 0;
+}
+
+/**
+ * Waits until everything passed to recorder_capture()
+ * has been written out, including what's on the spool
+ */
+void
+recorder_drain(struct recorder *rcd)
+{
+	pthread_mutex_lock(&consumer_process_mutex);
+	while (consumer_active && !recorder_backlog_empty(rcd))
+		pthread_cond_wait(&consumer_done_trigger,
+				  &consumer_process_mutex);
+	pthread_mutex_unlock(&consumer_process_mutex);
+}
+
+
 /****************\
 * JACK CALLBACKS *
 \****************/
@@ -423,99 +1595,460 @@ recorder_process(jack_nframes_t nframes, void *arg)
 {
 	int ret = 0;
 	struct recorder *rcd = (struct recorder *)arg;
-	jack_default_audio_sample_t *left_in, *right_in;
-	int i = 0;
-	int c = 0;
-	float peak_left = 0.0f;
-	float peak_right = 0.0f;
+	jack_default_audio_sample_t *in[2] = { NULL };
+	uint64_t start = 0;
 
 	/* Recorder not ready */
 	if (!recorder_state)
 		return 0;
 
-	if (rcd->stereo) {
-		/* Grab input */
-		left_in = (float *)jack_port_get_buffer(rcd->inL, nframes);
-		right_in = (float *)jack_port_get_buffer(rcd->inR, nframes);
+	/* Debug builds report any allocation from here on */
+	arena_trap_arm("process");
+
+	if (rcd->rtstats.enabled)
+		start = rtstats_begin(&rcd->rtstats, nframes);
 
-		if (left_in == NULL || right_in == NULL)
+	/* Grab input */
+	in[0] = (float *)jack_port_get_buffer(rcd->inL, nframes);
+	if (in[0] == NULL)
+		return -1;
+
+	if (rcd->stereo) {
+		in[1] = (float *)jack_port_get_buffer(rcd->inR, nframes);
+		if (in[1] == NULL)
 			return -1;
+	}
 
-		/* Put frames on the buffer and update the peak levels */
-		for (i = 0, c = 0; i < nframes; i++) {
-			rcd->inbuff[c] = left_in[i];
-			rcd->inbuff[c + 1] = right_in[i];
-			c += 2;
-			if (rcd->headless)
+	ret = recorder_capture(rcd, in, nframes);
+
+	if (rcd->rtstats.enabled)
+		rtstats_end(&rcd->rtstats, start, nframes);
+
+	return ret;
+}
+
+/**
+ * Called by JACK on xruns, only registered when
+ * keeping timing stats
+ */
+static int
+recorder_xrun(void *arg)
+{
+	struct recorder *rcd = (struct recorder *)arg;
+
+	rtstats_xrun(&rcd->rtstats);
+	return 0;
+}
+
+/**
+ * Keeps track of what our ports are connected to, so that we
+ * can restore it after a server restart. Runs on JACK's
+ * notification thread, port lookups don't need the server.
+ * Connections going away along with the server don't get
+ * reported, so they stay on the list.
+ */
+static void
+recorder_jack_port_connect(jack_port_id_t a, jack_port_id_t b, int connect,
+			   void *arg)
+{
+	struct recorder *rcd = (struct recorder *)arg;
+	jack_port_t *port_a = jack_port_by_id(rcd->client, a);
+	jack_port_t *port_b = jack_port_by_id(rcd->client, b);
+	const char *other = NULL;
+	char (*conns)[RECORDER_PORT_NAME_MAX] = NULL;
+	int *num_conns = NULL;
+	int idx = 0;
+	int i = 0;
+
+	if (!port_a || !port_b)
+		return;
+
+	if (port_b == rcd->inL || (port_b == rcd->inR && rcd->inR)) {
+		idx = (port_b == rcd->inL) ? 0 : 1;
+		other = jack_port_name(port_a);
+	} else if (port_a == rcd->inL || (port_a == rcd->inR && rcd->inR)) {
+		idx = (port_a == rcd->inL) ? 0 : 1;
+		other = jack_port_name(port_b);
+	} else
+		return;
+
+	conns = rcd->jack_conns[idx];
+	num_conns = &rcd->jack_num_conns[idx];
+
+	pthread_mutex_lock(&jack_conns_mutex);
+	for (i = 0; i < *num_conns; i++)
+		if (!strcmp(conns[i], other))
+			break;
+	if (connect && i == *num_conns && i < RECORDER_MAX_CONNS) {
+		snprintf(conns[i], RECORDER_PORT_NAME_MAX, "%s", other);
+		(*num_conns)++;
+	} else if (!connect && i < *num_conns) {
+		(*num_conns)--;
+		memcpy(conns[i], conns[*num_conns], RECORDER_PORT_NAME_MAX);
+	}
+	pthread_mutex_unlock(&jack_conns_mutex);
+}
+
+/**
+ * A port got registered somewhere, it may be (again) one of
+ * our sources. Runs on JACK's notification thread, where we
+ * can't call back to the server, so the timer thread takes
+ * it from there.
+ */
+static void
+recorder_jack_port_registration(jack_port_id_t id, int reg, void *arg)
+{
+	struct recorder *rcd = (struct recorder *)arg;
+
+	if (!reg || (!rcd->jack_sources[0] && !rcd->jack_sources[1]))
+		return;
+
+	__atomic_store_n(&rcd->jack_ports_changed, 1, __ATOMIC_RELEASE);
+	recorder_timer_kick();
+}
+
+/**
+ * JACK calls this if the server ever shuts down or decides
+ * to disconnect the client. We can't do much from here, the
+ * timer thread takes it from there.
+ */
+static void
+recorder_jack_lost(void *arg)
+{
+	struct recorder *rcd = (struct recorder *)arg;
+
+	__atomic_store_n(&rcd->jack_lost, 1, __ATOMIC_RELEASE);
+	recorder_timer_kick();
+}
+
+/**
+ * libjack's error messages, we don't want to hear about
+ * the server not being there while polling for it
+ */
+static void
+recorder_jack_error(const char *msg)
+{
+	if (!jack_quiet)
+		fprintf(stderr, "JACK: %s\n", msg);
+}
+
+/**
+ * Opens a client on the JACK server, registers our callbacks
+ * and ports, and leaves it to the caller to activate it
+ */
+static int
+recorder_jack_open(struct recorder *rcd)
+{
+	int ret = 0;
+	jack_status_t status = 0;
+	jack_options_t options = JackNoStartServer;
+	char *client_name = NULL;
+
+	/* Open a client connection to the default JACK server */
+	rcd->client = jack_client_open("Audio Coffin", options, &status, NULL);
+	if (rcd->client == NULL) {
+		if (jack_quiet)
+			return RECORDER_JACKD_ERR;
+		fprintf(stderr,
+			"jack_client_open() failed, status = 0x%2.0x\n",
+			status);
+		if (status & JackServerFailed)
+			fprintf(stderr, "Unable to connect to JACK server\n");
+		return RECORDER_JACKD_ERR;
+	}
+
+	if (status & JackServerStarted)
+		fprintf(stderr, "JACK server started\n");
+
+	if (status & JackNameNotUnique) {
+		client_name = jack_get_client_name(rcd->client);
+		fprintf(stderr, "Unique name `%s' assigned\n", client_name);
+	}
+
+
+	/* Get maximum real time priority of jack threads */
+	rcd->rtprio = jack_client_max_real_time_priority(rcd->client);
+	if (rcd->rtprio < 0) {
+		ret = RECORDER_JACKD_ERR;
+		goto cleanup;
+	}
+
+
+	/* Register callbacks on JACK */
+	jack_set_process_callback(rcd->client, recorder_process, rcd);
+	jack_on_shutdown(rcd->client, recorder_jack_lost, rcd);
+	jack_set_port_connect_callback(rcd->client, recorder_jack_port_connect,
+				       rcd);
+	jack_set_port_registration_callback(rcd->client,
+					    recorder_jack_port_registration,
+					    rcd);
+	if (rcd->rtstats.enabled)
+		jack_set_xrun_callback(rcd->client, recorder_xrun, rcd);
+
+
+	/* Register ports */
+	rcd->inL = jack_port_register(rcd->client, "AudioL",
+				      JACK_DEFAULT_AUDIO_TYPE,
+				      JackPortIsInput, 0);
+	if (rcd->inL == NULL) {
+		ret = RECORDER_JACKD_ERR;
+		goto cleanup;
+	}
+
+	if (rcd->stereo) {
+		rcd->inR = jack_port_register(rcd->client, "AudioR",
+					      JACK_DEFAULT_AUDIO_TYPE,
+					      JackPortIsInput, 0);
+		if (rcd->inR == NULL) {
+			ret = RECORDER_JACKD_ERR;
+			goto cleanup;
+		}
+	}
+
+ cleanup:
+	if (ret < 0) {
+		jack_client_close(rcd->client);
+		rcd->client = NULL;
+		rcd->inL = NULL;
+		rcd->inR = NULL;
+	}
+	return ret;
+}
+
+/**
+ * Connects our ports to whatever they were connected
+ * to before the server went away
+ */
+static void
+recorder_jack_restore_connections(struct recorder *rcd)
+{
+	char conns[2][RECORDER_MAX_CONNS][RECORDER_PORT_NAME_MAX];
+	jack_port_t *ports[2] = { rcd->inL, rcd->inR };
+	int num_conns[2] = { 0 };
+	int ret = 0;
+	int i = 0;
+	int j = 0;
+
+	/* Our own connections get reported back
+	 * while we are at it */
+	pthread_mutex_lock(&jack_conns_mutex);
+	memcpy(conns, rcd->jack_conns, sizeof(conns));
+	memcpy(num_conns, rcd->jack_num_conns, sizeof(num_conns));
+	pthread_mutex_unlock(&jack_conns_mutex);
+
+	for (i = 0; i < 2; i++) {
+		if (!ports[i])
+			continue;
+		for (j = 0; j < num_conns[i]; j++) {
+			ret = jack_connect(rcd->client, conns[i][j],
+					   jack_port_name(ports[i]));
+			if (ret && ret != EEXIST)
+				fprintf(stderr, "Could not reconnect %s to %s\n",
+					conns[i][j], jack_port_name(ports[i]));
+		}
+	}
+}
+
+/**
+ * Connects our ports to the ones matching jack_sources, called
+ * from the timer thread once we are active and every time a
+ * port gets registered. A pattern gets resolved to the first
+ * output port that matches it and we stick to that name, so
+ * that a source that goes away and comes back (e.g. a playout
+ * system restarting) gets connected again without matching
+ * every new port against the patterns. It only gets resolved
+ * again if that port is not there.
+ */
+static void
+recorder_jack_autoconnect(struct recorder *rcd)
+{
+	jack_port_t *ports[2] = { rcd->inL, rcd->inR };
+	char *source = NULL;
+	const char **found = NULL;
+	int ret = 0;
+	int i = 0;
+
+	for (i = 0; i < 2; i++) {
+		if (!ports[i] || !rcd->jack_sources[i])
+			continue;
+		source = rcd->jack_source_ports[i];
+
+		if (!source[0] || !jack_port_by_name(rcd->client, source)) {
+			found = jack_get_ports(rcd->client, rcd->jack_sources[i],
+					       JACK_DEFAULT_AUDIO_TYPE,
+					       JackPortIsOutput);
+			if (!found || !found[0]) {
+				if (found)
+					jack_free(found);
 				continue;
-			peak_left =
-			    (left_in[i] > peak_left) ? left_in[i] : peak_left;
-			peak_right =
-			    (right_in[i] >
-			     peak_right) ? right_in[i] : peak_right;
+			}
+			snprintf(source, RECORDER_PORT_NAME_MAX, "%s", found[0]);
+			jack_free(found);
 		}
 
-		if (!rcd->headless)
-			recorder_update_gui_meters(rcd, peak_left, peak_right);
-	} else {
-		left_in = (float *)jack_port_get_buffer(rcd->inL, nframes);
+		if (jack_port_connected_to(ports[i], source))
+			continue;
+
+		ret = jack_connect(rcd->client, source,
+				   jack_port_name(ports[i]));
+		if (ret && ret != EEXIST)
+			fprintf(stderr, "Could not connect %s to %s\n",
+				source, jack_port_name(ports[i]));
+		else
+			fprintf(stderr, "Connected %s to %s\n", source,
+				jack_port_name(ports[i]));
+	}
+}
+
+/**
+ * Called from the timer thread after the JACK server went
+ * away. First it wraps up the file we were on, with a marker
+ * where the gap starts, and then tries to get back to the
+ * server every RECORDER_RECONNECT_MSECS. Once there, our
+ * ports get their connections back and recording resumes
+ * on a new file. The rest of the recorder (threads, buffers,
+ * encoder settings) stays as it was.
+ */
+static void
+recorder_jack_reconnect(struct recorder *rcd)
+{
+	uint64_t now = recorder_get_usecs();
+	uint32_t max_frames = 0;
+	uint32_t sample_rate = 0;
+	uint32_t buffer_size = 0;
+	int ret = 0;
+
+	/* Just lost it */
+	if (rcd->client) {
+		fprintf(stderr, "JACK server went away, waiting for it "
+			"to come back\n");
+
+		rcd->jack_resume = (recorder_state == RECORDER_RUNNING ||
+				    recorder_state == RECORDER_ARMED);
+		if (rcd->jack_resume ||
+		    recorder_state == RECORDER_DELAYED_STOP)
+			recorder_state = RECORDER_STOPPED;
+
+		/* Let the consumer finish with what made it
+		 * to the ring and the spool */
+		recorder_drain(rcd);
+		recorder_append_marker(rcd, "gap: JACK server lost");
+		recorder_retire_file(rcd);
+		recorder_timer_kick();
+
+		jack_client_close(rcd->client);
+		rcd->client = NULL;
+		rcd->inL = NULL;
+		rcd->inR = NULL;
+		rcd->jack_retry_usecs = now;
+		return;
+	}
+
+	if (now < rcd->jack_retry_usecs)
+		return;
+	rcd->jack_retry_usecs = now + RECORDER_RECONNECT_MSECS * 1000;
 
-		if (left_in == NULL)
-			return -1;
+	jack_quiet = 1;
+	ret = recorder_jack_open(rcd);
+	jack_quiet = 0;
+	if (ret < 0)
+		return;
 
-		for (i = 0; i < nframes; i++) {
-			rcd->inbuff[i] = left_in[i];
-			if (rcd->headless)
-				continue;
-			peak_left =
-			    (left_in[i] > peak_left) ? left_in[i] : peak_left;
-		}
+	/* Buffers were sized for the server we had */
+	max_frames = rcd->inbuff_size / ((rcd->stereo ? 2 : 1) *
+					 sizeof(float));
+	sample_rate = jack_get_sample_rate(rcd->client);
+	buffer_size = jack_get_buffer_size(rcd->client);
+	if (sample_rate != rcd->in_sample_rate || buffer_size > max_frames) {
+		if (!rcd->jack_mismatch)
+			fprintf(stderr, "JACK server is back at %uHz / %u "
+				"frames, we need %uHz / up to %u frames\n",
+				sample_rate, buffer_size, rcd->in_sample_rate,
+				max_frames);
+		rcd->jack_mismatch = 1;
+		goto cleanup;
+	}
+	rcd->jack_mismatch = 0;
 
-		if (!rcd->headless)
-			recorder_update_gui_meters(rcd, peak_left, 0);
+	/* If it goes away again from now on, we'll
+	 * hear about it */
+	__atomic_store_n(&rcd->jack_lost, 0, __ATOMIC_RELEASE);
+	ret = jack_activate(rcd->client);
+	if (ret != 0) {
+		__atomic_store_n(&rcd->jack_lost, 1, __ATOMIC_RELEASE);
+		goto cleanup;
 	}
 
-	if (recorder_state != RECORDER_RUNNING)
-		return 0;
+	recorder_jack_restore_connections(rcd);
+	recorder_jack_autoconnect(rcd);
+	fprintf(stderr, "Reconnected to the JACK server\n");
 
-	/* Wait for the previous write to complete, copy the current
-	 * buffer to inbuff_copy and trigger the next write */
-	pthread_mutex_lock(&consumer_process_mutex);
-	memcpy(rcd->inbuff_copy, rcd->inbuff, rcd->inbuff_size);
-	rcd->num_frames = nframes;
-	pthread_cond_signal(&consumer_process_trigger);
-	pthread_mutex_unlock(&consumer_process_mutex);
+	if (rcd->jack_resume) {
+		rcd->jack_resume = 0;
+		recorder_start(rcd);
+	}
+	return;
 
-	return 0;
+ cleanup:
+	jack_client_close(rcd->client);
+	rcd->client = NULL;
+	rcd->inL = NULL;
+	rcd->inR = NULL;
 }
 
 /**
- * JACK calls this shutdown_callback if the server ever shuts down or
- * decides to disconnect the client.
+ * Tears everything down, called on exit / when
+ * initialization fails
  */
 static void
 recorder_shutdown(void *arg)
 {
 	struct recorder *rcd = (struct recorder *)arg;
+	struct recorder_file *next = NULL;
 
 	recorder_state = RECORDER_NOT_INITIALIZED;
+	evloop_stop();
+	metrics_cleanup();
+	stream_cleanup();
+	ctl_cleanup();
 	recorder_set_consumer_state(rcd, 0);
 	recorder_set_timer_state(rcd, 0);
+	recorder_flush_markers(rcd);
+
+	/* No more process callbacks from here on, the timer
+	 * thread is gone so it won't reconnect either */
+	if (rcd->client)
+		jack_client_close(rcd->client);
+	rcd->client = NULL;
 
-	/* Close output file */
-	recorder_close_file(rcd);
+	/* Close output files, the spare one gets removed */
+	recorder_close_file(rcd, rcd->out);
+	rcd->out = NULL;
+	recorder_close_file(rcd, rcd->spare);
+	rcd->spare = NULL;
+	while (rcd->retired) {
+		next = rcd->retired->next;
+		recorder_close_file(rcd, rcd->retired);
+		rcd->retired = next;
+	}
 
-	/* Free buffers */
-	if (rcd->inbuff)
-		free(rcd->inbuff);
-	if (rcd->inbuff_copy)
-		free(rcd->inbuff_copy);
-	if (rcd->outbuff)
-		free(rcd->outbuff);
+	/* Free buffers, they all live on the arena except
+	 * for the spool and the tap */
+	rcd->inbuff = NULL;
+	rcd->inbuff_copy = NULL;
+	rcd->ring = NULL;
+	rcd->outbuff = NULL;
+	arena_cleanup(&rcd->arena);
+	spool_cleanup(&rcd->spool);
+	tap_cleanup(&rcd->tap);
+	if (rcd->resampler_state)
+		src_delete(rcd->resampler_state);
+	rcd->resampler_state = NULL;
+	monitor_cleanup(&rcd->monitor);
 
 	/* Clean up GUI resources */
 	if (!rcd->headless)
-		recorder_cleanup_gui(rcd);
+		gui_cleanup(rcd);
 
 	return;
 }
@@ -525,6 +2058,66 @@ recorder_shutdown(void *arg)
 * ENTRY POINTS *
 \**************/
 
+/**
+ * Copies the path of the active file and reports how much
+ * has been written so far, on this file and the ones
+ * before it. The path is left empty if there is no active
+ * file.
+ */
+void
+recorder_get_file_info(struct recorder *rcd, char *path, uint64_t *bytes)
+{
+	struct stat st = { 0 };
+
+	path[0] = '\0';
+	pthread_mutex_lock(&files_mutex);
+	if (rcd->out)
+		memcpy(path, rcd->out->path, PATH_MAX);
+	pthread_mutex_unlock(&files_mutex);
+
+	*bytes = __atomic_load_n(&rcd->stats.bytes_closed, __ATOMIC_RELAXED);
+	if (path[0] && stat(path, &st) == 0)
+		*bytes += st.st_size;
+}
+
+/**
+ * Checks if name is the active file or one waiting to be
+ * closed, on any of the targets it's written to
+ */
+int
+recorder_file_in_use(struct recorder *rcd, const char *name)
+{
+	struct recorder_file *file = NULL;
+	const char *base = NULL;
+	int in_use = 0;
+	int i = 0;
+
+	pthread_mutex_lock(&files_mutex);
+	file = rcd->out ? rcd->out : rcd->retired;
+	while (file && !in_use) {
+		for (i = 0; i < file->num_sinks && !in_use; i++) {
+			base = strrchr(file->sinks[i].path, '/');
+			in_use = base && !strcmp(base + 1, name);
+		}
+		file = (file == rcd->out) ? rcd->retired : file->next;
+	}
+	pthread_mutex_unlock(&files_mutex);
+
+	return in_use;
+}
+
+/**
+ * Removes a finished output file along with its sidecars
+ */
+int
+recorder_remove_file(const char *path)
+{
+	if (unlink(path) < 0)
+		return RECORDER_INVALID;
+	recorder_move_sidecars(path, NULL);
+	return 0;
+}
+
 /**
  * Stops an active recording
  */
@@ -533,6 +2126,14 @@ recorder_stop(struct recorder *rcd)
 {
 	int ret = 0;
 
+	/* Don't resume once the JACK server is back */
+	rcd->jack_resume = 0;
+
+	/* Drop a start the timer thread didn't get to */
+	if (__atomic_exchange_n(&rcd->start_pending, 0, __ATOMIC_RELAXED) &&
+	    recorder_state == RECORDER_STOPPED)
+		return 0;
+
 	/* Avoid re-closing an already closed file and don't try to
 	 * stop when switching states */
 	if (recorder_state == RECORDER_STOPPED
@@ -548,14 +2149,13 @@ recorder_stop(struct recorder *rcd)
 	if (!rcd->headless) {
 		/* Prevent user from interacting with the button */
 		if (recorder_state != RECORDER_DELAYED_STOP)
-			recorder_update_gui_button_state(rcd,
-							 GUI_BUTTON_DISABLED);
+			gui_update_button_state(rcd, GUI_BUTTON_DISABLED);
 
 		/* Since the user can't interact with the button
 		 * we need another way to come back here to stop
 		 * the recorder. Set the state to RECORDER_DELAYED_STOP
-		 * and let the timer thread make the call when it
-		 * exits.*/
+		 * and let the timer thread make the call once
+		 * enough time has passed.*/
 		if (rcd->secs_recorded < RECORDER_STOP_DELAY_SECS) {
 			recorder_state = RECORDER_DELAYED_STOP;
 			return RECORDER_AGAIN;
@@ -563,18 +2163,23 @@ recorder_stop(struct recorder *rcd)
 	}
 
 	/* If there is no GUI or we operate on logger
-	 * mode (so no button) shut down instead */
-	if (rcd->headless || rcd->opmode == RECORDER_LOGGER) {
+	 * mode (so no button) shut down instead, unless
+	 * we can be started again through the control
+	 * socket */
+	if (!rcd->ctl_path &&
+	    (rcd->headless || rcd->opmode == RECORDER_LOGGER)) {
 		recorder_shutdown((void *)rcd);
 		return 0;
 	}
 
-	recorder_close_file(rcd);
-	recorder_set_timer_state(rcd, 0);
+	/* The process callback stops feeding the consumer on the
+	 * next period, let the timer thread handle the file and
+	 * prepare a new one for the next start */
 	recorder_state = RECORDER_STOPPED;
+	recorder_timer_kick();
 
 	if (!rcd->headless)
-		recorder_update_gui_button_state(rcd, GUI_BUTTON_RAISED);
+		gui_update_button_state(rcd, GUI_BUTTON_RAISED);
 
 	return ret;
 }
@@ -587,177 +2192,393 @@ recorder_start(struct recorder *rcd)
 {
 	int ret = 0;
 
+	struct recorder_file *file = NULL;
+
 	/* Already running or switching states */
 	if (recorder_state == RECORDER_RUNNING
+	    || recorder_state == RECORDER_ARMED
 	    || recorder_state == RECORDER_TRANSITION)
 		return RECORDER_AGAIN;
 
 	recorder_state = RECORDER_TRANSITION;
 
 	if (!rcd->headless)
-		recorder_update_gui_button_state(rcd, GUI_BUTTON_DISABLED);
+		gui_update_button_state(rcd, GUI_BUTTON_DISABLED);
 
-	/* Open a new file to write to */
-	rcd->out = NULL;
-	rcd->out = recorder_open_new_file(rcd);
-	if (!rcd->out)
-		return RECORDER_SNDFILE_ERR;
+	/* The timer thread may not have handled the previous
+	 * stop yet, let the consumer finish with it first */
+	recorder_drain(rcd);
+	recorder_retire_file(rcd);
 
-	/* Create the timer thread if needed */
-	ret = recorder_set_timer_state(rcd, 1);
-	if (ret < 0)
-		goto cleanup;
+	/* Don't carry commands over from the previous one */
+	__atomic_store_n(&rcd->ctl_pending, 0, __ATOMIC_RELAXED);
+	recorder_flush_markers(rcd);
 
-	/* Create the consumer thread if needed */
-	ret = recorder_set_consumer_state(rcd, 1);
-	if (ret < 0)
+	/* Grab the pre-opened file, or open a new one if
+	 * there is none */
+	file = recorder_get_next_file(rcd);
+	if (!file) {
+		ret = RECORDER_SNDFILE_ERR;
 		goto cleanup;
+	}
+
+	pthread_mutex_lock(&files_mutex);
+	pthread_mutex_lock(&consumer_process_mutex);
+	rcd->out = file;
+	stream_set_file(file);
+	pthread_mutex_unlock(&consumer_process_mutex);
+	pthread_mutex_unlock(&files_mutex);
+
+	/* Threads are already there, all that's left is to let
+	 * the process callback pick this up on the next period */
+	rcd->secs_recorded = 0;
+	rcd->start_request_usecs = recorder_get_usecs();
+	recorder_state = RECORDER_ARMED;
+
+	/* Rename the file and prepare the next one in
+	 * the background */
+	recorder_timer_kick();
 
  cleanup:
 	if (ret < 0) {
-		recorder_set_consumer_state(rcd, 0);
-		recorder_set_timer_state(rcd, 0);
-		recorder_close_file(rcd);
 		recorder_state = RECORDER_STOPPED;
 		if (!rcd->headless)
-			recorder_update_gui_button_state(rcd,
-							 GUI_BUTTON_RAISED);
+			gui_update_button_state(rcd, GUI_BUTTON_RAISED);
 	} else {
-		recorder_state = RECORDER_RUNNING;
 		if (!rcd->headless)
-			recorder_update_gui_button_state(rcd,
-							 GUI_BUTTON_PRESSED);
+			gui_update_button_state(rcd, GUI_BUTTON_PRESSED);
 	}
 
 	return ret;
 }
 
 /**
- * Initialize the recorder
+ * Has the timer thread start recording, for callers that
+ * can't block until the previous recording is written out
+ * (see recorder_start()). Returns before it's started.
  */
 int
-recorder_initialize(struct recorder *rcd)
+recorder_request_start(struct recorder *rcd)
 {
-	int ret = 0;
-	jack_status_t status = 0;
-	jack_options_t options = JackNoStartServer;
-	char *client_name = NULL;
-	int jack_samplerate = 0;
-	int maxframes = 0;
-	int num_channels = 0;
+	if (recorder_state == RECORDER_RUNNING
+	    || recorder_state == RECORDER_ARMED
+	    || recorder_state == RECORDER_TRANSITION)
+		return RECORDER_AGAIN;
 
-	recorder_state = RECORDER_NOT_INITIALIZED;
+	if (__atomic_exchange_n(&rcd->start_pending, 1, __ATOMIC_RELAXED))
+		return RECORDER_AGAIN;
 
-	/* Open a client connection to the default JACK server */
-	rcd->client = jack_client_open("Audio Coffin", options, &status, NULL);
-	if (rcd->client == NULL) {
-		fprintf(stderr,
-			"jack_client_open() failed, status = 0x%2.0x\n",
-			status);
-		if (status & JackServerFailed)
-			fprintf(stderr, "Unable to connect to JACK server\n");
-		return RECORDER_JACKD_ERR;
-	}
+	recorder_timer_kick();
 
-	if (status & JackServerStarted)
-		fprintf(stderr, "JACK server started\n");
+	return 0;
+}
 
-	if (status & JackNameNotUnique) {
-		client_name = jack_get_client_name(rcd->client);
-		fprintf(stderr, "Unique name `%s' assigned\n", client_name);
-	}
+/**
+ * Swaps in new output settings, they take effect on the next
+ * file (so on the next rotation / start), the active one is
+ * left alone. The pre-opened spare file was opened with the
+ * old ones, so it gets dropped and re-opened by the timer
+ * thread. The storage path is used as is, it's up to the
+ * caller to keep it around.
+ */
+int
+recorder_set_output(struct recorder *rcd, char *storage_path, int format,
+		    double quality, double comp_level,
+		    uint32_t logrotate_interval_secs)
+{
+	struct recorder_file *spare = NULL;
+	SF_INFO info = rcd->info;
+
+	info.format = recorder_get_sf_format(format);
+	if (!info.format || !sf_format_check(&info))
+		return RECORDER_INVALID;
+
+	pthread_mutex_lock(&files_mutex);
+	rcd->storage_path = storage_path;
+	rcd->format = format;
+	rcd->info.format = info.format;
+	rcd->quality = quality;
+	rcd->comp_level = comp_level;
+	rcd->logrotate_interval_secs = logrotate_interval_secs;
+	spare = rcd->spare;
+	rcd->spare = NULL;
+	pthread_mutex_unlock(&files_mutex);
+
+	recorder_close_file(rcd, spare);
+	recorder_timer_kick();
+
+	return 0;
+}
 
+/**
+ * Replaces the spare file with one opened with the current
+ * output settings, so that they take effect on the next
+ * rotation without the consumer having to open a file.
+ * Called from the timer thread.
+ */
+void
+recorder_renew_spare(struct recorder *rcd)
+{
+	struct recorder_file *spare = NULL;
 
-	/* Get maximum real time priority of jack threads */
-	rcd->rtprio = jack_client_max_real_time_priority(rcd->client);
-	if (rcd->rtprio < 0) {
-		ret = RECORDER_JACKD_ERR;
-		goto cleanup;
-	}
+	pthread_mutex_lock(&files_mutex);
+	spare = rcd->spare;
+	rcd->spare = NULL;
+	pthread_mutex_unlock(&files_mutex);
 
+	recorder_close_file(rcd, spare);
+	if (recorder_state != RECORDER_NOT_INITIALIZED)
+		recorder_open_spare(rcd);
+}
 
-	/* Register callbacks on JACK */
-	jack_set_process_callback(rcd->client, recorder_process, rcd);
-	jack_on_shutdown(rcd->client, recorder_shutdown, rcd);
+/**
+ * Switches to a new file, starting with the next period
+ */
+int
+recorder_rotate(struct recorder *rcd)
+{
+	if (recorder_state != RECORDER_RUNNING)
+		return RECORDER_AGAIN;
 
+	rcd->secs_recorded = 0;
+	__atomic_or_fetch(&rcd->ctl_pending, RECORDER_BLOCK_ROTATE,
+			  __ATOMIC_RELEASE);
 
-	/* Register ports */
-	rcd->inL = jack_port_register(rcd->client, "AudioL",
-				      JACK_DEFAULT_AUDIO_TYPE,
-				      JackPortIsInput, 0);
-	if (rcd->inL == NULL) {
-		ret = RECORDER_JACKD_ERR;
-		goto cleanup;
-	}
+	return 0;
+}
 
-	if (rcd->stereo) {
-		rcd->inR = jack_port_register(rcd->client, "AudioR",
-					      JACK_DEFAULT_AUDIO_TYPE,
-					      JackPortIsInput, 0);
-		if (rcd->inR == NULL) {
-			ret = RECORDER_JACKD_ERR;
-			goto cleanup;
-		}
-	}
+/**
+ * Puts a marker with the given label on the next period,
+ * tabs / newlines in the label become spaces
+ */
+int
+recorder_mark(struct recorder *rcd, const char *label)
+{
+	struct recorder_marker *marker = NULL;
+	struct recorder_marker **tail = NULL;
+	int i = 0;
+
+	if (recorder_state != RECORDER_RUNNING)
+		return RECORDER_AGAIN;
+
+	marker = malloc(sizeof(struct recorder_marker));
+	if (!marker)
+		return RECORDER_NOMEM;
+	memset(marker, 0, sizeof(struct recorder_marker));
+
+	snprintf(marker->label, RECORDER_MARKER_LABEL_MAX, "%s", label);
+	for (i = 0; marker->label[i]; i++)
+		if (marker->label[i] == '\t' || marker->label[i] == '\n' ||
+		    marker->label[i] == '\r')
+			marker->label[i] = ' ';
+
+	/* Queue it before the process callback gets to see
+	 * the new count */
+	pthread_mutex_lock(&markers_mutex);
+	for (tail = &rcd->markers; *tail; tail = &(*tail)->next) ;
+	*tail = marker;
+	__atomic_store_n(&rcd->marks_queued, rcd->marks_queued + 1,
+			 __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&markers_mutex);
+
+	return 0;
+}
 
+/**
+ * Sets up everything past the JACK client, the output
+ * format, the resampler, the buffers and our threads, for
+ * input at in_sample_rate in periods of up to max_frames
+ */
+static int
+recorder_setup(struct recorder *rcd, uint32_t in_sample_rate,
+	       uint32_t max_frames)
+{
+	size_t ring_size = 0;
+	int ret = 0;
+	int num_channels = 0;
 
 	/* Initialize output format */
 	num_channels = (rcd->stereo) ? 2 : 1;
 	rcd->info.samplerate = rcd->sample_rate;
 	rcd->info.channels = num_channels;
-	switch (rcd->format) {
-	case RECORDER_FORMAT_FLAC:
-		rcd->info.format = SF_FORMAT_FLAC | SF_FORMAT_PCM_24;
-		break;
-	case RECORDER_FORMAT_OGG_VORBIS:
-		rcd->info.format = SF_FORMAT_OGG | SF_FORMAT_VORBIS;
-		break;
-	default:
-		ret = RECORDER_INVALID;
-		goto cleanup;
-	}
+	rcd->info.format = recorder_get_sf_format(rcd->format);
+	if (!rcd->info.format)
+		return RECORDER_INVALID;
 
 	if (!sf_format_check(&rcd->info)) {
 		fprintf(stderr, "output file format error\n");
-		ret = RECORDER_SNDFILE_ERR;
-		goto cleanup;
+		return RECORDER_SNDFILE_ERR;
+	}
+
+#ifndef ENABLE_LIBFLAC
+	if (rcd->flac.direct) {
+		fprintf(stderr, "Built without libFLAC, encoding FLAC "
+			"through libsndfile\n");
+		rcd->flac.direct = 0;
 	}
+#endif
 
 
 	/* Initialize resampler */
-	jack_samplerate = jack_get_sample_rate(rcd->client);
+	rcd->in_sample_rate = in_sample_rate;
 	rcd->resampler_ratio =
-	    (double)rcd->sample_rate / (double)jack_samplerate;
-	rcd->resampler_state = src_new(SRC_SINC_FASTEST, num_channels, &ret);
+	    (double)rcd->sample_rate / (double)in_sample_rate;
+	rcd->resampler_state = src_new(rcd->resampler_type, num_channels,
+				       &ret);
 	if (ret != 0) {
 		printf("resampler: %s\n", src_strerror(ret));
-		return -1;
+		return RECORDER_RESAMPLER_ERR;
 	}
+	rcd->resampler_state_type = rcd->resampler_type;
 
 
-	/* Initialize buffers */
-	maxframes = jack_get_buffer_size(rcd->client);
-	rcd->inbuff_size = num_channels * maxframes * sizeof(float);
-	rcd->inbuff = malloc(rcd->inbuff_size);
-	if (rcd->inbuff == NULL) {
-		ret = RECORDER_NOMEM;
-		goto cleanup;
-	}
-	rcd->inbuff_copy = malloc(rcd->inbuff_size);
-	if (rcd->inbuff_copy == NULL) {
-		ret = RECORDER_NOMEM;
-		goto cleanup;
+	/* Initialize signal monitor */
+	ret = monitor_init(&rcd->monitor, num_channels, in_sample_rate);
+	if (ret < 0)
+		return ret;
+
+	/* Publish what we capture for local readers */
+	if (rcd->tap.name) {
+		if (!rcd->tap.secs)
+			rcd->tap.secs = TAP_DEFAULT_SECS;
+		ret = tap_init(&rcd->tap, num_channels, in_sample_rate,
+			       max_frames);
+		if (ret < 0)
+			return ret;
 	}
+
+	/* Initialize free space forecasting */
+	space_init(&rcd->space);
+
+	/* Initialize adaptive degradation */
+	load_init(&rcd->load, rcd);
+
+	if (rcd->rtstats.enabled)
+		rtstats_init(&rcd->rtstats, in_sample_rate);
+
+
+	/* Initialize buffers, all on the arena, with room
+	 * for buffer_secs of audio on the ring in periods of
+	 * max_frames */
+	if (!rcd->buffer_secs)
+		rcd->buffer_secs = RECORDER_RING_SECS;
+	rcd->inbuff_size = num_channels * max_frames * sizeof(float);
 	rcd->max_out_frames =
-	    ((int)(((double)rcd->sample_rate / (double)jack_samplerate) + 1.0))
-	    * num_channels * maxframes;
+	    ((int)(((double)rcd->sample_rate / (double)in_sample_rate) + 1.0))
+	    * num_channels * max_frames;
 	rcd->outbuff_size = rcd->max_out_frames * sizeof(float);
-	rcd->outbuff = malloc(rcd->outbuff_size);
-	if (rcd->outbuff == NULL) {
-		ret = RECORDER_NOMEM;
-		goto cleanup;
+	ring_size = rcd->buffer_secs * in_sample_rate * num_channels *
+		    sizeof(float) +
+		    (rcd->buffer_secs * in_sample_rate / max_frames + 1) *
+		    sizeof(struct recorder_block);
+
+	/* Spool mins of audio on disk, offline the caller
+	 * waits for the consumer anyway. Mapped before memory
+	 * gets locked, see spool_enable() */
+	if (rcd->spool.mins && !rcd->offline) {
+		ret = spool_init(&rcd->spool, (size_t)rcd->spool.mins * 60 *
+				 (in_sample_rate * num_channels *
+				  sizeof(float) +
+				  (in_sample_rate / max_frames + 1) *
+				  sizeof(struct recorder_block)));
+		if (ret < 0)
+			return ret;
+	}
+
+	if (rcd->lock_all)
+		arena_lock_all();
+
+	if (rcd->spool.ring) {
+		ret = spool_enable(&rcd->spool);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = arena_init(&rcd->arena, 2 * arena_round(rcd->inbuff_size) +
+			 arena_round(rcd->outbuff_size) +
+			 arena_ringbuffer_size(ring_size));
+	if (ret < 0)
+		return ret;
+
+	rcd->inbuff = arena_alloc(&rcd->arena, rcd->inbuff_size);
+	if (rcd->inbuff == NULL)
+		return RECORDER_NOMEM;
+	rcd->inbuff_copy = arena_alloc(&rcd->arena, rcd->inbuff_size);
+	if (rcd->inbuff_copy == NULL)
+		return RECORDER_NOMEM;
+	rcd->outbuff = arena_alloc(&rcd->arena, rcd->outbuff_size);
+	if (rcd->outbuff == NULL)
+		return RECORDER_NOMEM;
+	rcd->ring = arena_ringbuffer(&rcd->arena, ring_size);
+	if (rcd->ring == NULL)
+		return RECORDER_NOMEM;
+
+	/* Link the first file we close to the
+	 * last one of the previous run */
+	manifest_init(rcd);
+
+	/* Before any file gets opened, so that they all
+	 * keep their heads for the listeners */
+	if (rcd->stream_port) {
+		ret = stream_init(rcd);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* Before the timer thread gets to create any files,
+	 * see ctl_init() */
+	if (rcd->ctl_path) {
+		ret = ctl_init(rcd);
+		if (ret < 0)
+			return ret;
+	}
+
+	/* Bring up the timer and consumer threads, they stay
+	 * around for the lifetime of the recorder */
+	ret = recorder_set_timer_state(rcd, 1);
+	if (ret < 0)
+		return ret;
+
+	ret = recorder_set_consumer_state(rcd, 1);
+	if (ret < 0)
+		return ret;
+
+	/* Metrics, stream and control requests get served
+	 * from the event loop thread, off the audio path */
+	if (rcd->metrics_port) {
+		ret = metrics_init(rcd);
+		if (ret < 0)
+			return ret;
 	}
 
+	if (rcd->metrics_port || rcd->stream_port || rcd->ctl_path)
+		ret = evloop_start();
+
+	return ret;
+}
+
+/**
+ * Initialize the recorder
+ */
+int
+recorder_initialize(struct recorder *rcd)
+{
+	int ret = 0;
+
+	recorder_state = RECORDER_NOT_INITIALIZED;
+	rcd->offline = 0;
+
+	jack_set_error_function(recorder_jack_error);
+	ret = recorder_jack_open(rcd);
+	if (ret < 0)
+		return ret;
+
+
+	ret = recorder_setup(rcd, jack_get_sample_rate(rcd->client),
+			     jack_get_buffer_size(rcd->client));
+	if (ret < 0)
+		goto cleanup;
+
 
 	/* Tell the JACK server that we are ready to roll.  Our
 	 * process() callback will start running now. */
@@ -767,21 +2588,54 @@ recorder_initialize(struct recorder *rcd)
 		goto cleanup;
 	}
 
+	/* Let the timer thread connect our ports to
+	 * their sources */
+	__atomic_store_n(&rcd->jack_ports_changed, 1, __ATOMIC_RELEASE);
+
 
 	/* No interaction when on logger mode, start the recorder
 	 * immediately */
 	if (rcd->opmode == RECORDER_LOGGER)
 		recorder_start(rcd);
-	else
+	else {
 		recorder_state = RECORDER_STOPPED;
+		recorder_timer_kick();
+	}
 
  cleanup:
+	if (ret < 0)
+		recorder_shutdown((void *)rcd);
+
+	return ret;
+}
+
+/**
+ * Initialize the recorder without a JACK client, audio gets
+ * fed through recorder_capture() in periods of up to
+ * max_frames frames. The recorder starts in the stopped
+ * state, regardless of the operation mode.
+ */
+int
+recorder_initialize_offline(struct recorder *rcd, uint32_t in_sample_rate,
+			    uint32_t max_frames)
+{
+	int ret = 0;
+
+	recorder_state = RECORDER_NOT_INITIALIZED;
+	rcd->offline = 1;
+	rcd->client = NULL;
+	rcd->rtprio = 0;
+
+	ret = recorder_setup(rcd, in_sample_rate, max_frames);
 	if (ret < 0) {
-		jack_client_close(rcd->client);
 		recorder_shutdown((void *)rcd);
+		return ret;
 	}
 
-	return ret;
+	recorder_state = RECORDER_STOPPED;
+	recorder_timer_kick();
+
+	return 0;
 }
 
 void
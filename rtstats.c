@@ -0,0 +1,271 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Process callback timing statistics
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf */
+#include <string.h>		/* For memset */
+#include <time.h>		/* For clock_gettime / nanosleep */
+
+/*
+ * The process callback is the only writer of the histograms,
+ * so it just does relaxed loads / stores on them without any
+ * read-modify-write. The timer thread reads them the same way
+ * when dumping, so a dump may be off by a period here and
+ * there, but never blocks the callback.
+ *
+ * Time is kept in ticks of the TSC where we have one (assumed
+ * to be constant / invariant, as on any recent x86), else of
+ * CLOCK_MONOTONIC in nsecs, and converted to usecs when
+ * recording.
+ */
+
+volatile sig_atomic_t rtstats_dump_requested = 0;
+
+static const char *hist_names[RTSTATS_NUM_HISTS] = {
+	"callback",
+	"lock wait",
+	"jitter"
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+static uint64_t
+rtstats_clock_nsecs(void)
+{
+	struct timespec ts = { 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Figures out how many ticks we get per usec
+ */
+static double
+rtstats_calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	struct timespec delay = { 0, 20 * 1000 * 1000 };
+	uint64_t start_nsecs = 0;
+	uint64_t start_ticks = 0;
+	uint64_t nsecs = 0;
+	uint64_t ticks = 0;
+
+	start_nsecs = rtstats_clock_nsecs();
+	start_ticks = rtstats_ticks();
+	nanosleep(&delay, NULL);
+	ticks = rtstats_ticks() - start_ticks;
+	nsecs = rtstats_clock_nsecs() - start_nsecs;
+
+	return (double)ticks * 1000.0 / (double)nsecs;
+#else
+	return 1000.0;
+#endif
+}
+
+static void
+rtstats_record(struct rtstats_hist *hist, uint32_t usecs)
+{
+	int bucket = usecs ? 32 - __builtin_clz(usecs) : 0;
+
+	if (bucket >= RTSTATS_BUCKETS)
+		bucket = RTSTATS_BUCKETS - 1;
+
+	__atomic_store_n(&hist->count[bucket], hist->count[bucket] + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&hist->total_usecs, hist->total_usecs + usecs,
+			 __ATOMIC_RELAXED);
+	if (usecs > hist->max_usecs)
+		__atomic_store_n(&hist->max_usecs, usecs, __ATOMIC_RELAXED);
+}
+
+static uint32_t
+rtstats_to_usecs(struct rtstats *st, uint64_t ticks)
+{
+	return (uint32_t) ((double)ticks * st->usecs_per_tick);
+}
+
+static void
+rtstats_dump_hist(struct rtstats_hist *hist, const char *name)
+{
+	uint64_t count[RTSTATS_BUCKETS] = { 0 };
+	uint64_t total = 0;
+	uint64_t samples = 0;
+	char line[512] = { 0 };
+	int len = 0;
+	int i = 0;
+
+	for (i = 0; i < RTSTATS_BUCKETS; i++) {
+		count[i] = __atomic_load_n(&hist->count[i], __ATOMIC_RELAXED);
+		samples += count[i];
+	}
+	total = __atomic_load_n(&hist->total_usecs, __ATOMIC_RELAXED);
+
+	/* Bucket i holds values below 2^i usecs */
+	for (i = 0; i < RTSTATS_BUCKETS && len < (int)sizeof(line); i++) {
+		if (!count[i])
+			continue;
+		len += snprintf(line + len, sizeof(line) - len, " <%u:%llu",
+				1U << i, (unsigned long long)count[i]);
+	}
+
+	fprintf(stderr, "rtstats: %-9s mean %.1f max %u usecs |%s\n", name,
+		samples ? (double)total / (double)samples : 0.0,
+		__atomic_load_n(&hist->max_usecs, __ATOMIC_RELAXED), line);
+}
+
+static void
+rtstats_dump(struct rtstats *st)
+{
+	time_t curr_time = 0;
+	char date_time[26] = { 0 };
+	int i = 0;
+
+	time(&curr_time);
+	strftime(date_time, 26, "%F %T", localtime(&curr_time));
+
+	fprintf(stderr, "[%s] rtstats: %llu periods, %llu over budget, "
+		"%u xruns\n", date_time,
+		(unsigned long long)__atomic_load_n(&st->periods,
+						    __ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&st->over_budget,
+						    __ATOMIC_RELAXED),
+		__atomic_load_n(&st->xruns, __ATOMIC_RELAXED));
+	for (i = 0; i < RTSTATS_NUM_HISTS; i++)
+		rtstats_dump_hist(&st->hists[i], hist_names[i]);
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Current time in ticks, cheap enough for the
+ * process callback
+ */
+uint64_t
+rtstats_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return rtstats_clock_nsecs();
+#endif
+}
+
+/**
+ * Called at the start of the process callback, records
+ * how far off the period boundary we got called. Returns
+ * the start time for rtstats_end().
+ */
+uint64_t
+rtstats_begin(struct rtstats *st, jack_nframes_t nframes)
+{
+	uint64_t now = rtstats_ticks();
+	uint64_t period = (uint64_t) nframes * st->ticks_per_frame;
+	uint64_t interval = now - st->last_begin;
+
+	if (st->last_begin)
+		rtstats_record(&st->hists[RTSTATS_JITTER],
+			       rtstats_to_usecs(st, interval > period ?
+						interval - period :
+						period - interval));
+	st->last_begin = now;
+
+	return now;
+}
+
+/**
+ * Called at the end of the process callback
+ */
+void
+rtstats_end(struct rtstats *st, uint64_t start, jack_nframes_t nframes)
+{
+	uint64_t ticks = rtstats_ticks() - start;
+
+	rtstats_record(&st->hists[RTSTATS_CALLBACK],
+		       rtstats_to_usecs(st, ticks));
+	__atomic_store_n(&st->periods, st->periods + 1, __ATOMIC_RELAXED);
+	if (ticks > (uint64_t) nframes * st->ticks_per_frame)
+		__atomic_store_n(&st->over_budget, st->over_budget + 1,
+				 __ATOMIC_RELAXED);
+}
+
+/**
+ * Records the time we spent waiting for a lock,
+ * since start
+ */
+void
+rtstats_lock_wait(struct rtstats *st, uint64_t start)
+{
+	rtstats_record(&st->hists[RTSTATS_LOCK_WAIT],
+		       rtstats_to_usecs(st, rtstats_ticks() - start));
+}
+
+/**
+ * Called from JACK's xrun callback, that one doesn't run
+ * on the process thread so this one is atomic
+ */
+void
+rtstats_xrun(struct rtstats *st)
+{
+	__atomic_add_fetch(&st->xruns, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Called from the timer thread once per second, dumps
+ * the stats every dump_interval_secs, or when asked to
+ * through rtstats_dump_requested (SIGUSR1)
+ */
+void
+rtstats_update(struct rtstats *st)
+{
+	if (!st->enabled)
+		return;
+
+	st->secs_since_dump++;
+	if (rtstats_dump_requested ||
+	    (st->dump_interval_secs &&
+	     st->secs_since_dump >= st->dump_interval_secs)) {
+		rtstats_dump_requested = 0;
+		st->secs_since_dump = 0;
+		rtstats_dump(st);
+	}
+}
+
+void
+rtstats_init(struct rtstats *st, uint32_t sample_rate)
+{
+	double ticks_per_usec = 0.0;
+
+	memset(st->hists, 0, sizeof(st->hists));
+	st->periods = 0;
+	st->over_budget = 0;
+	st->xruns = 0;
+	st->last_begin = 0;
+	st->secs_since_dump = 0;
+
+	ticks_per_usec = rtstats_calibrate();
+	st->usecs_per_tick = 1.0 / ticks_per_usec;
+	st->ticks_per_frame = (uint64_t) (ticks_per_usec * 1000000.0 /
+					  (double)sample_rate);
+}
@@ -0,0 +1,277 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. SHA-256 for the hash manifests
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "manifest.h"
+#include <stdio.h>		/* For snprintf() */
+#include <stdlib.h>		/* For malloc() / free() */
+#include <string.h>		/* For memcpy / memset */
+#include <errno.h>		/* For errno */
+#include <unistd.h>		/* For pread() */
+
+/*
+ * Plain FIPS 180-4 SHA-256, shared by the recorder and
+ * acoffin-verify, plus the segment / chain hashes of the
+ * manifest format described in manifest.h.
+ */
+
+#define SHA256_READ_SIZE	(1024 * 1024)
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+static inline uint32_t
+sha256_ror(uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+static void
+sha256_block(struct sha256 *ctx, const uint8_t *block)
+{
+	uint32_t w[64] = { 0 };
+	uint32_t s[8] = { 0 };
+	uint32_t t1 = 0;
+	uint32_t t2 = 0;
+	int i = 0;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32_t)block[4 * i] << 24) |
+		       ((uint32_t)block[4 * i + 1] << 16) |
+		       ((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (sha256_ror(w[i - 15], 7) ^ sha256_ror(w[i - 15], 18) ^
+			(w[i - 15] >> 3)) +
+		       (sha256_ror(w[i - 2], 17) ^ sha256_ror(w[i - 2], 19) ^
+			(w[i - 2] >> 10));
+
+	memcpy(s, ctx->state, sizeof(s));
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + (sha256_ror(s[4], 6) ^ sha256_ror(s[4], 11) ^
+			     sha256_ror(s[4], 25)) +
+		     ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+		t2 = (sha256_ror(s[0], 2) ^ sha256_ror(s[0], 13) ^
+		      sha256_ror(s[0], 22)) +
+		     ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + t1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = t1 + t2;
+	}
+
+	for (i = 0; i < 8; i++)
+		ctx->state[i] += s[i];
+}
+
+/**
+ * Feeds fd's bytes from offset up to end to ctx
+ */
+static int
+sha256_read(struct sha256 *ctx, int fd, uint64_t offset, uint64_t end)
+{
+	uint8_t *buf = NULL;
+	size_t len = 0;
+	ssize_t ret = 0;
+
+	if (offset >= end)
+		return 0;
+
+	buf = malloc(SHA256_READ_SIZE);
+	if (!buf)
+		return -1;
+
+	while (offset < end) {
+		len = end - offset < SHA256_READ_SIZE ? end - offset :
+		      SHA256_READ_SIZE;
+		ret = pread(fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		sha256_update(ctx, buf, ret);
+		offset += ret;
+	}
+	free(buf);
+
+	return offset < end ? -1 : 0;
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+void
+sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memset(ctx, 0, sizeof(struct sha256));
+	memcpy(ctx->state, iv, sizeof(iv));
+}
+
+void
+sha256_update(struct sha256 *ctx, const void *data, size_t len)
+{
+	const uint8_t *ptr = (const uint8_t *)data;
+	size_t used = ctx->bytes & 63;
+	size_t fill = 0;
+
+	ctx->bytes += len;
+
+	if (used) {
+		fill = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->block + used, ptr, fill);
+		ptr += fill;
+		len -= fill;
+		if (used + fill < 64)
+			return;
+		sha256_block(ctx, ctx->block);
+	}
+
+	for (; len >= 64; ptr += 64, len -= 64)
+		sha256_block(ctx, ptr);
+	memcpy(ctx->block, ptr, len);
+}
+
+void
+sha256_final(struct sha256 *ctx, uint8_t digest[SHA256_LEN])
+{
+	uint64_t bits = ctx->bytes * 8;
+	size_t used = ctx->bytes & 63;
+	int i = 0;
+
+	ctx->block[used++] = 0x80;
+	if (used > 56) {
+		memset(ctx->block + used, 0, 64 - used);
+		sha256_block(ctx, ctx->block);
+		used = 0;
+	}
+	memset(ctx->block + used, 0, 56 - used);
+	for (i = 0; i < 8; i++)
+		ctx->block[56 + i] = bits >> (56 - 8 * i);
+	sha256_block(ctx, ctx->block);
+
+	for (i = 0; i < 8; i++) {
+		digest[4 * i] = ctx->state[i] >> 24;
+		digest[4 * i + 1] = ctx->state[i] >> 16;
+		digest[4 * i + 2] = ctx->state[i] >> 8;
+		digest[4 * i + 3] = ctx->state[i];
+	}
+}
+
+void
+sha256_to_hex(const uint8_t digest[SHA256_LEN], char hex[SHA256_HEX_LEN + 1])
+{
+	int i = 0;
+
+	for (i = 0; i < SHA256_LEN; i++)
+		snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+}
+
+/**
+ * Parses SHA256_HEX_LEN hex digits, returns 0 or -1
+ */
+int
+sha256_from_hex(const char *hex, uint8_t digest[SHA256_LEN])
+{
+	unsigned int byte = 0;
+	int i = 0;
+
+	for (i = 0; i < SHA256_LEN; i++) {
+		if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			return -1;
+		digest[i] = byte;
+	}
+
+	return 0;
+}
+
+/**
+ * Segment hash of the first len bytes of fd, see manifest.h.
+ * If body is given it already holds the body's bytes, else
+ * they get read from fd as well. Returns 0 or -1.
+ */
+int
+sha256_segment(int fd, uint64_t len, struct sha256 *body,
+	       uint8_t digest[SHA256_LEN])
+{
+	uint64_t head_len = len < MANIFEST_HEAD_BYTES ? len :
+			    MANIFEST_HEAD_BYTES;
+	uint8_t hashes[2 * SHA256_LEN] = { 0 };
+	struct sha256 ctx = { 0 };
+
+	sha256_init(&ctx);
+	if (sha256_read(&ctx, fd, 0, head_len) < 0)
+		return -1;
+	sha256_final(&ctx, hashes);
+
+	if (!body) {
+		sha256_init(&ctx);
+		if (sha256_read(&ctx, fd, head_len, len) < 0)
+			return -1;
+		body = &ctx;
+	}
+	sha256_final(body, hashes + SHA256_LEN);
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, hashes, sizeof(hashes));
+	sha256_final(&ctx, digest);
+
+	return 0;
+}
+
+void
+sha256_chain(const uint8_t prev_chain[SHA256_LEN],
+	     const uint8_t segment[SHA256_LEN], uint8_t chain[SHA256_LEN])
+{
+	struct sha256 ctx = { 0 };
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, prev_chain, SHA256_LEN);
+	sha256_update(&ctx, segment, SHA256_LEN);
+	sha256_final(&ctx, chain);
+}
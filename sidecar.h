@@ -0,0 +1,41 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Sidecar files
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ACOFFIN_SIDECAR_H__
+#define __ACOFFIN_SIDECAR_H__
+
+#include "manifest.h"		/* For MANIFEST_EXT */
+
+/*
+ * Files kept next to each output file, named after it with one
+ * of these appended. Shared with the tools, so that whatever
+ * moves or removes a log along with its sidecars goes through
+ * SIDECAR_EXTS and picks up new ones.
+ */
+
+#define LOUDNESS_EXT	".loudness"
+#define PEAKS_EXT	".peaks"
+#define MARKERS_EXT	".markers"
+/* Only there while the file is being written, see tail.c */
+#define PROGRESS_EXT	".progress"
+
+#define SIDECAR_EXTS \
+	LOUDNESS_EXT, PEAKS_EXT, MARKERS_EXT, PROGRESS_EXT, MANIFEST_EXT
+
+#endif /* __ACOFFIN_SIDECAR_H__ */
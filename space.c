@@ -0,0 +1,274 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Free space forecasting
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf / snprintf */
+#include <string.h>		/* For strncmp / strcmp */
+#include <math.h>		/* For INFINITY */
+#include <dirent.h>		/* For opendir() / readdir() */
+#include <sys/stat.h>		/* For stat() */
+#include <sys/statvfs.h>	/* For statvfs() */
+
+/*
+ * Runs on the timer thread, every check_secs it statvfs()es
+ * each storage target and estimates how fast we fill it up
+ * from the bytes written to it (see storage.c), to forecast
+ * when it'll be full. Once a target we write to gets below
+ * low_mins we warn and, if asked to, remove the oldest log
+ * on it each time we check. Below critical_mins we switch to
+ * Ogg/Vorbis at degraded_quality until there is enough room
+ * again at the rate we had before, so that we don't lose
+ * audio while someone makes room.
+ *
+ * The forecast gets updated with relaxed stores, the metrics
+ * may see it a check late.
+ */
+
+/*********\
+* HELPERS *
+\*********/
+
+static const char *
+space_target_path(struct recorder *rcd, int target)
+{
+	/* Only gets swapped on the timer thread */
+	if (target == 0)
+		return rcd->storage_path;
+	return rcd->alt_storage_paths[target - 1];
+}
+
+/**
+ * Removes the oldest log on dir, except for the ones we
+ * are still writing to (here or on another target) or
+ * that someone else is, going by their progress sidecar
+ */
+static void
+space_purge(struct recorder *rcd, const char *dir)
+{
+	char path[PATH_MAX] = { 0 };
+	char oldest[PATH_MAX] = { 0 };
+	time_t oldest_mtime = 0;
+	struct dirent *entry = NULL;
+	struct stat st = { 0 };
+	size_t len = 0;
+	DIR *dp = NULL;
+
+	dp = opendir(dir);
+	if (!dp)
+		return;
+
+	while ((entry = readdir(dp))) {
+		/* Only our own logs, spare files are hidden */
+		if (strncmp(entry->d_name, "Log-", 4))
+			continue;
+		len = strlen(entry->d_name);
+		if ((len < 5 || strcmp(entry->d_name + len - 5, ".flac")) &&
+		    (len < 4 || strcmp(entry->d_name + len - 4, ".ogg")))
+			continue;
+		if (recorder_file_in_use(rcd, entry->d_name))
+			continue;
+
+		snprintf(path, PATH_MAX, "%s/%s%s", dir, entry->d_name,
+			 PROGRESS_EXT);
+		if (stat(path, &st) == 0)
+			continue;
+
+		snprintf(path, PATH_MAX, "%s/%s", dir, entry->d_name);
+		if (stat(path, &st) < 0 || !S_ISREG(st.st_mode))
+			continue;
+
+		if (!oldest[0] || st.st_mtime < oldest_mtime) {
+			memcpy(oldest, path, PATH_MAX);
+			oldest_mtime = st.st_mtime;
+		}
+	}
+	closedir(dp);
+
+	if (!oldest[0])
+		return;
+
+	if (recorder_remove_file(oldest) < 0)
+		perror("cannot remove old log");
+	else
+		fprintf(stderr, "space: removed %s to make room\n", oldest);
+}
+
+/**
+ * Updates the forecast for a target, returns how many
+ * seconds it has left if we write to it, else -1
+ */
+static double
+space_check_target(struct space_monitor *sm, struct recorder *rcd,
+		   int target)
+{
+	struct space_target *st = &sm->targets[target];
+	const char *path = space_target_path(rcd, target);
+	struct statvfs vfs = { 0 };
+	uint64_t bytes = storage_target_bytes(target);
+	uint64_t avail = 0;
+	double rate = 0.0;
+	double secs = INFINITY;
+
+	rate = (double)(bytes - st->prev_bytes) / (double)sm->check_secs;
+	st->prev_bytes = bytes;
+	if (st->bytes_per_sec > 0.0)
+		rate = SPACE_RATE_WEIGHT * rate +
+		       (1.0 - SPACE_RATE_WEIGHT) * st->bytes_per_sec;
+
+	if (statvfs(path, &vfs) < 0) {
+		fprintf(stderr, "space: statvfs(%s) failed\n", path);
+		return -1;
+	}
+	avail = (uint64_t) vfs.f_bavail * vfs.f_frsize;
+
+	/* Below a byte per sec it's just the tail of
+	 * the last recording */
+	if (rate >= 1.0)
+		secs = (double)avail / rate;
+	else
+		rate = 0.0;
+
+	__atomic_store_n(&st->avail_bytes, avail, __ATOMIC_RELAXED);
+	__atomic_store(&st->bytes_per_sec, &rate, __ATOMIC_RELAXED);
+	__atomic_store(&st->secs_to_full, &secs, __ATOMIC_RELAXED);
+
+	if (rate == 0.0)
+		return -1;
+
+	if (sm->low_mins && secs < sm->low_mins * 60.0) {
+		if (!st->low)
+			fprintf(stderr, "space: %s will be full in %.0f mins\n",
+				path, secs / 60.0);
+		st->low = 1;
+		if (sm->purge)
+			space_purge(rcd, path);
+	} else
+		st->low = 0;
+
+	return secs;
+}
+
+/**
+ * Switches to / back from a lower bitrate, depending
+ * on the tightest forecast
+ */
+static void
+space_set_degraded(struct space_monitor *sm, struct recorder *rcd,
+		   double secs, double rate)
+{
+	int ret = 0;
+
+	/* A config reload changed the output settings,
+	 * they are not ours to restore anymore */
+	if (sm->degraded && (rcd->format != RECORDER_FORMAT_OGG_VORBIS ||
+			     rcd->quality != sm->degraded_quality))
+		__atomic_store_n(&sm->degraded, 0, __ATOMIC_RELAXED);
+
+	if (!sm->degraded) {
+		if (secs < 0 || secs >= sm->critical_mins * 60.0)
+			return;
+		/* Nothing to go down to */
+		if (rcd->format == RECORDER_FORMAT_OGG_VORBIS &&
+		    rcd->quality <= sm->degraded_quality)
+			return;
+
+		sm->saved_format = rcd->format;
+		sm->saved_quality = rcd->quality;
+		sm->saved_bytes_per_sec = rate;
+		ret = recorder_set_output(rcd, rcd->storage_path,
+					  RECORDER_FORMAT_OGG_VORBIS,
+					  sm->degraded_quality,
+					  rcd->comp_level,
+					  rcd->logrotate_interval_secs);
+		if (ret < 0)
+			return;
+		__atomic_store_n(&sm->degraded, 1, __ATOMIC_RELAXED);
+		fprintf(stderr, "space: %.0f mins left, switching to "
+			"Ogg/Vorbis at quality %.2f\n", secs / 60.0,
+			sm->degraded_quality);
+		recorder_rotate(rcd);
+		return;
+	}
+
+	/* Wait for low_mins (or critical_mins if higher) of room
+	 * at the rate we had before, so that we don't bounce
+	 * back and forth */
+	if (secs >= 0 && secs * rate / sm->saved_bytes_per_sec <
+	    (sm->low_mins > sm->critical_mins ? sm->low_mins :
+	     sm->critical_mins) * 60.0)
+		return;
+
+	ret = recorder_set_output(rcd, rcd->storage_path, sm->saved_format,
+				  sm->saved_quality, rcd->comp_level,
+				  rcd->logrotate_interval_secs);
+	if (ret < 0)
+		return;
+	__atomic_store_n(&sm->degraded, 0, __ATOMIC_RELAXED);
+	fprintf(stderr, "space: enough room again, switching back\n");
+	recorder_rotate(rcd);
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Called from the timer thread once per second
+ */
+void
+space_update(struct space_monitor *sm, struct recorder *rcd)
+{
+	double secs = -1;
+	double min_secs = -1;
+	double rate = 0.0;
+	int i = 0;
+
+	if (!sm->check_secs)
+		return;
+
+	sm->secs++;
+	if (sm->secs < sm->check_secs)
+		return;
+	sm->secs = 0;
+
+	for (i = 0; i <= rcd->num_alt_storage_paths; i++) {
+		secs = space_check_target(sm, rcd, i);
+		if (secs >= 0 && (min_secs < 0 || secs < min_secs)) {
+			min_secs = secs;
+			rate = sm->targets[i].bytes_per_sec;
+		}
+	}
+
+	if (sm->critical_mins)
+		space_set_degraded(sm, rcd, min_secs, rate);
+}
+
+void
+space_init(struct space_monitor *sm)
+{
+	int i = 0;
+
+	sm->secs = 0;
+	sm->degraded = 0;
+	for (i = 0; i < STORAGE_MAX_TARGETS; i++) {
+		memset(&sm->targets[i], 0, sizeof(struct space_target));
+		sm->targets[i].secs_to_full = INFINITY;
+	}
+}
@@ -0,0 +1,290 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Disk-backed spool
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE		/* For sync_file_range() */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf / snprintf */
+#include <stdlib.h>		/* For mkstemp() / calloc() */
+#include <string.h>		/* For strerror */
+#include <errno.h>		/* For errno */
+#include <fcntl.h>		/* For posix_fallocate() / sync_file_range() */
+#include <unistd.h>		/* For unlink() / close() */
+#include <sys/mman.h>		/* For mmap() / mprotect() / madvise() */
+
+/*
+ * The ring on the arena only holds a few seconds of audio, a
+ * longer stall of the output storage (or an encoder that can't
+ * keep up for a while) would have the process callback drop
+ * periods. When enabled, the spool thread moves every block off
+ * that ring as soon as it gets there, onto a second ring that
+ * lives on a file mapping and holds mins of audio, and that's
+ * what the consumer reads from. Blocks keep their order, so
+ * commands / markers still take effect where they were meant to.
+ *
+ * The file is allocated up front, so that we never hit a full
+ * disk through the mapping (that'd be a SIGBUS), and unlinked
+ * right away. Chunks of it that fill up while the consumer is
+ * behind get written back and dropped from our mapping, chunks
+ * the consumer is done with get dropped from the page cache too,
+ * so what's kept in memory stays bounded no matter how long the
+ * spool gets. While the consumer keeps up nothing gets written
+ * back on our behalf, blocks come and go through the page cache.
+ *
+ * It should be on a local disk, spooling on the storage that
+ * stalls won't help.
+ */
+
+/*********\
+* HELPERS *
+\*********/
+
+/**
+ * Starts writing back the chunks that filled up and the
+ * consumer didn't get to yet, they don't need to stay
+ * in our mapping meanwhile. Drops the ones the consumer
+ * is done with from the page cache.
+ */
+static void
+spool_writeback(struct spool *sp)
+{
+	uint64_t consumed = sp->written -
+			    jack_ringbuffer_read_space(sp->ring);
+	size_t off = 0;
+
+	while (sp->written - sp->synced >= SPOOL_CHUNK_SIZE) {
+		off = sp->synced & sp->ring->size_mask;
+		if (consumed < sp->synced + SPOOL_CHUNK_SIZE) {
+			sync_file_range(sp->fd, off, SPOOL_CHUNK_SIZE,
+					SYNC_FILE_RANGE_WRITE);
+			madvise(sp->ring->buf + off, SPOOL_CHUNK_SIZE,
+				MADV_DONTNEED);
+		}
+		sp->synced += SPOOL_CHUNK_SIZE;
+	}
+
+	while (consumed - sp->released >= SPOOL_CHUNK_SIZE) {
+		off = sp->released & sp->ring->size_mask;
+		madvise(sp->ring->buf + off, SPOOL_CHUNK_SIZE, MADV_DONTNEED);
+		posix_fadvise(sp->fd, off, SPOOL_CHUNK_SIZE,
+			      POSIX_FADV_DONTNEED);
+		sp->released += SPOOL_CHUNK_SIZE;
+	}
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Moves every complete block on ring to the spool, as long as
+ * there is room for it, each block being a struct recorder_block
+ * followed by its frames of frame_size bytes. Spool thread only,
+ * returns how many blocks it moved.
+ */
+int
+spool_move(struct spool *sp, jack_ringbuffer_t *ring, size_t frame_size)
+{
+	struct recorder_block block = { 0 };
+	jack_ringbuffer_data_t vec[2] = { 0 };
+	size_t avail = 0;
+	size_t len = 0;
+	size_t first = 0;
+	int moved = 0;
+
+	while (1) {
+		avail = jack_ringbuffer_read_space(ring);
+		if (avail < sizeof(struct recorder_block))
+			break;
+
+		/* The frames may not be there yet, see
+		 * recorder_block_ready() */
+		jack_ringbuffer_peek(ring, (char *)&block,
+				     sizeof(struct recorder_block));
+		len = sizeof(struct recorder_block) +
+		      block.nframes * frame_size;
+		if (avail < len)
+			break;
+
+		/* Leave it on the ring, once that fills up too
+		 * the process callback drops periods as usual */
+		if (jack_ringbuffer_write_space(sp->ring) < len) {
+			if (!sp->full)
+				fprintf(stderr, "spool: full, %u mins behind\n",
+					sp->mins);
+			sp->full = 1;
+			break;
+		}
+
+		/* Straight from one ring to the other, the block
+		 * leaves the ring only after it's on the spool */
+		jack_ringbuffer_get_read_vector(ring, vec);
+		first = len < vec[0].len ? len : vec[0].len;
+		jack_ringbuffer_write(sp->ring, vec[0].buf, first);
+		if (len > first)
+			jack_ringbuffer_write(sp->ring, vec[1].buf, len - first);
+		jack_ringbuffer_read_advance(ring, len);
+		sp->written += len;
+		moved++;
+
+		/* Don't flap while the consumer catches up */
+		if (sp->full && jack_ringbuffer_read_space(sp->ring) <
+		    sp->ring->size / 2) {
+			fprintf(stderr, "spool: half empty again\n");
+			sp->full = 0;
+		}
+	}
+
+	spool_writeback(sp);
+
+	return moved;
+}
+
+/**
+ * Waits on the process callback for a bit
+ */
+void
+spool_wait(struct spool *sp)
+{
+	struct timespec tv = { 0 };
+
+	clock_gettime(CLOCK_MONOTONIC, &tv);
+	tv.tv_nsec += RECORDER_CONSUMER_POLL_MSECS * 1000000L;
+	if (tv.tv_nsec >= 1000000000L) {
+		tv.tv_sec++;
+		tv.tv_nsec -= 1000000000L;
+	}
+	pthread_mutex_lock(&sp->lock);
+	pthread_cond_timedwait(&sp->trigger, &sp->lock, &tv);
+	pthread_mutex_unlock(&sp->lock);
+}
+
+/**
+ * Creates the spool file on sp->path and maps a ring
+ * of (at least) size bytes over it. The mapping stays
+ * inaccessible until spool_enable(), so that locking
+ * memory in between (lock_all) doesn't fault it in.
+ */
+int
+spool_init(struct spool *sp, size_t size)
+{
+	char path[PATH_MAX] = { 0 };
+	size_t buf_size = SPOOL_CHUNK_SIZE;
+	pthread_condattr_t attr;
+	char *buf = MAP_FAILED;
+	int ret = 0;
+
+	while (buf_size < size)
+		buf_size <<= 1;
+
+	sp->written = 0;
+	sp->synced = 0;
+	sp->released = 0;
+	sp->full = 0;
+
+	snprintf(path, PATH_MAX, "%s/.acoffin-spool-XXXXXX",
+		 sp->path ? sp->path : SPOOL_DEFAULT_PATH);
+	sp->fd = mkstemp(path);
+	if (sp->fd < 0) {
+		fprintf(stderr, "spool: cannot create %s: %s\n", path,
+			strerror(errno));
+		return RECORDER_SPOOL_ERR;
+	}
+	/* Nobody else needs it, it goes away with us */
+	unlink(path);
+
+	ret = posix_fallocate(sp->fd, 0, buf_size);
+	if (ret != 0) {
+		fprintf(stderr, "spool: cannot allocate %zu MiB on %s: %s\n",
+			buf_size >> 20, sp->path ? sp->path :
+			SPOOL_DEFAULT_PATH, strerror(ret));
+		ret = RECORDER_SPOOL_ERR;
+		goto cleanup;
+	}
+
+	buf = mmap(NULL, buf_size, PROT_NONE, MAP_SHARED, sp->fd, 0);
+	if (buf == MAP_FAILED) {
+		perror("spool mmap()");
+		ret = RECORDER_NOMEM;
+		goto cleanup;
+	}
+
+	sp->ring = calloc(1, sizeof(jack_ringbuffer_t));
+	if (!sp->ring) {
+		munmap(buf, buf_size);
+		ret = RECORDER_NOMEM;
+		goto cleanup;
+	}
+	sp->ring->buf = buf;
+	sp->ring->size = buf_size;
+	sp->ring->size_mask = buf_size - 1;
+
+	/* We sleep on CLOCK_MONOTONIC deadlines */
+	pthread_mutex_init(&sp->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&sp->trigger, &attr);
+	pthread_condattr_destroy(&attr);
+
+	fprintf(stderr, "spool: %zu MiB on %s\n", buf_size >> 20,
+		sp->path ? sp->path : SPOOL_DEFAULT_PATH);
+
+	return 0;
+
+ cleanup:
+	close(sp->fd);
+	sp->fd = -1;
+	return ret;
+}
+
+/**
+ * Makes the mapping accessible, once memory got locked (if
+ * at all). mlockall() only marks an inaccessible mapping as
+ * locked without faulting it in, unlock it before opening it
+ * up so that it stays out of memory, and mappings created
+ * after mlockall(MCL_FUTURE) would get locked in full.
+ */
+int
+spool_enable(struct spool *sp)
+{
+	munlock(sp->ring->buf, sp->ring->size);
+	if (mprotect(sp->ring->buf, sp->ring->size,
+		     PROT_READ | PROT_WRITE) < 0) {
+		perror("spool mprotect()");
+		return RECORDER_NOMEM;
+	}
+	madvise(sp->ring->buf, sp->ring->size, MADV_SEQUENTIAL);
+
+	return 0;
+}
+
+void
+spool_cleanup(struct spool *sp)
+{
+	if (!sp->ring)
+		return;
+
+	munmap(sp->ring->buf, sp->ring->size);
+	free(sp->ring);
+	sp->ring = NULL;
+	close(sp->fd);
+	sp->fd = -1;
+	pthread_cond_destroy(&sp->trigger);
+	pthread_mutex_destroy(&sp->lock);
+}
@@ -0,0 +1,552 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Storage targets
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE		/* For syscall() */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf / snprintf / rename() */
+#include <string.h>		/* For strerror() / strrchr() / memset */
+#include <unistd.h>		/* For pwrite() / pread() / close() / link() */
+#include <fcntl.h>		/* For open() / AT_FDCWD */
+#include <errno.h>		/* For errno */
+#include <time.h>		/* For time() */
+#include <sys/syscall.h>	/* For SYS_renameat2 */
+
+/*
+ * Output files may go to more than one directory (storage
+ * target), the first one being storage_path and the rest
+ * alt_storage_paths. With the failover policy a file lives on
+ * the first usable target, with mirroring on the first two.
+ *
+ * Encoders (libsndfile through a virtual IO interface, or
+ * libFLAC, see flac.c) write through storage_write() so that
+ * the encoded stream can be written to every copy (sink) of the
+ * file. A sink that fails to write gets closed and its target
+ * is marked as failed, so that new files avoid it for
+ * STORAGE_RETRY_SECS. As long as one sink of a file is still
+ * there the write succeeds, else the file is marked as lost
+ * and the consumer moves to a new file (it doesn't rely on the
+ * encoder reporting the error, libsndfile's Vorbis writer
+ * ignores it).
+ *
+ * All of this runs on the consumer thread, except for opening
+ * / closing spare files on the timer thread, failure times and
+ * byte counts are accessed atomically since both may update
+ * them.
+ *
+ * Names only have second resolution and files may come faster
+ * than that (rotations, stop / start, recovery), so files get
+ * created and renamed without replacing anything, with a -N
+ * suffix if the name is taken on any of the targets.
+ */
+
+#define STORAGE_MAX_SUFFIX	100
+
+/* From linux/fs.h, older glibc doesn't wrap renameat2() */
+#define STORAGE_RENAME_NOREPLACE	(1 << 0)
+
+static time_t storage_failed_at[STORAGE_MAX_TARGETS];
+static uint64_t storage_bytes[STORAGE_MAX_TARGETS];
+
+/*********\
+* HELPERS *
+\*********/
+
+static const char *
+storage_target_dir(struct recorder *rcd, struct recorder_file *file,
+		   int target)
+{
+	if (target == 0)
+		return file->dir;
+	return rcd->alt_storage_paths[target - 1];
+}
+
+/**
+ * Whether new files may go to target, it's up until it
+ * fails and again STORAGE_RETRY_SECS later
+ */
+int
+storage_target_up(int target)
+{
+	time_t failed_at = __atomic_load_n(&storage_failed_at[target],
+					   __ATOMIC_RELAXED);
+
+	return !failed_at || time(NULL) - failed_at >= STORAGE_RETRY_SECS;
+}
+
+static void
+storage_target_failed(int target)
+{
+	__atomic_store_n(&storage_failed_at[target], time(NULL),
+			 __ATOMIC_RELAXED);
+}
+
+static void
+storage_sink_failed(struct storage_sink *sink, const char *what)
+{
+	fprintf(stderr, "storage: %s %s failed: %s\n", what, sink->path,
+		strerror(errno));
+	storage_target_failed(sink->target);
+	close(sink->fd);
+	sink->fd = -1;
+	sink->failed = 1;
+}
+
+static int
+storage_pwrite(int fd, const char *buf, size_t len, off_t offset)
+{
+	ssize_t ret = 0;
+
+	while (len > 0) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		/* A short write on a full disk leaves errno alone */
+		if (ret == 0)
+			errno = ENOSPC;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	return 0;
+}
+
+static struct storage_sink *
+storage_first_sink(struct recorder_file *file)
+{
+	int i = 0;
+
+	for (i = 0; i < file->num_sinks; i++)
+		if (file->sinks[i].fd >= 0)
+			return &file->sinks[i];
+	return NULL;
+}
+
+/**
+ * Puts a -n suffix on name, before its extension,
+ * n = 0 leaves it as it is
+ */
+static void
+storage_suffix_name(const char *name, int n, char *out)
+{
+	const char *ext = strrchr(name, '.');
+
+	if (!n) {
+		snprintf(out, PATH_MAX, "%s", name);
+		return;
+	}
+
+	if (!ext || ext == name)
+		ext = name + strlen(name);
+	snprintf(out, PATH_MAX, "%.*s-%i%s", (int)(ext - name), name, n, ext);
+}
+
+/**
+ * Like rename() but fails with EEXIST instead of replacing
+ * to, falls back to link() / unlink() on filesystems (or
+ * kernels) that don't support RENAME_NOREPLACE
+ */
+static int
+storage_rename_noreplace(const char *from, const char *to)
+{
+#ifdef SYS_renameat2
+	if (syscall(SYS_renameat2, AT_FDCWD, from, AT_FDCWD, to,
+		    STORAGE_RENAME_NOREPLACE) == 0)
+		return 0;
+	if (errno != EINVAL && errno != ENOSYS)
+		return -1;
+#endif
+	if (link(from, to) < 0)
+		return -1;
+	unlink(from);
+	return 0;
+}
+
+/**
+ * Creates name on the first usable target(s), returns
+ * -EEXIST (with nothing left open) if it's taken on one
+ * of them
+ */
+static int
+storage_create(struct recorder *rcd, struct recorder_file *file,
+	       const char *name)
+{
+	struct storage_sink *sink = NULL;
+	int num_targets = rcd->num_alt_storage_paths + 1;
+	int wanted = rcd->storage_policy == STORAGE_MIRROR ? 2 : 1;
+	int target = 0;
+
+	for (target = 0; target < num_targets && file->num_sinks < wanted;
+	     target++) {
+		if (!storage_target_up(target))
+			continue;
+
+		sink = &file->sinks[file->num_sinks];
+		sink->target = target;
+		snprintf(sink->dir, PATH_MAX, "%s",
+			 storage_target_dir(rcd, file, target));
+		snprintf(sink->path, PATH_MAX, "%s/%s", sink->dir, name);
+		sink->failed = 0;
+
+		sink->fd = open(sink->path, O_RDWR | O_CREAT | O_EXCL |
+				O_CLOEXEC, 0666);
+		if (sink->fd < 0 && errno == EEXIST) {
+			storage_close(file, 1);
+			file->num_sinks = 0;
+			return -EEXIST;
+		}
+		if (sink->fd < 0) {
+			storage_sink_failed(sink, "creating");
+			continue;
+		}
+		file->num_sinks++;
+	}
+
+	return 0;
+}
+
+/**
+ * Renames every copy of the file to name, returns -EEXIST
+ * (with the copies back where they were) if it's taken
+ * next to one of them
+ */
+static int
+storage_rename_sinks(struct recorder_file *file, const char *name)
+{
+	char old_paths[STORAGE_MAX_SINKS][PATH_MAX] = { 0 };
+	char path[PATH_MAX] = { 0 };
+	struct storage_sink *sink = NULL;
+	int ret = 0;
+	int i = 0;
+
+	for (i = 0; i < file->num_sinks; i++) {
+		sink = &file->sinks[i];
+		snprintf(path, PATH_MAX, "%s/%s", sink->dir, name);
+		if (storage_rename_noreplace(sink->path, path) == 0) {
+			memcpy(old_paths[i], sink->path, PATH_MAX);
+			snprintf(sink->path, PATH_MAX, "%s", path);
+			continue;
+		}
+
+		if (errno == EEXIST)
+			break;
+		fprintf(stderr, "storage: renaming %s failed: %s\n",
+			sink->path, strerror(errno));
+		if (i == 0)
+			ret = -1;
+	}
+
+	if (i == file->num_sinks)
+		return ret;
+
+	/* Put back the ones that got the name already */
+	while (i-- > 0) {
+		sink = &file->sinks[i];
+		if (!old_paths[i][0] ||
+		    rename(sink->path, old_paths[i]) < 0)
+			continue;
+		snprintf(sink->path, PATH_MAX, "%s", old_paths[i]);
+	}
+
+	return -EEXIST;
+}
+
+
+/*****************\
+* SNDFILE VIRT IO *
+\*****************/
+
+static sf_count_t
+storage_vio_get_filelen(void *user_data)
+{
+	struct recorder_file *file = (struct recorder_file *)user_data;
+
+	return file->length;
+}
+
+static sf_count_t
+storage_vio_seek(sf_count_t offset, int whence, void *user_data)
+{
+	return storage_seek((struct recorder_file *)user_data, offset, whence);
+}
+
+static sf_count_t
+storage_vio_read(void *ptr, sf_count_t count, void *user_data)
+{
+	struct recorder_file *file = (struct recorder_file *)user_data;
+	struct storage_sink *sink = storage_first_sink(file);
+	ssize_t ret = 0;
+
+	if (!sink)
+		return 0;
+
+	ret = pread(sink->fd, ptr, count, file->offset);
+	if (ret < 0)
+		return 0;
+	file->offset += ret;
+
+	return ret;
+}
+
+static sf_count_t
+storage_vio_write(const void *ptr, sf_count_t count, void *user_data)
+{
+	return storage_write((struct recorder_file *)user_data, ptr, count);
+}
+
+static sf_count_t
+storage_vio_tell(void *user_data)
+{
+	return ((struct recorder_file *)user_data)->offset;
+}
+
+static SF_VIRTUAL_IO storage_vio = {
+	.get_filelen = storage_vio_get_filelen,
+	.seek = storage_vio_seek,
+	.read = storage_vio_read,
+	.write = storage_vio_write,
+	.tell = storage_vio_tell
+};
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Creates name on the first usable target (or the first two
+ * when mirroring), for an encoder to write to. file->dir
+ * should be set to the storage path the file goes to, it's
+ * the first target. If name is taken it gets a -N suffix.
+ * Returns 0 or RECORDER_SNDFILE_ERR.
+ */
+int
+storage_open(struct recorder *rcd, struct recorder_file *file,
+	     const char *name)
+{
+	char unique_name[PATH_MAX] = { 0 };
+	int wanted = rcd->storage_policy == STORAGE_MIRROR ? 2 : 1;
+	int suffix = 0;
+
+	for (suffix = 0; suffix < STORAGE_MAX_SUFFIX; suffix++) {
+		storage_suffix_name(name, suffix, unique_name);
+		if (storage_create(rcd, file, unique_name) != -EEXIST)
+			break;
+	}
+
+	/* Failed targets got reported already */
+	if (!file->num_sinks) {
+		if (suffix == STORAGE_MAX_SUFFIX)
+			fprintf(stderr, "storage: %s is taken\n", name);
+		return RECORDER_SNDFILE_ERR;
+	}
+
+	if (file->num_sinks < wanted)
+		fprintf(stderr, "storage: not mirroring %s\n", unique_name);
+
+	snprintf(file->path, PATH_MAX, "%s", file->sinks[0].path);
+	file->offset = 0;
+	file->length = 0;
+
+	return 0;
+}
+
+/**
+ * Opens the file with libsndfile for writing,
+ * on top of its sinks
+ */
+int
+storage_sf_open(struct recorder_file *file, SF_INFO *info)
+{
+	file->sf = sf_open_virtual(&storage_vio, SFM_WRITE, info, file);
+	if (!file->sf) {
+		fprintf(stderr, "Could not open %s\n\t%s\n", file->path,
+			sf_strerror(NULL));
+		return RECORDER_SNDFILE_ERR;
+	}
+
+	return 0;
+}
+
+/**
+ * Writes count bytes of the encoded stream at the current
+ * offset, to every sink that's still there. Returns count,
+ * or 0 (marking the file as lost) if none of them is.
+ */
+sf_count_t
+storage_write(struct recorder_file *file, const void *ptr, sf_count_t count)
+{
+	struct storage_sink *sink = NULL;
+	int i = 0;
+
+	for (i = 0; i < file->num_sinks; i++) {
+		sink = &file->sinks[i];
+		if (sink->fd < 0)
+			continue;
+		if (storage_pwrite(sink->fd, ptr, count, file->offset) < 0)
+			storage_sink_failed(sink, "write to");
+		else
+			__atomic_add_fetch(&storage_bytes[sink->target], count,
+					   __ATOMIC_RELAXED);
+	}
+
+	if (!storage_first_sink(file)) {
+		file->lost = 1;
+		return 0;
+	}
+
+	/* Listeners only get the stream as it goes, not
+	 * the header rewrites */
+	if (file->offset == file->length)
+		stream_write(file, ptr, count);
+	manifest_write(file, ptr, count);
+
+	file->offset += count;
+	if (file->offset > file->length)
+		file->length = file->offset;
+
+	return count;
+}
+
+sf_count_t
+storage_seek(struct recorder_file *file, sf_count_t offset, int whence)
+{
+	switch (whence) {
+	case SEEK_SET:
+		file->offset = offset;
+		break;
+	case SEEK_CUR:
+		file->offset += offset;
+		break;
+	case SEEK_END:
+		file->offset = file->length + offset;
+		break;
+	}
+
+	return file->offset;
+}
+
+/**
+ * Renames every copy of the file to name, within the
+ * directory it lives in, or to name with a -N suffix if
+ * it's taken. Returns 0 if the first copy got renamed,
+ * -1 otherwise.
+ */
+int
+storage_rename(struct recorder_file *file, const char *name)
+{
+	char unique_name[PATH_MAX] = { 0 };
+	int ret = -EEXIST;
+	int suffix = 0;
+
+	for (suffix = 0; suffix < STORAGE_MAX_SUFFIX && ret == -EEXIST;
+	     suffix++) {
+		storage_suffix_name(name, suffix, unique_name);
+		ret = storage_rename_sinks(file, unique_name);
+	}
+
+	if (ret == -EEXIST) {
+		fprintf(stderr, "storage: %s is taken\n", name);
+		ret = -1;
+	}
+
+	snprintf(file->path, PATH_MAX, "%s", file->sinks[0].path);
+
+	return ret;
+}
+
+/**
+ * Closes the file and its sinks, removing every
+ * copy if asked to
+ */
+void
+storage_close(struct recorder_file *file, int remove)
+{
+	int i = 0;
+
+	if (file->sf)
+		sf_close(file->sf);
+	file->sf = NULL;
+
+	for (i = 0; i < file->num_sinks; i++) {
+		if (file->sinks[i].fd >= 0)
+			close(file->sinks[i].fd);
+		file->sinks[i].fd = -1;
+		if (remove)
+			unlink(file->sinks[i].path);
+	}
+}
+
+/**
+ * A file is usable as long as none of its targets failed,
+ * checked before a spare file gets used
+ */
+int
+storage_file_usable(struct recorder_file *file)
+{
+	int i = 0;
+
+	for (i = 0; i < file->num_sinks; i++)
+		if (file->sinks[i].fd < 0 ||
+		    !storage_target_up(file->sinks[i].target))
+			return 0;
+	return 1;
+}
+
+/**
+ * Path of the first copy of the file that got everything
+ * written to it, NULL if none did
+ */
+const char *
+storage_good_copy(struct recorder_file *file)
+{
+	int i = 0;
+
+	for (i = 0; i < file->num_sinks; i++)
+		if (!file->sinks[i].failed)
+			return file->sinks[i].path;
+	return NULL;
+}
+
+/**
+ * Whether a new file has somewhere to go,
+ * i.e. one of the targets is up
+ */
+int
+storage_available(struct recorder *rcd)
+{
+	int target = 0;
+
+	for (target = 0; target <= rcd->num_alt_storage_paths; target++)
+		if (storage_target_up(target))
+			return 1;
+	return 0;
+}
+
+/**
+ * Bytes written to target so far, for
+ * forecasting its free space
+ */
+uint64_t
+storage_target_bytes(int target)
+{
+	return __atomic_load_n(&storage_bytes[target], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,731 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Live stream
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE		/* For accept4() */
+#include "acoffin.h"
+#include <stdio.h>		/* For snprintf / perror */
+#include <stdlib.h>		/* For malloc / free */
+#include <string.h>		/* For memcpy / memcmp / strstr */
+#include <unistd.h>		/* For close() / read() */
+#include <sys/socket.h>		/* For socket() / accept4() / send() */
+#include <netinet/in.h>		/* For struct sockaddr_in */
+#include <arpa/inet.h>		/* For htons() / htonl() */
+#include <poll.h>		/* For POLLIN / POLLOUT */
+#include <errno.h>		/* For EAGAIN */
+
+/*
+ * Serves the encoded stream of the output file on localhost, on
+ * /stream, so that it can be listened to as it gets recorded
+ * without another encoder. Whatever the encoder appends to the
+ * current file (see storage_write()) also goes on a ring here,
+ * header rewrites / files other than the current one don't.
+ *
+ * Each listener has its own position on that ring, what's between
+ * it and the end of the ring is its send queue, and the event
+ * loop thread sends it along as the listener's socket takes it.
+ * Putting bytes on the ring never waits for anyone, a listener
+ * that falls more than the ring behind skips forward to the
+ * latest sync point (FLAC frame / Ogg page), so slow listeners
+ * only affect themselves.
+ *
+ * A listener gets the head of the current file first (FLAC
+ * metadata / Ogg header pages, kept per file as it gets written
+ * since spare files are opened in advance) and then the stream
+ * from the latest sync point on. When we move to a new file of
+ * the same format Ogg listeners get its head too (a chained
+ * stream), FLAC ones just carry on unless the sample rate /
+ * channels / sample size changed, in which case (as on a format
+ * change) they get disconnected and may reconnect.
+ */
+
+#define STREAM_MAX_CLIENTS	16
+#define STREAM_REQ_MAX		1024
+#define STREAM_RESP_MAX		256
+
+enum stream_client_states {
+	STREAM_CLIENT_READING = 0,
+	STREAM_CLIENT_WAITING,
+	STREAM_CLIENT_JOINED,
+	STREAM_CLIENT_REJECTED
+};
+
+struct stream_client {
+	int fd;
+	int state;
+	short events;
+	/* Nothing to send, until stream_wake() */
+	int idle;
+	char req[STREAM_REQ_MAX];
+	size_t req_len;
+	char resp[STREAM_RESP_MAX];
+	size_t resp_len;
+	size_t resp_sent;
+	/* File (generation) it follows, and its format */
+	uint32_t gen;
+	int format;
+	uint8_t info[4];
+	size_t head_len;
+	size_t head_sent;
+	uint64_t pos;
+};
+
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stream_client stream_clients[STREAM_MAX_CLIENTS];
+static struct recorder_file *stream_file = NULL;
+static struct recorder *stream_rcd = NULL;
+static int stream_enabled = 0;
+static int stream_fd = -1;
+/* The last STREAM_BUF_SIZE bytes, stream_pos counts every
+ * byte that went through the ring */
+static uint8_t *stream_buf = NULL;
+static uint64_t stream_pos = 0;
+/* Current file, where its part of the stream starts and
+ * its latest sync point */
+static uint32_t stream_gen = 0;
+static int stream_format = 0;
+static uint64_t stream_switch_pos = 0;
+static uint64_t stream_sync_pos = 0;
+static int stream_has_sync = 0;
+/* Its head, once we have it */
+static uint8_t *stream_head = NULL;
+static size_t stream_head_len = 0;
+static int stream_head_ready = 0;
+static uint8_t stream_info[4];
+
+/*********\
+* HELPERS *
+\*********/
+
+/**
+ * Finds where the head of a file ends, given its first len
+ * bytes. Returns 1 if it did, 0 if it needs more and -1 if
+ * this is not what we expected.
+ */
+static int
+stream_head_end(int format, const uint8_t *buf, size_t len, size_t *end)
+{
+	size_t pos = 0;
+	size_t body = 0;
+	uint32_t nsegs = 0;
+	int last = 0;
+	int i = 0;
+
+	if (format == RECORDER_FORMAT_FLAC) {
+		/* "fLaC" and metadata blocks up to the last one */
+		if (len < 4)
+			return 0;
+		if (memcmp(buf, "fLaC", 4))
+			return -1;
+		pos = 4;
+		do {
+			if (pos + 4 > len)
+				return 0;
+			last = buf[pos] & 0x80;
+			pos += 4 + (((size_t)buf[pos + 1] << 16) |
+				    ((size_t)buf[pos + 2] << 8) | buf[pos + 3]);
+		} while (!last);
+		if (pos > len)
+			return 0;
+		*end = pos;
+		return 1;
+	}
+
+	/* Ogg pages up to the first one with a granule position,
+	 * header pages don't have one */
+	while (1) {
+		if (pos + 27 > len)
+			return 0;
+		if (memcmp(buf + pos, "OggS", 4))
+			return -1;
+		for (i = 0; i < 8 && pos > 0; i++)
+			if (buf[pos + 6 + i]) {
+				*end = pos;
+				return 1;
+			}
+		nsegs = buf[pos + 26];
+		if (pos + 27 + nsegs > len)
+			return 0;
+		for (body = 0, i = 0; i < nsegs; i++)
+			body += buf[pos + 27 + i];
+		pos += 27 + nsegs + body;
+	}
+}
+
+/**
+ * Whether a listener may start from here, encoders write
+ * out a frame / page at a time
+ */
+static int
+stream_is_sync(const uint8_t *buf, size_t len)
+{
+	if (len < 4)
+		return 0;
+	if (stream_format == RECORDER_FORMAT_FLAC)
+		return buf[0] == 0xFF && (buf[1] & 0xFE) == 0xF8;
+	return !memcmp(buf, "OggS", 4);
+}
+
+/**
+ * Called with stream_mutex held
+ */
+static void
+stream_set_events(struct stream_client *client, short events)
+{
+	if (client->events == events)
+		return;
+	client->events = events;
+	evloop_set_events(client->fd, events);
+}
+
+/**
+ * Lets idle listeners know there is something new,
+ * called with stream_mutex held
+ */
+static void
+stream_wake(void)
+{
+	struct stream_client *client = NULL;
+	int i = 0;
+
+	for (i = 0; i < STREAM_MAX_CLIENTS; i++) {
+		client = &stream_clients[i];
+		if (client->fd < 0 || !client->idle)
+			continue;
+		client->idle = 0;
+		stream_set_events(client, POLLIN | POLLOUT);
+	}
+}
+
+/**
+ * Puts bytes of the current file on the ring, called
+ * with stream_mutex held
+ */
+static void
+stream_push(const uint8_t *buf, size_t len)
+{
+	size_t off = 0;
+	size_t first = 0;
+
+	if (!len)
+		return;
+
+	if (stream_is_sync(buf, len)) {
+		stream_sync_pos = stream_pos;
+		stream_has_sync = 1;
+	}
+
+	/* Only the tail of it fits */
+	if (len > STREAM_BUF_SIZE) {
+		buf += len - STREAM_BUF_SIZE;
+		stream_pos += len - STREAM_BUF_SIZE;
+		len = STREAM_BUF_SIZE;
+	}
+
+	off = stream_pos & (STREAM_BUF_SIZE - 1);
+	first = STREAM_BUF_SIZE - off < len ? STREAM_BUF_SIZE - off : len;
+	memcpy(stream_buf + off, buf, first);
+	memcpy(stream_buf, buf + first, len - first);
+	stream_pos += len;
+
+	stream_wake();
+}
+
+/**
+ * Takes the head of the current file, called
+ * with stream_mutex held
+ */
+static void
+stream_set_head(struct recorder_file *file)
+{
+	memcpy(stream_head, file->head.data, file->head.end);
+	stream_head_len = file->head.end;
+	/* Sample rate, channels and sample size, in STREAMINFO
+	 * right after "fLaC" and the block's header */
+	memset(stream_info, 0, sizeof(stream_info));
+	if (file->format == RECORDER_FORMAT_FLAC && stream_head_len >= 22) {
+		memcpy(stream_info, stream_head + 18, 4);
+		stream_info[3] &= 0xF0;
+	}
+	stream_head_ready = 1;
+	stream_wake();
+}
+
+static void
+stream_close_client(struct stream_client *client)
+{
+	evloop_remove(client->fd);
+	close(client->fd);
+	memset(client, 0, sizeof(struct stream_client));
+	client->fd = -1;
+}
+
+/**
+ * Starts a listener off the current file's head and its
+ * latest sync point, returns 1 if it did, 0 if it has
+ * to wait for them
+ */
+static int
+stream_client_join(struct stream_client *client)
+{
+	if (!stream_file || !stream_head_ready || !stream_has_sync ||
+	    stream_pos - stream_sync_pos > STREAM_BUF_SIZE)
+		return 0;
+
+	client->gen = stream_gen;
+	client->format = stream_format;
+	memcpy(client->info, stream_info, sizeof(stream_info));
+	client->head_len = stream_head_len;
+	client->head_sent = 0;
+	client->pos = stream_sync_pos;
+
+	client->resp_len = snprintf(client->resp, STREAM_RESP_MAX,
+				    "HTTP/1.0 200 OK\r\n"
+				    "Content-Type: %s\r\n"
+				    "Cache-Control: no-cache\r\n"
+				    "Connection: close\r\n\r\n",
+				    stream_format == RECORDER_FORMAT_FLAC ?
+				    "audio/flac" : "audio/ogg");
+	client->resp_sent = 0;
+	client->state = STREAM_CLIENT_JOINED;
+
+	return 1;
+}
+
+/**
+ * Moves a listener that got to the end of the previous file
+ * on to the current one. Returns 1 if it did, 0 if it has to
+ * wait for the head and -1 if the listener can't follow.
+ */
+static int
+stream_client_switch(struct stream_client *client)
+{
+	if (client->gen + 1 != stream_gen)
+		return -1;
+	if (!stream_head_ready)
+		return 0;
+	if (client->format != stream_format ||
+	    memcmp(client->info, stream_info, sizeof(stream_info)))
+		return -1;
+
+	client->gen = stream_gen;
+	if (stream_format == RECORDER_FORMAT_OGG_VORBIS) {
+		client->head_len = stream_head_len;
+		client->head_sent = 0;
+	}
+
+	return 1;
+}
+
+/**
+ * Sends whatever the listener's socket takes, called with
+ * stream_mutex held. Returns 1 if the socket is full, 0 if
+ * there is nothing left to send and -1 if the listener
+ * should go.
+ */
+static int
+stream_client_send(struct stream_client *client)
+{
+	const uint8_t *data = NULL;
+	uint64_t limit = 0;
+	size_t len = 0;
+	size_t off = 0;
+	ssize_t ret = 0;
+
+	while (1) {
+		if (client->state == STREAM_CLIENT_WAITING &&
+		    !stream_client_join(client))
+			return 0;
+
+		if (client->resp_sent < client->resp_len) {
+			data = (const uint8_t *)client->resp + client->resp_sent;
+			len = client->resp_len - client->resp_sent;
+		} else if (client->state == STREAM_CLIENT_REJECTED) {
+			return -1;
+		} else if (client->head_sent < client->head_len) {
+			/* It got replaced under us */
+			if (client->gen != stream_gen)
+				return -1;
+			data = stream_head + client->head_sent;
+			len = client->head_len - client->head_sent;
+		} else {
+			/* Fell behind, skip what's gone */
+			if (stream_pos - client->pos > STREAM_BUF_SIZE) {
+				if (client->gen != stream_gen ||
+				    !stream_has_sync ||
+				    stream_pos - stream_sync_pos >
+				    STREAM_BUF_SIZE)
+					return -1;
+				client->pos = stream_sync_pos;
+			}
+
+			if (client->gen != stream_gen &&
+			    client->pos == stream_switch_pos) {
+				ret = stream_client_switch(client);
+				if (ret <= 0)
+					return ret;
+				continue;
+			}
+
+			limit = (client->gen == stream_gen) ? stream_pos :
+				stream_switch_pos;
+			if (client->pos == limit)
+				return 0;
+
+			off = client->pos & (STREAM_BUF_SIZE - 1);
+			len = limit - client->pos;
+			if (len > STREAM_BUF_SIZE - off)
+				len = STREAM_BUF_SIZE - off;
+			data = stream_buf + off;
+		}
+
+		ret = send(client->fd, data, len, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			return 1;
+		if (ret <= 0)
+			return -1;
+
+		if (client->resp_sent < client->resp_len)
+			client->resp_sent += ret;
+		else if (client->head_sent < client->head_len)
+			client->head_sent += ret;
+		else
+			client->pos += ret;
+	}
+}
+
+
+/****************\
+* EVENT HANDLERS *
+\****************/
+
+static void
+stream_client_handler(int fd, short revents, void *data)
+{
+	struct stream_client *client = (struct stream_client *)data;
+	char drain[256] = { 0 };
+	ssize_t ret = 0;
+
+	pthread_mutex_lock(&stream_mutex);
+
+	if (revents & POLLIN) {
+		if (client->state != STREAM_CLIENT_READING) {
+			/* Nothing more to read, just see if they left */
+			ret = read(fd, drain, sizeof(drain));
+			if (ret == 0 || (ret < 0 && errno != EAGAIN &&
+					 errno != EINTR))
+				goto close;
+		} else {
+			ret = read(fd, client->req + client->req_len,
+				   STREAM_REQ_MAX - 1 - client->req_len);
+			if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+				goto unlock;
+			if (ret <= 0)
+				goto close;
+
+			client->req_len += ret;
+			client->req[client->req_len] = '\0';
+			if (!strstr(client->req, "\r\n\r\n")) {
+				/* Too large for us */
+				if (client->req_len >= STREAM_REQ_MAX - 1)
+					goto close;
+				goto unlock;
+			}
+
+			if (!strncmp(client->req, "GET /stream ", 12))
+				client->state = STREAM_CLIENT_WAITING;
+			else {
+				client->state = STREAM_CLIENT_REJECTED;
+				client->resp_len =
+				    snprintf(client->resp, STREAM_RESP_MAX,
+					     "HTTP/1.0 404 Not Found\r\n"
+					     "Content-Type: text/plain\r\n"
+					     "Connection: close\r\n\r\n"
+					     "Not found, try /stream\n");
+			}
+		}
+	}
+
+	if (client->state == STREAM_CLIENT_READING) {
+		if (revents & (POLLERR | POLLHUP | POLLNVAL))
+			goto close;
+		goto unlock;
+	}
+
+	ret = stream_client_send(client);
+	if (ret < 0)
+		goto close;
+	client->idle = !ret;
+	stream_set_events(client, ret ? POLLIN | POLLOUT : POLLIN);
+	goto unlock;
+
+ close:
+	stream_close_client(client);
+ unlock:
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+static void
+stream_accept_handler(int fd, short revents, void *data)
+{
+	struct stream_client *client = NULL;
+	int client_fd = 0;
+	int i = 0;
+
+	client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd < 0)
+		return;
+
+	pthread_mutex_lock(&stream_mutex);
+	for (i = 0; i < STREAM_MAX_CLIENTS; i++)
+		if (stream_clients[i].fd < 0) {
+			client = &stream_clients[i];
+			break;
+		}
+
+	/* Too many listeners at once */
+	if (!client || evloop_add(client_fd, POLLIN, stream_client_handler,
+				  client) < 0) {
+		close(client_fd);
+		goto unlock;
+	}
+	client->fd = client_fd;
+	client->events = POLLIN;
+
+ unlock:
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Sets up a new file to keep its head around, for
+ * when it becomes the current one
+ */
+void
+stream_file_init(struct recorder_file *file)
+{
+	if (!__atomic_load_n(&stream_enabled, __ATOMIC_RELAXED))
+		return;
+
+	/* Not streaming it is not a reason to lose audio */
+	file->head.data = malloc(STREAM_HEAD_MAX);
+}
+
+void
+stream_file_cleanup(struct recorder_file *file)
+{
+	free(file->head.data);
+	file->head.data = NULL;
+}
+
+/**
+ * Called with everything the encoder appends to file,
+ * from the thread that writes to it
+ */
+void
+stream_write(struct recorder_file *file, const void *ptr, size_t count)
+{
+	struct stream_head *head = &file->head;
+	const uint8_t *buf = (const uint8_t *)ptr;
+	size_t copied = 0;
+	size_t end = 0;
+	int got_head = 0;
+	int ret = 0;
+
+	if (!head->data)
+		return;
+
+	/* Still on its head, only the file's writer
+	 * gets here so no need to lock */
+	if (!head->done) {
+		copied = STREAM_HEAD_MAX - head->len < count ?
+			 STREAM_HEAD_MAX - head->len : count;
+		memcpy(head->data + head->len, buf, copied);
+		head->len += copied;
+
+		ret = stream_head_end(file->format, head->data, head->len,
+				      &end);
+		if (ret == 0 && copied == count)
+			return;
+		if (ret <= 0) {
+			fprintf(stderr, "stream: unexpected header on %s, "
+				"not streaming it\n", file->path);
+			stream_file_cleanup(file);
+			head->done = 1;
+			return;
+		}
+		head->end = end;
+		head->done = 1;
+		got_head = 1;
+	}
+
+	pthread_mutex_lock(&stream_mutex);
+	if (file != stream_file)
+		goto unlock;
+
+	/* What came after the head is the start of the stream */
+	if (got_head) {
+		stream_set_head(file);
+		stream_push(head->data + end, head->len - end);
+		stream_push(buf + copied, count - copied);
+	} else
+		stream_push(buf, count);
+
+ unlock:
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+/**
+ * Switches the stream to file, whenever rcd->out changes,
+ * NULL while not recording
+ */
+void
+stream_set_file(struct recorder_file *file)
+{
+	pthread_mutex_lock(&stream_mutex);
+	if (!stream_enabled || file == stream_file)
+		goto unlock;
+
+	stream_file = file;
+	if (!file)
+		goto unlock;
+
+	stream_gen++;
+	stream_format = file->format;
+	stream_switch_pos = stream_pos;
+	stream_has_sync = 0;
+	stream_head_ready = 0;
+	if (file->head.done && file->head.data)
+		stream_set_head(file);
+
+ unlock:
+	pthread_mutex_unlock(&stream_mutex);
+}
+
+/**
+ * Listeners currently following the stream, for the metrics
+ */
+int
+stream_num_listeners(void)
+{
+	int num = 0;
+	int i = 0;
+
+	pthread_mutex_lock(&stream_mutex);
+	for (i = 0; i < STREAM_MAX_CLIENTS; i++)
+		if (stream_clients[i].fd >= 0 &&
+		    stream_clients[i].state == STREAM_CLIENT_JOINED)
+			num++;
+	pthread_mutex_unlock(&stream_mutex);
+
+	return num;
+}
+
+/**
+ * Starts listening on localhost:stream_port, listeners get
+ * served once the event loop is started
+ */
+int
+stream_init(struct recorder *rcd)
+{
+	struct sockaddr_in addr = { 0 };
+	int one = 1;
+	int i = 0;
+
+	stream_rcd = rcd;
+	for (i = 0; i < STREAM_MAX_CLIENTS; i++)
+		stream_clients[i].fd = -1;
+
+	stream_buf = malloc(STREAM_BUF_SIZE);
+	stream_head = malloc(STREAM_HEAD_MAX);
+	if (!stream_buf || !stream_head) {
+		stream_cleanup();
+		return RECORDER_NOMEM;
+	}
+
+	stream_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK |
+			   SOCK_CLOEXEC, 0);
+	if (stream_fd < 0) {
+		perror("stream socket()");
+		stream_cleanup();
+		return RECORDER_INVALID;
+	}
+	setsockopt(stream_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(rcd->stream_port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(stream_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(stream_fd, STREAM_MAX_CLIENTS) < 0) {
+		perror("cannot listen for stream requests");
+		stream_cleanup();
+		return RECORDER_INVALID;
+	}
+
+	if (evloop_add(stream_fd, POLLIN, stream_accept_handler, NULL) < 0) {
+		stream_cleanup();
+		return RECORDER_INVALID;
+	}
+
+	__atomic_store_n(&stream_enabled, 1, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/**
+ * Closes the listening socket and any listeners, the event
+ * loop should be stopped by now. Files keep their heads
+ * until they get closed.
+ */
+void
+stream_cleanup(void)
+{
+	int i = 0;
+
+	/* Never initialized */
+	if (!stream_rcd)
+		return;
+
+	pthread_mutex_lock(&stream_mutex);
+	__atomic_store_n(&stream_enabled, 0, __ATOMIC_RELAXED);
+	stream_file = NULL;
+
+	for (i = 0; i < STREAM_MAX_CLIENTS; i++)
+		if (stream_clients[i].fd >= 0)
+			stream_close_client(&stream_clients[i]);
+
+	if (stream_fd >= 0) {
+		evloop_remove(stream_fd);
+		close(stream_fd);
+	}
+	stream_fd = -1;
+
+	free(stream_buf);
+	stream_buf = NULL;
+	free(stream_head);
+	stream_head = NULL;
+	stream_head_ready = 0;
+	stream_rcd = NULL;
+	pthread_mutex_unlock(&stream_mutex);
+}
@@ -0,0 +1,921 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Follows the file being recorded
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE		/* For strchrnul() */
+#include "sidecar.h"
+#include <stdio.h>		/* For printf/fprintf/perror */
+#include <stdlib.h>		/* For exit() / strtol() */
+#include <string.h>		/* For memcmp / strcmp / strrchr */
+#include <stdint.h>		/* For typed ints */
+#include <limits.h>		/* For PATH_MAX */
+#include <errno.h>		/* For errno */
+#include <fcntl.h>		/* For open() */
+#include <unistd.h>		/* For pread() / write() / getopt() */
+#include <dirent.h>		/* For opendir / readdir */
+#include <sys/stat.h>		/* For stat() */
+#include <sys/inotify.h>	/* For inotify_* */
+#include <sndfile.h>		/* For writing out decoded audio */
+#ifdef ENABLE_LIBFLAC
+#include <FLAC/stream_decoder.h>
+#endif
+
+/*
+ * While the recorder writes a file it keeps a progress sidecar
+ * next to it (<file>.progress), replaced atomically about once
+ * per second, with key=value lines:
+ *
+ *	format=flac|ogg
+ *	sample_rate=<Hz>
+ *	channels=<int>
+ *	frames=<frames handed to the encoder so far>
+ *	bytes=<the file ends with a complete frame / page here>
+ *
+ * The sidecar goes away once the file is closed and its header
+ * is final. frames may be ahead of what's in bytes by what the
+ * encoder holds on to, it's only used here to tell how many
+ * bytes a second of audio takes.
+ *
+ * This reads the file up to bytes, starting from the frame /
+ * page closest to a given number of secs back, right after the
+ * file's head (FLAC metadata / Ogg header pages) so that it
+ * decodes on its own, and waits on inotify for the sidecar to
+ * move forward. It then moves on to the next file the recorder
+ * writes to, if asked to. It either decodes FLAC (with libFLAC)
+ * to Sun AU on stdout, or writes out the encoded stream as is
+ * (FLAC / chained Ogg), for a player / decoder to read through
+ * a pipe.
+ */
+
+#define TAIL_BUF_SIZE	(64 * 1024)
+
+enum tail_formats {
+	TAIL_FORMAT_FLAC = 0,
+	TAIL_FORMAT_OGG = 1
+};
+
+struct tail {
+	char dir[PATH_MAX];
+	char path[PATH_MAX];
+	char progress_name[NAME_MAX + 1];
+	int fd;
+	int inotify_fd;
+	int format;
+	/* As of the last progress update */
+	uint32_t sample_rate;
+	int channels;
+	uint64_t frames;
+	uint64_t avail;
+	/* Its header is final, read it through */
+	int done;
+	/* Head, then the rest from start */
+	uint64_t head_len;
+	uint64_t start;
+	uint64_t pos;
+	int in_head;
+	/* Sample rate / channels / sample size from STREAMINFO */
+	uint8_t info[4];
+};
+
+struct tail_opts {
+	uint32_t secs;
+	int copy;
+	int single;
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+static int
+tail_pread(struct tail *t, void *buf, size_t len, uint64_t offset)
+{
+	ssize_t ret = 0;
+	size_t got = 0;
+
+	while (got < len) {
+		ret = pread(t->fd, (char *)buf + got, len - got, offset + got);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		got += ret;
+	}
+
+	return 0;
+}
+
+static int
+tail_write_all(const uint8_t *buf, size_t len)
+{
+	ssize_t ret = 0;
+
+	while (len > 0) {
+		ret = write(STDOUT_FILENO, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static uint8_t
+tail_crc8(const uint8_t *buf, size_t len)
+{
+	uint8_t crc = 0;
+	int i = 0;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+	}
+
+	return crc;
+}
+
+static uint32_t
+tail_ogg_crc(const uint8_t *buf, size_t len)
+{
+	uint32_t crc = 0;
+	size_t i = 0;
+	int j = 0;
+
+	for (i = 0; i < len; i++) {
+		/* The checksum field counts as zeroes */
+		crc ^= (uint32_t)((i >= 22 && i < 26) ? 0 : buf[i]) << 24;
+		for (j = 0; j < 8; j++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 :
+			      crc << 1;
+	}
+
+	return crc;
+}
+
+/**
+ * Whether a FLAC frame starts at buf, by its header's CRC-8,
+ * len being what's there to look at
+ */
+static int
+tail_flac_frame(const uint8_t *buf, size_t len)
+{
+	size_t hdr_len = 4;
+	int bs_code = 0;
+	int sr_code = 0;
+	uint8_t c = 0;
+
+	if (len < 16 || buf[0] != 0xFF || (buf[1] & 0xFE) != 0xF8)
+		return 0;
+
+	bs_code = buf[2] >> 4;
+	sr_code = buf[2] & 0x0F;
+	if (!bs_code || sr_code == 0x0F || (buf[3] & 0x01))
+		return 0;
+
+	/* Frame / sample number, UTF-8 style */
+	for (c = buf[4]; c & 0x80; c <<= 1)
+		hdr_len++;
+	hdr_len++;
+	if (hdr_len > 4 + 7)
+		return 0;
+
+	if (bs_code == 6)
+		hdr_len += 1;
+	else if (bs_code == 7)
+		hdr_len += 2;
+	if (sr_code == 12)
+		hdr_len += 1;
+	else if (sr_code == 13 || sr_code == 14)
+		hdr_len += 2;
+
+	return tail_crc8(buf, hdr_len) == buf[hdr_len];
+}
+
+/**
+ * Checks that an Ogg page starts at offset, and that it's
+ * all there by its CRC. Returns its length or 0.
+ */
+static size_t
+tail_ogg_page(struct tail *t, uint64_t offset, uint64_t end)
+{
+	static uint8_t page[27 + 255 + 255 * 255];
+	uint32_t crc = 0;
+	size_t len = 0;
+	int i = 0;
+
+	if (offset + 27 > end || tail_pread(t, page, 27, offset) < 0)
+		return 0;
+	if (memcmp(page, "OggS", 4) || page[4] != 0)
+		return 0;
+
+	len = 27 + page[26];
+	if (offset + len > end ||
+	    tail_pread(t, page + 27, page[26], offset + 27) < 0)
+		return 0;
+	for (i = 0; i < page[26]; i++)
+		len += page[27 + i];
+	if (offset + len > end ||
+	    tail_pread(t, page + 27 + page[26], len - 27 - page[26],
+		       offset + 27 + page[26]) < 0)
+		return 0;
+
+	crc = page[22] | (page[23] << 8) | (page[24] << 16) |
+	      ((uint32_t)page[25] << 24);
+	return tail_ogg_crc(page, len) == crc ? len : 0;
+}
+
+/**
+ * Finds where the file's head ends, it's there
+ * from the moment the file gets opened
+ */
+static int
+tail_find_head(struct tail *t)
+{
+	uint8_t hdr[27] = { 0 };
+	uint8_t si[8] = { 0 };
+	uint64_t pos = 0;
+	size_t len = 0;
+	int last = 0;
+	int i = 0;
+
+	if (t->format == TAIL_FORMAT_FLAC) {
+		/* "fLaC" and metadata blocks up to the last one,
+		 * STREAMINFO being the first */
+		pos = 4;
+		do {
+			if (tail_pread(t, hdr, 4, pos) < 0)
+				return -1;
+			last = hdr[0] & 0x80;
+			if (pos == 4 && tail_pread(t, si, 8, 18) < 0)
+				return -1;
+			pos += 4 + (((uint64_t)hdr[1] << 16) |
+				    ((uint64_t)hdr[2] << 8) | hdr[3]);
+		} while (!last);
+		memcpy(t->info, si, 4);
+		t->info[3] &= 0xF0;
+		t->head_len = pos;
+
+		/* Complete files have it all in STREAMINFO */
+		if (t->done) {
+			t->sample_rate = (si[0] << 12) | (si[1] << 4) |
+					 (si[2] >> 4);
+			t->frames = ((uint64_t)(si[3] & 0x0F) << 32) |
+				    ((uint64_t)si[4] << 24) | (si[5] << 16) |
+				    (si[6] << 8) | si[7];
+		}
+		return 0;
+	}
+
+	/* Ogg pages up to the first one with a granule
+	 * position, header pages don't have one */
+	while (1) {
+		if (tail_pread(t, hdr, 27, pos) < 0)
+			return -1;
+		for (i = 6; i < 14 && pos > 0; i++)
+			if (hdr[i]) {
+				t->head_len = pos;
+				return 0;
+			}
+		len = tail_ogg_page(t, pos, UINT64_MAX);
+		if (!len)
+			return -1;
+		pos += len;
+	}
+}
+
+/**
+ * Finds the first frame / page at or after offset, up
+ * to what's complete, or returns the end of it
+ */
+static uint64_t
+tail_find_sync(struct tail *t, uint64_t offset)
+{
+	static uint8_t buf[TAIL_BUF_SIZE];
+	uint64_t end = t->avail;
+	size_t len = 0;
+	size_t i = 0;
+
+	while (offset < end) {
+		len = end - offset < TAIL_BUF_SIZE ? end - offset :
+		      TAIL_BUF_SIZE;
+		if (tail_pread(t, buf, len, offset) < 0)
+			break;
+		for (i = 0; i + 4 <= len; i++) {
+			if (t->format == TAIL_FORMAT_FLAC &&
+			    tail_flac_frame(buf + i, len - i))
+				return offset + i;
+			if (t->format == TAIL_FORMAT_OGG &&
+			    !memcmp(buf + i, "OggS", 4) &&
+			    tail_ogg_page(t, offset + i, end))
+				return offset + i;
+		}
+		/* Headers may cross the window */
+		if (len < TAIL_BUF_SIZE)
+			break;
+		offset += len - 32;
+	}
+
+	return end;
+}
+
+/**
+ * Reads the progress sidecar, if it's gone the
+ * file is complete
+ */
+static int
+tail_load_progress(struct tail *t)
+{
+	char path[PATH_MAX] = { 0 };
+	char line[128] = { 0 };
+	unsigned long long val = 0;
+	struct stat st = { 0 };
+	FILE *progress = NULL;
+
+	snprintf(path, PATH_MAX, "%s/%s", t->dir, t->progress_name);
+	progress = fopen(path, "r");
+	if (!progress) {
+		if (errno != ENOENT || fstat(t->fd, &st) < 0)
+			return -1;
+		t->avail = st.st_size;
+		t->done = 1;
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), progress)) {
+		if (sscanf(line, "bytes=%llu", &val) == 1) {
+			if (val > t->avail)
+				t->avail = val;
+		} else if (sscanf(line, "frames=%llu", &val) == 1)
+			t->frames = val;
+		else if (sscanf(line, "sample_rate=%llu", &val) == 1)
+			t->sample_rate = val;
+		else if (sscanf(line, "channels=%llu", &val) == 1)
+			t->channels = val;
+	}
+	fclose(progress);
+
+	return 0;
+}
+
+/**
+ * Waits for something to change on the directory, returns
+ * 1 if it was our progress sidecar, 0 if something else
+ */
+static int
+tail_wait(struct tail *t, char *name_out)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev = NULL;
+	ssize_t len = 0;
+	char *ptr = NULL;
+	int ours = 0;
+
+	do {
+		len = read(t->inotify_fd, buf, sizeof(buf));
+	} while (len < 0 && errno == EINTR);
+	if (len <= 0)
+		return -1;
+
+	for (ptr = buf; ptr < buf + len;
+	     ptr += sizeof(struct inotify_event) + ev->len) {
+		ev = (const struct inotify_event *)ptr;
+		if (!ev->len)
+			continue;
+		if (!strcmp(ev->name, t->progress_name))
+			ours = 1;
+		else if (name_out && (ev->mask & IN_MOVED_TO))
+			snprintf(name_out, NAME_MAX + 1, "%s", ev->name);
+	}
+
+	return ours;
+}
+
+/**
+ * Hands out the next len bytes at most, head first, waiting
+ * for more if needed. Returns 0 once the file is over.
+ */
+static ssize_t
+tail_read(struct tail *t, uint8_t *buf, size_t len)
+{
+	uint64_t limit = 0;
+
+	while (1) {
+		limit = t->in_head ? t->head_len : t->avail;
+		if (t->pos < limit) {
+			if (len > limit - t->pos)
+				len = limit - t->pos;
+			if (tail_pread(t, buf, len, t->pos) < 0)
+				return -1;
+			t->pos += len;
+			if (t->in_head && t->pos == t->head_len) {
+				t->in_head = 0;
+				t->pos = t->start;
+			}
+			return len;
+		}
+
+		if (t->done)
+			return 0;
+		if (tail_wait(t, NULL) < 0 || tail_load_progress(t) < 0)
+			return -1;
+	}
+}
+
+static void
+tail_close(struct tail *t)
+{
+	if (t->fd >= 0)
+		close(t->fd);
+	t->fd = -1;
+}
+
+/**
+ * Opens path and positions it secs before the end of what's
+ * written, with its head in front
+ */
+static int
+tail_open(struct tail *t, const char *path, uint32_t secs)
+{
+	const char *name = strrchr(path, '/');
+	uint8_t magic[4] = { 0 };
+	uint64_t bytes_per_sec = 0;
+	uint64_t back = 0;
+
+	snprintf(t->path, PATH_MAX, "%s", path);
+	snprintf(t->progress_name, NAME_MAX + 1, "%s%s",
+		 name ? name + 1 : path, PROGRESS_EXT);
+	t->avail = 0;
+	t->frames = 0;
+	t->done = 0;
+
+	t->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (t->fd < 0) {
+		fprintf(stderr, "Could not open %s: %s\n", path,
+			strerror(errno));
+		return -1;
+	}
+
+	if (tail_pread(t, magic, 4, 0) < 0)
+		goto invalid;
+	if (!memcmp(magic, "fLaC", 4))
+		t->format = TAIL_FORMAT_FLAC;
+	else if (!memcmp(magic, "OggS", 4))
+		t->format = TAIL_FORMAT_OGG;
+	else
+		goto invalid;
+
+	if (tail_load_progress(t) < 0 || tail_find_head(t) < 0)
+		goto invalid;
+	if (t->avail < t->head_len)
+		t->avail = t->head_len;
+
+	/* Go by the average bitrate so far */
+	if (secs && t->frames && t->sample_rate) {
+		bytes_per_sec = (t->avail - t->head_len) * t->sample_rate /
+				t->frames;
+		back = (uint64_t) secs * bytes_per_sec;
+	} else if (secs)
+		back = t->avail;
+	back = back < t->avail - t->head_len ? back : t->avail - t->head_len;
+
+	t->start = tail_find_sync(t, t->avail - back);
+	t->pos = 0;
+	t->in_head = 1;
+
+	return 0;
+
+ invalid:
+	fprintf(stderr, "%s is not a FLAC / Ogg file we wrote\n", path);
+	tail_close(t);
+	return -1;
+}
+
+/**
+ * Finds the newest file on the directory that has a progress
+ * sidecar, other than the one we were following
+ */
+static int
+tail_find_current(struct tail *t, char *path)
+{
+	struct dirent *entry = NULL;
+	struct stat st = { 0 };
+	char entry_path[PATH_MAX] = { 0 };
+	time_t newest = 0;
+	size_t name_len = 0;
+	size_t ext_len = strlen(PROGRESS_EXT);
+	DIR *dir = NULL;
+	int found = 0;
+
+	dir = opendir(t->dir);
+	if (!dir)
+		return -1;
+
+	while ((entry = readdir(dir))) {
+		name_len = strlen(entry->d_name);
+		if (name_len <= ext_len || entry->d_name[0] == '.' ||
+		    strcmp(entry->d_name + name_len - ext_len, PROGRESS_EXT) ||
+		    !strcmp(entry->d_name, t->progress_name))
+			continue;
+
+		snprintf(entry_path, PATH_MAX, "%s/%s", t->dir,
+			 entry->d_name);
+		if (stat(entry_path, &st) < 0 || (found &&
+						  st.st_mtime <= newest))
+			continue;
+
+		newest = st.st_mtime;
+		snprintf(path, PATH_MAX, "%s/%.*s", t->dir,
+			 (int)(name_len - ext_len), entry->d_name);
+		found = 1;
+	}
+	closedir(dir);
+
+	return found;
+}
+
+/**
+ * Waits for the recorder to move on to a new file, and
+ * opens it from its start
+ */
+static int
+tail_next(struct tail *t)
+{
+	char path[PATH_MAX] = { 0 };
+	char name[NAME_MAX + 1] = { 0 };
+	size_t len = 0;
+	size_t ext_len = strlen(PROGRESS_EXT);
+	int ret = 0;
+
+	while (1) {
+		ret = tail_find_current(t, path);
+		if (ret < 0)
+			return -1;
+		if (ret)
+			break;
+
+		name[0] = '\0';
+		if (tail_wait(t, name) < 0)
+			return -1;
+		len = strlen(name);
+		if (len > ext_len &&
+		    !strcmp(name + len - ext_len, PROGRESS_EXT)) {
+			snprintf(path, PATH_MAX, "%s/%.*s", t->dir,
+				 (int)(len - ext_len), name);
+			break;
+		}
+	}
+
+	tail_close(t);
+	if (tail_open(t, path, 0) < 0)
+		return -1;
+
+	/* From its first frame / page on */
+	t->start = t->head_len;
+	fprintf(stderr, "Following %s\n", t->path);
+
+	return 0;
+}
+
+
+/*************\
+* ENCODED OUT *
+\*************/
+
+/**
+ * Writes out the encoded stream, FLAC files that follow get
+ * appended without their head as long as they carry the
+ * same kind of audio, Ogg ones get chained
+ */
+static int
+tail_copy(struct tail *t, struct tail_opts *opts)
+{
+	static uint8_t buf[TAIL_BUF_SIZE];
+	uint8_t info[4] = { 0 };
+	ssize_t len = 0;
+
+	memcpy(info, t->info, sizeof(info));
+	while (1) {
+		len = tail_read(t, buf, TAIL_BUF_SIZE);
+		if (len < 0)
+			return -1;
+		if (len > 0) {
+			if (tail_write_all(buf, len) < 0)
+				return -1;
+			continue;
+		}
+
+		if (opts->single || tail_next(t) < 0)
+			return 0;
+
+		if (t->format != TAIL_FORMAT_FLAC)
+			continue;
+		if (memcmp(info, t->info, sizeof(info))) {
+			fprintf(stderr, "%s has a different sample rate / "
+				"channels / sample size, stopping\n", t->path);
+			return 0;
+		}
+		t->in_head = 0;
+		t->pos = t->start;
+	}
+}
+
+
+/*************\
+* DECODED OUT *
+\*************/
+
+#ifdef ENABLE_LIBFLAC
+struct tail_decoder {
+	struct tail *t;
+	SNDFILE *out;
+	SF_INFO out_info;
+	uint32_t bits;
+	int32_t *buf;
+	uint32_t buf_frames;
+};
+
+static FLAC__StreamDecoderReadStatus
+tail_flac_read(const FLAC__StreamDecoder *decoder, FLAC__byte buffer[],
+	       size_t *bytes, void *client_data)
+{
+	struct tail_decoder *td = (struct tail_decoder *)client_data;
+	ssize_t ret = tail_read(td->t, buffer, *bytes);
+
+	if (ret < 0)
+		return FLAC__STREAM_DECODER_READ_STATUS_ABORT;
+	*bytes = ret;
+	if (!ret)
+		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__StreamDecoderWriteStatus
+tail_flac_write(const FLAC__StreamDecoder *decoder, const FLAC__Frame *frame,
+		const FLAC__int32 * const buffer[], void *client_data)
+{
+	struct tail_decoder *td = (struct tail_decoder *)client_data;
+	uint32_t nframes = frame->header.blocksize;
+	uint32_t channels = frame->header.channels;
+	uint32_t shift = 32 - td->bits;
+	uint32_t i = 0;
+	uint32_t c = 0;
+
+	if (!td->out || channels != (uint32_t)td->out_info.channels)
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+	if (nframes > td->buf_frames) {
+		free(td->buf);
+		td->buf = malloc((size_t)nframes * channels * sizeof(int32_t));
+		if (!td->buf)
+			return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+		td->buf_frames = nframes;
+	}
+
+	/* libsndfile takes ints at full scale */
+	for (i = 0; i < nframes; i++)
+		for (c = 0; c < channels; c++)
+			td->buf[i * channels + c] =
+			    (int32_t)((uint32_t)buffer[c][i] << shift);
+
+	if (sf_writef_int(td->out, td->buf, nframes) != nframes)
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void
+tail_flac_metadata(const FLAC__StreamDecoder *decoder,
+		   const FLAC__StreamMetadata *metadata, void *client_data)
+{
+	struct tail_decoder *td = (struct tail_decoder *)client_data;
+	const FLAC__StreamMetadata_StreamInfo *si = NULL;
+
+	if (metadata->type != FLAC__METADATA_TYPE_STREAMINFO)
+		return;
+	si = &metadata->data.stream_info;
+
+	/* Files that follow need to match */
+	if (td->out) {
+		if (si->sample_rate != (uint32_t)td->out_info.samplerate ||
+		    si->channels != (uint32_t)td->out_info.channels ||
+		    si->bits_per_sample != td->bits) {
+			fprintf(stderr, "%s has a different sample rate / "
+				"channels / sample size, stopping\n",
+				td->t->path);
+			sf_close(td->out);
+			td->out = NULL;
+		}
+		return;
+	}
+
+	td->bits = si->bits_per_sample;
+	td->out_info.samplerate = si->sample_rate;
+	td->out_info.channels = si->channels;
+	td->out_info.format = SF_FORMAT_AU |
+			      (td->bits > 16 ? SF_FORMAT_PCM_24 :
+			       SF_FORMAT_PCM_16);
+	td->out = sf_open_fd(STDOUT_FILENO, SFM_WRITE, &td->out_info, 0);
+	if (!td->out)
+		fprintf(stderr, "Could not write to stdout: %s\n",
+			sf_strerror(NULL));
+}
+
+static void
+tail_flac_error(const FLAC__StreamDecoder *decoder,
+		FLAC__StreamDecoderErrorStatus status, void *client_data)
+{
+	fprintf(stderr, "flac: %s\n",
+		FLAC__StreamDecoderErrorStatusString[status]);
+}
+
+/**
+ * Decodes the stream to Sun AU on stdout,
+ * one decoder per file
+ */
+static int
+tail_decode(struct tail *t, struct tail_opts *opts)
+{
+	struct tail_decoder td = { 0 };
+	FLAC__StreamDecoder *decoder = NULL;
+	int ret = 0;
+
+	if (t->format != TAIL_FORMAT_FLAC) {
+		fprintf(stderr, "Only FLAC gets decoded, use -c and pipe "
+			"the Ogg stream to a decoder\n");
+		return -1;
+	}
+
+	td.t = t;
+	decoder = FLAC__stream_decoder_new();
+	if (!decoder)
+		return -1;
+
+	while (1) {
+		if (FLAC__stream_decoder_init_stream(decoder, tail_flac_read,
+						     NULL, NULL, NULL, NULL,
+						     tail_flac_write,
+						     tail_flac_metadata,
+						     tail_flac_error, &td) !=
+		    FLAC__STREAM_DECODER_INIT_STATUS_OK) {
+			ret = -1;
+			break;
+		}
+
+		if (!FLAC__stream_decoder_process_until_end_of_stream(decoder))
+			ret = -1;
+		FLAC__stream_decoder_finish(decoder);
+		if (ret < 0 || !td.out || opts->single || tail_next(t) < 0)
+			break;
+
+		if (t->format != TAIL_FORMAT_FLAC) {
+			fprintf(stderr, "%s is not FLAC, stopping\n", t->path);
+			break;
+		}
+	}
+
+	FLAC__stream_decoder_delete(decoder);
+	if (td.out)
+		sf_close(td.out);
+	free(td.buf);
+
+	return ret;
+}
+#endif
+
+
+/*************\
+* ENTRY POINT *
+\*************/
+
+static void
+usage(char *name)
+{
+	printf("Audio Coffin, follows the file being recorded\n");
+	printf("\nUsage: %s [<parameter> <value>] <file or directory>\n",
+	       name);
+	printf("\nGiven a directory, it follows the file being recorded "
+	       "there.\n");
+	printf("\nParameters:\n"
+	       "\t-h\t\tShow this list\n"
+	       "\t-s   <int>\tStart this many secs before the end of what's written so far (default: 0)\n"
+	       "\t-c\t\tWrite out the encoded FLAC / Ogg stream instead of decoding it, e.g. to pipe it to a player\n"
+	       "\t-1\t\tStop at the end of this file, instead of moving on to the next one the recorder writes to\n");
+#ifndef ENABLE_LIBFLAC
+	printf("\nBuilt without libFLAC, only -c is available.\n");
+#else
+	printf("\nFLAC gets decoded to Sun AU on stdout, Ogg needs -c.\n");
+#endif
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct tail_opts opts = { 0 };
+	struct tail t = { 0 };
+	char path[PATH_MAX] = { 0 };
+	char *slash = NULL;
+	struct stat st = { 0 };
+	int opt = 0;
+	int ret = 0;
+
+	t.fd = -1;
+	t.inotify_fd = -1;
+
+	while ((opt = getopt(argc, argv, "hs:c1")) != -1) {
+		switch (opt) {
+		case 's':
+			opts.secs = strtol(optarg, NULL, 10);
+			break;
+		case 'c':
+			opts.copy = 1;
+			break;
+		case '1':
+			opts.single = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : -1);
+		}
+	}
+
+	if (optind != argc - 1 || stat(argv[optind], &st) < 0) {
+		usage(argv[0]);
+		exit(-1);
+	}
+
+#ifndef ENABLE_LIBFLAC
+	if (!opts.copy) {
+		fprintf(stderr, "Built without libFLAC, use -c\n");
+		exit(-1);
+	}
+#endif
+
+	if (S_ISDIR(st.st_mode))
+		snprintf(t.dir, PATH_MAX, "%s", argv[optind]);
+	else {
+		snprintf(t.dir, PATH_MAX, "%s", argv[optind]);
+		slash = strrchr(t.dir, '/');
+		if (slash)
+			*slash = '\0';
+		else
+			snprintf(t.dir, PATH_MAX, ".");
+	}
+
+	/* Watch before looking, so that we don't miss anything */
+	t.inotify_fd = inotify_init1(IN_CLOEXEC);
+	if (t.inotify_fd < 0 ||
+	    inotify_add_watch(t.inotify_fd, t.dir, IN_MOVED_TO |
+			      IN_DELETE) < 0) {
+		perror("inotify");
+		ret = -1;
+		goto cleanup;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		ret = tail_find_current(&t, path);
+		if (ret <= 0) {
+			fprintf(stderr, "Nothing is being recorded on %s\n",
+				t.dir);
+			ret = -1;
+			goto cleanup;
+		}
+	} else
+		snprintf(path, PATH_MAX, "%s", argv[optind]);
+
+	ret = tail_open(&t, path, opts.secs);
+	if (ret < 0)
+		goto cleanup;
+
+#ifdef ENABLE_LIBFLAC
+	if (!opts.copy)
+		ret = tail_decode(&t, &opts);
+	else
+#endif
+		ret = tail_copy(&t, &opts);
+
+ cleanup:
+	tail_close(&t);
+	if (t.inotify_fd >= 0)
+		close(t.inotify_fd);
+	return ret < 0 ? -1 : 0;
+}
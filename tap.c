@@ -0,0 +1,170 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Shared memory tap
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include <stdio.h>		/* For fprintf / perror */
+#include <string.h>		/* For memcpy / memset */
+#include <fcntl.h>		/* For O_* flags */
+#include <unistd.h>		/* For ftruncate() / close() / sysconf() */
+#include <sys/mman.h>		/* For shm_open() / mmap() / mlock() */
+
+/*
+ * Publishes every period the process callback gets, recording
+ * or not, on a shared memory segment that local readers (meters,
+ * silence detectors, previews) can follow instead of registering
+ * JACK clients of their own, see tap.h for the protocol. The
+ * segment is locked in memory and faulted in up front, putting
+ * a period on it is just a copy and a couple of stores.
+ */
+
+/**************\
+* ENTRY POINTS *
+\**************/
+
+/**
+ * Process callback only, buf holds nframes interleaved frames
+ */
+void
+tap_write(struct tap *tap, const float *buf, uint32_t nframes)
+{
+	struct tap_header *hdr = tap->hdr;
+	uint32_t channels = 0;
+	uint32_t mask = 0;
+	uint32_t off = 0;
+	uint32_t first = 0;
+	uint32_t seq = 0;
+
+	if (!hdr || nframes > hdr->max_period)
+		return;
+
+	channels = hdr->channels;
+	mask = hdr->size_frames - 1;
+	off = hdr->frames & mask;
+	first = hdr->size_frames - off < nframes ?
+		hdr->size_frames - off : nframes;
+
+	/* Odd while we are at it, before we touch the ring */
+	seq = hdr->seq;
+	__atomic_store_n(&hdr->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy(tap->ring + (size_t)off * channels, buf,
+	       (size_t)first * channels * sizeof(float));
+	memcpy(tap->ring, buf + (size_t)first * channels,
+	       (size_t)(nframes - first) * channels * sizeof(float));
+
+	__atomic_store_n(&hdr->frames, hdr->frames + nframes,
+			 __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates the segment with room for tap->secs of audio,
+ * in periods of up to max_period frames
+ */
+int
+tap_init(struct tap *tap, int channels, uint32_t sample_rate,
+	 uint32_t max_period)
+{
+	uint64_t frames = (uint64_t) tap->secs * sample_rate;
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint32_t size_frames = 1;
+	struct tap_header *hdr = NULL;
+	void *base = MAP_FAILED;
+	size_t off = 0;
+	int fd = -1;
+	int ret = 0;
+
+	if (frames < 2 * (uint64_t) max_period)
+		frames = 2 * (uint64_t) max_period;
+	while (size_frames < frames)
+		size_frames <<= 1;
+
+	tap->map_size = sizeof(struct tap_header) +
+			(size_t)size_frames * channels * sizeof(float);
+
+	/* Start over with a new one, readers of the old one
+	 * (if it was left behind) would fault if we resized
+	 * it under them. It's the audio we capture, only our
+	 * user gets to read it, same as the control socket. */
+	shm_unlink(tap->name);
+	fd = shm_open(tap->name, O_CREAT | O_EXCL | O_RDWR, 0600);
+	if (fd < 0) {
+		perror("tap shm_open()");
+		return RECORDER_NOMEM;
+	}
+
+	if (ftruncate(fd, tap->map_size) < 0) {
+		perror("tap ftruncate()");
+		ret = RECORDER_NOMEM;
+		goto cleanup;
+	}
+
+	base = mmap(NULL, tap->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    fd, 0);
+	if (base == MAP_FAILED) {
+		perror("tap mmap()");
+		ret = RECORDER_NOMEM;
+		goto cleanup;
+	}
+
+	/* It's on the audio path, as with the arena not being
+	 * able to lock it is not fatal */
+	if (mlock(base, tap->map_size) < 0)
+		fprintf(stderr, "tap: cannot lock %zu bytes in memory, "
+			"check ulimit -l\n", tap->map_size);
+	for (off = 0; off < tap->map_size; off += page_size)
+		((volatile char *)base)[off] = 0;
+
+	hdr = base;
+	memset(hdr, 0, sizeof(struct tap_header));
+	hdr->version = TAP_VERSION;
+	hdr->channels = channels;
+	hdr->sample_rate = sample_rate;
+	hdr->size_frames = size_frames;
+	hdr->max_period = max_period;
+	/* Readers check this last */
+	__atomic_store_n(&hdr->magic, TAP_MAGIC, __ATOMIC_RELEASE);
+
+	tap->hdr = hdr;
+	tap->ring = (float *)(hdr + 1);
+
+ cleanup:
+	close(fd);
+	if (ret < 0)
+		shm_unlink(tap->name);
+	return ret;
+}
+
+/**
+ * Lets the readers know we are gone and removes the
+ * segment, they may keep their mappings around
+ */
+void
+tap_cleanup(struct tap *tap)
+{
+	if (!tap->hdr)
+		return;
+
+	__atomic_store_n(&tap->hdr->closed, 1, __ATOMIC_RELEASE);
+	munmap(tap->hdr, tap->map_size);
+	shm_unlink(tap->name);
+	tap->hdr = NULL;
+	tap->ring = NULL;
+}
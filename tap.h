@@ -0,0 +1,130 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Shared memory tap, layout and reader
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ACOFFIN_TAP_H__
+#define __ACOFFIN_TAP_H__
+
+#include <stdint.h>		/* For typed ints */
+#include <string.h>		/* For memcpy() */
+
+/*
+ * The captured audio gets published on a POSIX shared memory
+ * segment, for local readers that want to follow it without
+ * a JACK client of their own. This header is all they need,
+ * shm_open() the segment read-only, mmap() it and call
+ * tap_read(). Only the recorder's user may open it.
+ *
+ * The segment is a struct tap_header followed by a ring of
+ * size_frames interleaved float frames, frame n of the stream
+ * being at (n % size_frames). Each period the writer bumps seq
+ * (so it's odd), puts the period on the ring, moves frames
+ * forward and bumps seq again. A reader that copied frames
+ * [pos, frames) is good if seq didn't change meanwhile, else
+ * if none of them is within the part of the ring the writer
+ * may be overwriting by then, see tap_read(). Readers never
+ * write to the segment, there is no limit to how many there
+ * are.
+ */
+
+#define TAP_MAGIC	0x50544341	/* "ACTP" */
+#define TAP_VERSION	1
+
+struct tap_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t channels;
+	uint32_t sample_rate;
+	/* Ring size, a power of two, and the most
+	 * frames a period may have */
+	uint32_t size_frames;
+	uint32_t max_period;
+	/* Odd while the writer updates the ring */
+	uint32_t seq;
+	/* Set once the writer is gone, the segment may get
+	 * re-created by the next one */
+	uint32_t closed;
+	/* Frames written since the segment was created */
+	uint64_t frames;
+	uint8_t pad[24];
+};
+
+/**
+ * Copies up to max_frames frames from *pos on to buf, and moves
+ * *pos forward. Returns how many frames it copied, 0 if there
+ * are no new ones yet, or -1 if the reader fell behind by more
+ * than the ring holds, in which case *pos moves to the oldest
+ * frame still there. Start with *pos at hdr->frames to follow
+ * the live stream.
+ */
+static inline int
+tap_read(const struct tap_header *hdr, uint64_t *pos, float *buf,
+	 uint32_t max_frames)
+{
+	const float *ring = (const float *)(hdr + 1);
+	uint64_t size = hdr->size_frames;
+	uint64_t reach = size - hdr->max_period;
+	uint32_t channels = hdr->channels;
+	uint64_t frames = 0;
+	uint32_t seq = 0;
+	uint32_t off = 0;
+	uint32_t first = 0;
+	uint32_t n = 0;
+
+	while (1) {
+		seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+		frames = __atomic_load_n(&hdr->frames, __ATOMIC_ACQUIRE);
+
+		/* Ahead of a writer that started over */
+		if (*pos > frames)
+			*pos = frames;
+
+		if (frames > reach && *pos < frames - reach) {
+			*pos = frames - reach;
+			return -1;
+		}
+
+		n = frames - *pos < max_frames ?
+		    (uint32_t) (frames - *pos) : max_frames;
+		if (!n)
+			return 0;
+
+		off = *pos & (size - 1);
+		first = size - off < n ? size - off : n;
+		memcpy(buf, ring + (size_t)off * channels,
+		       (size_t)first * channels * sizeof(float));
+		memcpy(buf + (size_t)first * channels, ring,
+		       (size_t)(n - first) * channels * sizeof(float));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(seq & 1) &&
+		    __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) == seq)
+			break;
+
+		/* The writer was at it, what we copied is fine as
+		 * long as it's out of its reach */
+		frames = __atomic_load_n(&hdr->frames, __ATOMIC_ACQUIRE);
+		if (frames <= reach || *pos >= frames - reach)
+			break;
+	}
+
+	*pos += n;
+	return n;
+}
+
+#endif /* __ACOFFIN_TAP_H__ */
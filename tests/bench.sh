@@ -0,0 +1,8 @@
+#!/bin/sh
+# A minute of each format through acoffin-bench, with every
+# output decoded back and checked
+dir=$(mktemp -d) || exit 99
+./acoffin-bench -p "$dir" -t 1 -R 1 -c
+ret=$?
+rm -rf "$dir"
+exit $ret
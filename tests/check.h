@@ -0,0 +1,46 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Helpers for the make check programs
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __ACOFFIN_CHECK_H__
+#define __ACOFFIN_CHECK_H__
+
+#include <stdio.h>		/* For fprintf */
+
+/*
+ * Each check program runs its cases, reports the ones that
+ * fail on stderr and exits with 1 if any did, or with
+ * CHECK_SKIP if it can't run here, see the Automake manual.
+ */
+
+#define CHECK_SKIP	77
+
+static int check_failures = 0;
+
+#define check(cond, ...) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%i: ", __FILE__, __LINE__);		\
+		fprintf(stderr, __VA_ARGS__);				\
+		fprintf(stderr, "\n");					\
+		check_failures++;					\
+	}								\
+} while (0)
+
+#define check_result() (check_failures ? 1 : 0)
+
+#endif /* __ACOFFIN_CHECK_H__ */
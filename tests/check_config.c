@@ -0,0 +1,248 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Checks for config.c
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include "check.h"
+#include <stdlib.h>		/* For mkstemp() */
+#include <string.h>		/* For memset / strcmp / strlen */
+#include <unistd.h>		/* For write() / unlink() / close() */
+
+/*
+ * Loads a few config files, checks that the settings end up
+ * where they should and that bad files get rejected as a whole,
+ * then reloads one on top of the current settings.
+ */
+
+static const char check_good[] =
+	"# Comments and blank lines are fine\n"
+	"\n"
+	"[recorder]\n"
+	"mode = logger\n"
+	"  stereo=yes   ; so are trailing ones\n"
+	"gui = off\n"
+	"[ output ]\n"
+	"path = /srv/audiologs\n"
+	"alt_path = /mnt/a\n"
+	"alt_path = /mnt/b\n"
+	"policy = mirror\n"
+	"format = FLAC\n"
+	"compression = 0.75\n"
+	"rotate_mins = 60\n"
+	"[flac]\n"
+	"threads = 2\n"
+	"[monitor]\n"
+	"silence = -60.5\n"
+	"[server]\n"
+	"metrics_port = 9100\n";
+
+static const char *check_bad[] = {
+	"[recorder]\nmood = logger\n",
+	"[nowhere]\nmode = logger\n",
+	"mode = logger\n",
+	"[recorder]\nmode = player\n",
+	"[recorder]\nstereo = maybe\n",
+	"[recorder]\nmode\n",
+	"[recorder\nmode = logger\n",
+	"[recorder] x\nmode = logger\n",
+	"[output]\npath =\n",
+	"[output]\nbuffer_secs = 0\n",
+	"[output]\nbuffer_secs = 601\n",
+	"[output]\nrotate_mins = 60x\n",
+	"[output]\ncompression = 1.5\n",
+	"[output]\npolicy = raid\n",
+	"[flac]\nbits = 8\n",
+	"[server]\nmetrics_port = 65536\n",
+	"[output]\nalt_path = /a\nalt_path = /b\nalt_path = /c\n"
+	"alt_path = /d\n",
+	NULL
+};
+
+/* What config_reload() passed on */
+static struct {
+	int calls;
+	char *path;
+	int format;
+	double comp_level;
+	uint32_t interval;
+} check_output;
+
+/*********\
+* HELPERS *
+\*********/
+
+int
+recorder_set_output(struct recorder *rcd, char *storage_path, int format,
+		    double quality, double comp_level,
+		    uint32_t logrotate_interval_secs)
+{
+	(void)rcd;
+	(void)quality;
+
+	check_output.calls++;
+	check_output.path = storage_path;
+	check_output.format = format;
+	check_output.comp_level = comp_level;
+	check_output.interval = logrotate_interval_secs;
+	return 0;
+}
+
+static int
+check_write(char *path, const char *contents)
+{
+	size_t len = strlen(contents);
+	int fd = -1;
+	int ret = 0;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+	if (write(fd, contents, len) != (ssize_t)len)
+		ret = -1;
+	close(fd);
+
+	return ret;
+}
+
+static void
+check_load_good(void)
+{
+	char path[] = "/tmp/acoffin-check-XXXXXX";
+	struct recorder rcd = { 0 };
+
+	if (check_write(path, check_good) < 0) {
+		check(0, "cannot write the config file");
+		return;
+	}
+
+	check(!config_load(path, &rcd), "cannot load a valid file");
+	check(rcd.opmode == RECORDER_LOGGER, "mode");
+	check(rcd.stereo == 1, "stereo");
+	check(rcd.headless == 1, "gui");
+	check(rcd.storage_path && !strcmp(rcd.storage_path, "/srv/audiologs"),
+	      "path");
+	check(rcd.num_alt_storage_paths == 2 &&
+	      !strcmp(rcd.alt_storage_paths[0], "/mnt/a") &&
+	      !strcmp(rcd.alt_storage_paths[1], "/mnt/b"), "alt_path");
+	check(rcd.storage_policy == STORAGE_MIRROR, "policy");
+	check(rcd.format == RECORDER_FORMAT_FLAC, "format");
+	check(rcd.comp_level == 0.75, "compression");
+	check(rcd.logrotate_interval_secs == 3600, "rotate_mins");
+	check(rcd.flac.threads == 2, "threads");
+	check(rcd.monitor.silence_db == -60.5f, "silence");
+	check(rcd.metrics_port == 9100, "metrics_port");
+	check(rcd.config_path == path, "config path");
+
+	/* Settings point into the first one */
+	check(config_load(path, &rcd) < 0, "loaded a second file");
+
+	config_cleanup();
+	unlink(path);
+}
+
+static void
+check_load_bad(void)
+{
+	char path[] = "/tmp/acoffin-check-XXXXXX";
+	struct recorder rcd = { 0 };
+	int i = 0;
+
+	for (i = 0; check_bad[i]; i++) {
+		strcpy(path + strlen(path) - 6, "XXXXXX");
+		if (check_write(path, check_bad[i]) < 0) {
+			check(0, "cannot write the config file");
+			return;
+		}
+		memset(&rcd, 0, sizeof(rcd));
+		check(config_load(path, &rcd) < 0 && !rcd.config_path,
+		      "accepted:\n%s", check_bad[i]);
+		config_cleanup();
+		unlink(path);
+	}
+
+	check(config_load("/nonexistent/acoffin.conf", &rcd) < 0,
+	      "loaded a missing file");
+	config_cleanup();
+}
+
+static void
+check_reload(void)
+{
+	char path[] = "/tmp/acoffin-check-XXXXXX";
+	char dir[] = "/tmp/acoffin-check-XXXXXX";
+	char contents[256] = { 0 };
+	struct recorder rcd = { 0 };
+
+	if (!mkdtemp(dir)) {
+		check(0, "cannot create a directory");
+		return;
+	}
+
+	/* Only the output settings get picked up */
+	snprintf(contents, sizeof(contents),
+		 "[recorder]\nstereo = yes\n"
+		 "[output]\npath = %s\nformat = vorbis\ncompression = 0.5\n"
+		 "rotate_mins = 15\n", dir);
+	if (check_write(path, contents) < 0) {
+		check(0, "cannot write the config file");
+		goto cleanup;
+	}
+
+	rcd.format = RECORDER_FORMAT_FLAC;
+	rcd.config_path = path;
+	config_reload(&rcd);
+	check(check_output.calls == 1, "output not set on reload");
+	check(check_output.path && !strcmp(check_output.path, dir),
+	      "reloaded path");
+	check(check_output.format == RECORDER_FORMAT_OGG_VORBIS,
+	      "reloaded format");
+	check(check_output.comp_level == 0.5, "reloaded compression");
+	check(check_output.interval == 15 * 60, "reloaded rotate_mins");
+	check(rcd.stereo == 0, "stereo changed on reload");
+	unlink(path);
+
+	/* A bad file leaves everything as it was */
+	strcpy(path + strlen(path) - 6, "XXXXXX");
+	if (check_write(path, "[output]\nformat = mp3\n") < 0) {
+		check(0, "cannot write the config file");
+		goto cleanup;
+	}
+	rcd.config_path = path;
+	config_reload(&rcd);
+	check(check_output.calls == 1, "output set from a bad file");
+	unlink(path);
+
+ cleanup:
+	config_cleanup();
+	rmdir(dir);
+}
+
+
+/*************\
+* ENTRY POINT *
+\*************/
+
+int
+main(void)
+{
+	check_load_good();
+	check_load_bad();
+	check_reload();
+
+	return check_result();
+}
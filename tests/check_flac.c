@@ -0,0 +1,414 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Checks for flac.c
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* For its static helpers */
+#include "flac.c"
+#include "check.h"
+#include <FLAC/stream_decoder.h>
+
+/*
+ * The MD5 we put in STREAMINFO in parallel mode, against the
+ * test suite of RFC 1321, fed in one go and in odd sized pieces.
+ *
+ * Then the same audio gets encoded in memory on the consumer
+ * (where libFLAC does it all) and in parallel (where we renumber
+ * the frames and write STREAMINFO ourselves), in blocks small
+ * enough for the frame numbers to get past 0x80 and 0x800, where
+ * their UTF-8 style coding grows by a byte. Both streams get
+ * decoded through libFLAC with MD5 checking on and should come
+ * out the same, with the same MD5 in STREAMINFO.
+ */
+
+#define CHECK_RATE		44100
+#define CHECK_BLOCKSIZE		64
+/* Past frame 0x800, ending with a short block */
+#define CHECK_FRAMES		(0x830 * CHECK_BLOCKSIZE + 27)
+/* Not a multiple of the block size or FLAC_CHUNK_FRAMES */
+#define CHECK_WRITE_FRAMES	1500
+
+static const struct {
+	const char *msg;
+	const char *hex;
+} check_vectors[] = {
+	{"", "d41d8cd98f00b204e9800998ecf8427e"},
+	{"a", "0cc175b9c0f1b6a831c399e269772661"},
+	{"abc", "900150983cd24fb0d6963f7d28e17f72"},
+	{"message digest", "f96b697d7cb7938d525a2f31aaf161d0"},
+	{"abcdefghijklmnopqrstuvwxyz", "c3fcd3d76192e4007dfb496cca67e13b"},
+	{"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+	 "d174ab98d277d9f5a5611c2c9f419d9f"},
+	{"1234567890123456789012345678901234567890"
+	 "1234567890123456789012345678901234567890",
+	 "57edf4a22be3c955ac49da2e2107b67a"},
+	{NULL, NULL}
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+/* An encoded stream, in memory instead of on the file's sinks */
+struct check_stream {
+	/* Must be first, see storage_write() */
+	struct recorder_file file;
+	uint8_t *data;
+	size_t size;
+	/* Decoder's position */
+	size_t pos;
+};
+
+/* What came out of the decoder */
+struct check_decoded {
+	struct check_stream *stream;
+	FLAC__StreamMetadata_StreamInfo info;
+	int got_info;
+	int channels;
+	FLAC__int32 *samples;
+	uint64_t frames;
+	int errors;
+};
+
+sf_count_t
+storage_write(struct recorder_file *file, const void *ptr, sf_count_t count)
+{
+	struct check_stream *cs = (struct check_stream *)file;
+	size_t end = file->offset + count;
+	size_t size = cs->size ? cs->size : 4096;
+	uint8_t *data = NULL;
+
+	if (end > cs->size) {
+		while (size < end)
+			size *= 2;
+		data = realloc(cs->data, size);
+		if (!data)
+			return 0;
+		cs->data = data;
+		cs->size = size;
+	}
+	memcpy(cs->data + file->offset, ptr, count);
+
+	file->offset += count;
+	if (file->offset > file->length)
+		file->length = file->offset;
+
+	return count;
+}
+
+sf_count_t
+storage_seek(struct recorder_file *file, sf_count_t offset, int whence)
+{
+	switch (whence) {
+	case SEEK_SET:
+		file->offset = offset;
+		break;
+	case SEEK_CUR:
+		file->offset += offset;
+		break;
+	case SEEK_END:
+		file->offset = file->length + offset;
+		break;
+	}
+
+	return file->offset;
+}
+
+static void
+check_md5_hex(const uint8_t digest[16], char out[33])
+{
+	int i = 0;
+
+	for (i = 0; i < 16; i++)
+		snprintf(out + i * 2, 3, "%02x", digest[i]);
+}
+
+static void
+check_md5_vector(const char *msg, const char *hex)
+{
+	struct flac_md5 md5 = { 0 };
+	uint8_t digest[16] = { 0 };
+	char out[33] = { 0 };
+	size_t len = strlen(msg);
+	size_t off = 0;
+	size_t step = 0;
+
+	flac_md5_init(&md5);
+	flac_md5_update(&md5, (const uint8_t *)msg, len);
+	flac_md5_final(&md5, digest);
+	check_md5_hex(digest, out);
+	check(!strcmp(out, hex), "md5(\"%s\") = %s", msg, out);
+
+	for (step = 1; step < 64; step += 7) {
+		flac_md5_init(&md5);
+		for (off = 0; off < len; off += step)
+			flac_md5_update(&md5, (const uint8_t *)msg + off,
+					len - off < step ? len - off : step);
+		flac_md5_final(&md5, digest);
+		check_md5_hex(digest, out);
+		check(!strcmp(out, hex), "md5(\"%s\") in pieces of %zu = %s",
+		      msg, step, out);
+	}
+}
+
+
+/*****************\
+* ENCODE / DECODE *
+\*****************/
+
+/**
+ * A tone per channel with some noise on top, same
+ * on every call
+ */
+static float *
+check_input(int channels)
+{
+	float *buf = NULL;
+	uint32_t noise = 0x12345678;
+	uint32_t i = 0;
+	int c = 0;
+
+	buf = malloc((size_t)CHECK_FRAMES * channels * sizeof(float));
+	if (!buf)
+		return NULL;
+
+	for (i = 0; i < CHECK_FRAMES; i++)
+		for (c = 0; c < channels; c++) {
+			noise = noise * 1664525 + 1013904223;
+			buf[i * channels + c] =
+			    0.5f * sinf(2.0f * M_PI * 440.0f * (c + 1) * i /
+					CHECK_RATE) +
+			    0.1f * (float)(int32_t) noise / 2147483648.0f;
+		}
+
+	return buf;
+}
+
+static int
+check_encode(struct check_stream *cs, const float *input, int channels,
+	     uint32_t bits, uint32_t threads)
+{
+	struct flac_opts opts = { 0 };
+	struct flac_encoder *fe = NULL;
+	SF_INFO info = { 0 };
+	uint32_t done = 0;
+	uint32_t n = 0;
+
+	opts.direct = 1;
+	opts.bits = bits;
+	opts.blocksize = CHECK_BLOCKSIZE;
+	opts.threads = threads;
+	info.channels = channels;
+	info.samplerate = CHECK_RATE;
+	snprintf(cs->file.path, PATH_MAX, "check-%u-threads.flac", threads);
+
+	fe = flac_open(&cs->file, &opts, &info, 0.5);
+	if (!fe)
+		return -1;
+
+	for (done = 0; done < CHECK_FRAMES; done += n) {
+		n = CHECK_FRAMES - done < CHECK_WRITE_FRAMES ?
+		    CHECK_FRAMES - done : CHECK_WRITE_FRAMES;
+		if (flac_write(fe, input + (size_t)done * channels, n) !=
+		    (int)n)
+			break;
+	}
+	flac_close(fe);
+
+	return done == CHECK_FRAMES ? 0 : -1;
+}
+
+static FLAC__StreamDecoderReadStatus
+check_read_cb(const FLAC__StreamDecoder *dec, FLAC__byte buffer[],
+	      size_t *bytes, void *client_data)
+{
+	struct check_decoded *cd = (struct check_decoded *)client_data;
+	struct check_stream *cs = cd->stream;
+	size_t left = cs->file.length - cs->pos;
+
+	if (!left) {
+		*bytes = 0;
+		return FLAC__STREAM_DECODER_READ_STATUS_END_OF_STREAM;
+	}
+	if (*bytes > left)
+		*bytes = left;
+	memcpy(buffer, cs->data + cs->pos, *bytes);
+	cs->pos += *bytes;
+
+	return FLAC__STREAM_DECODER_READ_STATUS_CONTINUE;
+}
+
+static FLAC__StreamDecoderWriteStatus
+check_write_cb(const FLAC__StreamDecoder *dec, const FLAC__Frame *frame,
+	       const FLAC__int32 *const buffer[], void *client_data)
+{
+	struct check_decoded *cd = (struct check_decoded *)client_data;
+	uint32_t blocksize = frame->header.blocksize;
+	uint32_t i = 0;
+	int c = 0;
+
+	/* Frame numbers come out as sample numbers, a frame
+	 * that was numbered wrong ends up in the wrong place */
+	if (frame->header.number_type !=
+	    FLAC__FRAME_NUMBER_TYPE_SAMPLE_NUMBER ||
+	    frame->header.number.sample_number != cd->frames ||
+	    frame->header.channels != (uint32_t) cd->channels ||
+	    cd->frames + blocksize > CHECK_FRAMES) {
+		cd->errors++;
+		return FLAC__STREAM_DECODER_WRITE_STATUS_ABORT;
+	}
+
+	for (i = 0; i < blocksize; i++)
+		for (c = 0; c < cd->channels; c++)
+			cd->samples[(cd->frames + i) * cd->channels + c] =
+			    buffer[c][i];
+	cd->frames += blocksize;
+
+	return FLAC__STREAM_DECODER_WRITE_STATUS_CONTINUE;
+}
+
+static void
+check_metadata_cb(const FLAC__StreamDecoder *dec,
+		  const FLAC__StreamMetadata *metadata, void *client_data)
+{
+	struct check_decoded *cd = (struct check_decoded *)client_data;
+
+	if (metadata->type != FLAC__METADATA_TYPE_STREAMINFO)
+		return;
+	cd->info = metadata->data.stream_info;
+	cd->got_info = 1;
+}
+
+static void
+check_error_cb(const FLAC__StreamDecoder *dec,
+	       FLAC__StreamDecoderErrorStatus status, void *client_data)
+{
+	struct check_decoded *cd = (struct check_decoded *)client_data;
+
+	fprintf(stderr, "decoder: %s\n",
+		FLAC__StreamDecoderErrorStatusString[status]);
+	cd->errors++;
+}
+
+/**
+ * Decodes cd->stream through libFLAC, checking the MD5 in
+ * its STREAMINFO against the decoded samples
+ */
+static int
+check_decode(struct check_decoded *cd)
+{
+	FLAC__StreamDecoder *dec = NULL;
+	int ret = -1;
+
+	cd->samples = malloc((size_t)CHECK_FRAMES * cd->channels *
+			     sizeof(FLAC__int32));
+	dec = FLAC__stream_decoder_new();
+	if (!cd->samples || !dec)
+		goto cleanup;
+
+	FLAC__stream_decoder_set_md5_checking(dec, 1);
+	if (FLAC__stream_decoder_init_stream(dec, check_read_cb, NULL, NULL,
+					     NULL, NULL, check_write_cb,
+					     check_metadata_cb, check_error_cb,
+					     cd) !=
+	    FLAC__STREAM_DECODER_INIT_STATUS_OK)
+		goto cleanup;
+
+	if (FLAC__stream_decoder_process_until_end_of_stream(dec))
+		ret = 0;
+	/* Fails on an MD5 mismatch */
+	if (!FLAC__stream_decoder_finish(dec))
+		ret = -1;
+
+ cleanup:
+	if (dec)
+		FLAC__stream_decoder_delete(dec);
+	return ret;
+}
+
+static void
+check_parallel(int channels, uint32_t bits, uint32_t threads)
+{
+	static const uint8_t no_md5[16] = { 0 };
+	struct check_stream streams[2] = { 0 };
+	struct check_decoded decoded[2] = { 0 };
+	int failures = check_failures;
+	float *input = NULL;
+	int i = 0;
+
+	input = check_input(channels);
+	if (!input) {
+		check(0, "cannot allocate the input");
+		return;
+	}
+
+	/* On the consumer and on threads */
+	for (i = 0; i < 2; i++) {
+		check(!check_encode(&streams[i], input, channels, bits,
+				    i ? threads : 0),
+		      "cannot encode %i channels of %u bits on %u threads",
+		      channels, bits, i ? threads : 0);
+		decoded[i].stream = &streams[i];
+		decoded[i].channels = channels;
+		check(!check_decode(&decoded[i]) && !decoded[i].errors,
+		      "cannot decode what was encoded on %u threads",
+		      i ? threads : 0);
+		check(decoded[i].got_info &&
+		      decoded[i].info.total_samples == CHECK_FRAMES &&
+		      decoded[i].info.channels == (uint32_t) channels &&
+		      decoded[i].info.bits_per_sample == bits &&
+		      memcmp(decoded[i].info.md5sum, no_md5, 16),
+		      "bad STREAMINFO from %u threads", i ? threads : 0);
+		check(decoded[i].frames == CHECK_FRAMES,
+		      "decoded %llu frames from %u threads",
+		      (unsigned long long)decoded[i].frames, i ? threads : 0);
+	}
+
+	if (check_failures == failures) {
+		check(!memcmp(decoded[0].info.md5sum, decoded[1].info.md5sum,
+			      16), "MD5 differs on %u threads", threads);
+		check(!memcmp(decoded[0].samples, decoded[1].samples,
+			      (size_t)CHECK_FRAMES * channels *
+			      sizeof(FLAC__int32)),
+		      "samples differ on %u threads", threads);
+	}
+
+	for (i = 0; i < 2; i++) {
+		free(streams[i].data);
+		free(decoded[i].samples);
+	}
+	free(input);
+}
+
+
+/*************\
+* ENTRY POINT *
+\*************/
+
+int
+main(void)
+{
+	int i = 0;
+
+	for (i = 0; check_vectors[i].msg; i++)
+		check_md5_vector(check_vectors[i].msg, check_vectors[i].hex);
+
+	check_parallel(2, 24, 3);
+	check_parallel(1, 16, 2);
+
+	return check_result();
+}
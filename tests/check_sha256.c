@@ -0,0 +1,209 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Checks for sha256.c
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "manifest.h"
+#include "check.h"
+#include <stdlib.h>		/* For mkstemp() */
+#include <string.h>		/* For strlen / memcmp / memset */
+#include <unistd.h>		/* For write() / unlink() / close() */
+
+/*
+ * Known answers from FIPS 180-2, fed in one go and in odd sized
+ * pieces so that every path of sha256_update() gets its turn,
+ * and the manifest's segment / chain hashes against the same
+ * put together by hand.
+ */
+
+static const struct {
+	const char *msg;
+	const char *hex;
+} check_vectors[] = {
+	{"",
+	 "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+	{"abc",
+	 "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+	{"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+	 "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+	{"abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+	 "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+	 "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1"},
+	{NULL, NULL}
+};
+
+/* A million times 'a' */
+#define CHECK_MILLION_HEX \
+	"cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"
+
+/*********\
+* HELPERS *
+\*********/
+
+static void
+check_hash(const void *data, size_t len, uint8_t digest[SHA256_LEN])
+{
+	struct sha256 ctx = { 0 };
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, len);
+	sha256_final(&ctx, digest);
+}
+
+static void
+check_vector(const char *msg, const char *hex)
+{
+	char out[SHA256_HEX_LEN + 1] = { 0 };
+	uint8_t digest[SHA256_LEN] = { 0 };
+	uint8_t parsed[SHA256_LEN] = { 0 };
+	struct sha256 ctx = { 0 };
+	size_t len = strlen(msg);
+	size_t off = 0;
+	size_t step = 0;
+
+	check_hash(msg, len, digest);
+	sha256_to_hex(digest, out);
+	check(!strcmp(out, hex), "sha256(\"%s\") = %s", msg, out);
+
+	for (step = 1; step < 64; step += 7) {
+		sha256_init(&ctx);
+		for (off = 0; off < len; off += step)
+			sha256_update(&ctx, msg + off,
+				      len - off < step ? len - off : step);
+		sha256_final(&ctx, digest);
+		sha256_to_hex(digest, out);
+		check(!strcmp(out, hex), "sha256(\"%s\") in pieces of %zu "
+		      "= %s", msg, step, out);
+	}
+
+	check(!sha256_from_hex(hex, parsed) && !memcmp(parsed, digest,
+						       SHA256_LEN),
+	      "cannot parse back %s", hex);
+}
+
+static void
+check_million(void)
+{
+	char out[SHA256_HEX_LEN + 1] = { 0 };
+	uint8_t digest[SHA256_LEN] = { 0 };
+	char block[1000] = { 0 };
+	struct sha256 ctx = { 0 };
+	int i = 0;
+
+	memset(block, 'a', sizeof(block));
+	sha256_init(&ctx);
+	for (i = 0; i < 1000; i++)
+		sha256_update(&ctx, block, sizeof(block));
+	sha256_final(&ctx, digest);
+	sha256_to_hex(digest, out);
+	check(!strcmp(out, CHECK_MILLION_HEX), "sha256(a * 10^6) = %s", out);
+}
+
+/**
+ * Segment hash of a file len bytes long, read back and
+ * with the body hashed as it's written
+ */
+static void
+check_segment(size_t len)
+{
+	char path[] = "/tmp/acoffin-check-XXXXXX";
+	uint8_t hashes[2 * SHA256_LEN] = { 0 };
+	uint8_t expected[SHA256_LEN] = { 0 };
+	uint8_t digest[SHA256_LEN] = { 0 };
+	size_t head_len = len < MANIFEST_HEAD_BYTES ? len :
+			  MANIFEST_HEAD_BYTES;
+	struct sha256 body = { 0 };
+	uint8_t *data = NULL;
+	size_t i = 0;
+	int fd = -1;
+
+	data = malloc(len + 1);
+	fd = mkstemp(path);
+	if (!data || fd < 0) {
+		check(0, "cannot set up a %zu byte file", len);
+		goto cleanup;
+	}
+	unlink(path);
+
+	for (i = 0; i < len; i++)
+		data[i] = (i * 131) >> 3;
+	if (write(fd, data, len) != (ssize_t)len) {
+		check(0, "cannot write a %zu byte file", len);
+		goto cleanup;
+	}
+
+	check_hash(data, head_len, hashes);
+	check_hash(data + head_len, len - head_len, hashes + SHA256_LEN);
+	check_hash(hashes, sizeof(hashes), expected);
+
+	check(!sha256_segment(fd, len, NULL, digest) &&
+	      !memcmp(digest, expected, SHA256_LEN),
+	      "segment hash of %zu bytes, read back", len);
+
+	sha256_init(&body);
+	sha256_update(&body, data + head_len, len - head_len);
+	check(!sha256_segment(fd, len, &body, digest) &&
+	      !memcmp(digest, expected, SHA256_LEN),
+	      "segment hash of %zu bytes, body given", len);
+
+	check(sha256_segment(fd, len + 1, NULL, digest) < 0,
+	      "segment hash past the end of %zu bytes", len);
+
+ cleanup:
+	if (fd >= 0)
+		close(fd);
+	free(data);
+}
+
+static void
+check_chain(void)
+{
+	uint8_t both[2 * SHA256_LEN] = { 0 };
+	uint8_t expected[SHA256_LEN] = { 0 };
+	uint8_t chain[SHA256_LEN] = { 0 };
+	int i = 0;
+
+	for (i = 0; i < 2 * SHA256_LEN; i++)
+		both[i] = i;
+	check_hash(both, sizeof(both), expected);
+	sha256_chain(both, both + SHA256_LEN, chain);
+	check(!memcmp(chain, expected, SHA256_LEN), "chain hash");
+}
+
+
+/*************\
+* ENTRY POINT *
+\*************/
+
+int
+main(void)
+{
+	int i = 0;
+
+	for (i = 0; check_vectors[i].msg; i++)
+		check_vector(check_vectors[i].msg, check_vectors[i].hex);
+	check_million();
+
+	check_segment(0);
+	check_segment(1000);
+	check_segment(MANIFEST_HEAD_BYTES);
+	check_segment(MANIFEST_HEAD_BYTES + 1);
+	check_segment(3 * MANIFEST_HEAD_BYTES + 12345);
+	check_chain();
+
+	return check_result();
+}
@@ -0,0 +1,190 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Checks for tap.c and tap_read()
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "acoffin.h"
+#include "check.h"
+#include <fcntl.h>		/* For O_* flags */
+#include <unistd.h>		/* For getpid() / close() */
+#include <sys/mman.h>		/* For shm_open() / mmap() */
+#include <sys/stat.h>		/* For fstat() */
+
+/*
+ * Writes periods on a small tap and follows it the way a
+ * reader would, through a read-only mapping of its own, across
+ * the end of the ring and after falling behind the writer.
+ */
+
+#define CHECK_CHANNELS	2
+#define CHECK_RATE	100
+#define CHECK_PERIOD	16
+
+/*********\
+* HELPERS *
+\*********/
+
+/* Sample c of frame n of the stream */
+static float
+check_sample(uint64_t n, int c)
+{
+	return (float)(n * CHECK_CHANNELS + c);
+}
+
+static void
+check_write_frames(struct tap *tap, uint64_t *written, uint32_t frames)
+{
+	float buf[CHECK_PERIOD * CHECK_CHANNELS] = { 0 };
+	uint32_t nframes = 0;
+	uint32_t i = 0;
+	int c = 0;
+
+	while (frames) {
+		nframes = frames < CHECK_PERIOD ? frames : CHECK_PERIOD;
+		for (i = 0; i < nframes; i++)
+			for (c = 0; c < CHECK_CHANNELS; c++)
+				buf[i * CHECK_CHANNELS + c] =
+				    check_sample(*written + i, c);
+		tap_write(tap, buf, nframes);
+		*written += nframes;
+		frames -= nframes;
+	}
+}
+
+/**
+ * Reads max_frames from *pos expecting ret back, and checks
+ * that they are the ones written there
+ */
+static void
+check_read(const struct tap_header *hdr, uint64_t *pos, uint32_t max_frames,
+	   int expected)
+{
+	float buf[256 * CHECK_CHANNELS] = { 0 };
+	uint64_t start = *pos;
+	int bad = 0;
+	int ret = 0;
+	int i = 0;
+	int c = 0;
+
+	ret = tap_read(hdr, pos, buf, max_frames);
+	check(ret == expected, "read %u from %llu: got %i, expected %i",
+	      max_frames, (unsigned long long)start, ret, expected);
+	if (ret <= 0)
+		return;
+
+	check(*pos == start + ret, "position %llu after reading %i from %llu",
+	      (unsigned long long)*pos, ret, (unsigned long long)start);
+	for (i = 0; i < ret; i++)
+		for (c = 0; c < CHECK_CHANNELS; c++)
+			if (buf[i * CHECK_CHANNELS + c] !=
+			    check_sample(start + i, c))
+				bad++;
+	check(!bad, "%i wrong samples reading %i from %llu", bad, ret,
+	      (unsigned long long)start);
+}
+
+
+/*************\
+* ENTRY POINT *
+\*************/
+
+int
+main(void)
+{
+	char name[64] = { 0 };
+	const struct tap_header *hdr = NULL;
+	struct tap tap = { 0 };
+	struct stat st = { 0 };
+	uint64_t written = 0;
+	uint64_t reach = 0;
+	uint64_t size = 0;
+	uint64_t pos = 0;
+	void *base = MAP_FAILED;
+	int fd = -1;
+
+	snprintf(name, sizeof(name), "/acoffin-check-%i", (int)getpid());
+	tap.name = name;
+	tap.secs = 1;
+	if (tap_init(&tap, CHECK_CHANNELS, CHECK_RATE, CHECK_PERIOD) < 0) {
+		fprintf(stderr, "no shared memory, skipping\n");
+		return CHECK_SKIP;
+	}
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		check(0, "cannot open the segment");
+		goto cleanup;
+	}
+	check((st.st_mode & 0777) == 0600, "segment mode %o",
+	      (unsigned)(st.st_mode & 0777));
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED) {
+		check(0, "cannot map the segment");
+		goto cleanup;
+	}
+	hdr = base;
+
+	check(hdr->magic == TAP_MAGIC && hdr->version == TAP_VERSION &&
+	      hdr->channels == CHECK_CHANNELS &&
+	      hdr->sample_rate == CHECK_RATE &&
+	      hdr->max_period == CHECK_PERIOD, "header");
+	size = hdr->size_frames;
+	check(size && !(size & (size - 1)) && size >= CHECK_RATE,
+	      "ring of %llu frames", (unsigned long long)size);
+	reach = size - CHECK_PERIOD;
+
+	/* Nothing there yet */
+	check_read(hdr, &pos, 64, 0);
+
+	/* Up to the writer's reach, in two goes */
+	check_write_frames(&tap, &written, reach);
+	check_read(hdr, &pos, 50, 50);
+	check_read(hdr, &pos, 256, reach - 50);
+	check_read(hdr, &pos, 256, 0);
+
+	/* Across the end of the ring */
+	check_write_frames(&tap, &written, size / 2);
+	check_read(hdr, &pos, 256, size / 2);
+	check(pos == written, "caught up at %llu of %llu",
+	      (unsigned long long)pos, (unsigned long long)written);
+
+	/* Fell behind, gets moved to the oldest frame it may still
+	 * read and continues from there, wrapping around */
+	check_write_frames(&tap, &written, size + CHECK_PERIOD + 3);
+	check_read(hdr, &pos, 256, -1);
+	check(pos == written - reach, "moved to %llu after falling behind, "
+	      "expected %llu", (unsigned long long)pos,
+	      (unsigned long long)(written - reach));
+	check_read(hdr, &pos, 256, reach);
+
+	/* Ahead of a writer that started over */
+	pos = written + 1000;
+	check_read(hdr, &pos, 256, 0);
+	check(pos == written, "not moved back to the writer");
+
+	tap_cleanup(&tap);
+	check(__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE) == 1,
+	      "not marked as closed");
+
+ cleanup:
+	if (base != MAP_FAILED)
+		munmap(base, st.st_size);
+	if (fd >= 0)
+		close(fd);
+	tap_cleanup(&tap);
+	return check_result();
+}
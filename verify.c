@@ -0,0 +1,497 @@
+/*
+ * Audio Coffin - A simple audio recorder/logger on top of Jack,
+ * libsndfile and libsoxr. Checks files against their manifests
+ *
+ * Copyright (C) 2016 Nick Kossifidis <mickflemm@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "manifest.h"
+#include <stdio.h>		/* For printf/fprintf/perror */
+#include <stdlib.h>		/* For exit() / strtol() / qsort() */
+#include <string.h>		/* For strcmp / strncmp / strchr */
+#include <limits.h>		/* For PATH_MAX / NAME_MAX */
+#include <errno.h>		/* For errno */
+#include <fcntl.h>		/* For open() */
+#include <unistd.h>		/* For getopt() / close() */
+#include <pthread.h>		/* For pthread_* */
+#include <dirent.h>		/* For opendir / readdir */
+#include <sys/stat.h>		/* For stat() */
+
+/*
+ * Goes through the manifests (see manifest.h) on the given
+ * directories, re-hashes the files they cover that were
+ * recorded within a date range on a thread per core, one file
+ * per thread at a time, and checks that each manifest links
+ * to the one of the file closed before it. The date is the
+ * one on the file's name. Manifests outside the range are
+ * only used to check the links of the ones within it.
+ *
+ * Files the archive tool transcoded since have a manifest that
+ * names the FLAC file they came from, their content can't be
+ * checked anymore but their place on the chain still is.
+ */
+
+#define VERIFY_MAX_JOBS		64
+#define VERIFY_DATE_LEN		10
+
+enum verify_status {
+	VERIFY_OK = 0,
+	VERIFY_TRANSCODED,
+	VERIFY_MISSING,
+	VERIFY_SIZE_MISMATCH,
+	VERIFY_HASH_MISMATCH,
+	VERIFY_UNREADABLE,
+	VERIFY_BAD_MANIFEST,
+	VERIFY_BROKEN_LINK,
+	VERIFY_GONE_PREV
+};
+
+static const char *verify_status_str[] = {
+	"ok",
+	"transcoded since, only its place on the chain got checked",
+	"file is missing",
+	"size does not match",
+	"hash does not match",
+	"file is not readable",
+	"manifest is not consistent with itself",
+	"does not link to the manifest of the file before it",
+	"the file before it is gone"
+};
+
+struct verify_entry {
+	const char *dir;
+	/* Name of the manifest, and of the file next to it */
+	char manifest_name[NAME_MAX + 1];
+	char file_name[NAME_MAX + 1];
+	/* What the manifest says */
+	char name[NAME_MAX + 1];
+	char prev_file[NAME_MAX + 1];
+	uint64_t bytes;
+	uint8_t sha256[SHA256_LEN];
+	uint8_t prev_chain[SHA256_LEN];
+	uint8_t chain[SHA256_LEN];
+	int valid;
+	int in_range;
+	int status;
+};
+
+struct verify_opts {
+	const char *from;
+	const char *to;
+	int jobs;
+	int verbose;
+};
+
+struct verify_queue {
+	struct verify_entry *entries;
+	size_t count;
+	/* Next one to pick up, under lock */
+	size_t next;
+	pthread_mutex_t lock;
+	/* Totals, under lock */
+	uint64_t bytes;
+};
+
+/*********\
+* HELPERS *
+\*********/
+
+/**
+ * Points to the YYYY-MM-DD date on the name, or NULL
+ */
+static const char *
+verify_get_date(const char *name)
+{
+	const char *date = strchr(name, '[');
+
+	if (!date || strlen(date) < VERIFY_DATE_LEN + 2 ||
+	    date[VERIFY_DATE_LEN + 1] != ']')
+		return NULL;
+	return date + 1;
+}
+
+static int
+verify_date_in_range(const char *name, const struct verify_opts *opts)
+{
+	const char *date = verify_get_date(name);
+
+	if (!opts->from && !opts->to)
+		return 1;
+	if (!date)
+		return 0;
+	if (opts->from && strncmp(date, opts->from, VERIFY_DATE_LEN) < 0)
+		return 0;
+	if (opts->to && strncmp(date, opts->to, VERIFY_DATE_LEN) > 0)
+		return 0;
+	return 1;
+}
+
+static void
+verify_load_manifest(struct verify_entry *entry)
+{
+	char path[PATH_MAX] = { 0 };
+	char line[PATH_MAX + 16] = { 0 };
+	unsigned long long bytes = 0;
+	FILE *manifest = NULL;
+	size_t len = 0;
+	int fields = 0;
+
+	snprintf(path, PATH_MAX, "%s/%s", entry->dir, entry->manifest_name);
+	manifest = fopen(path, "r");
+	if (!manifest)
+		return;
+
+	while (fgets(line, sizeof(line), manifest)) {
+		len = strlen(line);
+		if (len && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!strncmp(line, "file=", 5)) {
+			snprintf(entry->name, NAME_MAX + 1, "%s", line + 5);
+			fields++;
+		} else if (!strncmp(line, "prev_file=", 10)) {
+			snprintf(entry->prev_file, NAME_MAX + 1, "%s",
+				 line + 10);
+			fields++;
+		} else if (sscanf(line, "bytes=%llu", &bytes) == 1) {
+			entry->bytes = bytes;
+			fields++;
+		} else if (!strncmp(line, "sha256=", 7))
+			fields += !sha256_from_hex(line + 7, entry->sha256);
+		else if (!strncmp(line, "prev_chain=", 11))
+			fields += !sha256_from_hex(line + 11,
+						   entry->prev_chain);
+		else if (!strncmp(line, "chain=", 6))
+			fields += !sha256_from_hex(line + 6, entry->chain);
+	}
+	fclose(manifest);
+
+	entry->valid = (fields == 6);
+}
+
+/**
+ * Adds the manifests on dir
+ */
+static int
+verify_scan(struct verify_queue *queue, const char *dir,
+	    const struct verify_opts *opts)
+{
+	struct verify_entry *entries = NULL;
+	struct verify_entry *entry = NULL;
+	struct dirent *dent = NULL;
+	size_t ext_len = strlen(MANIFEST_EXT);
+	size_t len = 0;
+	DIR *dp = NULL;
+
+	dp = opendir(dir);
+	if (!dp) {
+		fprintf(stderr, "Could not open %s: %s\n", dir,
+			strerror(errno));
+		return -1;
+	}
+
+	while ((dent = readdir(dp))) {
+		len = strlen(dent->d_name);
+		if (dent->d_name[0] == '.' || len <= ext_len ||
+		    strcmp(dent->d_name + len - ext_len, MANIFEST_EXT))
+			continue;
+
+		entries = realloc(queue->entries, (queue->count + 1) *
+				  sizeof(struct verify_entry));
+		if (!entries)
+			break;
+		queue->entries = entries;
+		entry = &queue->entries[queue->count++];
+		memset(entry, 0, sizeof(struct verify_entry));
+
+		entry->dir = dir;
+		snprintf(entry->manifest_name, NAME_MAX + 1, "%s",
+			 dent->d_name);
+		snprintf(entry->file_name, NAME_MAX + 1, "%.*s",
+			 (int)(len - ext_len), dent->d_name);
+		entry->in_range = verify_date_in_range(entry->file_name, opts);
+		verify_load_manifest(entry);
+	}
+	closedir(dp);
+
+	return dent ? -1 : 0;
+}
+
+/**
+ * Re-hashes the file of an entry
+ */
+static void
+verify_file(struct verify_entry *entry)
+{
+	char path[PATH_MAX] = { 0 };
+	uint8_t segment[SHA256_LEN] = { 0 };
+	struct stat st = { 0 };
+	int fd = -1;
+
+	if (!entry->valid) {
+		entry->status = VERIFY_BAD_MANIFEST;
+		return;
+	}
+
+	snprintf(path, PATH_MAX, "%s/%s", entry->dir, entry->file_name);
+	if (stat(path, &st) < 0) {
+		entry->status = VERIFY_MISSING;
+		return;
+	}
+
+	if (strcmp(entry->file_name, entry->name)) {
+		entry->status = VERIFY_TRANSCODED;
+		return;
+	}
+
+	if ((uint64_t) st.st_size != entry->bytes) {
+		entry->status = VERIFY_SIZE_MISMATCH;
+		return;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || sha256_segment(fd, entry->bytes, NULL, segment) < 0)
+		entry->status = VERIFY_UNREADABLE;
+	else if (memcmp(segment, entry->sha256, SHA256_LEN))
+		entry->status = VERIFY_HASH_MISMATCH;
+	if (fd >= 0)
+		close(fd);
+}
+
+/**
+ * Worker thread, takes entries in range off the
+ * queue until it's empty
+ */
+static void *
+verify_worker(void *data)
+{
+	struct verify_queue *queue = (struct verify_queue *)data;
+	struct verify_entry *entry = NULL;
+
+	while (1) {
+		pthread_mutex_lock(&queue->lock);
+		while (queue->next < queue->count &&
+		       !queue->entries[queue->next].in_range)
+			queue->next++;
+		entry = queue->next < queue->count ?
+			&queue->entries[queue->next++] : NULL;
+		pthread_mutex_unlock(&queue->lock);
+		if (!entry)
+			break;
+
+		verify_file(entry);
+
+		if (entry->status == VERIFY_OK ||
+		    entry->status == VERIFY_HASH_MISMATCH) {
+			pthread_mutex_lock(&queue->lock);
+			queue->bytes += entry->bytes;
+			pthread_mutex_unlock(&queue->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static int
+verify_compare_names(const void *a, const void *b)
+{
+	const struct verify_entry *ea = (const struct verify_entry *)a;
+	const struct verify_entry *eb = (const struct verify_entry *)b;
+
+	return strcmp(ea->name, eb->name);
+}
+
+/**
+ * Finds the entry whose manifest covers name, on the
+ * same directory as entry if there are more than one
+ * (mirrors). Entries are sorted by name.
+ */
+static struct verify_entry *
+verify_find(struct verify_queue *queue, struct verify_entry *entry,
+	    const char *name)
+{
+	struct verify_entry key = { 0 };
+	struct verify_entry *found = NULL;
+	struct verify_entry *cur = NULL;
+	struct verify_entry *end = queue->entries + queue->count;
+
+	snprintf(key.name, NAME_MAX + 1, "%s", name);
+	found = bsearch(&key, queue->entries, queue->count,
+			sizeof(struct verify_entry), verify_compare_names);
+	if (!found)
+		return NULL;
+
+	while (found > queue->entries && !strcmp(found[-1].name, name))
+		found--;
+	for (cur = found; cur < end && !strcmp(cur->name, name); cur++)
+		if (cur->dir == entry->dir)
+			return cur;
+	return found;
+}
+
+/**
+ * Checks the links of the entries in range, once
+ * their files got checked
+ */
+static void
+verify_chain(struct verify_queue *queue, const struct verify_opts *opts)
+{
+	struct verify_entry *entry = NULL;
+	struct verify_entry *prev = NULL;
+	uint8_t chain[SHA256_LEN] = { 0 };
+	size_t i = 0;
+
+	for (i = 0; i < queue->count; i++) {
+		entry = &queue->entries[i];
+		if (!entry->in_range || !entry->valid ||
+		    (entry->status != VERIFY_OK &&
+		     entry->status != VERIFY_TRANSCODED))
+			continue;
+
+		sha256_chain(entry->prev_chain, entry->sha256, chain);
+		if (memcmp(chain, entry->chain, SHA256_LEN)) {
+			entry->status = VERIFY_BAD_MANIFEST;
+			continue;
+		}
+
+		if (!entry->prev_file[0]) {
+			printf("%s/%s starts a chain\n", entry->dir,
+			       entry->file_name);
+			continue;
+		}
+
+		prev = verify_find(queue, entry, entry->prev_file);
+		if (!prev) {
+			/* Only expected to be there within the range */
+			if (verify_date_in_range(entry->prev_file, opts))
+				entry->status = VERIFY_GONE_PREV;
+			continue;
+		}
+		if (!prev->valid ||
+		    memcmp(prev->chain, entry->prev_chain, SHA256_LEN))
+			entry->status = VERIFY_BROKEN_LINK;
+	}
+}
+
+
+/*************\
+* ENTRY POINT *
+\*************/
+
+static void
+usage(char *name)
+{
+	printf("Audio Coffin, checks files against their hash manifests\n");
+	printf("\nUsage: %s [<parameter> <value>] <directory> [<directory>...]\n",
+	       name);
+	printf("\nParameters:\n"
+	       "\t-h\t\tShow this list\n"
+	       "\t-f   <date>\tOnly files recorded on or after this date, as YYYY-MM-DD (default: all)\n"
+	       "\t-t   <date>\tOnly files recorded on or before this date, as YYYY-MM-DD (default: all)\n"
+	       "\t-j   <int>\tCheck this many files in parallel (default: one per online CPU)\n"
+	       "\t-v\t\tAlso list the files that check out\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct verify_opts opts = { 0 };
+	struct verify_queue queue = { 0 };
+	struct verify_entry *entry = NULL;
+	pthread_t threads[VERIFY_MAX_JOBS];
+	uint32_t checked = 0;
+	uint32_t failed = 0;
+	size_t i = 0;
+	int started = 0;
+	int opt = 0;
+	int ret = 0;
+
+	/* Set default values */
+	opts.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "hf:t:j:v")) != -1) {
+		switch (opt) {
+		case 'f':
+			opts.from = optarg;
+			break;
+		case 't':
+			opts.to = optarg;
+			break;
+		case 'j':
+			opts.jobs = strtol(optarg, NULL, 10);
+			break;
+		case 'v':
+			opts.verbose = 1;
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : -1);
+		}
+	}
+
+	if (optind >= argc ||
+	    (opts.from && strlen(opts.from) != VERIFY_DATE_LEN) ||
+	    (opts.to && strlen(opts.to) != VERIFY_DATE_LEN)) {
+		usage(argv[0]);
+		exit(-1);
+	}
+	if (opts.jobs < 1)
+		opts.jobs = 1;
+	if (opts.jobs > VERIFY_MAX_JOBS)
+		opts.jobs = VERIFY_MAX_JOBS;
+
+	for (; optind < argc; optind++)
+		if (verify_scan(&queue, argv[optind], &opts) < 0)
+			ret = -1;
+	qsort(queue.entries, queue.count, sizeof(struct verify_entry),
+	      verify_compare_names);
+
+	pthread_mutex_init(&queue.lock, NULL);
+	for (started = 0; started < opts.jobs; started++)
+		if (pthread_create(&threads[started], NULL, verify_worker,
+				   &queue) != 0)
+			break;
+	/* Do it ourselves if we couldn't start any */
+	if (!started)
+		verify_worker(&queue);
+	while (started--)
+		pthread_join(threads[started], NULL);
+	pthread_mutex_destroy(&queue.lock);
+
+	verify_chain(&queue, &opts);
+
+	for (i = 0; i < queue.count; i++) {
+		entry = &queue.entries[i];
+		if (!entry->in_range)
+			continue;
+		checked++;
+		if (entry->status > VERIFY_TRANSCODED)
+			failed++;
+		if (entry->status == VERIFY_OK && !opts.verbose)
+			continue;
+		printf("%s %s/%s: %s\n",
+		       entry->status > VERIFY_TRANSCODED ? "FAILED" : "OK",
+		       entry->dir, entry->file_name,
+		       verify_status_str[entry->status]);
+	}
+
+	printf("Checked %u files (%llu bytes hashed), %u failed\n", checked,
+	       (unsigned long long)queue.bytes, failed);
+	if (failed)
+		ret = -1;
+
+	free(queue.entries);
+	return ret;
+}